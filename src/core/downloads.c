@@ -70,6 +70,7 @@
 #include "sockets.h"
 #include "thex_download.h"
 #include "token.h"
+#include "tth_cache.h"
 #include "udp.h"
 #include "uploads.h"
 #include "verify_sha1.h"
@@ -188,6 +189,10 @@ static void download_incomplete_header(struct download *d);
 static bool has_blank_guid(const struct download *d);
 static void download_verify_sha1(struct download *d);
 static void download_verify_tigertree(struct download *d);
+static void download_tth_slice_free(struct download *d);
+static void download_verify_tigertree_done(struct download *d,
+	const struct tth *tth, uint elapsed,
+	const struct tth *leaves, size_t num_leaves);
 static bool download_get_server_name(struct download *d, header_t *header);
 static bool use_push_proxy(struct download *d);
 static void download_unavailable(struct download *d,
@@ -1058,6 +1063,7 @@ download_free(struct download **d_ptr)
 	d = *d_ptr;
 	download_check(d);
 
+	download_tth_slice_free(d);
 	hikset_remove(dl_by_id, d->id);
 	dualhash_remove_key(dl_thex, d->id);
 	atom_guid_free_null(&d->id);
@@ -1412,6 +1418,183 @@ buffers_free(struct download *d)
 	d->buffers = NULL;
 }
 
+/***
+ *** Incremental tigertree verification.
+ ***/
+
+/**
+ * Tigertree slice being hashed as its data is received.
+ *
+ * When the tigertree of the file is known, the data we receive is hashed
+ * as it is flushed to disk, whilst it is still held in the download buffers,
+ * and each complete slice is checked against the corresponding tigertree
+ * leaf.  Corrupted slices can then be requested again immediately, and when
+ * all the slices were verified, there is no need to read the whole file again
+ * to verify it once completed.
+ */
+struct dl_tth_slice {
+	TTH_CONTEXT *tt;		/**< Tigertree computation context */
+	filesize_t start;		/**< Start offset of slice */
+	filesize_t end;			/**< End offset of slice (first byte beyond) */
+	filesize_t next;		/**< Next offset we expect to hash */
+	size_t index;			/**< Index of slice in the tigertree leaves */
+};
+
+/**
+ * Dispose of the slice verification context.
+ */
+static void
+download_tth_slice_free(struct download *d)
+{
+	struct dl_tth_slice *ts = d->tth_slice;
+
+	if (ts != NULL) {
+		HFREE_NULL(ts->tt);
+		WFREE(ts);
+		d->tth_slice = NULL;
+	}
+}
+
+/**
+ * Start hashing the slice beginning at the given offset.
+ *
+ * @return the slice context.
+ */
+static struct dl_tth_slice *
+download_tth_slice_start(struct download *d, filesize_t pos)
+{
+	fileinfo_t *fi = d->file_info;
+	struct dl_tth_slice *ts = d->tth_slice;
+
+	g_assert(0 == pos % fi->tigertree.slice_size);
+	g_assert(pos < fi->size);
+
+	if (NULL == ts) {
+		WALLOC0(ts);
+		ts->tt = halloc(tt_size());
+		d->tth_slice = ts;
+	}
+
+	ts->index = pos / fi->tigertree.slice_size;
+	ts->start = ts->next = pos;
+	ts->end = MIN(fi->size, pos + fi->tigertree.slice_size);
+	tt_init(ts->tt, ts->end - ts->start);
+
+	g_assert(ts->index < fi->tigertree.num_leaves);
+
+	return ts;
+}
+
+/**
+ * Check the fully hashed slice against the tigertree.
+ *
+ * When the slice is corrupted, its data is discarded so that it gets
+ * downloaded again.
+ */
+static void
+download_tth_slice_check(struct download *d, struct dl_tth_slice *ts)
+{
+	fileinfo_t *fi = d->file_info;
+	struct tth digest;
+
+	g_assert(ts->next == ts->end);
+
+	tt_digest(ts->tt, &digest);
+
+	if (tth_eq(&digest, &fi->tigertree.leaves[ts->index])) {
+		file_info_slice_verified(fi, ts->index);
+		gnet_stats_inc_general(GNR_TTH_SLICES_VERIFIED);
+	} else {
+		g_warning("TTH bad slice #%zu (%s-%s) from %s in \"%s\"",
+			ts->index, filesize_to_string(ts->start),
+			filesize_to_string2(ts->end - 1),
+			download_host_info(d), download_basename(d));
+
+		gnet_stats_inc_general(GNR_TTH_SLICES_CORRUPTED);
+		file_info_update(d, ts->start, ts->end, DL_CHUNK_EMPTY);
+	}
+}
+
+/**
+ * Feed the data just written to the file at the given position to the
+ * verification of the tigertree slices.
+ *
+ * Hashing can only start at a slice boundary: when we do not receive data
+ * from the start of a slice, it is not verified and the whole file will
+ * have to be read again once completed.
+ */
+static void
+download_tth_feed(struct download *d,
+	filesize_t pos, const void *data, size_t len)
+{
+	fileinfo_t *fi = d->file_info;
+	struct dl_tth_slice *ts = d->tth_slice;
+	const char *p = data;
+
+	while (len != 0) {
+		size_t n;
+
+		if (NULL == ts || ts->next != pos || ts->next == ts->end) {
+			filesize_t skip = pos % fi->tigertree.slice_size;
+
+			if (skip != 0) {
+				skip = fi->tigertree.slice_size - skip;
+				if (ts != NULL)
+					ts->next = ts->end;		/* Nothing being hashed */
+				if (skip >= len)
+					return;
+				p += skip;
+				pos += skip;
+				len -= skip;
+			}
+
+			ts = download_tth_slice_start(d, pos);
+		}
+
+		n = MIN(len, ts->end - ts->next);
+		tt_update(ts->tt, p, n);
+		ts->next += n;
+		pos += n;
+		p += n;
+		len -= n;
+
+		if (ts->next == ts->end)
+			download_tth_slice_check(d, ts);
+	}
+}
+
+/**
+ * Feed data just written from the I/O vector to the tigertree verification,
+ * if the tigertree of the file is known.
+ *
+ * @param d		the download
+ * @param iov	the I/O vector that was written
+ * @param iovcnt	amount of entries in the I/O vector
+ * @param pos	file position where data was written
+ * @param size	amount of bytes written
+ */
+static void
+download_tth_update(struct download *d,
+	const iovec_t *iov, int iovcnt, filesize_t pos, size_t size)
+{
+	fileinfo_t *fi = d->file_info;
+	int i;
+
+	if (
+		NULL == fi->tigertree.leaves || !fi->file_size_known ||
+		(FI_F_TRANSIENT & fi->flags)
+	)
+		return;
+
+	for (i = 0; i < iovcnt && size != 0; i++) {
+		size_t n = MIN(size, iovec_len(&iov[i]));
+
+		download_tth_feed(d, pos, iovec_base(&iov[i]), n);
+		pos += n;
+		size -= n;
+	}
+}
+
 /**
  * Reset the I/O vector for reading from the start.
  */
@@ -3979,6 +4162,7 @@ download_clone(struct download *d)
 	 */
 
 	cd->buffers = NULL;		/* Allocated at each new request */
+	cd->tth_slice = NULL;
 	cd->thex = NULL;
 	cd->browse = NULL;
 
@@ -4629,6 +4813,7 @@ download_stop_v(struct download *d, download_status_t new_status,
 			buffers_free(d);
 		}
 
+		download_tth_slice_free(d);
 		d->file_info->recvcount--;
 		d->file_info->dirty_status = TRUE;
 	}
@@ -9260,11 +9445,11 @@ download_flush(struct download *d, bool *trimmed, bool may_stop)
 
 		iov = buffers_to_iovec(d, &n);
 		ret = file_object_pwritev(d->out_file, iov, n, d->pos);
-		HFREE_NULL(iov);
 
 		b->mode = DL_BUF_READING;
 
 		if ((ssize_t) -1 == ret || 0 == ret) {
+			HFREE_NULL(iov);
 			if (0 == written) {
 				written = ret;
 			}
@@ -9275,6 +9460,8 @@ download_flush(struct download *d, bool *trimmed, bool may_stop)
 			g_assert(size <= b->held);
 
 			file_info_update(d, d->pos, d->pos + size, DL_CHUNK_DONE);
+			download_tth_update(d, iov, n, d->pos, size);
+			HFREE_NULL(iov);
 			gnet_prop_set_guint64_val(PROP_DL_BYTE_COUNT,
 				GNET_PROPERTY(dl_byte_count) + size);
 
@@ -12828,6 +13015,7 @@ http_version_nofix:
 		struct rx_inflate_args args;
 
 		args.cb = &download_rx_inflate_cb;
+		args.threaded = FALSE;
 		d->rx = rx_make_above(d->rx, rx_inflate_get_ops(), &args);
 		d->flags |= DL_F_NO_PIPELINE;	/* Disabled for this request */
 	}
@@ -15441,10 +15629,14 @@ download_verifying_done(struct download *d)
 
 /**
  * Called when download verification is finished and digest is known.
+ *
+ * The TTH of the file was computed along with its SHA1, so there is no
+ * need to read the file again should we need to verify the TTH.
  */
 static void
 download_verify_sha1_done(struct download *d,
-	const struct sha1 *sha1, uint elapsed)
+	const struct sha1 *sha1, uint elapsed,
+	const struct tth *tth, const struct tth *leaves, size_t num_leaves)
 {
 	fileinfo_t *fi;
 
@@ -15467,14 +15659,28 @@ download_verify_sha1_done(struct download *d,
 	file_info_store_binary(fi, TRUE);		/* Resync with computed SHA1 */
 	file_info_changed(fi);
 
-	download_set_status(d, GTA_DL_VERIFIED);
-	fi->flags &= ~FI_F_VERIFYING;
-
 	ignore_add_sha1(file_info_readable_filename(fi), fi->cha1);
 
+	/*
+	 * When the file has the expected bitprint, persist the TTH leaves we
+	 * computed so that we do not need to hash the file again when it is
+	 * seeded and we prepare its TTH tree.
+	 */
+
+	if (
+		fi->sha1 != NULL && fi->tth != NULL &&
+		has_good_sha1(d) && tth_eq(tth, fi->tth)
+	) {
+		tth_cache_insert(tth, leaves, num_leaves);
+	}
+
 	if (fi->tth && (!has_good_sha1(d) || GNET_PROPERTY(tigertree_debug) > 1)) {
-		download_verify_tigertree(d);
+		fi->tth_check = TRUE;
+		gnet_stats_inc_general(GNR_TTH_VERIFICATIONS);
+		download_verify_tigertree_done(d, tth, elapsed, leaves, num_leaves);
 	} else {
+		download_set_status(d, GTA_DL_VERIFIED);
+		fi->flags &= ~FI_F_VERIFYING;
 		download_verifying_done(d);
 	}
 }
@@ -15543,7 +15749,9 @@ download_verify_sha1_callback(const struct verify *ctx,
 	case VERIFY_DONE:
 		gnet_prop_set_boolean_val(PROP_SHA1_VERIFYING, FALSE);
 		download_verify_sha1_done(d,
-			verify_sha1_digest(ctx), verify_elapsed(ctx));
+			verify_sha1_digest(ctx), verify_elapsed(ctx),
+			verify_sha1_tth_digest(ctx), verify_sha1_tth_leaves(ctx),
+			verify_sha1_tth_leave_count(ctx));
 		return TRUE;
 	case VERIFY_ERROR:
 		gnet_prop_set_boolean_val(PROP_SHA1_VERIFYING, FALSE);
@@ -15608,6 +15816,37 @@ download_verify_sha1(struct download *d)
 	queue_suspend_downloads_with_file(fi, TRUE);
 	d->flags &= ~DL_F_CLONED;		/* Has to be persisted until SHA-1 is OK */
 
+	/*
+	 * When all the slices of the file were verified against its tigertree
+	 * whilst being downloaded, we only need to compute the root of the
+	 * tree from its leaves: if it matches the TTH, the file content is the
+	 * one described by the bitprint we got along with the tigertree, and
+	 * we take the SHA-1 from that bitprint instead of re-reading the file.
+	 */
+
+	if (
+		fi->sha1 != NULL && fi->tth != NULL &&
+		file_info_slices_verified(fi)
+	) {
+		struct tth root;
+
+		root = tt_root_hash(fi->tigertree.leaves, fi->tigertree.num_leaves);
+
+		if (tth_eq(&root, fi->tth)) {
+			if (GNET_PROPERTY(verify_debug)) {
+				g_debug("all TTH slices verified for %s",
+					download_pathname(d));
+			}
+
+			gnet_stats_inc_general(GNR_TTH_INCREMENTAL_VERIFICATIONS);
+			download_set_status(d, GTA_DL_VERIFYING);
+			fi->flags |= FI_F_VERIFYING;
+			download_verify_sha1_done(d, fi->sha1, 0, fi->tth,
+				fi->tigertree.leaves, fi->tigertree.num_leaves);
+			return;
+		}
+	}
+
 	inserted = verify_sha1_enqueue(TRUE, download_pathname(d),
 					download_filesize(d), download_verify_sha1_callback, d);
 
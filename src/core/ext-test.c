@@ -0,0 +1,400 @@
+/*
+ * ext-test -- replays extension payloads through the extension parser.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the authors nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Payloads are the extension areas found in queries and query hits, as
+ * handed to ext_parse(): HUGE URNs, GGEP blocks, XML and whatever garbage
+ * servents put there.  They can be captured from a running servent and
+ * given in a file, one payload per line, hex-encoded.  Empty lines and
+ * lines starting with '#' are ignored.  Without a file, payloads mixing
+ * HUGE URNs, GGEP extensions and garbage are generated.
+ *
+ * Each payload is parsed, then parsed again with all the payloads being
+ * decoded, which exercises the COBS decoding and the inflating of GGEP
+ * extensions.
+ *
+ * The program only links the extension parser, the property variables it
+ * reads and the library.
+ */
+
+#include "common.h"
+
+#include "extensions.h"
+#include "ggep.h"
+
+#include "lib/ascii.h"
+#include "lib/log.h"
+#include "lib/misc.h"
+#include "lib/progname.h"
+#include "lib/random.h"
+#include "lib/stats.h"
+#include "lib/str.h"
+#include "lib/stringify.h"
+#include "lib/tm.h"
+#include "lib/xmalloc.h"
+
+#include "lib/override.h"		/* Must be the last header included */
+
+#define LINE_MAX_LEN	(2 * 65536 + 2)	/* Hex-encoded payload + "\n" */
+#define PAYLOAD_MAX		4096	/* Max size of synthetic payloads */
+
+#define HUGE_FS			0x1c	/* HUGE Field Separator */
+
+#define POINTS			20
+#define OUTLIERS		3.0
+
+struct payload {
+	char *data;
+	size_t len;
+};
+
+static struct payload *payloads;
+static size_t payloads_count;
+static size_t payloads_bytes;
+
+static bool verbose;
+
+static const char *ggep_ids[] = {
+	"ALT", "BH", "CT", "DN", "GTKG.IPV6", "GTKGV", "H", "LF", "PATH", "PUSH",
+	"Q2", "T", "UDPHC", "XQ",
+};
+
+static const char base32_alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ234567";
+
+static void G_NORETURN
+usage(void)
+{
+	fprintf(stderr,
+			"Usage: %s [-hv] [-f payloads] [-n count]\n"
+			"  -f : read hex-encoded payloads from file, one per line\n"
+			"  -n : amount of synthetic payloads when -f is not given\n"
+			"  -h : prints this help message\n"
+			"  -v : be verbose\n"
+			, getprogname());
+	exit(EXIT_FAILURE);
+}
+
+static void
+payload_add(const char *data, size_t len)
+{
+	static size_t size;
+	struct payload *p;
+
+	if (payloads_count == size) {
+		size = MAX(1024, size * 2);
+		XREALLOC_ARRAY(payloads, size);
+	}
+
+	p = &payloads[payloads_count++];
+	p->data = xcopy(data, len);
+	p->len = len;
+	payloads_bytes += len;
+}
+
+static void
+read_payloads(const char *file)
+{
+	FILE *f;
+	char *line, *buf;
+	size_t lineno = 0;
+
+	f = fopen(file, "r");
+	if (NULL == f)
+		s_fatal_exit(EXIT_FAILURE, "can't open \"%s\": %m", file);
+
+	line = xmalloc(LINE_MAX_LEN);
+	buf = xmalloc(LINE_MAX_LEN / 2);
+
+	while (fgets(line, LINE_MAX_LEN, f)) {
+		const char *p;
+		size_t len = 0;
+		int hi = -1;
+
+		lineno++;
+
+		if ('#' == line[0])
+			continue;
+
+		for (p = line; *p != '\0'; p++) {
+			int c = *p;
+
+			if (is_ascii_space(c))
+				continue;
+			if (!is_ascii_xdigit(c)) {
+				s_fatal_exit(EXIT_FAILURE, "%s, line %zu: invalid hex char",
+					file, lineno);
+			}
+			if (-1 == hi) {
+				hi = hex2int_inline(c);
+			} else {
+				buf[len++] = (hi << 4) | hex2int_inline(c);
+				hi = -1;
+			}
+		}
+
+		if (hi != -1) {
+			s_fatal_exit(EXIT_FAILURE, "%s, line %zu: odd amount of hex chars",
+				file, lineno);
+		}
+
+		if (len != 0)
+			payload_add(buf, len);
+	}
+
+	fclose(f);
+	xfree(line);
+	xfree(buf);
+}
+
+static void
+fill_random_chars(str_t *s, const char *alphabet, size_t alen, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		str_putc(s, alphabet[random_value(alen - 1)]);
+	}
+}
+
+static void
+append_huge_urn(str_t *s)
+{
+	str_cat(s, "urn:sha1:");
+	fill_random_chars(s, ARYLEN(base32_alphabet) - 1, SHA1_BASE32_SIZE);
+}
+
+/**
+ * Append a GGEP block with plain payloads.
+ */
+static void
+append_ggep_block(str_t *s)
+{
+	size_t i, n = 1 + random_value(5);
+
+	str_putc(s, GGEP_MAGIC);
+
+	for (i = 0; i < n; i++) {
+		const char *id = ggep_ids[random_value(N_ITEMS(ggep_ids) - 1)];
+		size_t idlen = strlen(id);
+		size_t len = random_value(random_value(9) < 8 ? 40 : 600);
+		uchar flags = idlen;
+		size_t j;
+
+		if (i + 1 == n)
+			flags |= GGEP_F_LAST;
+
+		str_putc(s, flags);
+		str_cat(s, id);
+
+		if (len >> GGEP_L_VSHIFT)
+			str_putc(s, GGEP_L_CONT | (len >> GGEP_L_VSHIFT));
+		str_putc(s, GGEP_L_LAST | (len & GGEP_L_VALUE));
+
+		for (j = 0; j < len; j++) {
+			str_putc(s, 1 + random_value(254));
+		}
+	}
+}
+
+static void
+generate_payloads(size_t count)
+{
+	str_t *s = str_new(PAYLOAD_MAX);
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		uint kind = random_value(99);
+
+		str_reset(s);
+
+		if (kind < 30) {
+			append_huge_urn(s);
+			str_putc(s, HUGE_FS);
+			append_ggep_block(s);
+		} else if (kind < 80) {
+			append_ggep_block(s);
+		} else if (kind < 90) {
+			append_huge_urn(s);
+		} else {
+			/* Garbage, forcing resynchronization */
+			size_t j, len = 1 + random_value(200);
+			for (j = 0; j < len; j++) {
+				str_putc(s, random_value(255));
+			}
+			append_ggep_block(s);
+		}
+
+		payload_add(str_2c(s), str_len(s));
+	}
+
+	str_destroy_null(&s);
+}
+
+static size_t
+parse_all(bool decode)
+{
+	size_t i, found = 0;
+	extvec_t exv[MAX_EXTVEC];
+
+	ext_prepare(exv, MAX_EXTVEC);
+
+	for (i = 0; i < payloads_count; i++) {
+		const struct payload *p = &payloads[i];
+		int j, n = ext_parse(p->data, p->len, exv, MAX_EXTVEC);
+
+		if (decode) {
+			for (j = 0; j < n; j++) {
+				if (ext_payload(&exv[j]) != NULL)
+					found += ext_paylen(&exv[j]);
+			}
+		}
+
+		found += n;
+		ext_reset(exv, MAX_EXTVEC);
+	}
+
+	return found;
+}
+
+static double
+timeit(bool decode)
+{
+	statx_t *sx;
+	size_t i, found = 0;
+	double elapsed;
+
+	sx = statx_make();
+
+	for (i = 0; i < POINTS; i++) {
+		tm_nano_t start, end;
+		size_t n;
+
+		tm_precise_time(&start);
+		n = parse_all(decode);
+		tm_precise_time(&end);
+
+		g_assert(0 == i || n == found);		/* Parsing is deterministic */
+
+		found = n;
+		statx_add(sx, tm_precise_elapsed_f(&end, &start));
+	}
+
+	statx_remove_outliers(sx, OUTLIERS);
+	elapsed = statx_avg(sx);
+	statx_free_null(&sx);
+
+	return elapsed;
+}
+
+static void
+show_payloads(void)
+{
+	size_t i;
+	extvec_t exv[MAX_EXTVEC];
+
+	ext_prepare(exv, MAX_EXTVEC);
+
+	for (i = 0; i < payloads_count; i++) {
+		const struct payload *p = &payloads[i];
+		int n = ext_parse(p->data, p->len, exv, MAX_EXTVEC);
+
+		printf("payload #%zu, %zu byte%s:\n", i, p->len, plural(p->len));
+		ext_dump(stdout, exv, n, "\t", "\n", TRUE);
+		ext_reset(exv, MAX_EXTVEC);
+	}
+}
+
+static void
+report(const char *what, double elapsed)
+{
+	s_info("\t%s: %'zu ns/payload, %'zu payloads/s, %'zu KiB/s",
+		what, (size_t) (elapsed * 1e9 / payloads_count),
+		(size_t) (payloads_count / elapsed),
+		(size_t) (payloads_bytes / elapsed / 1024));
+}
+
+int
+main(int argc, char **argv)
+{
+	extern int optind;
+	extern char *optarg;
+	int c;
+	const char options[] = "f:hn:v";
+	const char *file = NULL;
+	size_t count = 10000;
+
+	progstart(argc, argv);
+
+	while ((c = getopt(argc, argv, options)) != EOF) {
+		switch (c) {
+		case 'f':			/* payloads file */
+			file = optarg;
+			break;
+		case 'n':			/* amount of synthetic payloads */
+			count = atol(optarg);
+			break;
+		case 'v':			/* verbose */
+			verbose = TRUE;
+			break;
+		case 'h':			/* show help */
+			/* FALL THROUGH */
+		default:
+			usage();
+			break;
+		}
+	}
+
+	if (0 != (argc -= optind))
+		usage();
+
+	ext_init();
+
+	if (file != NULL)
+		read_payloads(file);
+	else
+		generate_payloads(count);
+
+	if (0 == payloads_count) {
+		s_warning("no payloads to parse");
+		return 1;
+	}
+
+	if (verbose)
+		show_payloads();
+
+	s_info("parsing %zu payloads (%zu bytes):", payloads_count, payloads_bytes);
+	report("parsing only", timeit(FALSE));
+	report("with decoding", timeit(TRUE));
+
+	ext_close();
+
+	return 0;
+}
+
+/* vi: set ts=4 sw=4 cindent: */
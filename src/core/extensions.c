@@ -58,62 +58,17 @@
 #define GGEP_MAXLEN	65535		/**< Maximum decompressed length */
 #define GGEP_GROW	512			/**< Minimum chunk growth when resizing */
 
-/**
- * An extension descriptor.
- *
- * The extension block is structured thusly:
- *
- *    - <.................len.......................>
- *    - <..headlen.><..........paylen...............>
- *    - +-----------+-------------------------------+
- *    - |   header  |      extension payload        |
- *    - +-----------+-------------------------------+
- *    - ^           ^
- *    - base        payload
- *
- * The "<headlen>" part is simply "<len>" - "<paylen>" so it is not stored.
- * Likewise, we store only the beginning of the payload, the base can be
- * computed if needed.
- *
- * All those pointers refer DIRECTLY to the message we received, so naturally
- * one MUST NOT alter the data we can read or we would corrupt the messages
- * before forwarding them.
- *
- * There is a slight complication introduced with GGEP extensions, since the
- * data there can be COBS encoded, and even deflated.  Therefore, reading
- * directly data from ext_phys_payload could yield compressed data, not
- * something really usable.
- *
- * Therefore, the extension structure is mostly private, and routines are
- * provided to access the data.  Decompression and decoding of COBS is lazily
- * performed when they wish to access the extension data.
- *
- * The ext_phys_xxx fields refer to the physical information about the
- * extension.  The ext_xxx() routines allow access to the virtual information
- * after decompression and COBS decoding.  Naturally, if the extension is
- * not compressed nor COBS-encoded, the ext_xxx() routine will return the
- * physical data.
- *
- * The structure here refers to the opaque data that is dynamically allocated
- * each time a new extension is found.
+#define ONEMASK ((size_t) (-1) / 0xff)	/* 0x01010101 on 32-bit machine */
+#define HIGHMASK (ONEMASK << 7)			/* 0x80808080 on 32-bit machine */
+
+/*
+ * Word-at-a-time byte scanning: does the word `w' hold a NUL byte, or does
+ * it hold the byte `c'?  These can report false positives for bytes located
+ * after a genuine match in the word, which is fine since we only use them
+ * to know whether a word can be skipped as a whole.
  */
-typedef struct extdesc {
-	const char *ext_phys_payload;	/**< Start of payload buffer */
-	const char *ext_payload;		/**< "virtual" payload */
-	uint16 ext_phys_len;		/**< Extension length (header + payload) */
-	uint16 ext_phys_paylen;		/**< Extension payload length */
-	uint16 ext_paylen;			/**< "virtual" payload length */
-	uint16 ext_rpaylen;			/**< Length of buffer for "virtual" payload */
-
-	union {
-		struct {
-			bool extu_cobs;			/**< Payload is COBS-encoded */
-			bool extu_deflate;		/**< Payload is deflated */
-			const char *extu_id;	/**< Extension ID */
-		} extu_ggep;
-	} ext_u;
-
-} extdesc_t;
+#define EXT_WORD_HAS_ZERO(w)	(((w) - ONEMASK) & ~(w) & HIGHMASK)
+#define EXT_WORD_HAS(w,c)		EXT_WORD_HAS_ZERO((w) ^ (ONEMASK * (uchar) (c)))
 
 #define ext_phys_headlen(d)	((d)->ext_phys_len - (d)->ext_phys_paylen)
 #define ext_phys_base(d)	((d)->ext_phys_payload - ext_phys_headlen(d))
@@ -566,7 +521,7 @@ ext_ggep_parse(const char **retp, int len, extvec_t *exv, int exvcnt)
 		 * OK, at this point we have validated the GGEP header.
 		 */
 
-		WALLOC(d);
+		d = &exv->ext_desc;
 
 		d->ext_phys_payload = p;
 		d->ext_phys_paylen = data_length;
@@ -628,13 +583,105 @@ abort:
 
 	while (count--) {
 		exv--;
-		wfree(exv->opaque, sizeof(extdesc_t));
 		exv->opaque = NULL;
 	}
 
 	return 0;		/* Cannot be a GGEP block: leave parsing pointer intact */
 }
 
+/**
+ * Can byte be a resynchronization point for ext_unknown_parse()?
+ */
+static inline bool
+ext_is_resync_byte(uchar c)
+{
+	return '\0' == c || HUGE_FS == c || GGEP_MAGIC == c ||
+		'u' == c || 'U' == c || '<' == c;
+}
+
+/**
+ * Skip bytes that cannot be a resynchronization point for ext_unknown_parse(),
+ * looking at a whole word at a time when possible.
+ *
+ * @param p		start of the data to scan
+ * @param end	first byte beyond the data to scan
+ *
+ * @return pointer to the first byte that could be a resynchronization point,
+ * or `end' if there are none.
+ */
+static const char *
+ext_resync_skip(const char *p, const char *end)
+{
+	/*
+	 * Handle any initial misaligned bytes.
+	 */
+
+	for (/* empty */; pointer_to_ulong(p) & (sizeof(size_t) - 1); p++) {
+		if (p == end || ext_is_resync_byte(*p))
+			return p;
+	}
+
+	/*
+	 * Handle complete words, stopping at the first word which may contain
+	 * an interesting byte.  Folding to lowercase catches 'U' along with 'u'.
+	 */
+
+	for (/* empty */; end - p >= (ssize_t) sizeof(size_t); p += sizeof(size_t)) {
+		size_t w = *(const size_t *) p;
+		size_t l = w | (ONEMASK * 0x20);
+
+		if (
+			EXT_WORD_HAS_ZERO(w) || EXT_WORD_HAS(w, HUGE_FS) ||
+			EXT_WORD_HAS(w, GGEP_MAGIC) || EXT_WORD_HAS(w, '<') ||
+			EXT_WORD_HAS(l, 'u')
+		)
+			break;
+	}
+
+	/*
+	 * Locate the exact byte, if any.
+	 */
+
+	for (/* empty */; p != end; p++) {
+		if (ext_is_resync_byte(*p))
+			break;
+	}
+
+	return p;
+}
+
+/**
+ * Locate the end of an XML block, ended by a NUL byte or a HUGE separator,
+ * looking at a whole word at a time when possible.
+ *
+ * @param p		start of the data to scan
+ * @param end	first byte beyond the data to scan
+ *
+ * @return pointer to the separator, or `end' if there are none.
+ */
+static const char *
+ext_xml_end(const char *p, const char *end)
+{
+	for (/* empty */; pointer_to_ulong(p) & (sizeof(size_t) - 1); p++) {
+		if (p == end || '\0' == *p || HUGE_FS == (uchar) *p)
+			return p;
+	}
+
+	for (/* empty */; end - p >= (ssize_t) sizeof(size_t); p += sizeof(size_t)) {
+		size_t w = *(const size_t *) p;
+
+		if (EXT_WORD_HAS_ZERO(w) || EXT_WORD_HAS(w, HUGE_FS))
+			break;
+	}
+
+	for (/* empty */; p != end; p++) {
+		if ('\0' == *p || HUGE_FS == (uchar) *p)
+			break;
+	}
+
+	return p;
+}
+
 static int
 ext_urn_bad_parse(const char **retp, int len, extvec_t *exv, int exvcnt)
 {
@@ -655,7 +702,7 @@ ext_urn_bad_parse(const char **retp, int len, extvec_t *exv, int exvcnt)
 	 * Encapsulate as one big opaque chunk.
 	 */
 
-	WALLOC(d);
+	d = &exv->ext_desc;
 
 	d->ext_phys_payload = lastp;
 	d->ext_phys_len = d->ext_phys_paylen = p - lastp;
@@ -782,7 +829,7 @@ ext_huge_parse(const char **retp, int len, extvec_t *exv, int exvcnt)
 found:
 	g_assert(payload_start);
 
-	WALLOC(d);
+	d = &exv->ext_desc;
 
 	d->ext_phys_payload = payload_start;
 	d->ext_phys_paylen = data_length;
@@ -820,18 +867,13 @@ ext_xml_parse(const char **retp, int len, extvec_t *exv, int exvcnt)
 	g_assert(exvcnt > 0);
 	g_assert(exv->opaque == NULL);
 
-	for (/* NOTHING */; p != end; p++) {
-		uchar c = *p;
-		if (c == '\0' || c == HUGE_FS) {
-			break;
-		}
-	}
+	p = ext_xml_end(p, end);
 
 	/*
 	 * We don't analyze the XML, encapsulate as one big opaque chunk.
 	 */
 
-	WALLOC(d);
+	d = &exv->ext_desc;
 
 	d->ext_phys_payload = lastp;
 	d->ext_phys_len = d->ext_phys_paylen = p - lastp;
@@ -877,8 +919,16 @@ ext_unknown_parse(const char **retp, int len, extvec_t *exv,
 	 */
 
 	for (/* NOTHING*/; len > 0; p++, len--) {
+		const char *q;
 		bool found;
 
+		q = ext_resync_skip(p, &p[len]);
+		len -= q - p;
+		p = q;
+
+		if (0 == len)
+			break;
+
 		switch ((uchar) *p) {
 		case '\0':
 		case HUGE_FS:
@@ -911,7 +961,7 @@ ext_unknown_parse(const char **retp, int len, extvec_t *exv,
 	 * Encapsulate as one big opaque chunk.
 	 */
 
-	WALLOC(d);
+	d = &exv->ext_desc;
 
 	d->ext_phys_payload = lastp;
 	d->ext_phys_len = d->ext_phys_paylen = p - lastp;
@@ -970,7 +1020,7 @@ ext_none_parse(const char **retp, int len, extvec_t *exv, int exvcnt)
 	 * Encapsulate as one big opaque chunk.
 	 */
 
-	WALLOC(d);
+	d = &exv->ext_desc;
 
 	d->ext_phys_payload = lastp;
 	d->ext_phys_len = d->ext_phys_paylen = p - lastp;
@@ -1037,14 +1087,13 @@ ext_merge_adjacent(extvec_t *exv, extvec_t *next)
 	}
 
 	/*
-	 * Get rid of the `next' opaque descriptor.
+	 * Forget about the `next' opaque descriptor.
 	 * We should not have computed any "virtual" payload at this point.
 	 */
 
 	g_assert(
 		nd->ext_payload == NULL || nd->ext_payload == nd->ext_phys_payload);
 
-	WFREE(nd);
 	next->opaque = NULL;
 }
 
@@ -2201,8 +2250,8 @@ ext_prepare(extvec_t *exv, int exvcnt)
 }
 
 /**
- * Reset an extension vector by disposing of the opaque structures
- * and of any allocated "virtual" payload.
+ * Reset an extension vector by disposing of any allocated "virtual" payload
+ * and forgetting about the opaque structures.
  */
 void
 ext_reset(extvec_t *exv, int exvcnt)
@@ -2229,7 +2278,6 @@ ext_reset(extvec_t *exv, int exvcnt)
 			d->ext_payload = NULL;
 		}
 
-		WFREE(d);
 		e->opaque = NULL;
 	}
 }
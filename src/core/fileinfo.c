@@ -69,6 +69,7 @@
 #include "lib/ascii.h"
 #include "lib/atoms.h"
 #include "lib/base32.h"
+#include "lib/bit_array.h"
 #include "lib/concat.h"
 #include "lib/crash.h"
 #include "lib/cstr.h"
@@ -1009,11 +1010,77 @@ fi_tigertree_free(fileinfo_t *fi)
 
 	if (fi->tigertree.leaves != NULL) {
 		g_assert(fi->tigertree.num_leaves != 0);
+		if (fi->tigertree.verified != NULL) {
+			wfree(fi->tigertree.verified,
+				BIT_ARRAY_BYTE_SIZE(fi->tigertree.num_leaves));
+		}
 		WFREE_ARRAY(fi->tigertree.leaves, fi->tigertree.num_leaves);
 		ZERO(&fi->tigertree);
 	}
 }
 
+/**
+ * Record that a tigertree slice was verified whilst being downloaded.
+ *
+ * @param fi		the fileinfo
+ * @param slice		the index of the slice in the tigertree leaves
+ */
+void
+file_info_slice_verified(fileinfo_t *fi, size_t slice)
+{
+	file_info_check(fi);
+	g_return_if_fail(slice < fi->tigertree.num_leaves);
+
+	if (NULL == fi->tigertree.verified) {
+		fi->tigertree.verified =
+			walloc0(BIT_ARRAY_BYTE_SIZE(fi->tigertree.num_leaves));
+	}
+
+	if (!bit_array_get(fi->tigertree.verified, slice)) {
+		bit_array_set(fi->tigertree.verified, slice);
+		fi->tigertree.num_verified++;
+	}
+}
+
+/**
+ * @return whether all the slices of the file were verified against the
+ * tigertree whilst being downloaded.
+ */
+bool
+file_info_slices_verified(const fileinfo_t *fi)
+{
+	file_info_check(fi);
+
+	return fi->tigertree.num_leaves != 0 &&
+		fi->tigertree.num_verified == fi->tigertree.num_leaves;
+}
+
+/**
+ * Forget about the verification of slices overlapping the given range,
+ * which is no longer holding downloaded data.
+ */
+static void
+fi_tigertree_unverify(fileinfo_t *fi, filesize_t from, filesize_t to)
+{
+	size_t i, last;
+
+	if (NULL == fi->tigertree.verified || 0 == fi->tigertree.num_verified)
+		return;
+
+	g_assert(fi->tigertree.slice_size != 0);
+
+	i = from / fi->tigertree.slice_size;
+	last = (to - 1) / fi->tigertree.slice_size;
+	last = MIN(last, fi->tigertree.num_leaves - 1);
+
+	for (/* empty */; i <= last; i++) {
+		if (bit_array_get(fi->tigertree.verified, i)) {
+			bit_array_clear(fi->tigertree.verified, i);
+			fi->tigertree.num_verified--;
+		}
+	}
+}
+
 void
 file_info_got_tigertree(fileinfo_t *fi,
 	const struct tth *leaves, size_t num_leaves, bool mark_dirty)
@@ -4616,6 +4683,8 @@ status_ok:
 	if (DL_CHUNK_DONE == status) {
 		fi->modified = fi->stamp;
 		fi->dirty = TRUE;
+	} else if (DL_CHUNK_EMPTY == status) {
+		fi_tigertree_unverify(fi, from, to);
 	}
 
 again:
@@ -710,6 +710,100 @@ ggep_stream_close(ggep_stream_t *gs)
 	return len;
 }
 
+/**
+ * We're done with the stream, close it and turn its content into a block
+ * of extensions that can later be spliced into another stream through
+ * ggep_stream_splice().
+ *
+ * The leading GGEP magic byte is removed from the buffer and the "last"
+ * flag is not set on the final extension.
+ *
+ * @param gs		the GGEP stream
+ * @param last		where offset of the flags of the final extension is written
+ *
+ * @return the length of the extension block, 0 if nothing was written.
+ */
+size_t
+ggep_stream_close_block(ggep_stream_t *gs, size_t *last)
+{
+	size_t len;
+
+	g_assert(!gs->begun);			/* Not in the middle of an extension! */
+	g_assert(gs->outbuf != NULL);	/* Not closed already */
+	g_assert(last != NULL);
+
+	if (gs->zd != NULL) {
+		zlib_deflater_free(gs->zd, TRUE);
+		gs->zd = NULL;
+	}
+
+	if (gs->last_fp == NULL) {
+		len = 0;
+		*last = 0;
+	} else {
+		g_assert(gs->magic_sent);
+		g_assert(GGEP_MAGIC == (uchar) gs->outbuf[0]);
+
+		len = gs->o - gs->outbuf - 1;
+		*last = gs->last_fp - gs->outbuf - 1;
+		memmove(gs->outbuf, gs->outbuf + 1, len);
+	}
+
+	gs->outbuf = NULL;				/* Mark stream as closed */
+
+	g_assert(len < gs->size);
+	g_assert(0 == len || *last < len);
+
+	return len;
+}
+
+/**
+ * Append pre-serialized extensions to the stream.
+ *
+ * @param gs		the GGEP stream
+ * @param data		the extension block, as built by ggep_stream_close_block()
+ * @param len		length of the extension block
+ * @param last		offset of the flags of the final extension within block
+ *
+ * @return TRUE if written successfully.  On error, the stream is left
+ * untouched.
+ */
+bool
+ggep_stream_splice(ggep_stream_t *gs,
+	const void *data, size_t len, size_t last)
+{
+	size_t needed;
+	char *start;
+
+	g_assert(ggep_stream_is_valid(gs));
+	g_assert(!gs->begun);
+	g_assert(0 == len || data != NULL);
+	g_assert(0 == len || last < len);
+
+	if (0 == len)
+		return TRUE;
+
+	needed = len + (gs->magic_sent ? 0 : 1);
+
+	if (needed > ggep_stream_avail(gs)) {
+		ggep_errno = GGEP_E_SPACE;
+		return FALSE;
+	}
+
+	if (!gs->magic_sent) {
+		ggep_stream_appendc(gs, GGEP_MAGIC);
+		gs->magic_sent = TRUE;
+	}
+
+	start = gs->o;
+	ggep_stream_append(gs, data, len);
+	gs->last_fp = start + last;
+
+	g_assert(0 == (*gs->last_fp & GGEP_F_LAST));
+
+	return TRUE;
+}
+
 /**
  * The vectorized version of ggep_stream_pack().
  *
@@ -48,6 +48,7 @@
 #include "settings.h"
 #include "share.h"
 #include "spam.h"
+#include "tth_cache.h"
 #include "verify_sha1.h"
 #include "verify_tth.h"
 #include "version.h"
@@ -55,18 +56,25 @@
 #include "lib/atoms.h"
 #include "lib/base32.h"
 #include "lib/cq.h"
+#include "lib/crc.h"
+#include "lib/endian.h"
+#include "lib/fd.h"
 #include "lib/file.h"
 #include "lib/gnet_host.h"
 #include "lib/halloc.h"
 #include "lib/hashing.h"
 #include "lib/header.h"
 #include "lib/hikset.h"
+#include "lib/hstrfn.h"
+#include "lib/mempcpy.h"
+#include "lib/misc.h"
 #include "lib/parse.h"
 #include "lib/pattern.h"
 #include "lib/sha1.h"
 #include "lib/stringify.h"
 #include "lib/tm.h"
 #include "lib/urn.h"
+#include "lib/vmm.h"
 #include "lib/walloc.h"
 
 #include "if/gnet_property.h"
@@ -78,7 +86,7 @@
 
 /**
  * There's an in-core cache (the hash table ``sha1_cache''), and a
- * persistent copy (normally in ~/.gtk-gnutella/sha1_cache). The
+ * persistent copy (normally in ~/.gtk-gnutella/sha1_store). The
  * in-core cache is filled with the persistent one at launch. When the
  * "shared_file" (the records describing the shared files, see
  * share.h) are created, a call is made to sha1_set_digest to fill the
@@ -89,10 +97,16 @@
  * modification time. If they're identical to the ones in the cache,
  * the digest is considered to be accurate, and is used. If the file
  * size or last modification time don't match, the digest is computed
- * again and stored in the in-core cache, but it isn't stored in the
- * persistent one. Instead, the cache is marked as dirty, and will be
- * entirely overwritten by dump_cache, called when everything has been
- * computed.
+ * again and stored in the in-core cache.
+ *
+ * The persistent cache is a binary log of records, each change to the
+ * in-core cache being appended to it as it happens: a record either
+ * stores the entry for a path, superseding any previous one, or removes
+ * it.  When the log holds too many superseded records, it is compacted
+ * by rewriting it from the in-core cache.
+ *
+ * The old text format (~/.gtk-gnutella/sha1_cache) is imported once
+ * when there is no binary log yet.
  */
 
 struct sha1_cache_entry {
@@ -108,7 +122,8 @@ struct sha1_cache_entry {
 static hikset_t *sha1_cache;
 
 /**
- * cache_dirty = TRUE means that in-core cache is different from the disk one.
+ * cache_dirty = TRUE means that the on-disk log missed some changes made to
+ * the in-core cache and must be rewritten.
  */
 static bool cache_dirty;
 static time_t cache_dumped;
@@ -161,115 +176,222 @@ add_volatile_cache_entry(const char *filename, filesize_t size, time_t mtime,
 
 /* Disk cache */
 
-static const char sha1_persistent_cache_file_header[] =
-"#\n"
-"# gtk-gnutella SHA1 cache file.\n"
-"# This file is automatically generated.\n"
-"# Format is: URN<TAB>file_size<TAB>file_mtime<TAB>file_name\n"
-"# Comment lines start with a sharp (#)\n"
-"#\n"
-"\n";
+#define HUGE_STORE_FILE		"sha1_store"	/* Binary log */
+#define HUGE_STORE_TEXT		"sha1_cache"	/* Old text format */
+#define HUGE_STORE_MAGIC	"GTKGSHA1"		/* File magic */
+#define HUGE_STORE_VERSION	1				/* File version */
+#define HUGE_STORE_HEADER	16				/* Magic + version + flags */
+#define HUGE_STORE_PATHMAX	4096			/* Max path length we store */
+#define HUGE_STORE_WASTE	2				/* Compaction factor */
+#define HUGE_STORE_MIN		1024			/* Min records before compacting */
 
-static void
-cache_entry_print(FILE *f, const char *filename,
-	const struct sha1 *sha1, const struct tth *tth,
-	filesize_t size, time_t mtime)
+/*
+ * Records are laid out as follows, all integers being big-endian:
+ *
+ *    uint32	CRC-32 of the remaining of the record
+ *    uint8		operation (HUGE_REC_PUT or HUGE_REC_DEL)
+ *    uint8		flags (HUGE_REC_F_TTH when TTH is present)
+ *    uint16	path length
+ *
+ * followed for HUGE_REC_PUT by:
+ *
+ *    uint64	file size
+ *    uint64	file modification time
+ *    20 bytes	SHA-1
+ *    24 bytes	TTH, if HUGE_REC_F_TTH
+ *
+ * and finally by the path, without any trailing NUL.
+ */
+#define HUGE_REC_HEADER		8				/* Fixed record header */
+#define HUGE_REC_PUT		1
+#define HUGE_REC_DEL		2
+#define HUGE_REC_F_TTH		(1U << 0)
+
+#define HUGE_REC_MAXLEN		(HUGE_REC_HEADER + 16 + \
+	SHA1_RAW_SIZE + TTH_RAW_SIZE + HUGE_STORE_PATHMAX)
+
+static int huge_store_fd = -1;		/* Opened for appending */
+static size_t huge_store_records;	/* Records in the log */
+
+/**
+ * Serialize a record in the supplied buffer.
+ *
+ * @return the length of the record, 0 if path is too long.
+ */
+static size_t
+huge_store_record(char *buf, uint8 op, const char *path,
+	filesize_t size, time_t mtime,
+	const struct sha1 *sha1, const struct tth *tth)
 {
-	char size_buf[UINT64_DEC_BUFLEN], mtime_buf[UINT64_DEC_BUFLEN];
+	size_t plen = vstrlen(path);
+	char *p = &buf[HUGE_REC_HEADER];
+
+	if G_UNLIKELY(plen > HUGE_STORE_PATHMAX)
+		return 0;
+
+	if (HUGE_REC_PUT == op) {
+		g_assert(sha1 != NULL);
+
+		poke_be64(p, size);
+		p += 8;
+		poke_be64(p, mtime);
+		p += 8;
+		p = mempcpy(p, sha1->data, SHA1_RAW_SIZE);
+		if (tth != NULL)
+			p = mempcpy(p, tth->data, TTH_RAW_SIZE);
+	}
 
-	g_return_if_fail(f);
-	g_return_if_fail(filename);
-	g_return_if_fail(sha1);
-	g_return_if_fail(size > 0);
+	p = mempcpy(p, path, plen);
 
-	uint64_to_string_buf(size, ARYLEN(size_buf));
-	uint64_to_string_buf(mtime, ARYLEN(mtime_buf));
+	buf[4] = op;
+	buf[5] = (HUGE_REC_PUT == op && tth != NULL) ? HUGE_REC_F_TTH : 0;
+	poke_be16(&buf[6], plen);
+	poke_be32(&buf[0], crc32_update(0, &buf[4], (p - buf) - 4));
 
-	fprintf(f, "%s\t%s\t%s\t%s\n", bitprint_to_urn_string(sha1, tth),
-		size_buf, mtime_buf, filename);
+	return p - buf;
 }
 
 /**
- * Add an entry to the persistent cache.
+ * Append a record to the persistent cache.
  */
 static void
-add_persistent_cache_entry(const char *filename, filesize_t size,
-	time_t mtime, const struct sha1 *sha1, const struct tth *tth)
+huge_store_append(uint8 op, const char *path,
+	filesize_t size, time_t mtime,
+	const struct sha1 *sha1, const struct tth *tth)
 {
-	char *pathname;
-	FILE *f;
+	char buf[HUGE_REC_MAXLEN];
+	size_t len;
+	ssize_t w;
 
-	pathname = make_pathname(settings_config_dir(), "sha1_cache");
-	f = file_fopen(pathname, "a");
-	if (f) {
-		filestat_t sb;
+	if G_UNLIKELY(-1 == huge_store_fd)
+		return;
 
-		/*
-		 * If we're adding the very first entry (file empty), then emit header.
-		 */
+	len = huge_store_record(buf, op, path, size, mtime, sha1, tth);
+	if G_UNLIKELY(0 == len) {
+		g_warning("%s(): path too long, not persisting \"%s\"",
+			G_STRFUNC, path);
+		return;
+	}
 
-		if (fstat(fileno(f), &sb)) {
-			g_warning("%s(): could not stat \"%s\": %m", G_STRFUNC, pathname);
-		} else {
-			if (0 == sb.st_size) {
-				fputs(sha1_persistent_cache_file_header, f);
-			}
-			cache_entry_print(f, filename, sha1, tth, size, mtime);
-		}
-		fclose(f);
-	} else {
-		g_warning("%s(): could not open \"%s\": %m", G_STRFUNC, pathname);
+	w = write(huge_store_fd, buf, len);
+	if G_UNLIKELY(UNSIGNED(w) != len) {
+		g_warning("%s(): could not append to SHA-1 cache: %s",
+			G_STRFUNC, -1 == w ? english_strerror(errno) : "partial write");
+		fd_forget_and_close(&huge_store_fd);	/* Will compact on next dump */
+		cache_dirty = TRUE;
+		return;
 	}
-	HFREE_NULL(pathname);
+
+	huge_store_records++;
+}
+
+/**
+ * Open the persistent cache for appending records.
+ */
+static void
+huge_store_open(void)
+{
+	char *path;
+
+	g_assert(-1 == huge_store_fd);
+
+	path = make_pathname(settings_config_dir(), HUGE_STORE_FILE);
+	huge_store_fd = file_open(path, O_WRONLY | O_APPEND, 0);
+	HFREE_NULL(path);
 }
 
 struct dump_cache_context {
 	FILE *f;
-	bool forced;
+	size_t records;
+	bool failed;
 };
 
 /**
- * Dump one (in-memory) cache into the persistent cache. This is a callback
- * called by dump_cache to dump the whole in-memory cache onto disk.
+ * Dump one (in-memory) cache entry into the persistent cache. This is a
+ * callback called by dump_cache to dump the whole in-memory cache onto disk.
  */
 static void
 dump_cache_one_entry(void *value, void *udata)
 {
 	struct sha1_cache_entry *e = value;
 	struct dump_cache_context *ctx = udata;
+	char buf[HUGE_REC_MAXLEN];
+	size_t len;
 
-	if (ctx->forced || e->shared) {
-		cache_entry_print(ctx->f,
-			e->file_name, e->sha1, e->tth, e->size, e->mtime);
-	}
+	if (ctx->failed)
+		return;
+
+	len = huge_store_record(buf, HUGE_REC_PUT,
+			e->file_name, e->size, e->mtime, e->sha1, e->tth);
+
+	if (0 == len)
+		return;		/* Path too long */
+
+	if (1 != fwrite(buf, len, 1, ctx->f))
+		ctx->failed = TRUE;
+	else
+		ctx->records++;
 }
 
 /**
- * Dump the whole in-memory cache onto disk.
+ * Rewrite the persistent cache from the in-core cache.
+ *
+ * This is only done when forced or when the log holds too many superseded
+ * records, since every change is otherwise appended to it.
  */
 static void
 dump_cache(bool force)
 {
 	FILE *f;
 	file_path_t fp;
+	size_t count = hikset_count(sha1_cache);
 
-	if (!force && !cache_dirty)
+	if (
+		!force && !cache_dirty &&
+		(huge_store_records < HUGE_STORE_MIN ||
+			huge_store_records <= HUGE_STORE_WASTE * count)
+	)
 		return;
 
-	file_path_set(&fp, settings_config_dir(), "sha1_cache");
+	file_path_set(&fp, settings_config_dir(), HUGE_STORE_FILE);
 	f = file_config_open_write("SHA-1 cache", &fp);
 	if (f) {
 		struct dump_cache_context ctx;
+		char header[HUGE_STORE_HEADER];
 
-		fputs(sha1_persistent_cache_file_header, f);
+		ZERO(&header);
+		memcpy(header, HUGE_STORE_MAGIC, CONST_STRLEN(HUGE_STORE_MAGIC));
+		poke_be32(&header[8], HUGE_STORE_VERSION);
+
+		ZERO(&ctx);
 		ctx.f = f;
-		ctx.forced = force;
+		ctx.failed = 1 != fwrite(ARYLEN(header), 1, f);
 		hikset_foreach(sha1_cache, dump_cache_one_entry, &ctx);
-		if (file_config_close(f, &fp)) {
+
+		if (ctx.failed) {
+			g_warning("%s(): could not write SHA-1 cache: %m", G_STRFUNC);
+			fclose(f);
+		} else if (file_config_close(f, &fp)) {
+			fd_close(&huge_store_fd);
+			huge_store_records = ctx.records;
 			cache_dirty = FALSE;
+			huge_store_open();
+
+			if (GNET_PROPERTY(share_debug)) {
+				g_debug("%s(): wrote %zu entr%s to SHA-1 cache",
+					G_STRFUNC, ctx.records, plural_y(ctx.records));
+			}
 		}
 	}
 
+	/*
+	 * Without an opened log, changes are no longer recorded on disk until
+	 * we can write the whole cache again.
+	 */
+
+	if (-1 == huge_store_fd)
+		cache_dirty = TRUE;
+
 	/*
 	 * Update the timestamp even on failure to avoid that we retry this
 	 * too frequently.
@@ -277,6 +399,98 @@ dump_cache(bool force)
 	cache_dumped = tm_time();
 }
 
+/**
+ * Free SHA1 cache entry.
+ */
+static void
+cache_free_entry(void *v, void *unused_udata)
+{
+	struct sha1_cache_entry *e = v;
+
+	(void) unused_udata;
+
+	atom_str_free_null(&e->file_name);
+	atom_sha1_free_null(&e->sha1);
+	atom_tth_free_null(&e->tth);
+	WFREE(e);
+}
+
+/**
+ * Apply the records held in the persistent cache to the in-core cache.
+ *
+ * @param data		the log data, starting after the file header
+ * @param len		the length of the data
+ *
+ * @return the length of the valid log data.
+ */
+static size_t G_COLD
+huge_store_load(const char *data, size_t len)
+{
+	const char *p = data, *end = data + len;
+
+	while (p + HUGE_REC_HEADER <= end) {
+		uint8 op = p[4], flags = p[5];
+		uint16 plen = peek_be16(&p[6]);
+		size_t rlen = HUGE_REC_HEADER + plen;
+		const char *q = &p[HUGE_REC_HEADER];
+		struct sha1_cache_entry *cached;
+		char path[HUGE_STORE_PATHMAX + 1];
+		const char *key;
+
+		if (HUGE_REC_PUT == op)
+			rlen += 16 + SHA1_RAW_SIZE +
+				((flags & HUGE_REC_F_TTH) ? TTH_RAW_SIZE : 0);
+		else if (op != HUGE_REC_DEL)
+			break;
+
+		if (rlen > UNSIGNED(end - p) || plen > HUGE_STORE_PATHMAX)
+			break;
+
+		if (peek_be32(p) != crc32_update(0, &p[4], rlen - 4))
+			break;
+
+		clamp_memcpy(ARYLEN(path), &p[rlen - plen], plen);
+		path[plen] = '\0';
+
+		/*
+		 * The cache is keyed by the atom address, hence we need the atom
+		 * to look the path up.
+		 */
+
+		key = atom_str_get(path);
+		cached = hikset_lookup(sha1_cache, key);
+
+		if (HUGE_REC_DEL == op) {
+			if (cached != NULL) {
+				hikset_remove(sha1_cache, key);
+				cache_free_entry(cached, NULL);
+			}
+		} else {
+			filesize_t size = peek_be64(q);
+			time_t mtime = peek_be64(&q[8]);
+			const struct sha1 *sha1 = (const struct sha1 *) &q[16];
+			const struct tth *tth = (flags & HUGE_REC_F_TTH) ?
+				(const struct tth *) &q[16 + SHA1_RAW_SIZE] : NULL;
+
+			if (cached != NULL) {
+				cached->size = size;
+				cached->mtime = mtime;
+				atom_sha1_change(&cached->sha1, sha1);
+				atom_tth_change(&cached->tth, tth);
+			} else {
+				add_volatile_cache_entry(key, size, mtime, sha1, tth, FALSE);
+			}
+		}
+
+		atom_str_free_null(&key);
+
+		huge_store_records++;
+		p += rlen;
+	}
+
+	return p - data;
+}
+
 /**
  * This function is used to read the disk cache into memory.
  *
@@ -385,37 +599,157 @@ failure:
 }
 
 /**
- * Read the whole persistent cache into memory.
+ * Import the old text persistent cache into memory.
+ *
+ * @return TRUE if there was a cache to import.
  */
-static void G_COLD
-sha1_read_cache(void)
+static bool G_COLD
+sha1_import_text_cache(void)
 {
 	FILE *f;
 	file_path_t fp[1];
 	bool truncated = FALSE;
 
+	file_path_set(fp, settings_config_dir(), HUGE_STORE_TEXT);
+	f = file_config_open_read_norename("SHA-1 text cache", fp, N_ITEMS(fp));
+	if (NULL == f)
+		return FALSE;
+
+	for (;;) {
+		char buffer[4096];
+
+		if (NULL == fgets(ARYLEN(buffer), f))
+			break;
+
+		if (!file_line_chomp_tail(ARYLEN(buffer), NULL)) {
+			truncated = TRUE;
+		} else if (truncated) {
+			truncated = FALSE;
+		} else {
+			parse_and_append_cache_entry(buffer);
+		}
+	}
+	fclose(f);
+
+	g_info("imported %zu entr%s from old SHA-1 cache",
+		hikset_count(sha1_cache), plural_y(hikset_count(sha1_cache)));
+
+	return TRUE;
+}
+
+/**
+ * Read the whole persistent cache into memory.
+ */
+static void G_COLD
+sha1_read_cache(void)
+{
+	char *path;
+	filestat_t sb;
+	int fd;
+	size_t len, valid;
+	char *data;
+	bool mapped = FALSE;
+
 	g_return_if_fail(settings_config_dir());
 
-	file_path_set(fp, settings_config_dir(), "sha1_cache");
-	f = file_config_open_read("SHA-1 cache", fp, N_ITEMS(fp));
-	if (f) {
-		for (;;) {
-			char buffer[4096];
+	path = make_pathname(settings_config_dir(), HUGE_STORE_FILE);
+	fd = file_open_missing(path, O_RDWR);
 
-			if (NULL == fgets(ARYLEN(buffer), f))
-				break;
+	if (-1 == fd) {
+		/*
+		 * No binary cache yet: import the old text format, if any, and
+		 * create the binary cache.
+		 */
 
-			if (!file_line_chomp_tail(ARYLEN(buffer), NULL)) {
-				truncated = TRUE;
-			} else if (truncated) {
-				truncated = FALSE;
-			} else {
-				parse_and_append_cache_entry(buffer);
-			}
+		if (sha1_import_text_cache()) {
+			char *text = make_pathname(settings_config_dir(), HUGE_STORE_TEXT);
+			char *old = h_strconcat(text, ".old", NULL_PTR);
+
+			dump_cache(TRUE);
+			if (-1 == rename(text, old))
+				g_warning("%s(): cannot rename \"%s\": %m", G_STRFUNC, text);
+
+			HFREE_NULL(old);
+			HFREE_NULL(text);
+		} else {
+			dump_cache(TRUE);
+		}
+		goto done;
+	}
+
+	if (-1 == fstat(fd, &sb) || sb.st_size < HUGE_STORE_HEADER) {
+		g_warning("%s(): ignoring invalid \"%s\"", G_STRFUNC, path);
+		fd_forget_and_close(&fd);
+		dump_cache(TRUE);
+		goto done;
+	}
+
+	len = sb.st_size;
+
+#ifdef HAS_MMAP
+	data = vmm_mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (MAP_FAILED == data) {
+		data = NULL;
+	} else {
+		mapped = TRUE;
+		vmm_madvise_sequential(data, len);
+	}
+#else
+	data = NULL;
+#endif
+
+	if (NULL == data) {
+		data = halloc(len);
+		if (UNSIGNED(pread(fd, data, len, 0)) != len) {
+			g_warning("%s(): cannot read \"%s\": %m", G_STRFUNC, path);
+			HFREE_NULL(data);
+			fd_forget_and_close(&fd);
+			dump_cache(TRUE);
+			goto done;
 		}
-		fclose(f);
+	}
+
+	if (
+		0 != memcmp(data, HUGE_STORE_MAGIC, CONST_STRLEN(HUGE_STORE_MAGIC)) ||
+		peek_be32(&data[8]) != HUGE_STORE_VERSION
+	) {
+		g_warning("%s(): ignoring \"%s\": bad magic or version",
+			G_STRFUNC, path);
+		valid = 0;
+	} else {
+		valid = huge_store_load(&data[HUGE_STORE_HEADER],
+			len - HUGE_STORE_HEADER);
+	}
+
+	if (mapped)
+		vmm_munmap(data, len);
+	else
+		HFREE_NULL(data);
+
+	if (0 == valid && len > HUGE_STORE_HEADER) {
+		fd_forget_and_close(&fd);
 		dump_cache(TRUE);
+		goto done;
 	}
+
+	/*
+	 * Discard any trailing partial record, left by a crash whilst we were
+	 * appending to the log, before appending new records.
+	 */
+
+	if (HUGE_STORE_HEADER + valid != len) {
+		g_warning("%s(): truncating \"%s\" to %zu bytes (was %zu)",
+			G_STRFUNC, path, HUGE_STORE_HEADER + valid, len);
+		if (-1 == ftruncate(fd, HUGE_STORE_HEADER + valid))
+			g_warning("%s(): cannot truncate \"%s\": %m", G_STRFUNC, path);
+	}
+
+	fd_forget_and_close(&fd);
+	huge_store_open();
+	dump_cache(FALSE);		/* Compact if needed */
+
+done:
+	HFREE_NULL(path);
 }
 
 static bool
@@ -458,8 +792,6 @@ cache_dump_schedule(void)
 {
 	time_delta_t t;
 
-	cache_dirty = TRUE;
-
 	if G_UNLIKELY(0 == cache_dumped) {
 		t = 0;
 	} else {
@@ -538,15 +870,16 @@ huge_update_hashes(shared_file_t *sf,
 		update_volatile_cache(cached, shared_file_size(sf),
 			shared_file_modification_time(sf), sha1, tth);
 
-		cache_dump_schedule(); 	/* Dump cache once per minute */
+		cache_dump_schedule(); 	/* Check for compaction once per minute */
 	} else {
 		add_volatile_cache_entry(shared_file_path(sf),
 			shared_file_size(sf), shared_file_modification_time(sf),
 			sha1, tth, TRUE);
-		add_persistent_cache_entry(shared_file_path(sf),
-			shared_file_size(sf), shared_file_modification_time(sf),
-			sha1, tth);
 	}
+
+	huge_store_append(HUGE_REC_PUT, shared_file_path(sf),
+		shared_file_size(sf), shared_file_modification_time(sf), sha1, tth);
+
 	return TRUE;
 }
 
@@ -629,8 +962,21 @@ huge_verify_callback(const struct verify *ctx, enum verify_status status,
 	case VERIFY_PROGRESS:
 		return shared_file_indexed(sf);
 	case VERIFY_DONE:
-		huge_update_hashes(sf, verify_sha1_digest(ctx), NULL);
-		request_tigertree(sf, TRUE);
+		{
+			const struct tth *tth = verify_sha1_tth_digest(ctx);
+
+			/*
+			 * The TTH was computed in the same pass as the SHA-1, so there
+			 * is no need to read the file again through request_tigertree().
+			 *
+			 * As in the TTH verification callback, persist the TTH first,
+			 * so that huge_update_hashes() can rely on it being cached.
+			 */
+
+			tth_cache_insert(tth, verify_sha1_tth_leaves(ctx),
+				verify_sha1_tth_leave_count(ctx));
+			huge_update_hashes(sf, verify_sha1_digest(ctx), tth);
+		}
 		/* FALL THROUGH */
 	case VERIFY_ERROR:
 	case VERIFY_SHUTDOWN:
@@ -647,8 +993,7 @@ huge_verify_callback(const struct verify *ctx, enum verify_status status,
 /**
  * Put the shared file on the stack of the things to do.
  *
- * We first begin with the computation of the SHA1, and when completed we
- * will continue with the TTH computation.
+ * Both the SHA1 and the TTH are computed whilst reading the file once.
  */
 static void
 queue_shared_file_for_sha1_computation(shared_file_t *sf)
@@ -729,7 +1074,6 @@ request_sha1(shared_file_t *sf)
 	cached = hikset_lookup(sha1_cache, shared_file_path(sf));
 
 	if (cached && cached_entry_up_to_date(cached, sf)) {
-		cache_dirty = TRUE;
 		cached->shared = TRUE;
 		shared_file_set_sha1(sf, cached->sha1);
 		shared_file_set_tth(sf, cached->tth);
@@ -1019,10 +1363,8 @@ cache_entry_is_shared(void *v, void *unused_udata)
 	if (NULL == sf) {
 		/* Entry no longer shared */
 
-		atom_str_free_null(&e->file_name);
-		atom_sha1_free_null(&e->sha1);
-		atom_tth_free_null(&e->tth);
-		WFREE(e);
+		huge_store_append(HUGE_REC_DEL, e->file_name, 0, 0, NULL, NULL);
+		cache_free_entry(e, NULL);
 
 		return TRUE;
 	}
@@ -1070,28 +1412,13 @@ huge_sha1_cache_prune(void)
 void
 huge_init(void)
 {
+	crc_init();
 	sha1_cache = hikset_create(		/* Keys are atoms */
 		offsetof(struct sha1_cache_entry, file_name), HASH_KEY_SELF, 0);
 	sha1_read_cache();
 	has_http_urls = pattern_compile("http://", FALSE);
 }
 
-/**
- * Free SHA1 cache entry.
- */
-static void
-cache_free_entry(void *v, void *unused_udata)
-{
-	struct sha1_cache_entry *e = v;
-
-	(void) unused_udata;
-
-	atom_str_free_null(&e->file_name);
-	atom_sha1_free_null(&e->sha1);
-	atom_tth_free_null(&e->tth);
-	WFREE(e);
-}
-
 /**
  * Called when servent is shutdown.
  */
@@ -1099,6 +1426,7 @@ void
 huge_close(void)
 {
 	dump_cache(FALSE);
+	fd_close(&huge_store_fd);
 
 	hikset_foreach(sha1_cache, cache_free_entry, NULL);
 	hikset_free_null(&sha1_cache);
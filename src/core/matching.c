@@ -39,6 +39,7 @@
 #include "lib/halloc.h"
 #include "lib/hset.h"
 #include "lib/pattern.h"
+#include "lib/postings.h"
 #include "lib/pslist.h"
 #include "lib/stringify.h"	/* For hex_escape() */
 #include "lib/utf8.h"
@@ -84,9 +85,24 @@ typedef uint64 st_mask_t;
  *    bin["rc"] has 1
  *
  * Therefore we'll look for "arc" in the bin["rc"] list.
+ *
+ * Bins do not hold pointers to the entries: all the entries of a set are
+ * held in a single array and bins are compressed posting lists of indices
+ * within that array.  Since entries are only appended to the set, each
+ * posting list is naturally sorted.
+ *
+ * When the query yields more than one bin, the posting list of the smallest
+ * bin is intersected with the others, starting with the next smallest, which
+ * reduces the amount of entries on which we need to run pattern matching.
+ *
+ * Removed entries leave a NULL slot in the entries array, and their index
+ * stays in the posting lists.  Once there are too many of these, the set
+ * is rebuilt with only the live entries.
  */
 
-#define ST_MIN_BIN_SIZE		4
+#define ST_MIN_ENTRIES		16		/**< Initial size of entries[] */
+#define ST_REBUILD_MIN		1024	/**< Min removed entries before rebuild */
+#define ST_REBUILD_RATIO	4		/**< Rebuild when 1/4 of slots removed */
 
 struct st_entry {
 	const char *string;				/* atom */
@@ -94,15 +110,19 @@ struct st_entry {
 	st_mask_t mask;
 };
 
+/**
+ * A bin, holding the posting list of entries sharing a two-char key.
+ */
 struct st_bin {
-	uint nslots, nvals;
-	struct st_entry **vals;
+	postings_t list;			/**< Sorted indices of entries */
+	uint32 nlive;				/**< Amount of postings for live entries */
 };
 
 struct st_set {
 	uint nentries, nchars, nbins;
 	struct st_bin **bins;
-	struct st_bin all_entries;
+	struct st_entry **entries;	/**< All entries, NULL if removed */
+	uint32 nvals, nslots;		/**< Used and allocated entries[] */
 	uchar index_map[MAX_INT_VAL(uchar)];
 	uchar fold_map[MAX_INT_VAL(uchar)];
 };
@@ -133,22 +153,6 @@ destroy_entry(struct st_entry *entry)
 	WFREE(entry);
 }
 
-/**
- * Initialize a bin.
- */
-static void
-bin_initialize(struct st_bin *bin, int size)
-{
-	uint i;
-
-	bin->nvals = 0;
-	bin->nslots = size;
-
-	HALLOC_ARRAY(bin->vals, bin->nslots);
-	for (i = 0; i < bin->nslots; i++)
-		bin->vals[i] = NULL;
-}
-
 /**
  * Allocate a bin.
  */
@@ -157,8 +161,8 @@ bin_allocate(void)
 {
 	struct st_bin *bin;
 
-	WALLOC(bin);
-	bin_initialize(bin, ST_MIN_BIN_SIZE);
+	WALLOC0(bin);
+	postings_init(&bin->list);
 	return bin;
 }
 
@@ -170,32 +174,21 @@ bin_allocate(void)
 static void
 bin_destroy(struct st_bin *bin)
 {
-	HFREE_NULL(bin->vals);
-	bin->nslots = 0;
-	bin->nvals = 0;
-}
-
-/**
- * Inserts an item into a bin.
- */
-static void
-bin_insert_item(struct st_bin *bin, struct st_entry *entry)
-{
-	if (bin->nvals == bin->nslots) {
-		bin->nslots *= 2;
-		HREALLOC_ARRAY(bin->vals, bin->nslots);
-	}
-	bin->vals[bin->nvals++] = entry;
+	postings_discard(&bin->list);
+	WFREE(bin);
 }
 
 /**
- * Makes a bin take as little memory as needed.
+ * Appends an entry index to a bin.
+ *
+ * Indices must be appended in increasing order, hence the posting list
+ * is always sorted.
  */
 static void
-bin_compact(struct st_bin *bin)
+bin_insert_item(struct st_bin *bin, uint32 idx)
 {
-	HREALLOC_ARRAY(bin->vals, bin->nvals);
-	bin->nslots = bin->nvals;
+	postings_append(&bin->list, idx);
+	bin->nlive++;
 }
 
 static uchar map[MAX_INT_VAL(uchar)];
@@ -261,7 +254,8 @@ st_set_initialize(struct st_set *set)
 	set->nchars = cur_char;
 	set->nbins = set->nchars * set->nchars;
 	set->bins = NULL;
-	set->all_entries.vals = 0;
+	set->entries = NULL;
+	set->nvals = set->nslots = 0;
 
 	if (GNET_PROPERTY(matching_debug)) {
 		static bool done;
@@ -302,7 +296,9 @@ st_set_recreate(struct st_set *set)
 	for (i = 0; i < set->nbins; i++)
 		set->bins[i] = NULL;
 
-    bin_initialize(&set->all_entries, ST_MIN_BIN_SIZE);
+	set->nslots = ST_MIN_ENTRIES;
+	set->nvals = 0;
+	HALLOC_ARRAY(set->entries, set->nslots);
 }
 
 /**
@@ -329,20 +325,19 @@ st_set_destroy(struct st_set *set)
 		for (i = 0; i < set->nbins; i++) {
 			struct st_bin *bin = set->bins[i];
 
-			if (bin) {
+			if (bin)
 				bin_destroy(bin);
-				WFREE(bin);
-			}
 		}
 		HFREE_NULL(set->bins);
 	}
 
-	if (set->all_entries.vals) {
-		for (i = 0; i < set->all_entries.nvals; i++) {
-			destroy_entry(set->all_entries.vals[i]);
-			set->all_entries.vals[i] = NULL;
+	if (set->entries) {
+		for (i = 0; i < set->nvals; i++) {
+			if (set->entries[i] != NULL)
+				destroy_entry(set->entries[i]);
 		}
-		bin_destroy(&set->all_entries);
+		HFREE_NULL(set->entries);
+		set->nvals = set->nslots = 0;
 	}
 }
 
@@ -434,7 +429,7 @@ st_count(const search_table_t *table, enum match_set which)
 
 	g_assert(set != NULL);
 
-	return set->all_entries.nvals;
+	return set->nentries;
 }
 
 /**
@@ -477,6 +472,69 @@ st_key(struct st_set *set, const char k[2])
 		set->index_map[(uchar) k[1]];
 }
 
+/**
+ * Record entry index in the bins of all the two-char keys of its string.
+ */
+static void
+st_set_index_entry(struct st_set *set, const struct st_entry *entry, uint32 idx)
+{
+	size_t i, len;
+
+	len = vstrlen(entry->string);
+	for (i = 0; i < len - 1; i++) {
+		uint key = st_key(set, &entry->string[i]);
+		struct st_bin *bin;
+
+		g_assert(key < set->nbins);
+
+		bin = set->bins[key];
+		if (NULL == bin) {
+			bin = set->bins[key] = bin_allocate();
+		} else if (postings_last_is(&bin->list, idx)) {
+			continue;		/* Don't insert item into same bin twice */
+		}
+
+		bin_insert_item(bin, idx);
+	}
+}
+
+/**
+ * Rebuild the set with its live entries only, dropping the slots of the
+ * removed entries and their postings.
+ */
+static void
+st_set_rebuild(struct st_set *set)
+{
+	struct st_entry **entries = set->entries;
+	uint32 i, nvals = set->nvals;
+
+	for (i = 0; i < set->nbins; i++) {
+		if (set->bins[i] != NULL) {
+			bin_destroy(set->bins[i]);
+			set->bins[i] = NULL;
+		}
+	}
+
+	set->nslots = MAX(ST_MIN_ENTRIES, set->nentries);
+	set->nvals = 0;
+	HALLOC_ARRAY(set->entries, set->nslots);
+
+	for (i = 0; i < nvals; i++) {
+		struct st_entry *entry = entries[i];
+
+		if (entry != NULL) {
+			uint32 idx = set->nvals++;
+
+			set->entries[idx] = entry;
+			st_set_index_entry(set, entry, idx);
+		}
+	}
+
+	g_assert(set->nvals == set->nentries);
+
+	hfree(entries);
+}
+
 /**
  * Insert an item into the search_table
  * one-char strings are silently ignored.
@@ -487,10 +545,10 @@ bool
 st_insert_item(search_table_t *table,
 	enum match_set which, const char *s, const shared_file_t *sf)
 {
-	size_t i, len;
+	size_t len;
 	struct st_entry *entry;
-	hset_t *seen_keys;
 	struct st_set *set = NULL;
+	uint32 idx;
 
 	search_table_check(table);
 
@@ -504,35 +562,118 @@ st_insert_item(search_table_t *table,
 	}
 
 	g_assert(set != NULL);
-
-	seen_keys = hset_create(HASH_KEY_SELF, 0);
+	g_assert(set->nvals < MAX_INT_VAL(uint32));
 
 	WALLOC(entry);
 	entry->string = atom_str_get(s);
 	entry->sf = shared_file_ref(sf);
 	entry->mask = mask_hash(entry->string);
 
-	len = vstrlen(entry->string);
-	for (i = 0; i < len - 1; i++) {
-		uint key = st_key(set, &entry->string[i]);
+	if (set->nvals == set->nslots) {
+		set->nslots = MAX(ST_MIN_ENTRIES, set->nslots * 2);
+		HREALLOC_ARRAY(set->entries, set->nslots);
+	}
+
+	idx = set->nvals++;
+	set->entries[idx] = entry;
+	set->nentries++;
+
+	st_set_index_entry(set, entry, idx);
+
+	return TRUE;
+}
+
+/**
+ * Remove all the entries referring to the shared file from the set.
+ *
+ * @return amount of entries removed.
+ */
+static uint
+st_set_remove_item(struct st_set *set, const shared_file_t *sf)
+{
+	uint32 i;
+	uint removed = 0;
+
+	for (i = 0; i < set->nvals; i++) {
+		struct st_entry *entry = set->entries[i];
+		hset_t *seen_keys;
+		size_t j, len;
 
-		/* don't insert item into same bin twice */
-		if (hset_contains(seen_keys, int_to_pointer(key)))
+		if (NULL == entry || entry->sf != sf)
 			continue;
 
-		hset_insert(seen_keys, int_to_pointer(key));
+		/*
+		 * Posting lists cannot be edited in place, so the index of the
+		 * removed entry remains listed in the bins where st_insert_item()
+		 * put it, and the searches skip it.  We only account for the live
+		 * entries in these bins, so that bins that no longer reference any
+		 * live entry are freed and st_run_search() can immediately determine
+		 * that there will be no match.
+		 */
 
-		g_assert(key < set->nbins);
-		if (set->bins[key] == NULL)
-			set->bins[key] = bin_allocate();
+		seen_keys = hset_create(HASH_KEY_SELF, 0);
+		len = vstrlen(entry->string);
 
-		bin_insert_item(set->bins[key], entry);
+		for (j = 0; j < len - 1; j++) {
+			uint key = st_key(set, &entry->string[j]);
+			struct st_bin *bin = set->bins[key];
+
+			if (NULL == bin || hset_contains(seen_keys, uint_to_pointer(key)))
+				continue;
+
+			hset_insert(seen_keys, uint_to_pointer(key));
+
+			g_assert(bin->nlive != 0);
+
+			if (0 == --bin->nlive) {
+				bin_destroy(bin);
+				set->bins[key] = NULL;
+			}
+		}
+
+		hset_free_null(&seen_keys);
+		set->entries[i] = NULL;
+		set->nentries--;
+		destroy_entry(entry);
+		removed++;
 	}
-	bin_insert_item(&set->all_entries, entry);
-	set->nentries++;
 
-	hset_free_null(&seen_keys);
-	return TRUE;
+	/*
+	 * Searches scan the postings of removed entries, and their slots are
+	 * never reused: rebuild the set when they become too numerous.
+	 */
+
+	if (removed != 0) {
+		uint32 dead = set->nvals - set->nentries;
+
+		if (dead >= ST_REBUILD_MIN && dead >= set->nvals / ST_REBUILD_RATIO) {
+			if (GNET_PROPERTY(matching_debug)) {
+				g_debug("MATCH %s(): rebuilding set, %u/%u entries removed",
+					G_STRFUNC, dead, set->nvals);
+			}
+			st_set_rebuild(set);
+		}
+	}
+
+	return removed;
+}
+
+/**
+ * Remove all the entries referring to the shared file from the search table.
+ *
+ * This allows incremental updates of the table, as opposed to rebuilding
+ * it completely.  The caller must ensure nobody is searching the table
+ * concurrently.
+ *
+ * @return amount of entries removed, from both sets.
+ */
+uint
+st_remove_item(search_table_t *table, const shared_file_t *sf)
+{
+	search_table_check(table);
+
+	return st_set_remove_item(&table->plain, sf) +
+		st_set_remove_item(&table->alias, sf);
 }
 
 /**
@@ -543,14 +684,15 @@ st_set_compact(struct st_set *set)
 {
 	uint i;
 
-	if (!set->all_entries.nvals)
+	if (0 == set->nvals)
 		return;			/* Nothing in set */
 
-	bin_compact(&set->all_entries);
+	HREALLOC_ARRAY(set->entries, set->nvals);
+	set->nslots = set->nvals;
 
 	for (i = 0; i < set->nbins; i++) {
 		if (set->bins[i])
-			bin_compact(set->bins[i]);
+			postings_compact(&set->bins[i]->list);
 	}
 }
 
@@ -691,10 +833,12 @@ st_run_search(
 	uint i, len;
 	struct st_bin *best_bin = NULL;
 	uint best_bin_size = UINT_MAX;
+	const postings_t **lists = NULL;
+	uint nbins = 0;
 	word_vec_t *wovec;
 	uint wocnt;
 	cpattern_t **pattern;
-	struct st_entry **vals;
+	uint32 *vals;
 	uint vcnt;
 	int scanned = 0;		/* measure search mask efficiency */
 	pslist_t *local;
@@ -714,8 +858,12 @@ st_run_search(
 	if (len >= 2) {
 		uint b = 0;
 
+		HALLOC_ARRAY(lists, len - 1);
+
 		for (i = 0; i < len - 1; i++) {
 			struct st_bin *bin;
+			uint j;
+
 			if (is_ascii_space(search[i]) || is_ascii_space(search[i+1]))
 				continue;
 			key = st_key(set, search + i);
@@ -723,9 +871,15 @@ st_run_search(
 				best_bin = NULL;
 				break;
 			}
-			if (bin->nvals < best_bin_size) {
+			for (j = 0; j < nbins; j++) {
+				if (&bin->list == lists[j])
+					break;
+			}
+			if (j == nbins)
+				lists[nbins++] = &bin->list;	/* All the distinct bins */
+			if (bin->nlive < best_bin_size) {
 				best_bin = bin;
-				best_bin_size = bin->nvals;
+				best_bin_size = bin->nlive;
 				b = i;		/* Best bin starting index */
 			}
 		}
@@ -840,19 +994,21 @@ st_run_search(
 		shared_file_name_canonic_len : shared_file_name_normalized_len;
 
 	/*
-	 * Search through the smallest bin
+	 * Search through the entries listed in all the bins
 	 */
 
-	vcnt = best_bin->nvals;
-	vals = best_bin->vals;
+	vals = postings_intersect(lists, nbins, &vcnt);
 
 	nres = 0;
 	local = *result;
 	for (i = 0; i < vcnt; i++) {
-		const struct st_entry *e = vals[i];
+		const struct st_entry *e = set->entries[vals[i]];
 		const shared_file_t *sf;
 		size_t filename_len;
 
+		if (NULL == e)
+			continue;		/* Removed entry */
+
 		/*
 		 * As we only return a limited amount of results, we insert all the
 		 * matching entries in a list, which will then be randomly shuffled.
@@ -906,12 +1062,15 @@ st_run_search(
 		}
 
 		g_debug("MATCH %s(): "
-			"scanned %d/%d bin entr%s, "
+			"scanned %d/%u/%d bin entr%s (%u bin%s), "
 			"compiled %u/%u pattern%s, got %d match%s",
-			G_STRFUNC, scanned, best_bin_size, plural_y(scanned),
+			G_STRFUNC, scanned, vcnt, best_bin_size, plural_y(scanned),
+			nbins, plural(nbins),
 			compiled, wocnt, plural(compiled), nres, plural_es(nres));
 	}
 
+	HFREE_NULL(vals);
+
 	/*
 	 * Matching patterns are lazily compiled by entry_match(), as they are
 	 * needed, but in order.  Therefore we can stop as soon as we hit a NULL
@@ -931,38 +1090,41 @@ st_run_search(
 
 finish:
 	hset_free_null(&already_matched);
+	HFREE_NULL(lists);
 
 	return nres;
 }
 
 /**
- * Do an actual search.
+ * Collect all the entries matching the query, without any limit on the
+ * amount of results.
+ *
+ * The files listed in the returned list are not referenced: the caller must
+ * process them before the search table can be disposed of.
  *
  * @param table			table containing organized entries to search from
  * @param search_term	the query string
  * @param sri			search meta-information, for applying query limits
- * @param callback		routine to invoke for each match
- * @param ctx			user-supplied data to pass on to callback
- * @param max_res		maximum amount of results to return
+ * @param result		where the list of matching shared files is returned
  * @param qhv			query hash vector built from query string, for routing
  *
- * @return number of hits we produced
+ * @return number of matching entries, the length of the returned list.
  */
-int G_HOT
-st_search(
+uint G_HOT
+st_match(
 	search_table_t *table,
 	const char *search_term,
 	const search_request_info_t *sri,
-	st_search_callback callback,
-	void *ctx,
-	uint max_res,
+	pslist_t **result,
 	query_hashvec_t *qhv)
 {
 	uint nres = 0;
-	uint i;
-	pslist_t *result = NULL;
 	char *search, *alias;
 
+	g_assert(result != NULL);
+
+	*result = NULL;
+
 	/*
 	 * We use a canonic search string, which simplifies matching.
 	 *
@@ -990,7 +1152,7 @@ st_search(
 	 */
 
 	nres = st_run_search(
-				SEARCH_NORMAL, &table->plain, search, sri, &result, qhv);
+				SEARCH_NORMAL, &table->plain, search, sri, result, qhv);
 
 	/*
 	 * Handle aliases if needed.
@@ -1007,7 +1169,7 @@ st_search(
 		gnet_stats_inc_general(GNR_QUERY_ALIASED_WORDS);
 
 		ares = st_run_search(
-					SEARCH_ALIAS, &table->alias, alias, sri, &result, NULL);
+					SEARCH_ALIAS, &table->alias, alias, sri, result, NULL);
 		nres += ares;
 		HFREE_NULL(alias);
 
@@ -1015,6 +1177,40 @@ st_search(
 			gnet_stats_count_general(GNR_LOCAL_ALIASED_HITS, ares);
 	}
 
+	if (search != search_term)
+		HFREE_NULL(search);
+
+	return nres;
+}
+
+/**
+ * Do an actual search.
+ *
+ * @param table			table containing organized entries to search from
+ * @param search_term	the query string
+ * @param sri			search meta-information, for applying query limits
+ * @param callback		routine to invoke for each match
+ * @param ctx			user-supplied data to pass on to callback
+ * @param max_res		maximum amount of results to return
+ * @param qhv			query hash vector built from query string, for routing
+ *
+ * @return number of hits we produced
+ */
+int G_HOT
+st_search(
+	search_table_t *table,
+	const char *search_term,
+	const search_request_info_t *sri,
+	st_search_callback callback,
+	void *ctx,
+	uint max_res,
+	query_hashvec_t *qhv)
+{
+	uint nres, i;
+	pslist_t *result;
+
+	nres = st_match(table, search_term, sri, &result, qhv);
+
 	/*
 	 * Randomly shuffle the results and pick the first max_res items.
 	 */
@@ -1043,9 +1239,6 @@ st_search(
 		pslist_free_null(&result);
 	}
 
-	if (search != search_term)
-		HFREE_NULL(search);
-
 	return nres;
 }
 
@@ -82,6 +82,7 @@ enum match_set {
 int st_count(const search_table_t *st, enum match_set which);
 bool st_insert_item(search_table_t *, enum match_set which, const char *key,
 	const struct shared_file *sf);
+uint st_remove_item(search_table_t *, const struct shared_file *sf);
 
 /**
  * Callback for st_search().
@@ -95,6 +96,14 @@ bool st_insert_item(search_table_t *, enum match_set which, const char *key,
 typedef bool (*st_search_callback)(void *ctx, const void *data, bool limits);
 
 struct search_request_info;
+struct pslist;
+
+uint st_match(
+	search_table_t *table,
+	const char *search,
+	const struct search_request_info *sri,
+	struct pslist **result,
+	struct query_hashvec *qhv);
 
 int st_search(
 	search_table_t *table,
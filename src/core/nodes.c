@@ -2269,6 +2269,7 @@ node_remove_v(gnutella_node_t *n, const char *reason, va_list ap)
 		n->qrt_receive = NULL;
 	}
 	if (n->recv_query_table) {
+		qrp_index_remove(n->recv_query_table);
 		qrt_unref(n->recv_query_table);
 		n->recv_query_table = NULL;
 
@@ -3877,6 +3878,16 @@ node_add_tx_deflated(void *o, int amount)
 	n->tx_deflated += amount;
 }
 
+static void
+node_add_tx_deflate_cost(void *o, uint64 ns)
+{
+	gnutella_node_t *n = o;
+
+	node_check(n);
+
+	n->tx_deflate_ns += ns;
+}
+
 static void G_PRINTF(2, 3)
 node_tx_shutdown(void *o, const char *reason, ...)
 {
@@ -3905,6 +3916,7 @@ static struct tx_deflate_cb node_tx_deflate_cb = {
 	node_add_tx_deflated,		/* add_tx_deflated */
 	node_tx_shutdown,			/* shutdown */
 	node_tx_deflate_flowc,		/* flow_control */
+	node_add_tx_deflate_cost,	/* add_tx_deflate_cost */
 };
 
 /***
@@ -4866,6 +4878,7 @@ node_net_stack_create(gnutella_node_t *n)
 			g_debug("receiving compressed data from %s", node_infostr(n));
 
 		args.cb = &node_rx_inflate_cb;
+		args.threaded = TRUE;
 
 		n->rx = rx_make_above(n->rx, rx_inflate_get_ops(), &args);
 
@@ -11533,6 +11546,7 @@ node_qrt_discard(gnutella_node_t *n)
 	g_assert(n->peermode == NODE_P_LEAF || n->peermode == NODE_P_ULTRA);
 
 	if (n->recv_query_table != NULL) {
+		qrp_index_remove(n->recv_query_table);
 		qrt_unref(n->recv_query_table);
 		n->recv_query_table = NULL;
 	}
@@ -11592,15 +11606,23 @@ node_qrt_install(gnutella_node_t *n, struct routing_table *query_table)
 /**
  * Invoked for ultra nodes when the Query Routing Table of remote node
  * was fully patched (i.e. we got a new generation).
+ *
+ * The new table supersedes the one we had so far.
  */
 void
 node_qrt_patched(gnutella_node_t *n, struct routing_table *query_table)
 {
 	node_check(n);
 	g_assert(NODE_IS_LEAF(n) || NODE_IS_ULTRA(n));
-	g_assert(n->recv_query_table == query_table);
+	g_assert(n->recv_query_table != NULL);
 	g_assert(n->qrt_info != NULL);
 
+	if (n->recv_query_table != query_table) {
+		qrp_index_remove(n->recv_query_table);
+		qrt_unref(n->recv_query_table);
+		n->recv_query_table = qrt_ref(query_table);
+	}
+
 	if (node_qrt_new(n, query_table))
 		node_fire_node_flags_changed(n);
 }
@@ -12330,6 +12352,7 @@ node_get_status(const struct nid *node_id, gnet_node_status_t *status)
     status->tx_written  = node->tx_written;
     status->tx_compressed = NODE_TX_COMPRESSED(node);
     status->tx_compression_ratio = NODE_TX_COMPRESSION_RATIO(node);
+	status->tx_deflate_ns = node->tx_deflate_ns;
 	status->tx_bps = node->outq ? bio_bps(mq_bio(node->outq)) : 0;
 
     status->rx_given    = node->rx_given;
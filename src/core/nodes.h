@@ -260,6 +260,7 @@ typedef struct gnutella_node {
 	uint64 tx_given;		/**< Bytes fed to the TX stack (from top) */
 	uint64 tx_deflated;		/**< Bytes deflated by the TX stack */
 	uint64 tx_written;		/**< Bytes written by the TX stack */
+	uint64 tx_deflate_ns;	/**< CPU time spent deflating, in ns */
 
 	uint64 rx_given;		/**< Bytes fed to the RX stack (from bottom) */
 	uint64 rx_inflated;		/**< Bytes inflated by the RX stack */
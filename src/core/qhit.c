@@ -56,8 +56,10 @@
 #include "if/core/main.h"			/* For main_get_build() */
 
 #include "lib/array.h"
+#include "lib/atoms.h"
 #include "lib/endian.h"
 #include "lib/getdate.h"
+#include "lib/halloc.h"
 #include "lib/hashing.h"
 #include "lib/hset.h"
 #include "lib/product.h"
@@ -66,6 +68,7 @@
 #include "lib/sequence.h"
 #include "lib/stringify.h"
 #include "lib/tm.h"
+#include "lib/walloc.h"
 
 #include "lib/override.h"			/* Must be the last header included */
 
@@ -584,6 +587,266 @@ failure:
 	found_clear();
 }
 
+/**
+ * Pre-serialized query hit entry for a shared file.
+ *
+ * The parts of a hit entry which only depend on the file are serialized
+ * once and kept attached to the shared file, so that emitting the entry
+ * mostly boils down to copying these bytes.  Only the file index and the
+ * dynamic GGEP extensions (partial file status, alternate locations) are
+ * generated each time.
+ *
+ * The record data are laid out as follows:
+ *
+ *   entry		32-bit file size (little-endian), NFC filename, NUL
+ *   urn		ASCII SHA1 URN followed by 0x1c, when not using GGEP "H"
+ *   ext_h		static GGEP extensions when GGEP "H" is understood
+ *   ext_tt		static GGEP extensions otherwise
+ *
+ * GGEP extensions are stored without the leading magic byte and without
+ * the "last" flag, ready to be spliced into a GGEP stream.
+ */
+struct qhit_record {
+	const char *name;			/**< NFC filename used (atom) */
+	const char *path;			/**< Relative path used (atom) */
+	const struct sha1 *sha1;	/**< SHA1 used (atom) */
+	const struct tth *tth;		/**< TTH used (atom) */
+	filesize_t size;			/**< File size used */
+	time_t ctime;				/**< Creation time used */
+	char *data;					/**< Serialized data (halloc-ed) */
+	size_t entry_len;			/**< Length of entry, at start of data */
+	size_t urn_len;				/**< Length of URN, following entry */
+	size_t h_len;				/**< Length of extensions with "H" */
+	size_t h_last;				/**< Offset of last extension with "H" */
+	size_t tt_len;				/**< Length of extensions without "H" */
+	size_t tt_last;				/**< Offset of last extension without "H" */
+};
+
+/**
+ * Serialize the static GGEP extensions for a file.
+ *
+ * @param qr		the query hit record being built
+ * @param ggep_h	whether the recipient understands GGEP "H"
+ * @param buf		buffer where extensions are written
+ * @param len		length of buffer
+ * @param last		where offset of the last extension is written
+ *
+ * @return the length of the serialized extension block.
+ */
+static size_t
+qhit_record_ext(const struct qhit_record *qr, bool ggep_h,
+	char *buf, size_t len, size_t *last)
+{
+	ggep_stream_t gs;
+	bool ok;
+
+	ggep_stream_init(&gs, buf, len);
+
+	/*
+	 * Emit the SHA1 as GGEP "H" if they said they understand it. The modern
+	 * way is GGEP "H" for binary URN but only gtk-gnutella implements it.
+	 */
+
+	if (qr->sha1 != NULL && ggep_h) {
+		const uint8 type = qr->tth ? GGEP_H_BITPRINT : GGEP_H_SHA1;
+
+		ok =
+			ggep_stream_begin(&gs, GGEP_NAME(H), GGEP_W_COBS) &&
+			ggep_stream_write(&gs, &type, 1) &&
+			ggep_stream_write(&gs, qr->sha1->data, SHA1_RAW_SIZE) &&
+			(qr->tth ?
+				ggep_stream_write(&gs, qr->tth->data, TTH_RAW_SIZE) : TRUE) &&
+			ggep_stream_end(&gs);
+
+		if (!ok)
+			qhit_log_ggep_write_failure("H");
+	}
+
+	/*
+	 * First LimeWire emitted TTHs as plain text urn:ttroot:<base32 TTH>.
+	 * Now they are still unaware of GGEP "H" but emit GGEP "TT" with the
+	 * hash in binary form.
+	 */
+
+	if (qr->tth != NULL && !ggep_h) {
+		ok = ggep_stream_pack(&gs,
+					GGEP_NAME(TT), qr->tth->data, TTH_RAW_SIZE, GGEP_W_COBS);
+		if (!ok)
+			qhit_log_ggep_write_failure("TT");
+	}
+
+	/*
+	 * If the 32-bit size is the magic ~0 escape value, we need to emit
+	 * the real size in the "LF" extension.
+	 */
+
+	if (qr->size >= (1U << 31)) {
+		char lf[sizeof(uint64)];
+		int lflen;
+
+		lflen = ggept_filesize_encode(qr->size, ARYLEN(lf));
+
+		g_assert(lflen > 0 && UNSIGNED(lflen) <= sizeof lf);
+
+		ok = ggep_stream_pack(&gs, GGEP_NAME(LF), lf, lflen, GGEP_W_COBS);
+		if (!ok)
+			qhit_log_ggep_write_failure("LF");
+	}
+
+	if (qr->path != NULL) {
+		ok = ggep_stream_pack(&gs,
+				GGEP_NAME(PATH), qr->path, vstrlen(qr->path), 0);
+		if (!ok)
+			qhit_log_ggep_write_failure("PATH");
+	}
+
+	if ((time_t) -1 != qr->ctime) {
+		char ct[sizeof(uint64)];
+		int ctlen;
+
+		/*
+		 * Suppress negative values (if time_t is signed) as this would
+		 * be interpreted as a date far in this future.
+		 */
+
+		ctlen = ggept_ct_encode(MAX(0, qr->ctime), ARYLEN(ct));
+		g_assert(UNSIGNED(ctlen) <= sizeof ct);
+
+		ok = ggep_stream_pack(&gs, GGEP_NAME(CT), ct, ctlen, GGEP_W_COBS);
+		if (!ok)
+			qhit_log_ggep_write_failure("CT");
+	}
+
+	return ggep_stream_close_block(&gs, last);
+}
+
+/**
+ * Serialize the static parts of the query hit entry for a file.
+ *
+ * @return a new query hit record.
+ */
+static struct qhit_record *
+qhit_record_make(const shared_file_t *sf)
+{
+	struct qhit_record *qr;
+	size_t len, maxlen, pathlen;
+	uint32 fs32_le;
+	char *p, *ext;
+	const char *path;
+	const struct tth *tth;
+
+	/*
+	 * We hold references on the atoms: should the file attributes change,
+	 * the atoms we used could be freed and their address recycled for the
+	 * new values, which would make the record look up-to-date.
+	 */
+
+	WALLOC0(qr);
+	qr->name = atom_str_get(shared_file_name_nfc(sf));
+	path = shared_file_relative_path(sf);
+	qr->path = NULL == path ? NULL : atom_str_get(path);
+	if (sha1_hash_available(sf)) {
+		qr->sha1 = atom_sha1_get(shared_file_sha1(sf));
+		tth = shared_file_tth(sf);
+		qr->tth = NULL == tth ? NULL : atom_tth_get(tth);
+	}
+	qr->size = shared_file_size(sf);
+	qr->ctime = shared_file_creation_time(sf);
+
+	/*
+	 * The static extensions are at most: "H" with a bitprint (COBS-encoded),
+	 * "LF" and "CT" holding a 64-bit value and "PATH", each with a 4-byte
+	 * header at most.  This is largely over-estimated.
+	 */
+
+	pathlen = NULL == qr->path ? 0 : vstrlen(qr->path);
+	maxlen = 1 + 2 * (4 + 128) + 4 + 8 + 4 + pathlen + 4 + 8;
+
+	ext = halloc(maxlen);
+
+	qr->entry_len = 4 + shared_file_name_nfc_len(sf) + 1;
+	qr->urn_len = NULL == qr->sha1 ? 0 : SHA1_URN_LENGTH + 1;
+
+	len = qr->entry_len + qr->urn_len + 2 * maxlen;
+	qr->data = p = halloc(len);
+
+	/*
+	 * If size is greater than 2^31-1, we store ~0 as the file size and will
+	 * use the "LF" GGEP extension to hold the real size.
+	 */
+
+	poke_le32(&fs32_le, qr->size >= (1U << 31) ? ~0U : qr->size);
+	p = mempcpy(p, &fs32_le, sizeof fs32_le);
+	p = mempcpy(p, qr->name, shared_file_name_nfc_len(sf));
+	*p++ = '\0';
+
+	if (qr->sha1 != NULL) {
+		p = mempcpy(p, sha1_to_urn_string(qr->sha1), SHA1_URN_LENGTH);
+		*p++ = '\x1c';
+	}
+
+	qr->h_len = qhit_record_ext(qr, TRUE, ext, maxlen, &qr->h_last);
+	p = mempcpy(p, ext, qr->h_len);
+	qr->tt_len = qhit_record_ext(qr, FALSE, ext, maxlen, &qr->tt_last);
+	p = mempcpy(p, ext, qr->tt_len);
+
+	HFREE_NULL(ext);
+
+	/*
+	 * Shrink the data to what we actually used.
+	 */
+
+	len = p - qr->data;
+	qr->data = hrealloc(qr->data, MAX(len, 1));
+
+	return qr;
+}
+
+/**
+ * Free query hit record and nullify its pointer.
+ */
+void
+qhit_record_free_null(struct qhit_record **qr_ptr)
+{
+	struct qhit_record *qr = *qr_ptr;
+
+	if (qr != NULL) {
+		atom_str_free_null(&qr->name);
+		atom_str_free_null(&qr->path);
+		atom_sha1_free_null(&qr->sha1);
+		atom_tth_free_null(&qr->tth);
+		HFREE_NULL(qr->data);
+		WFREE(qr);
+		*qr_ptr = NULL;
+	}
+}
+
+/**
+ * Get the pre-serialized query hit entry for a file, building it or
+ * refreshing it when the file attributes it depends on have changed.
+ */
+static const struct qhit_record *
+qhit_record_get(const shared_file_t *sf)
+{
+	struct qhit_record *qr = shared_file_qhit_record(sf);
+
+	if (
+		G_LIKELY(qr != NULL) &&
+		qr->name == shared_file_name_nfc(sf) &&
+		qr->path == shared_file_relative_path(sf) &&
+		qr->sha1 == (sha1_hash_available(sf) ? shared_file_sha1(sf) : NULL) &&
+		qr->tth == (NULL == qr->sha1 ? NULL : shared_file_tth(sf)) &&
+		qr->size == shared_file_size(sf) &&
+		qr->ctime == shared_file_creation_time(sf)
+	)
+		return qr;
+
+	qr = qhit_record_make(sf);
+	shared_file_set_qhit_record(deconstify_pointer(sf), qr);
+
+	return qr;
+}
+
 /**
  * Generate a random index that is not conflicting with any of the entries
  * already present in the query hit being constructed.
@@ -622,10 +885,11 @@ qhit_random_index(void)
 static bool
 add_file(const shared_file_t *sf)
 {
+	const struct qhit_record *qr;
 	bool sha1_available;
 	gnet_host_t hvec[QHIT_MAX_ALT];
 	int hcnt = 0;
-	uint32 fs32, fs32_le, idx_le;
+	uint32 idx_le;
 	int ggep_len;
 	bool ok;
 	ggep_stream_t gs;
@@ -743,24 +1007,16 @@ add_file(const shared_file_t *sf)
 		return FALSE;
 
 	/*
-	 * If size is greater than 2^31-1, we store ~0 as the file size and will
-	 * use the "LF" GGEP extension to hold the real size.
+	 * The static part of the entry (file size, name and URN) comes from
+	 * the pre-serialized record of the file, only the index is variable.
 	 */
 
-	fs32 = shared_file_size(sf) >= (1U << 31) ? ~0U : shared_file_size(sf);
+	qr = qhit_record_get(sf);
 
 	poke_le32(&idx_le, file_index);
 	if (!found_write(&idx_le, sizeof idx_le))
 		return FALSE;
-	poke_le32(&fs32_le, fs32);
-	if (!found_write(&fs32_le, sizeof fs32_le))
-		return FALSE;
-	if (!found_write(shared_file_name_nfc(sf), shared_file_name_nfc_len(sf)))
-		return FALSE;
-
-	/* Position equals the next byte to be written to */
-
-	if (!found_write("", 1))
+	if (!found_write(qr->data, qr->entry_len))
 		return FALSE;
 
 	/*
@@ -771,13 +1027,8 @@ add_file(const shared_file_t *sf)
 	 * Emit the SHA1 as a plain ASCII URN if they don't grok "H".
 	 */
 
-	if (sha1_available && !found_ggep_h()) {
-		const struct sha1 * const sha1 = shared_file_sha1(sf);
-
-		/* Good old way: ASCII URN */
-		if (!found_write(sha1_to_urn_string(sha1), SHA1_URN_LENGTH))
-			return FALSE;
-		if (!found_write("\x1c", 1))
+	if (qr->urn_len != 0 && !found_ggep_h()) {
+		if (!found_write(qr->data + qr->entry_len, qr->urn_len))
 			return FALSE;
 	}
 
@@ -821,62 +1072,6 @@ add_file(const shared_file_t *sf)
 			qhit_log_ggep_write_failure("PRU");
 	}
 
-	/*
-	 * Emit the SHA1 as GGEP "H" if they said they understand it. The modern
-	 * way is GGEP "H" for binary URN but only gtk-gnutella implements it.
-	 */
-
-	if (sha1_available && found_ggep_h()) {
-		const struct sha1 * const sha1 = shared_file_sha1(sf);
-		const struct tth * const tth = shared_file_tth(sf);
-		const uint8 type = tth ? GGEP_H_BITPRINT : GGEP_H_SHA1;
-
-		ok =
-			ggep_stream_begin(&gs, GGEP_NAME(H), GGEP_W_COBS) &&
-			ggep_stream_write(&gs, &type, 1) &&
-			ggep_stream_write(&gs, sha1->data, SHA1_RAW_SIZE) &&
-			(tth ? ggep_stream_write(&gs, tth->data, TTH_RAW_SIZE) : TRUE) &&
-			ggep_stream_end(&gs);
-
-		if (!ok)
-			qhit_log_ggep_write_failure("H");
-	}
-
-	/*
-	 * First LimeWire emitted TTHs as plain text urn:ttroot:<base32 TTH>.
-	 * Now they are still unaware of GGEP "H" but emit GGEP "TT" with the
-	 * hash in binary form.
-	 */
-
-	if (sha1_available && !found_ggep_h()) {
-		const struct tth * const tth = shared_file_tth(sf);
-
-		if (tth) {
-			ok = ggep_stream_pack(&gs,
-						GGEP_NAME(TT), tth->data, TTH_RAW_SIZE, GGEP_W_COBS);
-			if (!ok)
-				qhit_log_ggep_write_failure("TT");
-		}
-	}
-
-	/*
-	 * If the 32-bit size is the magic ~0 escape value, we need to emit
-	 * the real size in the "LF" extension.
-	 */
-
-	if (fs32 == ~0U) {
-		char buf[sizeof(uint64)];
-		int len;
-
-		len = ggept_filesize_encode(shared_file_size(sf), ARYLEN(buf));
-
-		g_assert(len > 0 && UNSIGNED(len) <= sizeof buf);
-
-		ok = ggep_stream_pack(&gs, GGEP_NAME(LF), buf, len, GGEP_W_COBS);
-		if (!ok)
-			qhit_log_ggep_write_failure("LF");
-	}
-
 	/*
 	 * If we have known alternate locations, include a few of them for
 	 * this file in the GGEP "ALT" extension.
@@ -891,37 +1086,22 @@ add_file(const shared_file_t *sf)
 			qhit_log_ggep_write_failure("ALT");
 	}
 
-	{
-		const char *rp = shared_file_relative_path(sf);
-
-		if (rp) {
-			ok = ggep_stream_pack(&gs, GGEP_NAME(PATH), rp, vstrlen(rp), 0);
-			if (!ok)
-				qhit_log_ggep_write_failure("PATH");
-		}
-	}
+	/*
+	 * Append the static extensions ("H" or "TT", "LF", "PATH", "CT"),
+	 * which were pre-serialized in the record.
+	 */
 
 	{
-		time_t create_time;
-
-		create_time = shared_file_creation_time(sf);
-		if ((time_t) -1 != create_time) {
-			char buf[sizeof(uint64)];
-			int len;
-
-			/*
-			 * Suppress negative values (if time_t is signed) as this would
-			 * be interpreted as a date far in this future.
-			 */
-			create_time = MAX(0, create_time);
+		const char *ext = qr->data + qr->entry_len + qr->urn_len;
 
-			len = ggept_ct_encode(create_time, ARYLEN(buf));
-			g_assert(UNSIGNED(len) <= sizeof buf);
+		if (found_ggep_h())
+			ok = ggep_stream_splice(&gs, ext, qr->h_len, qr->h_last);
+		else
+			ok = ggep_stream_splice(&gs,
+					ext + qr->h_len, qr->tt_len, qr->tt_last);
 
-			ok = ggep_stream_pack(&gs, GGEP_NAME(CT), buf, len, GGEP_W_COBS);
-			if (!ok)
-				qhit_log_ggep_write_failure("CT");
-		}
+		if (!ok)
+			qhit_log_ggep_write_failure("static");
 	}
 
 	/*
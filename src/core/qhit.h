@@ -60,6 +60,7 @@ struct gnutella_node;
 struct array;
 struct guid;
 struct pslist;
+struct qhit_record;
 
 void qhit_init(void);
 void qhit_close(void);
@@ -71,6 +72,8 @@ void qhit_build_results(const struct pslist *files,
 	qhit_process_t cb, void *udata, const struct guid *muid, unsigned flags,
 	const struct array *token);
 
+void qhit_record_free_null(struct qhit_record **qr_ptr);
+
 #endif /* _core_qhit_h_ */
 
 /* vi: set ts=4 sw=4 cindent: */
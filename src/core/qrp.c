@@ -59,16 +59,21 @@
 
 #include "g2/node.h"
 
+#include "lib/atomic.h"
 #include "lib/atoms.h"
+#include "lib/barrier.h"
 #include "lib/bg.h"
+#include "lib/bit_array.h"
 #include "lib/cq.h"
 #include "lib/endian.h"
+#include "lib/getcpucount.h"
 #include "lib/halloc.h"
 #include "lib/hashing.h"
 #include "lib/hset.h"
 #include "lib/hstrfn.h"
 #include "lib/htable.h"
 #include "lib/mutex.h"
+#include "lib/nid.h"
 #include "lib/pow2.h"
 #include "lib/pslist.h"
 #include "lib/random.h"
@@ -76,6 +81,8 @@
 #include "lib/spinlock.h"
 #include "lib/str.h"
 #include "lib/stringify.h"
+#include "lib/teq.h"
+#include "lib/thread.h"
 #include "lib/tm.h"
 #include "lib/unsigned.h"
 #include "lib/utf8.h"
@@ -126,6 +133,14 @@ struct query_hashvec {
 
 static cperiodic_t *qrp_monitor_ev;
 
+/*
+ * The QRP thread applying received patches, THREAD_MAIN_ID if we run on a
+ * single CPU.
+ */
+static uint qrp_thread_id = THREAD_INVALID_ID;
+static bool qrp_thread_exiting;		/**< Set when QRP thread must exit */
+static uint qrp_thread_pending;		/**< Messages posted, not yet processed */
+
 bool
 qhvec_has_urn(const struct query_hashvec *qhv)
 {
@@ -187,6 +202,7 @@ struct routing_table {
 	int set_count;			/**< Amount of slots set in table */
 	int fill_ratio;			/**< 100 * fill ratio for table (received) */
 	int pass_throw;			/**< Query must pass a d100 throw to be forwarded */
+	uint leaf_column;		/**< 1 + column in the leaf index, 0 if none */
 	const struct sha1 *digest;	/**< SHA1 digest of the whole table (atom) */
 	char *name;				/**< Name for dumping purposes */
 	unsigned reset:1;		/**< This is a new table, after a RESET */
@@ -255,6 +271,8 @@ void test_hash(void);
 static bool qrp_can_route_default(
 	const query_hashvec_t *qhv, const struct routing_table *rt);
 static void qrt_patch_fire_ready(struct routing_patch *rp);
+static void qrp_index_update(gnutella_node_t *n, struct routing_table *rt);
+static void qrp_index_free(void);
 
 /**
  * Generate a description of the patch into a static string.
@@ -1126,6 +1144,7 @@ static void
 qrt_free(struct routing_table *rt)
 {
 	g_assert(rt->refcnt == 0);
+	g_assert(0 == rt->leaf_column);	/* Removed from leaf index by node */
 
 	atom_sha1_free_null(&rt->digest);
 	HFREE_NULL(rt->arena);
@@ -1197,6 +1216,14 @@ qrt_arena_relocate(struct routing_table *rt)
 {
 	qrt_check(rt);
 
+	/*
+	 * The QRP thread may be reading the arena to copy it, so we only move
+	 * tables around when it is idle.
+	 */
+
+	if (0 != atomic_uint_get(&qrp_thread_pending))
+		return;
+
 	rt->arena = hrealloc(rt->arena, rt->len);
 }
 
@@ -3723,6 +3750,17 @@ qrt_update_was_ok(struct qrt_update *qup)
  *
  * The table is compacted on the fly, and possibly shrunk down if its
  * slot size exceeds our maximum size.
+ *
+ * Reception is split in two: the main thread validates the QRP messages
+ * as they come and hands them over to the "QRP" thread, which inflates them
+ * and applies the patches to a private table.  Once the sequence is complete,
+ * the new table is handed back to the main thread which installs it in the
+ * node, superseding the previous one.  Until then, routing keeps using the
+ * previous table, which is never modified.
+ *
+ * When a patch sequence is not preceded by a RESET, the new table starts as
+ * a copy of the latest table we got from the node, the one still being
+ * built by the QRP thread if any, to preserve the patch ordering.
  */
 
 enum qrt_receive_magic {
@@ -3730,13 +3768,21 @@ enum qrt_receive_magic {
 };
 #define QRT_RECEIVE_BUFSIZE	4096		/**< Size of decompressing buffer */
 
-struct qrt_receive {
-	enum qrt_receive_magic magic;
-	gnutella_node_t *node;		/**< Node for which we're receiving */
+enum qrt_apply_magic {
+	QRT_APPLY_MAGIC = 0x3b2e75d1
+};
+
+/**
+ * State used to inflate and apply the received messages to the table.
+ *
+ * Once created, this state is only accessed by the QRP thread.
+ */
+struct qrt_apply {
+	enum qrt_apply_magic magic;
+	struct nid *node_id;	/**< ID of the node sending us the table */
+	char *info;				/**< Node description, for logging */
 	struct routing_table *table;	/**< Table being built / updated */
 	int shrink_factor;		/**< 1 means none, `n' means coalesce `n' entries */
-	int seqsize;			/**< Amount of patch messages to expect */
-	int seqno;				/**< Sequence number of next message we expect */
 	int entry_bits;			/**< Amount of bits used by PATCH */
 	z_streamp inz;			/**< Data inflater */
 	char *data;				/**< Where inflated data is written */
@@ -3744,22 +3790,78 @@ struct qrt_receive {
 	int current_slot;		/**< Current slot processed in patch */
 	int current_index;		/**< Current index (after shrinking) in QR table */
 	char *expansion;		/**< Temporary expansion arena before shrinking */
+	char *reason;			/**< Error message, when `failed' is set */
+	int code;				/**< BYE code, when `failed' is set */
 	bool deflated;			/**< Is data deflated? */
-	bool (*patch)(struct qrt_receive *qrcv, const uchar *data, int len,
+	bool failed;			/**< Whether we failed to apply a message */
+	bool (*patch)(struct qrt_apply *qa, const uchar *data, int len,
 						const struct qrp_patch *patch);
 };
 
+static inline void
+qrt_apply_check(const struct qrt_apply * const qa)
+{
+	g_assert(qa != NULL);
+	g_assert(QRT_APPLY_MAGIC == qa->magic);
+}
+
+struct qrt_receive {
+	enum qrt_receive_magic magic;
+	gnutella_node_t *node;		/**< Node for which we're receiving */
+	struct qrt_apply *qa;		/**< Table application state */
+	struct routing_table *base;	/**< Latest table from node, NULL if none */
+	struct routing_table *table;	/**< Last table handed to QRP thread */
+	int shrink_factor;		/**< 1 means none, `n' means coalesce `n' entries */
+	int seqsize;			/**< Amount of patch messages to expect */
+	int seqno;				/**< Sequence number of next message we expect */
+	int entry_bits;			/**< Amount of bits used by PATCH */
+	bool reset;				/**< Whether we got a RESET */
+};
+
+/*
+ * Maps a node ID to the latest table we handed to the QRP thread for that
+ * node, until it is returned to the main thread.
+ */
+static htable_t *qrt_pending;
+
+static void qrt_apply_release(struct qrt_apply *qa, struct routing_table *rt);
+
+/**
+ * Record that applying the received QRP messages failed.
+ *
+ * The node will be BYE-ed by the main thread with the supplied reason.
+ *
+ * @param qa		the table application state
+ * @param code		the BYE code
+ * @param fmt		format string for the BYE reason
+ */
+static void G_PRINTF(3, 4)
+qrt_apply_failed(struct qrt_apply *qa, int code, const char *fmt, ...)
+{
+	va_list args;
+
+	qrt_apply_check(qa);
+	g_assert(!qa->failed);
+
+	va_start(args, fmt);
+	qa->reason = h_strdup_vprintf(fmt, args);
+	va_end(args);
+
+	qa->code = code;
+	qa->failed = TRUE;
+}
+
 /**
  * A default handler that should never be called.
  *
  * @returns FALSE always.
  */
 static bool
-qrt_unknown_patch(struct qrt_receive *unused_qrcv,
+qrt_unknown_patch(struct qrt_apply *unused_qa,
 	const uchar *unused_data, int unused_len,
 	const struct qrp_patch *unused_patch)
 {
-	(void) unused_qrcv;
+	(void) unused_qa;
 	(void) unused_data;
 	(void) unused_len;
 	(void) unused_patch;
@@ -3786,12 +3888,24 @@ qrt_receive_create(gnutella_node_t *n, struct routing_table *query_table)
 {
 	struct routing_table *table = query_table;
 	struct qrt_receive *qrcv;
+	struct qrt_apply *qa;
 	z_streamp inz;
 	int ret;
 
 	g_assert(query_table == NULL || table->magic == QRP_ROUTE_MAGIC);
 	g_assert(query_table == NULL || table->client_slots > 0);
 
+	/*
+	 * If the QRP thread is still building a table for this node, it is
+	 * the one any patch will apply to.
+	 */
+
+	if (qrt_pending != NULL) {
+		struct routing_table *rt = htable_lookup(qrt_pending, NODE_ID(n));
+		if (rt != NULL)
+			table = rt;
+	}
+
 	WALLOC(inz);
 	inz->zalloc = zlib_alloc_func;
 	inz->zfree = zlib_free_func;
@@ -3806,35 +3920,36 @@ qrt_receive_create(gnutella_node_t *n, struct routing_table *query_table)
 		return NULL;
 	}
 
-	WALLOC(qrcv);
+	WALLOC0(qa);
+	qa->magic = QRT_APPLY_MAGIC;
+	qa->node_id = nid_ref(NODE_ID(n));
+	qa->info = h_strdup(node_infostr(n));
+	qa->shrink_factor = 1;
+	qa->inz = inz;
+	qa->len = QRT_RECEIVE_BUFSIZE;
+	qa->data = halloc(qa->len);
+	qa->patch = qrt_unknown_patch;
+
+	WALLOC0(qrcv);
 	qrcv->magic = QRT_RECEIVE_MAGIC;
 	qrcv->node = n;
-	qrcv->table = table ? qrt_ref(table) : NULL;
+	qrcv->qa = qa;
+	qrcv->base = table ? qrt_ref(table) : NULL;
 	qrcv->shrink_factor = 1;		/* Assume none for now */
 	qrcv->seqsize = 0;				/* Unknown yet */
 	qrcv->seqno = 1;				/* Expecting message #1 */
 	qrcv->entry_bits = 0;
-	qrcv->deflated = FALSE;
-	qrcv->inz = inz;
-	qrcv->len = QRT_RECEIVE_BUFSIZE;
-	qrcv->data = halloc(qrcv->len);
-	qrcv->expansion = NULL;
-	qrcv->patch = qrt_unknown_patch;
+	qrcv->reset = FALSE;
 
 	/*
 	 * We don't know yet whether we'll receive a RESET, but if we already
-	 * have a table, increase its generation number.  If a RESET comes,
-	 * we'll create a new table anyway.
-	 *
-	 * Also compute proper shrink factor and allocate `expansion'.
+	 * have a table, compute the proper shrink factor in case they only
+	 * send a patch.
 	 */
 
 	if (table != NULL) {
 		int length = table->client_slots;
 
-		table->generation++;
-		table->reset = FALSE;
-
 		/*
 		 * Since we know the table_length is a power of two, to
 		 * know the shrinking factor, we need only count the amount
@@ -3845,8 +3960,6 @@ qrt_receive_create(gnutella_node_t *n, struct routing_table *query_table)
 			length >>= 1;
 			qrcv->shrink_factor <<= 1;
 		}
-
-		qrcv->expansion = walloc(qrcv->shrink_factor);
 	}
 
 	return qrcv;
@@ -3860,13 +3973,15 @@ qrt_receive_free(struct qrt_receive *qrcv)
 {
 	g_assert(qrcv->magic == QRT_RECEIVE_MAGIC);
 
-	(void) inflateEnd(qrcv->inz);
-	WFREE(qrcv->inz);
-	if (qrcv->table)
-		qrt_unref(qrcv->table);
-	if (qrcv->expansion)
-		wfree(qrcv->expansion, qrcv->shrink_factor);
-	HFREE_NULL(qrcv->data);
+	/*
+	 * The application state is owned by the QRP thread, which may still
+	 * have messages to process: it will release it after these.
+	 */
+
+	qrt_apply_release(qrcv->qa, qrcv->table);
+
+	if (qrcv->base)
+		qrt_unref(qrcv->base);
 
 	qrcv->magic = 0;			/* Prevent accidental reuse */
 	WFREE(qrcv);
@@ -3875,26 +3990,26 @@ qrt_receive_free(struct qrt_receive *qrcv)
 /**
  * Apply raw patch data (uncompressed) to the current routing table.
  *
- * @param qrcv			query routing table being received
+ * @param qa			the table application state
  * @param data			patch data to apply
  * @param len			length of patch data (amount of data bytes)
  * @param patch			the PATCH message, for logging purposes
  *
- * @returns TRUE on sucess, FALSE on error with the node being BYE-ed.
+ * @returns TRUE on sucess, FALSE on error, recorded in `qa'.
  */
 static bool
-qrt_apply_patch(struct qrt_receive *qrcv, const uchar *data, int len,
+qrt_apply_patch(struct qrt_apply *qa, const uchar *data, int len,
 	const struct qrp_patch *patch)
 {
-	int bpe = qrcv->entry_bits;			/* bits per entry */
+	int bpe = qa->entry_bits;			/* bits per entry */
 	int epb;							/* entries per byte */
 	uint8 rmask;						/* reading mask */
 	int expansion_slot;
-	struct routing_table *rt = qrcv->table;
+	struct routing_table *rt = qa->table;
 	int i;
 
-	g_assert(qrcv->table != NULL);
-	g_assert(qrcv->expansion != NULL);
+	g_assert(qa->table != NULL);
+	g_assert(qa->expansion != NULL);
 
 	/*
 	 * Make sure the received table is not full yet.  If that
@@ -3905,15 +4020,14 @@ qrt_apply_patch(struct qrt_receive *qrcv, const uchar *data, int len,
 	if G_UNLIKELY(len == 0)				/* No data, only zlib trailer */
 		return TRUE;
 
-	if G_UNLIKELY(qrcv->current_index >= rt->slots) {
-		gnutella_node_t *n = qrcv->node;
+	if G_UNLIKELY(qa->current_index >= rt->slots) {
 		g_warning("%s overflowed its QRP %d-bit patch of %s slots"
 			" (%s message #%d/%d)",
-			node_infostr(n), qrcv->entry_bits,
+			qa->info, qa->entry_bits,
 			compact_size(rt->client_slots, FALSE),
 			patch->compressor ? "compressed" : "plain",
 			patch->seq_no, patch->seq_size);
-		node_bye_if_writable(n, 413, "QRP patch overflowed table (%s slots)",
+		qrt_apply_failed(qa, 413, "QRP patch overflowed table (%s slots)",
 			compact_size(rt->client_slots, FALSE));
 		return FALSE;
 	}
@@ -3953,10 +4067,10 @@ qrt_apply_patch(struct qrt_receive *qrcv, const uchar *data, int len,
 	 * to shrink it back yet.
 	 */
 
-	expansion_slot = qrcv->current_slot & ~(qrcv->shrink_factor - 1);
+	expansion_slot = qa->current_slot & ~(qa->shrink_factor - 1);
 
-	if (qrcv->current_slot > expansion_slot)
-		expansion_slot += qrcv->shrink_factor;
+	if (qa->current_slot > expansion_slot)
+		expansion_slot += qa->shrink_factor;
 
 	/*
 	 * Compute the amount of entries per byte, and the initial reading mask.
@@ -3972,7 +4086,7 @@ qrt_apply_patch(struct qrt_receive *qrcv, const uchar *data, int len,
 		return FALSE;
 	}
 
-	g_assert(qrcv->expansion != NULL);
+	g_assert(qa->expansion != NULL);
 
 	for (i = 0; i < len; i++) {
 		int j;
@@ -3996,18 +4110,18 @@ qrt_apply_patch(struct qrt_receive *qrcv, const uchar *data, int len,
 			 * matters here.
 			 */
 
-			if (qrcv->current_slot == expansion_slot) {
+			if (qa->current_slot == expansion_slot) {
 				int k;
 				bool val;
 
-				g_assert(qrcv->current_index < rt->slots);
+				g_assert(qa->current_index < rt->slots);
 
-				val = RT_SLOT_READ(rt->arena, qrcv->current_index);
+				val = RT_SLOT_READ(rt->arena, qa->current_index);
 
-				for (k = 0; k < qrcv->shrink_factor; k++)
-					qrcv->expansion[k] = val;
+				for (k = 0; k < qa->shrink_factor; k++)
+					qa->expansion[k] = val;
 
-				expansion_slot += qrcv->shrink_factor;	/* For next expansion */
+				expansion_slot += qa->shrink_factor;	/* For next expansion */
 			}
 
 			/*
@@ -4016,9 +4130,9 @@ qrt_apply_patch(struct qrt_receive *qrcv, const uchar *data, int len,
 			 * shrink_factor) is where the next patch must be applied.
 			 */
 
-			g_assert(expansion_slot > qrcv->current_slot);
+			g_assert(expansion_slot > qa->current_slot);
 
-			o = qrcv->shrink_factor - (expansion_slot - qrcv->current_slot);
+			o = qa->shrink_factor - (expansion_slot - qa->current_slot);
 
 			g_assert(o >= 0);
 
@@ -4040,11 +4154,11 @@ qrt_apply_patch(struct qrt_receive *qrcv, const uchar *data, int len,
 
 			if (bpe == 1) {				/* Special, use XOR */
 				if (v)
-					qrcv->expansion[o] = !qrcv->expansion[o];
+					qa->expansion[o] = !qa->expansion[o];
 			} else if (v & smask)		/* Negative value, sign bit is 1 */
-				qrcv->expansion[o] = 1;	/* We have something */
+				qa->expansion[o] = 1;	/* We have something */
 			else if (v != 0)			/* Positive value */
-				qrcv->expansion[o] = 0;	/* We no longer have something */
+				qa->expansion[o] = 0;	/* We no longer have something */
 
 			/*
 			 * Advance to next slot, and if we reach the next expansion
@@ -4052,22 +4166,22 @@ qrt_apply_patch(struct qrt_receive *qrcv, const uchar *data, int len,
 			 * and move to the next index.
 			 */
 
-			if (++qrcv->current_slot == expansion_slot) {
+			if (++qa->current_slot == expansion_slot) {
 				int k;
 				uint8 val = 0x01;
 
-				for (k = 0; k < qrcv->shrink_factor; k++) {
-					if (qrcv->expansion[k]) {
+				for (k = 0; k < qa->shrink_factor; k++) {
+					if (qa->expansion[k]) {
 						val = 0x80;
 						break;
 					}
 				}
 
-				g_assert(qrcv->current_index < rt->slots);
+				g_assert(qa->current_index < rt->slots);
 
-				qrt_patch_slot(rt, qrcv->current_index, val);
+				qrt_patch_slot(rt, qa->current_index, val);
 
-				qrcv->current_index++;
+				qa->current_index++;
 			}
 
 			/*
@@ -4075,15 +4189,14 @@ qrt_apply_patch(struct qrt_receive *qrcv, const uchar *data, int len,
 			 * the table can hold.
 			 */
 
-			if ((uint) qrcv->current_slot >= rt->client_slots) {
+			if ((uint) qa->current_slot >= rt->client_slots) {
 				if (j != (epb - 1) || i != (len - 1)) {
-					gnutella_node_t *n = qrcv->node;
 					g_warning("%s overflowed its QRP "
 						"%d-bit patch of %s slots",
-						node_infostr(n),
-						qrcv->entry_bits,
+						qa->info,
+						qa->entry_bits,
 						compact_size(rt->client_slots, FALSE));
-					node_bye_if_writable(n, 413,
+					qrt_apply_failed(qa, 413,
 						"QRP patch overflowed table (%s slots)",
 						compact_size(rt->client_slots, FALSE));
 					return FALSE;
@@ -4102,10 +4215,10 @@ qrt_apply_patch(struct qrt_receive *qrcv, const uchar *data, int len,
  * must be ignored.
  */
 static bool
-qrt_patch_is_valid(struct qrt_receive *qrcv, int len, int slots_per_byte,
+qrt_patch_is_valid(struct qrt_apply *qa, int len, int slots_per_byte,
 	const struct qrp_patch *patch)
 {
-	struct routing_table *rt = qrcv->table;
+	struct routing_table *rt = qa->table;
 	unsigned last_patch_slot;
 
 	/*
@@ -4114,16 +4227,15 @@ qrt_patch_is_valid(struct qrt_receive *qrcv, int len, int slots_per_byte,
 	 * advertised table size.
 	 */
 
-	if G_UNLIKELY(qrcv->current_index >= rt->slots) {
-		gnutella_node_t *n = qrcv->node;
+	if G_UNLIKELY(qa->current_index >= rt->slots) {
 		g_warning("%s overflowed its QRP %d-bit patch of %s slots"
 			" (current_index=%d, slots=%d at %s message #%u/%u)",
-			node_infostr(n), qrcv->entry_bits,
+			qa->info, qa->entry_bits,
 			compact_size(rt->client_slots, FALSE),
-			qrcv->current_index, rt->slots,
+			qa->current_index, rt->slots,
 			patch->compressor ? "compressed" : "plain",
 			patch->seq_no, patch->seq_size);
-		node_bye_if_writable(n, 413, "QRP patch overflowed table (%s slots)",
+		qrt_apply_failed(qa, 413, "QRP patch overflowed table (%s slots)",
 			compact_size(rt->client_slots, FALSE));
 		return FALSE;
 	}
@@ -4133,18 +4245,17 @@ qrt_patch_is_valid(struct qrt_receive *qrcv, int len, int slots_per_byte,
 	 * the table can hold.
 	 */
 
-	last_patch_slot = (uint) qrcv->current_slot + len * slots_per_byte;
+	last_patch_slot = (uint) qa->current_slot + len * slots_per_byte;
 
 	if G_UNLIKELY(last_patch_slot > rt->client_slots) {
-		gnutella_node_t *n = qrcv->node;
 		g_warning("%s overflowed its QRP %d-bit patch of "
 			"%s slots by extra %s at %s message #%u/%u",
-			node_infostr(n), qrcv->entry_bits,
+			qa->info, qa->entry_bits,
 			compact_size(rt->client_slots, FALSE),
 			uint32_to_string(last_patch_slot - rt->client_slots),
 			patch->compressor ? "compressed" : "plain",
 			patch->seq_no, patch->seq_size);
-		node_bye_if_writable(n, 413, "QRP patch overflowed table (%s slots)",
+		qrt_apply_failed(qa, 413, "QRP patch overflowed table (%s slots)",
 			compact_size(rt->client_slots, FALSE));
 		return FALSE;
 	}
@@ -4155,39 +4266,39 @@ qrt_patch_is_valid(struct qrt_receive *qrcv, int len, int slots_per_byte,
 /**
  * Apply raw 8-bit patch data (uncompressed) to the current routing table.
  *
- * @param qrcv			query routing table being received
+ * @param qa			the table application state
  * @param data			patch data to apply
  * @param len			length of patch data (amount of data bytes)
  * @param patch			the PATCH message, for logging purposes
  *
- * @returns TRUE on sucess, FALSE on error with the node being BYE-ed.
+ * @returns TRUE on sucess, FALSE on error, recorded in `qa'.
  */
 static bool
-qrt_apply_patch8(struct qrt_receive *qrcv, const uchar *data, int len,
+qrt_apply_patch8(struct qrt_apply *qa, const uchar *data, int len,
 	const struct qrp_patch *patch)
 {
-	struct routing_table *rt = qrcv->table;
+	struct routing_table *rt = qa->table;
 	int i;
 
-	g_assert(qrcv->table != NULL);
+	g_assert(qa->table != NULL);
 
 	/* True for this variant of patch function. 8-bit, no expansion. */
 	g_assert((int)rt->client_slots == rt->slots);
-	g_assert(qrcv->entry_bits == 8);
-	g_assert(qrcv->shrink_factor == 1);
+	g_assert(qa->entry_bits == 8);
+	g_assert(qa->shrink_factor == 1);
 
 	if (len == 0)						/* No data, only zlib trailer */
 		return TRUE;
 
-	if (!qrt_patch_is_valid(qrcv, len, 1, patch))
+	if (!qrt_patch_is_valid(qa, len, 1, patch))
 		return FALSE;
 
-	g_assert(qrcv->current_index + len <= rt->slots);
+	g_assert(qa->current_index + len <= rt->slots);
 
 	for (i = 0; i < len; i++) {
-		qrt_patch_slot(rt, qrcv->current_index++, data[i]);
+		qrt_patch_slot(rt, qa->current_index++, data[i]);
 	}
-	qrcv->current_slot = qrcv->current_index - 1;
+	qa->current_slot = qa->current_index - 1;
 
 	return TRUE;
 }
@@ -4196,34 +4307,34 @@ qrt_apply_patch8(struct qrt_receive *qrcv, const uchar *data, int len,
 /**
  * Apply raw 4-bit patch data (uncompressed) to the current routing table.
  *
- * @param qrcv			query routing table being received
+ * @param qa			the table application state
  * @param data			patch data to apply
  * @param len			length of patch data (amount of data bytes)
  * @param patch			the PATCH message, for logging purposes
  *
- * @returns TRUE on sucess, FALSE on error with the node being BYE-ed.
+ * @returns TRUE on sucess, FALSE on error, recorded in `qa'.
  */
 static bool
-qrt_apply_patch4(struct qrt_receive *qrcv, const uchar *data, int len,
+qrt_apply_patch4(struct qrt_apply *qa, const uchar *data, int len,
 	const struct qrp_patch *patch)
 {
-	struct routing_table *rt = qrcv->table;
+	struct routing_table *rt = qa->table;
 	int i;
 
-	g_assert(qrcv->table != NULL);
+	g_assert(qa->table != NULL);
 
 	/* True for this variant of patch function. 4-bit, no expansion. */
 	g_assert((int)rt->client_slots == rt->slots);
-	g_assert(qrcv->entry_bits == 4);
-	g_assert(qrcv->shrink_factor == 1);
+	g_assert(qa->entry_bits == 4);
+	g_assert(qa->shrink_factor == 1);
 
 	if G_UNLIKELY(len == 0)				/* No data, only zlib trailer */
 		return TRUE;
 
-	if (!qrt_patch_is_valid(qrcv, len, 2, patch))
+	if (!qrt_patch_is_valid(qa, len, 2, patch))
 		return FALSE;
 
-	g_assert(qrcv->current_index + len * 2 <= rt->slots);
+	g_assert(qa->current_index + len * 2 <= rt->slots);
 
 	for (i = 0; i < len; i++) {
 		uint8 v = data[i];	/* Patch byte contains 2 slots */
@@ -4233,11 +4344,11 @@ qrt_apply_patch4(struct qrt_receive *qrcv, const uchar *data, int len,
 		 * for the lowest table index).
 		 */
 
-		qrt_patch_slot(rt, qrcv->current_index++, v & 0xf0);
-		qrt_patch_slot(rt, qrcv->current_index++, (v << 4) & 0xf0);
+		qrt_patch_slot(rt, qa->current_index++, v & 0xf0);
+		qrt_patch_slot(rt, qa->current_index++, (v << 4) & 0xf0);
 
 	}
-	qrcv->current_slot = qrcv->current_index - 1;
+	qa->current_slot = qa->current_index - 1;
 
 	return TRUE;
 }
@@ -4245,34 +4356,34 @@ qrt_apply_patch4(struct qrt_receive *qrcv, const uchar *data, int len,
 /**
  * Apply raw 1-bit patch data (uncompressed) to the current routing table.
  *
- * @param qrcv			query routing table being received
+ * @param qa			the table application state
  * @param data			patch data to apply
  * @param len			length of patch data (amount of data bytes)
  * @param patch			the PATCH message, for logging purposes
  *
- * @returns TRUE on sucess, FALSE on error with the node being BYE-ed.
+ * @returns TRUE on sucess, FALSE on error, recorded in `qa'.
  */
 static bool
-qrt_apply_patch1(struct qrt_receive *qrcv, const uchar *data, int len,
+qrt_apply_patch1(struct qrt_apply *qa, const uchar *data, int len,
 	const struct qrp_patch *patch)
 {
-	struct routing_table *rt = qrcv->table;
+	struct routing_table *rt = qa->table;
 	int i;
 
-	g_assert(qrcv->table != NULL);
+	g_assert(qa->table != NULL);
 
 	/* True for this variant of patch function. 1-bit, no expansion. */
 	g_assert((int)rt->client_slots == rt->slots);
-	g_assert(qrcv->entry_bits == 1);
-	g_assert(qrcv->shrink_factor == 1);
+	g_assert(qa->entry_bits == 1);
+	g_assert(qa->shrink_factor == 1);
 
 	if G_UNLIKELY(len == 0)				/* No data, only zlib trailer */
 		return TRUE;
 
-	if (!qrt_patch_is_valid(qrcv, len, 8, patch))
+	if (!qrt_patch_is_valid(qa, len, 8, patch))
 		return FALSE;
 
-	g_assert(qrcv->current_index + len * 8 <= rt->slots);
+	g_assert(qa->current_index + len * 8 <= rt->slots);
 
 	for (i = 0; i < len; i++) {
 		/*
@@ -4286,8 +4397,8 @@ qrt_apply_patch1(struct qrt_receive *qrcv, const uchar *data, int len,
 		rt->set_count += bits_set(rt->arena[i >> 3]);
 	}
 
-	qrcv->current_index += len * 8;
-	qrcv->current_slot = qrcv->current_index;
+	qa->current_index += len * 8;
+	qa->current_slot = qa->current_index;
 
 	return TRUE;
 }
@@ -4296,34 +4407,34 @@ qrt_apply_patch1(struct qrt_receive *qrcv, const uchar *data, int len,
  * Apply raw 1-bit patch data (uncompressed) to the current routing table,
  * reversing each byte as we go.
  *
- * @param qrcv			query routing table being received
+ * @param qa			the table application state
  * @param data			patch data to apply
  * @param len			length of patch data (amount of data bytes)
  * @param patch			the PATCH message, for logging purposes
  *
- * @returns TRUE on sucess, FALSE on error with the node being BYE-ed.
+ * @returns TRUE on sucess, FALSE on error, recorded in `qa'.
  */
 static bool
-qrt_apply_reversed_patch1(struct qrt_receive *qrcv, const uchar *data, int len,
+qrt_apply_reversed_patch1(struct qrt_apply *qa, const uchar *data, int len,
 	const struct qrp_patch *patch)
 {
-	struct routing_table *rt = qrcv->table;
+	struct routing_table *rt = qa->table;
 	int i;
 
-	g_assert(qrcv->table != NULL);
+	g_assert(qa->table != NULL);
 
 	/* True for this variant of patch function. 1-bit, no expansion. */
 	g_assert((int)rt->client_slots == rt->slots);
-	g_assert(qrcv->entry_bits == 1);
-	g_assert(qrcv->shrink_factor == 1);
+	g_assert(qa->entry_bits == 1);
+	g_assert(qa->shrink_factor == 1);
 
 	if G_UNLIKELY(len == 0)				/* No data, only zlib trailer */
 		return TRUE;
 
-	if (!qrt_patch_is_valid(qrcv, len, 8, patch))
+	if (!qrt_patch_is_valid(qa, len, 8, patch))
 		return FALSE;
 
-	g_assert(qrcv->current_index + len * 8 <= rt->slots);
+	g_assert(qa->current_index + len * 8 <= rt->slots);
 
 	for (i = 0; i < len; i++) {
 		/*
@@ -4337,8 +4448,8 @@ qrt_apply_reversed_patch1(struct qrt_receive *qrcv, const uchar *data, int len,
 		rt->set_count += bits_set(rt->arena[i >> 3]);
 	}
 
-	qrcv->current_index += len * 8;
-	qrcv->current_slot = qrcv->current_index;
+	qa->current_index += len * 8;
+	qa->current_slot = qa->current_index;
 
 	return TRUE;
 }
@@ -4534,282 +4645,406 @@ qrt_dynamic_bind_empty(struct routing_table *rt)
 	rt->can_route     = qrp_cannot_route;
 }
 
+/***
+ *** Application of the received QRP messages, in the QRP thread.
+ ***/
+
+#define QRT_JOB_RELEASE		0xff	/**< Job releasing the application state */
+
 /**
- * Handle reception of QRP RESET.
- *
- * @returns TRUE if we handled the message correctly, FALSE if an error
- * was found and the node BYE-ed.
+ * A received QRP message, to be processed by the QRP thread.
  */
-static bool
-qrt_handle_reset(
-	gnutella_node_t *n, struct qrt_receive *qrcv, struct qrp_reset *reset)
+struct qrt_job {
+	struct qrt_apply *qa;			/**< Table application state */
+	struct routing_table *table;	/**< New table (RESET or first PATCH) */
+	struct routing_table *base;		/**< Table to copy into `table', if any */
+	struct qrp_patch patch;			/**< The PATCH message, data copied */
+	bool (*apply)(struct qrt_apply *qa, const uchar *data, int len,
+						const struct qrp_patch *patch);
+	int shrink_factor;				/**< Shrink factor for `table' */
+	uint8 type;						/**< Message type, or QRT_JOB_RELEASE */
+	bool first;						/**< First PATCH of the sequence */
+	bool last;						/**< Last PATCH of the sequence */
+};
+
+/**
+ * Outcome of the QRP thread processing, reported to the main thread.
+ */
+struct qrt_result {
+	struct nid *node_id;			/**< Node which sent the table */
+	struct routing_table *table;	/**< The table, or NULL */
+	char *reason;					/**< BYE reason on error, NULL if OK */
+	int code;						/**< BYE code on error */
+};
+
+/**
+ * Main thread callback to drop a reference on a table we were handed.
+ */
+static void
+qrt_unref_event(void *data)
 {
-	struct routing_table *rt;
-	int ret;
-	int slots;
-	int old_generation = -1;
+	qrt_unref(data);
+}
 
-	ret = inflateReset(qrcv->inz);
-	if G_UNLIKELY(ret != Z_OK) {
-		g_warning("unable to reset QRP decompressor for %s: %s",
-			node_infostr(n), zlib_strerror(ret));
-		node_bye_if_writable(n, 500, "Error resetting QRP inflater: %s",
-			zlib_strerror(ret));
-		return FALSE;
-	}
+/**
+ * Give back a table reference to the main thread, which frees tables.
+ */
+static void
+qrt_thread_unref(struct routing_table *rt)
+{
+	if (rt != NULL)
+		teq_safe_post(THREAD_MAIN_ID, qrt_unref_event, rt);
+}
 
-	/*
-	 * If the advertized table size is not a power of two, good bye.
-	 */
+/**
+ * Record the latest table handed to the QRP thread for a node.
+ */
+static void
+qrt_pending_set(const struct nid *node_id, struct routing_table *rt)
+{
+	const void *key;
+	void *value;
 
-	if G_UNLIKELY(!is_pow2(reset->table_length)) {
-		g_warning("%s sent us non power-of-two QRP length: %u",
-			node_infostr(n), reset->table_length);
-		node_bye_if_writable(n, 413, "Invalid QRP table length %u",
-			reset->table_length);
-		return FALSE;
-	}
+	g_assert(thread_is_main());
 
-	/*
-	 * If infinity is not at least 1, there is a problem.
-	 *
-	 * We allow 1 because for leaf<->ultrapeer QRTs, what matters is
-	 * presence, and we don't really care about the hop distance: normally,
-	 * presence would be 1 and absence 2, without any 0 in the table.  When
-	 * infinity is 1, presence will be indicated by a 0.
-	 */
+	if G_UNLIKELY(NULL == qrt_pending)
+		qrt_pending = htable_create_any(nid_hash, nid_hash2, nid_equal);
 
-	if G_UNLIKELY(reset->infinity < 1) {
-		g_warning("%s sent us invalid QRP infinity: %u",
-			node_infostr(n), (uint) reset->infinity);
-		node_bye_if_writable(n, 413, "Invalid QRP infinity %u",
-			(uint) reset->infinity);
-		return FALSE;
+	if (htable_lookup_extended(qrt_pending, node_id, &key, &value)) {
+		qrt_unref(value);
+		htable_insert(qrt_pending, key, qrt_ref(rt));
+	} else {
+		htable_insert(qrt_pending, nid_ref(node_id), qrt_ref(rt));
 	}
+}
 
-	/*
-	 * Create new empty table, and set shrink_factor correctly in case
-	 * the table's size exceeds our maximum size.
-	 */
+/**
+ * Forget about the pending table of a node, if it is still the given one.
+ */
+static void
+qrt_pending_clear(const struct nid *node_id, const struct routing_table *rt)
+{
+	const void *key;
+	void *value;
 
-	node_qrt_discard(n);
+	g_assert(thread_is_main());
+
+	if (NULL == qrt_pending)
+		return;
 
-	if (qrcv->table) {
-		old_generation = qrcv->table->generation;
-		qrt_unref(qrcv->table);
+	if (
+		htable_lookup_extended(qrt_pending, node_id, &key, &value) &&
+		value == rt
+	) {
+		htable_remove(qrt_pending, node_id);
+		nid_unref(deconstify_pointer(key));
+		qrt_unref(value);
 	}
+}
 
-	if (qrcv->expansion)
-		wfree(qrcv->expansion, qrcv->shrink_factor);
+/**
+ * htable_foreach() callback to free the pending tables.
+ */
+static void
+qrt_pending_free_kv(const void *key, void *value, void *unused_data)
+{
+	(void) unused_data;
 
-	WALLOC0(rt);
-	rt->magic = QRP_ROUTE_MAGIC;
-	rt->name = str_cmsg("QRT %s", node_infostr(n));
-	rt->refcnt = 1;
-	rt->generation = old_generation + 1;
-	rt->infinity = reset->infinity;
-	rt->client_slots = reset->table_length;
-	rt->compacted = TRUE;		/* We'll compact it on the fly */
-	rt->digest = NULL;
-	rt->reset = TRUE;
+	nid_unref(deconstify_pointer(key));
+	qrt_unref(value);
+}
 
-	qrcv->table = rt;
-	qrcv->shrink_factor = 1;		/* Assume none for now */
-	qrcv->seqsize = 0;				/* Unknown yet */
-	qrcv->seqno = 1;				/* Expecting message #1 */
+/**
+ * Report outcome to the main thread.
+ *
+ * The reference to the table, if any, is transferred to the main thread.
+ *
+ * @param qa		the table application state
+ * @param cb		the main thread callback
+ * @param rt		the table to report
+ */
+static void
+qrt_apply_report(struct qrt_apply *qa, notify_fn_t cb, struct routing_table *rt)
+{
+	struct qrt_result *r;
 
-	/*
-	 * Since we know the table_length is a power of two, to
-	 * know the shrinking factor, we need only count the amount
-	 * of right shifts required to make it be MAX_TABLE_SIZE.
-	 */
+	WALLOC0(r);
+	r->node_id = nid_ref(qa->node_id);
+	r->table = rt;
 
-	while (reset->table_length > MAX_TABLE_SIZE) {
-		reset->table_length >>= 1;
-		qrcv->shrink_factor <<= 1;
+	if (qa->failed) {
+		r->code = qa->code;
+		r->reason = qa->reason;
+		qa->reason = NULL;
 	}
 
-	if (qrp_debugging(0) && qrcv->shrink_factor > 1)
-		g_warning("QRP QRT from %s will be shrunk by a factor of %d",
-			node_infostr(n), qrcv->shrink_factor);
+	teq_safe_post(THREAD_MAIN_ID, cb, r);
+}
 
-	qrcv->expansion = walloc(qrcv->shrink_factor);
+/**
+ * Free the result structure.
+ */
+static void
+qrt_result_free(struct qrt_result *r)
+{
+	nid_unref(r->node_id);
+	HFREE_NULL(r->reason);
+	WFREE(r);
+}
 
-	rt->slots = rt->client_slots / qrcv->shrink_factor;
-	rt->bits = highest_bit_set(rt->slots);
+/**
+ * Main thread callback when the QRP thread is done with a table, either
+ * because it was fully received or because we got an error.
+ */
+static void
+qrt_apply_done(void *data)
+{
+	struct qrt_result *r = data;
+	struct routing_table *rt = r->table;
+	gnutella_node_t *n;
 
-	qrt_dynamic_bind(rt);
+	g_assert(thread_is_main());
 
-	g_assert(is_pow2(rt->slots));
-	g_assert(rt->slots <= MAX_TABLE_SIZE);
-	g_assert((1 << rt->bits) == rt->slots);
+	n = node_by_id(r->node_id);
 
-	/*
-	 * Allocate the compacted area.
-	 * Since the table is empty, it is zero-ed.
-	 */
+	if (NULL == n || NODE_IS_REMOVING(n))
+		goto done;
 
-	slots = rt->slots / 8;			/* 8 bits per byte, table is compacted */
-	rt->arena = halloc0(slots);
-	rt->len = slots;
+	if (!NODE_IS_LEAF(n) && !NODE_IS_ULTRA(n))
+		goto done;
 
-	gnet_prop_set_guint32_val(PROP_QRP_MEMORY,
-		GNET_PROPERTY(qrp_memory) + slots);
+	if (r->reason != NULL) {
+		node_bye_if_writable(n, r->code, "%s", r->reason);
+		goto done;
+	}
+
+	qrt_check(rt);
 
 	/*
-	 * We're now ready to handle PATCH messages.
+	 * Install the table in the node, superseding the previous one.
 	 */
 
-	return TRUE;
+	if (NULL == n->recv_query_table) {
+		node_qrt_install(n, rt);
+	} else {
+		node_qrt_patched(n, rt);	/* Removes old table from leaf index */
+	}
+
+	if (NODE_IS_LEAF(n)) {
+		qrp_index_update(n, rt);
+		qrp_leaf_changed();
+	}
+
+	if (qrp_debugging(4))
+		(void) qrt_dump(rt, GNET_PROPERTY(qrp_debug) > 19);
+
+	/* FALL THROUGH */
+
+done:
+	if (rt != NULL)
+		qrt_unref(rt);
+	qrt_result_free(r);
 }
 
 /**
- * Handle reception of QRP PATCH.
- *
- * @param n			the node sending the patch
- * @param qrcv		the querty routing table being received
- * @param patch		the PATCH message
- * @param done		written with TRUE when last message was processed
- *
- * @returns TRUE if we handled the message correctly, FALSE if an error
- * was found and the node BYE-ed.  Sets `done' to TRUE on the last message
- * from the sequence.
+ * Main thread callback when the QRP thread released the application state.
  */
-static bool
-qrt_handle_patch(
-	gnutella_node_t *n, struct qrt_receive *qrcv, struct qrp_patch *patch,
-	bool *done)
+static void
+qrt_apply_released(void *data)
 {
-	/*
-	 * If we don't have a routing table allocated, it means they never sent
-	 * the RESET message, and no prior table was recorded.
-	 */
-
-	if G_UNLIKELY(qrcv->table == NULL) {
-		g_warning("%s did not sent any QRP RESET before PATCH",
-			node_infostr(n));
-		node_bye_if_writable(n, 413, "No QRP RESET received before PATCH");
-		return FALSE;
-	}
+	struct qrt_result *r = data;
 
-	/*
-	 * Check that we're receiving the proper sequence.
-	 */
+	g_assert(thread_is_main());
 
-	if G_UNLIKELY(patch->seq_no != qrcv->seqno) {
-		g_warning("%s sent us invalid QRP seqno %u (expected %u)",
-			node_infostr(n), (uint) patch->seq_no, qrcv->seqno);
-		node_bye_if_writable(n, 413, "Invalid QRP seq number %u (expected %u)",
-			(uint) patch->seq_no, qrcv->seqno);
-		return FALSE;
+	if (r->table != NULL) {
+		qrt_pending_clear(r->node_id, r->table);
+		qrt_unref(r->table);
 	}
+	qrt_result_free(r);
+}
 
-	/*
-	 * Check that the maxmimum amount of messages for the patch sequence
-	 * is remaining stable accross all the PATCH messages.
+/**
+ * Make the given table the one being built, superseding any previous one.
+ *
+ * @param qa			the table application state
+ * @param rt			the new table (reference is taken over)
+ * @param shrink_factor	the shrink factor to apply when patching `rt'
+ */
+static void
+qrt_apply_adopt(struct qrt_apply *qa, struct routing_table *rt,
+	int shrink_factor)
+{
+	qrt_thread_unref(qa->table);
+
+	if (qa->expansion)
+		wfree(qa->expansion, qa->shrink_factor);
+
+	qa->table = rt;
+	qa->shrink_factor = shrink_factor;
+	qa->expansion = walloc(shrink_factor);
+}
+
+/**
+ * Report error to the main thread, handing back the table being built.
+ */
+static void
+qrt_apply_error(struct qrt_apply *qa)
+{
+	g_assert(qa->failed);
+
+	qrt_apply_report(qa, qrt_apply_done, qa->table);
+	qa->table = NULL;
+}
+
+/**
+ * Process RESET in the QRP thread.
+ */
+static void
+qrt_apply_reset(struct qrt_apply *qa, struct qrt_job *job)
+{
+	int ret;
+
+	ret = inflateReset(qa->inz);
+	if G_UNLIKELY(ret != Z_OK) {
+		g_warning("unable to reset QRP decompressor for %s: %s",
+			qa->info, zlib_strerror(ret));
+		qrt_apply_failed(qa, 500, "Error resetting QRP inflater: %s",
+			zlib_strerror(ret));
+		qrt_apply_error(qa);
+		return;
+	}
+
+	qrt_apply_adopt(qa, job->table, job->shrink_factor);
+	job->table = NULL;
+}
+
+/**
+ * Finalize the table once the whole PATCH sequence was applied, and hand
+ * it to the main thread.
+ */
+static void
+qrt_apply_finish(struct qrt_apply *qa)
+{
+	struct routing_table *rt = qa->table;
+
+	/*
+	 * Make sure the servent sent us a patch that covers the whole table.
+	 * We've reached the end of the patch sequence, but that does not
+	 * necessarily means it applied to all the slots.
 	 */
 
-	if G_UNLIKELY(qrcv->seqno == 1) {
-		qrcv->seqsize = patch->seq_size;
-		qrcv->deflated = patch->compressor == 0x1;
-		qrcv->entry_bits = patch->entry_bits;
-		qrcv->current_index = qrcv->current_slot = 0;
-		qrcv->table->set_count = 0;
-		qrcv->patch = qrt_apply_patch; /* Default handler. */
+	if G_UNLIKELY(qa->current_index < rt->slots) {
+		g_warning("QRP %d-bit patch from %s covered only %d/%d slots",
+			qa->entry_bits, qa->info, qa->current_index, rt->slots);
+		qrt_apply_failed(qa, 413,
+			"Incomplete %d-bit QRP patch covered %d/%d slots",
+			qa->entry_bits, qa->current_index, rt->slots);
+		qrt_apply_error(qa);
+		return;
+	}
 
-		qrt_dynamic_bind(qrcv->table);	/* Reset initial `can_route' */
+	g_assert(qa->current_index == rt->slots);
+	atom_sha1_free_null(&rt->digest);
 
-		switch (qrcv->entry_bits) {
-		case 8:
-			if (1 == qrcv->shrink_factor)
-				qrcv->patch = qrt_apply_patch8;
-			break;
-		case 4:
-			if (1 == qrcv->shrink_factor)
-				qrcv->patch = qrt_apply_patch4;
-			break;
-		case 2:
-			/* Use default handler. */
-			break;
-		case 1:
-			/*
-			 * G2 defined the ordering of bits in the 1-bit QRP as being
-			 * "little-endian" (i.e. the bit #0 in the logical QRP is actually
-			 * the low-order bit of the first byte), whereas in Gnutella, the
-			 * QRP is ordered in a "big-endian" way (i.e. the bit #0 in the
-			 * logical QRP is actually the high-order bit of the first byte).
-			 * This is consistent with the 4-bit patch, where the first nybble
-			 * is given in the high nybble of the first byte, i.e. in bits 7-4.
-			 *
-			 * This means we need to reverse each byte of the patch when
-			 * receiving a 1-bit patch from a G2 node.  Note that this only
-			 * happens when GTKG runs as a Hub, which is not going to be
-			 * implemented at first.
-			 *		--RAM, 2014-01-03
-			 */
-			if (NODE_TALKS_G2(n)) {
-				if (1 == qrcv->shrink_factor) {
-					qrcv->patch = qrt_apply_reversed_patch1;
-				} else {
-					g_warning("%s sent QRP 1-bit PATCH with shrink factor %u",
-						node_infostr(n), qrcv->shrink_factor);
-					node_bye_if_writable(n, 413,
-						"Invalid shrink factor %u for PATCH (QRT too large)",
-						qrcv->shrink_factor);
-					return FALSE;
-				}
-			} else if (1 == qrcv->shrink_factor) {
-				qrcv->patch = qrt_apply_patch1;
-			}
-			break;
-		default:
-			g_warning("%s sent invalid QRP entry bits %u for PATCH",
-				node_infostr(n), qrcv->entry_bits);
-			node_bye_if_writable(n, 413, "Invalid QRP entry bits %u for PATCH",
-				qrcv->entry_bits);
-			return FALSE;
-		}
-	} else if G_UNLIKELY(patch->seq_size != qrcv->seqsize) {
-		g_warning("%s changed QRP seqsize to %u at message #%d "
-			"(started with %u)",
-			node_infostr(n),
-			(uint) patch->seq_size, qrcv->seqno, qrcv->seqsize);
-		node_bye_if_writable(n, 413,
-			"Changed QRP seq size to %u at message #%d (began with %u)",
-			(uint) patch->seq_size, qrcv->seqno, qrcv->seqsize);
-		return FALSE;
+	if (qrp_debugging(2))
+		rt->digest = atom_sha1_get(qrt_sha1(rt));
+
+	rt->fill_ratio = (int) (100.0 * rt->set_count / rt->slots);
+
+	/*
+	 * If table is more than 5% full, each query will go through a
+	 * random d100 throw, and will pass only if the score is below
+	 * the value of the pass throw threshold.
+	 *
+	 * The function below quickly drops and then flattens:
+	 *
+	 *   x =  6%  -> throw = 84
+	 *   x =  7%  -> throw = 79
+	 *   x =  8%  -> throw = 75
+	 *   x = 10%  -> throw = 69
+	 *   x = 20%  -> throw = 53
+	 *   x = 50%  -> throw = 27
+	 *   x = 90%  -> throw = 6
+	 *   x = 99%  -> throw = 2
+	 *
+	 * throw = 100 * (1 - (x - 0.05)^1/2.5)
+	 *
+	 * Function was adjusted to cut at 5% now instead of 1% since we
+	 * now filter SHA1 queries via the QRP, so leaf traffic is far
+	 * diminished.
+	 *		--RAM, 03/01/2004
+	 */
+
+	if (rt->fill_ratio > 5)
+		rt->pass_throw = (int)
+			(100.0 * (1 - pow((rt->fill_ratio - 5) / 100.0, 1/2.5)));
+	else
+		rt->pass_throw = 100;		/* Always forward if QRT says so */
+
+	if (qrp_debugging(2)) {
+		g_debug("QRP got whole %d-bit patch "
+			"(gen=%d, slots=%d (*%d), fill=%d%%, throw=%d) "
+			"from %s: SHA1=%s",
+			qa->entry_bits, rt->generation, rt->slots,
+			qa->shrink_factor, rt->fill_ratio, rt->pass_throw,
+			qa->info,
+			rt->digest ? sha1_base32(rt->digest) : "<not computed>");
 	}
 
 	/*
-	 * Check that the compression bits and entry_bits values are staying
-	 * the same.
+	 * If table is empty, supersede the routing entries.
 	 */
 
-	if G_UNLIKELY(qrcv->entry_bits != patch->entry_bits) {
-		g_warning("%s changed QRP patch entry bits to %u "
-			"at message #%d (started with %u)",
-			node_infostr(n),
-			(uint) patch->entry_bits, qrcv->seqno, qrcv->entry_bits);
-		node_bye_if_writable(n, 413,
-			"Changed QRP patch entry bits to %u at message #%d (began with %u)",
-			(uint) patch->entry_bits, qrcv->seqno, qrcv->entry_bits);
-		return FALSE;
+	if (qrt_is_empty(rt)) {
+		rt->is_empty = TRUE;
+		qrt_dynamic_bind_empty(rt);
+	} else {
+		rt->is_empty = FALSE;
+		qrt_dynamic_bind(rt);
 	}
 
-	qrcv->seqno++;
+	qrt_apply_report(qa, qrt_apply_done, rt);
+	qa->table = NULL;
+}
+
+/**
+ * Process PATCH in the QRP thread.
+ */
+static void
+qrt_apply_patch_msg(struct qrt_apply *qa, struct qrt_job *job)
+{
+	const struct qrp_patch *patch = &job->patch;
 
 	/*
-	 * Attempt to relocate the table if interesting for the VM space.
+	 * When they did not send a RESET, the patch applies to a copy of the
+	 * last table we got from them, which is left untouched.
 	 */
 
-	qrt_arena_relocate(qrcv->table);
+	if (job->table != NULL) {
+		if (job->base != NULL) {
+			g_assert(job->table->len == job->base->len);
+			memcpy(job->table->arena, job->base->arena, job->table->len);
+		}
+		qrt_apply_adopt(qa, job->table, job->shrink_factor);
+		job->table = NULL;
+	}
+
+	g_assert(qa->table != NULL);
+
+	if (job->first) {
+		qa->deflated = patch->compressor == 0x1;
+		qa->entry_bits = patch->entry_bits;
+		qa->current_index = qa->current_slot = 0;
+		qa->table->set_count = 0;
+		qa->patch = job->apply;
+	}
 
 	/*
 	 * Process the patch data.
 	 */
 
-	if (qrcv->deflated) {
-		z_streamp inz = qrcv->inz;
+	if (qa->deflated) {
+		z_streamp inz = qa->inz;
 		int ret;
 		bool seen_end = FALSE;
 
@@ -4817,12 +5052,12 @@ qrt_handle_patch(
 		inz->avail_in = patch->len;
 
 		while (!seen_end && inz->avail_in > 0) {
-			inz->next_out = cast_to_pointer(qrcv->data);
-			inz->avail_out = qrcv->len;
+			inz->next_out = cast_to_pointer(qa->data);
+			inz->avail_out = qa->len;
 
 			ret = inflate(inz, Z_SYNC_FLUSH);
 
-			if (ret == Z_STREAM_END && qrcv->seqno > qrcv->seqsize) {
+			if (ret == Z_STREAM_END && job->last) {
 				seen_end = TRUE;
 				ret = Z_OK;
 			}
@@ -4830,19 +5065,19 @@ qrt_handle_patch(
 			if G_UNLIKELY(ret != Z_OK) {
 				g_warning("decompression of QRP patch #%u/%u failed for %s: %s",
 					(uint) patch->seq_no, (uint) patch->seq_size,
-					node_infostr(n), zlib_strerror(ret));
-				node_bye_if_writable(n, 413,
+					qa->info, zlib_strerror(ret));
+				qrt_apply_failed(qa, 413,
 					"QRP patch #%u/%u decompression failed: %s",
 					(uint) patch->seq_no, (uint) patch->seq_size,
 					zlib_strerror(ret));
-				return FALSE;
+				goto failed;
 			}
 
 			if (
-				!qrcv->patch(qrcv, (uchar *) qrcv->data,
-					qrcv->len - inz->avail_out, patch)
+				!qa->patch(qa, (uchar *) qa->data,
+					qa->len - inz->avail_out, patch)
 			)
-				return FALSE;
+				goto failed;
 		}
 
 		/*
@@ -4850,558 +5085,1638 @@ qrt_handle_patch(
 		 * the last patch of the sequence.
 		 */
 
-		if G_UNLIKELY(seen_end && qrcv->seqno <= qrcv->seqsize) {
+		if G_UNLIKELY(seen_end && !job->last) {
 			g_warning("saw end of compressed QRP patch at #%u/%u for %s",
-				(uint) patch->seq_no, (uint) patch->seq_size,
-				node_infostr(n));
-			node_bye_if_writable(n, 413,
+				(uint) patch->seq_no, (uint) patch->seq_size, qa->info);
+			qrt_apply_failed(qa, 413,
 				"Early end of compressed QRP patch at #%u/%u",
 				(uint) patch->seq_no, (uint) patch->seq_size);
-			return FALSE;
+			goto failed;
 		}
-	} else if (!qrcv->patch(qrcv, patch->data, patch->len, patch))
-		return FALSE;
+	} else if (!qa->patch(qa, patch->data, patch->len, patch))
+		goto failed;
 
 	/*
 	 * Was the PATCH sequence fully processed?
 	 */
 
-	if (qrcv->seqno > qrcv->seqsize) {
-		struct routing_table *rt = qrcv->table;
+	if (job->last)
+		qrt_apply_finish(qa);
 
-		*done = TRUE;
-
-		/*
-		 * Make sure the servent sent us a patch that covers the whole table.
-		 * We've reached the end of the patch sequence, but that does not
-		 * necessarily means it applied to all the slots.
-		 */
+	return;
 
-		if G_UNLIKELY(qrcv->current_index < rt->slots) {
-			g_warning("QRP %d-bit patch from %s covered only %d/%d slots",
-				qrcv->entry_bits, node_infostr(n),
-				qrcv->current_index, rt->slots);
-			node_bye_if_writable(n, 413,
-				"Incomplete %d-bit QRP patch covered %d/%d slots",
-				qrcv->entry_bits, qrcv->current_index, rt->slots);
-			return FALSE;
-		}
+failed:
+	qrt_apply_error(qa);
+}
 
-		g_assert(qrcv->current_index == rt->slots);
-		atom_sha1_free_null(&rt->digest);
+/**
+ * Dispose of the application state, in the QRP thread.
+ */
+static void
+qrt_apply_free(struct qrt_apply *qa, struct qrt_job *job)
+{
+	qrt_apply_check(qa);
 
-		if (qrp_debugging(2))
-			rt->digest = atom_sha1_get(qrt_sha1(rt));
+	/*
+	 * Notify the main thread that this table is no longer pending.
+	 * The table being built, if still there, was not fully received.
+	 */
 
-		rt->fill_ratio = (int) (100.0 * rt->set_count / rt->slots);
+	qrt_apply_report(qa, qrt_apply_released, job->table);
+	job->table = NULL;
+	qrt_thread_unref(qa->table);
+
+	(void) inflateEnd(qa->inz);
+	WFREE(qa->inz);
+	if (qa->expansion)
+		wfree(qa->expansion, qa->shrink_factor);
+	HFREE_NULL(qa->data);
+	HFREE_NULL(qa->info);
+	HFREE_NULL(qa->reason);
+	nid_unref(qa->node_id);
+
+	qa->magic = 0;
+	WFREE(qa);
+}
 
-		/*
-		 * If table is more than 5% full, each query will go through a
-		 * random d100 throw, and will pass only if the score is below
-		 * the value of the pass throw threshold.
-		 *
-		 * The function below quickly drops and then flattens:
-		 *
-		 *   x =  6%  -> throw = 84
-		 *   x =  7%  -> throw = 79
-		 *   x =  8%  -> throw = 75
-		 *   x = 10%  -> throw = 69
-		 *   x = 20%  -> throw = 53
-		 *   x = 50%  -> throw = 27
-		 *   x = 90%  -> throw = 6
-		 *   x = 99%  -> throw = 2
-		 *
-		 * throw = 100 * (1 - (x - 0.05)^1/2.5)
-		 *
-		 * Function was adjusted to cut at 5% now instead of 1% since we
-		 * now filter SHA1 queries via the QRP, so leaf traffic is far
-		 * diminished.
-		 *		--RAM, 03/01/2004
-		 */
+/**
+ * Process a job in the QRP thread.
+ *
+ * Jobs are handled as TEQ events, and are therefore processed in the order
+ * they were posted by the main thread.
+ */
+static void
+qrt_thread_job(void *data)
+{
+	struct qrt_job *job = data;
+	struct qrt_apply *qa = job->qa;
 
-		if (rt->fill_ratio > 5)
-			rt->pass_throw = (int)
-				(100.0 * (1 - pow((rt->fill_ratio - 5) / 100.0, 1/2.5)));
-		else
-			rt->pass_throw = 100;		/* Always forward if QRT says so */
+	qrt_apply_check(qa);
 
-		if (qrp_debugging(2)) {
-			g_debug("QRP got whole %d-bit patch "
-				"(gen=%d, slots=%d (*%d), fill=%d%%, throw=%d) "
-				"from %s: SHA1=%s",
-				qrcv->entry_bits, rt->generation, rt->slots,
-				qrcv->shrink_factor, rt->fill_ratio, rt->pass_throw,
-				node_infostr(n),
-				rt->digest ? sha1_base32(rt->digest) : "<not computed>");
-		}
+	switch (job->type) {
+	case GTA_MSGV_QRP_RESET:
+		if (!qa->failed)
+			qrt_apply_reset(qa, job);
+		break;
+	case GTA_MSGV_QRP_PATCH:
+		if (!qa->failed)
+			qrt_apply_patch_msg(qa, job);
+		break;
+	case QRT_JOB_RELEASE:
+		qrt_apply_free(qa, job);
+		break;
+	default:
+		g_assert_not_reached();
+	}
 
-		/*
-		 * If table is empty, supersede the routing entries.
-		 */
+	/*
+	 * Tables not consumed (because of an earlier error) are given back.
+	 */
 
-		if (qrt_is_empty(rt)) {
-			rt->is_empty = TRUE;
-			qrt_dynamic_bind_empty(rt);
-		} else {
-			rt->is_empty = FALSE;
-		}
+	qrt_thread_unref(job->table);
+	qrt_thread_unref(job->base);
 
-		/*
-		 * Install the table in the node, if it was a new table.
-		 * Otherwise, we only finished patching it.
-		 */
+	if (job->patch.data != NULL)
+		wfree(job->patch.data, job->patch.len);
+	WFREE(job);
 
-		if (rt->reset)
-			node_qrt_install(n, rt);
-		else
-			node_qrt_patched(n, rt);
+	atomic_uint_dec(&qrp_thread_pending);
+}
 
-		if (NODE_IS_LEAF(n))
-			qrp_leaf_changed();
+/**
+ * Post job to the QRP thread.
+ */
+static void
+qrt_job_post(struct qrt_job *job)
+{
+	g_assert(thread_is_main());
+	g_assert(qrp_thread_id != THREAD_INVALID_ID);
 
-		if (qrp_debugging(4))
-			(void) qrt_dump(rt, GNET_PROPERTY(qrp_debug) > 19);
-	}
+	atomic_uint_inc(&qrp_thread_pending);
 
-	return TRUE;
+	if (THREAD_MAIN_ID == qrp_thread_id)
+		teq_safe_post(THREAD_MAIN_ID, qrt_thread_job, job);
+	else
+		teq_post(qrp_thread_id, qrt_thread_job, job);
 }
 
 /**
- * Handle reception of the next QRP message in the stream for a given update.
- *
- * @returns whether we successfully handled the message.  If not, the node
- * has been signalled if needed, and may have been BYE-ed.
+ * Release the application state, once the QRP thread has processed all the
+ * jobs we already posted.
  *
- * When the last message from the sequence has been processed, set `done'
- * to TRUE.
+ * @param qa		the table application state
+ * @param rt		the last table we handed to the QRP thread, if any
  */
-bool
-qrt_receive_next(struct qrt_receive *qrcv, bool *done)
+static void
+qrt_apply_release(struct qrt_apply *qa, struct routing_table *rt)
 {
-	gnutella_node_t *n = qrcv->node;
-	uint8 type;
-
-	g_assert(qrcv->magic == QRT_RECEIVE_MAGIC);
-	g_assert(gnutella_header_get_function(&n->header) == GTA_MSG_QRP);
-
-	type = *n->data;
-
-	*done = FALSE;
-
-	switch (type) {
-	case GTA_MSGV_QRP_RESET:
-		{
-			struct qrp_reset reset;
+	struct qrt_job *job;
 
-			if (!qrp_recv_reset(n, &reset))
-				goto dropped;
+	WALLOC0(job);
+	job->qa = qa;
+	job->type = QRT_JOB_RELEASE;
+	job->table = rt != NULL ? qrt_ref(rt) : NULL;
 
-			return qrt_handle_reset(n, qrcv, &reset);
-		}
-		break;
-	case GTA_MSGV_QRP_PATCH:
-		{
-			struct qrp_patch patch;
+	qrt_job_post(job);
+}
 
-			if (!qrp_recv_patch(n, &patch))
-				goto dropped;
+/**
+ * Event posted to terminate the QRP thread.
+ *
+ * Since TEQ events are processed in order, all the jobs posted before
+ * have been handled when we get this event.
+ */
+static void
+qrp_thread_terminate(void *unused_data)
+{
+	(void) unused_data;
 
-			return qrt_handle_patch(n, qrcv, &patch, done);
-		}
-		break;
-	default:
-		gnet_stats_count_dropped(n, MSG_DROP_UNKNOWN_TYPE);
-		/* FALL THROUGH */
-	}
+	if (qrp_debugging(0))
+		g_debug("terminating QRP thread");
 
-dropped:
-	return TRUE;		/* Everything is fine, even if we dropped message */
+	atomic_bool_set(&qrp_thread_exiting, TRUE);
 }
 
-static bool qrt_leaf_change_notified = FALSE;
-
 /**
- * Called when we get a new QRT from a leaf node, or when we loose a leaf
- * that sent us its QRT.
+ * Is QRP thread terminated?
+ *
+ * All the work is done by processing TEQ events whilst we wait.
  */
-void
-qrp_leaf_changed(void)
+static bool
+qrp_thread_has_work(void *unused_arg)
 {
-	qrt_leaf_change_notified = TRUE;
+	(void) unused_arg;
+
+	return atomic_bool_get(&qrp_thread_exiting);
 }
 
 /**
- * Periodic monitor, to trigger recomputation of the merged table if we got
- * a new leaf with a QRT or lost a leaf which sent us its QRT.
+ * QRP thread main loop.
  */
-static bool
-qrp_monitor(void *unused_obj)
+static void *
+qrp_thread_main(void *arg)
 {
-	(void) unused_obj;
+	barrier_t *b = arg;
 
-	/*
-	 * If we're not running as an ultra node, or if the reconstruction thread
+	thread_set_name("QRP");
+	teq_create();				/* Queue to receive TEQ events */
+
+	barrier_wait(b);			/* Thread has initialized */
+	barrier_free_null(&b);
+
+	if (qrp_debugging(0))
+		g_debug("QRP thread started");
+
+	while (!atomic_bool_get(&qrp_thread_exiting))
+		teq_wait(qrp_thread_has_work, NULL);
+
+	if (qrp_debugging(0))
+		g_debug("QRP thread exiting");
+
+	return NULL;
+}
+
+/**
+ * Create the QRP thread.
+ *
+ * This routine does not return until the thread has been correctly
+ * initialized, so that the caller can immediately post events to it.
+ *
+ * @return thread ID.
+ */
+static uint
+qrp_thread_create(void)
+{
+	barrier_t *b;
+	int r;
+
+	b = barrier_new(2);
+
+	r = thread_create(qrp_thread_main, barrier_refcnt_inc(b),
+			THREAD_F_NO_CANCEL | THREAD_F_NO_POOL | THREAD_F_PANIC,
+			THREAD_STACK_MIN);
+
+	barrier_wait(b);		/* Wait for thread to initialize */
+	barrier_free_null(&b);
+
+	return r;
+}
+
+/***
+ *** Reception of QRP messages, in the main thread.
+ ***/
+
+/**
+ * Create new table for the reception of a PATCH sequence without RESET,
+ * which will start as a copy of the previous table, filled by the QRP
+ * thread.
+ */
+static struct routing_table *
+qrt_receive_new_table(struct qrt_receive *qrcv)
+{
+	const struct routing_table *base = qrcv->base;
+	struct routing_table *rt;
+
+	qrt_check(base);
+	g_assert(base->compacted);
+
+	WALLOC0(rt);
+	rt->magic = QRP_ROUTE_MAGIC;
+	rt->name = h_strdup(base->name);
+	rt->refcnt = 1;
+	rt->generation = base->generation + 1;
+	rt->infinity = base->infinity;
+	rt->client_slots = base->client_slots;
+	rt->slots = base->slots;
+	rt->bits = base->bits;
+	rt->compacted = TRUE;
+	rt->digest = NULL;
+	rt->reset = FALSE;
+	rt->arena = halloc(base->len);
+	rt->len = base->len;
+
+	qrt_dynamic_bind(rt);
+
+	gnet_prop_set_guint32_val(PROP_QRP_MEMORY,
+		GNET_PROPERTY(qrp_memory) + rt->len);
+
+	return rt;
+}
+
+/**
+ * Handle reception of QRP RESET.
+ *
+ * @returns TRUE if we handled the message correctly, FALSE if an error
+ * was found and the node BYE-ed.
+ */
+static bool
+qrt_handle_reset(
+	gnutella_node_t *n, struct qrt_receive *qrcv, struct qrp_reset *reset)
+{
+	struct routing_table *rt;
+	struct qrt_job *job;
+	int slots;
+
+	/*
+	 * If the advertized table size is not a power of two, good bye.
+	 */
+
+	if G_UNLIKELY(!is_pow2(reset->table_length)) {
+		g_warning("%s sent us non power-of-two QRP length: %u",
+			node_infostr(n), reset->table_length);
+		node_bye_if_writable(n, 413, "Invalid QRP table length %u",
+			reset->table_length);
+		return FALSE;
+	}
+
+	/*
+	 * If infinity is not at least 1, there is a problem.
+	 *
+	 * We allow 1 because for leaf<->ultrapeer QRTs, what matters is
+	 * presence, and we don't really care about the hop distance: normally,
+	 * presence would be 1 and absence 2, without any 0 in the table.  When
+	 * infinity is 1, presence will be indicated by a 0.
+	 */
+
+	if G_UNLIKELY(reset->infinity < 1) {
+		g_warning("%s sent us invalid QRP infinity: %u",
+			node_infostr(n), (uint) reset->infinity);
+		node_bye_if_writable(n, 413, "Invalid QRP infinity %u",
+			(uint) reset->infinity);
+		return FALSE;
+	}
+
+	/*
+	 * Create new empty table, and set shrink_factor correctly in case
+	 * the table's size exceeds our maximum size.
+	 *
+	 * The current table of the node is kept until the new one is fully
+	 * received, so that we can continue to route queries meanwhile.
+	 */
+
+	WALLOC0(rt);
+	rt->magic = QRP_ROUTE_MAGIC;
+	rt->name = str_cmsg("QRT %s", node_infostr(n));
+	rt->refcnt = 1;
+	rt->generation = NULL == qrcv->base ? 0 : qrcv->base->generation + 1;
+	rt->infinity = reset->infinity;
+	rt->client_slots = reset->table_length;
+	rt->compacted = TRUE;		/* We'll compact it on the fly */
+	rt->digest = NULL;
+	rt->reset = TRUE;
+
+	qrcv->reset = TRUE;
+	qrcv->shrink_factor = 1;		/* Assume none for now */
+	qrcv->seqsize = 0;				/* Unknown yet */
+	qrcv->seqno = 1;				/* Expecting message #1 */
+
+	/*
+	 * Since we know the table_length is a power of two, to
+	 * know the shrinking factor, we need only count the amount
+	 * of right shifts required to make it be MAX_TABLE_SIZE.
+	 */
+
+	while (reset->table_length > MAX_TABLE_SIZE) {
+		reset->table_length >>= 1;
+		qrcv->shrink_factor <<= 1;
+	}
+
+	if (qrp_debugging(0) && qrcv->shrink_factor > 1)
+		g_warning("QRP QRT from %s will be shrunk by a factor of %d",
+			node_infostr(n), qrcv->shrink_factor);
+
+	rt->slots = rt->client_slots / qrcv->shrink_factor;
+	rt->bits = highest_bit_set(rt->slots);
+
+	qrt_dynamic_bind(rt);
+
+	g_assert(is_pow2(rt->slots));
+	g_assert(rt->slots <= MAX_TABLE_SIZE);
+	g_assert((1 << rt->bits) == rt->slots);
+
+	/*
+	 * Allocate the compacted area.
+	 * Since the table is empty, it is zero-ed.
+	 */
+
+	slots = rt->slots / 8;			/* 8 bits per byte, table is compacted */
+	rt->arena = halloc0(slots);
+	rt->len = slots;
+
+	gnet_prop_set_guint32_val(PROP_QRP_MEMORY,
+		GNET_PROPERTY(qrp_memory) + slots);
+
+	/*
+	 * Hand the new table to the QRP thread.
+	 */
+
+	qrcv->table = rt;
+	qrt_pending_set(NODE_ID(n), rt);
+
+	WALLOC0(job);
+	job->qa = qrcv->qa;
+	job->type = GTA_MSGV_QRP_RESET;
+	job->table = rt;
+	job->shrink_factor = qrcv->shrink_factor;
+
+	qrt_job_post(job);
+
+	/*
+	 * We're now ready to handle PATCH messages.
+	 */
+
+	return TRUE;
+}
+
+/**
+ * Handle reception of QRP PATCH.
+ *
+ * @param n			the node sending the patch
+ * @param qrcv		the querty routing table being received
+ * @param patch		the PATCH message
+ * @param done		written with TRUE when last message was processed
+ *
+ * @returns TRUE if we handled the message correctly, FALSE if an error
+ * was found and the node BYE-ed.  Sets `done' to TRUE on the last message
+ * from the sequence.
+ */
+static bool
+qrt_handle_patch(
+	gnutella_node_t *n, struct qrt_receive *qrcv, struct qrp_patch *patch,
+	bool *done)
+{
+	bool (*apply)(struct qrt_apply *, const uchar *, int,
+		const struct qrp_patch *) = NULL;
+	struct qrt_job *job;
+	bool first, last;
+
+	/*
+	 * If we don't have a routing table allocated, it means they never sent
+	 * the RESET message, and no prior table was recorded.
+	 */
+
+	if G_UNLIKELY(!qrcv->reset && NULL == qrcv->base) {
+		g_warning("%s did not sent any QRP RESET before PATCH",
+			node_infostr(n));
+		node_bye_if_writable(n, 413, "No QRP RESET received before PATCH");
+		return FALSE;
+	}
+
+	/*
+	 * Check that we're receiving the proper sequence.
+	 */
+
+	if G_UNLIKELY(patch->seq_no != qrcv->seqno) {
+		g_warning("%s sent us invalid QRP seqno %u (expected %u)",
+			node_infostr(n), (uint) patch->seq_no, qrcv->seqno);
+		node_bye_if_writable(n, 413, "Invalid QRP seq number %u (expected %u)",
+			(uint) patch->seq_no, qrcv->seqno);
+		return FALSE;
+	}
+
+	/*
+	 * Check that the maxmimum amount of messages for the patch sequence
+	 * is remaining stable accross all the PATCH messages.
+	 */
+
+	first = 1 == qrcv->seqno;
+
+	if G_UNLIKELY(first) {
+		qrcv->seqsize = patch->seq_size;
+		qrcv->entry_bits = patch->entry_bits;
+		apply = qrt_apply_patch; /* Default handler. */
+
+		switch (qrcv->entry_bits) {
+		case 8:
+			if (1 == qrcv->shrink_factor)
+				apply = qrt_apply_patch8;
+			break;
+		case 4:
+			if (1 == qrcv->shrink_factor)
+				apply = qrt_apply_patch4;
+			break;
+		case 2:
+			/* Use default handler. */
+			break;
+		case 1:
+			/*
+			 * G2 defined the ordering of bits in the 1-bit QRP as being
+			 * "little-endian" (i.e. the bit #0 in the logical QRP is actually
+			 * the low-order bit of the first byte), whereas in Gnutella, the
+			 * QRP is ordered in a "big-endian" way (i.e. the bit #0 in the
+			 * logical QRP is actually the high-order bit of the first byte).
+			 * This is consistent with the 4-bit patch, where the first nybble
+			 * is given in the high nybble of the first byte, i.e. in bits 7-4.
+			 *
+			 * This means we need to reverse each byte of the patch when
+			 * receiving a 1-bit patch from a G2 node.  Note that this only
+			 * happens when GTKG runs as a Hub, which is not going to be
+			 * implemented at first.
+			 *		--RAM, 2014-01-03
+			 */
+			if (NODE_TALKS_G2(n)) {
+				if (1 == qrcv->shrink_factor) {
+					apply = qrt_apply_reversed_patch1;
+				} else {
+					g_warning("%s sent QRP 1-bit PATCH with shrink factor %u",
+						node_infostr(n), qrcv->shrink_factor);
+					node_bye_if_writable(n, 413,
+						"Invalid shrink factor %u for PATCH (QRT too large)",
+						qrcv->shrink_factor);
+					return FALSE;
+				}
+			} else if (1 == qrcv->shrink_factor) {
+				apply = qrt_apply_patch1;
+			}
+			break;
+		default:
+			g_warning("%s sent invalid QRP entry bits %u for PATCH",
+				node_infostr(n), qrcv->entry_bits);
+			node_bye_if_writable(n, 413, "Invalid QRP entry bits %u for PATCH",
+				qrcv->entry_bits);
+			return FALSE;
+		}
+	} else if G_UNLIKELY(patch->seq_size != qrcv->seqsize) {
+		g_warning("%s changed QRP seqsize to %u at message #%d "
+			"(started with %u)",
+			node_infostr(n),
+			(uint) patch->seq_size, qrcv->seqno, qrcv->seqsize);
+		node_bye_if_writable(n, 413,
+			"Changed QRP seq size to %u at message #%d (began with %u)",
+			(uint) patch->seq_size, qrcv->seqno, qrcv->seqsize);
+		return FALSE;
+	}
+
+	/*
+	 * Check that the compression bits and entry_bits values are staying
+	 * the same.
+	 */
+
+	if G_UNLIKELY(qrcv->entry_bits != patch->entry_bits) {
+		g_warning("%s changed QRP patch entry bits to %u "
+			"at message #%d (started with %u)",
+			node_infostr(n),
+			(uint) patch->entry_bits, qrcv->seqno, qrcv->entry_bits);
+		node_bye_if_writable(n, 413,
+			"Changed QRP patch entry bits to %u at message #%d (began with %u)",
+			(uint) patch->entry_bits, qrcv->seqno, qrcv->entry_bits);
+		return FALSE;
+	}
+
+	qrcv->seqno++;
+
+	/*
+	 * Hand the patch data to the QRP thread.  The message buffer will be
+	 * reused by the time it processes it, hence we copy the data.
+	 */
+
+	WALLOC0(job);
+	job->qa = qrcv->qa;
+	job->type = GTA_MSGV_QRP_PATCH;
+	job->patch = *patch;				/* Struct copy */
+	job->patch.data = 0 == patch->len ? NULL : wcopy(patch->data, patch->len);
+	job->apply = apply;
+	job->first = first;
+	job->last = last = qrcv->seqno > qrcv->seqsize;
+
+	/*
+	 * If we did not get a RESET, patch a copy of their latest table.
+	 */
+
+	if (first && !qrcv->reset) {
+		struct routing_table *rt = qrt_receive_new_table(qrcv);
+
+		qrcv->table = rt;
+		qrt_pending_set(NODE_ID(n), rt);
+
+		job->table = rt;
+		job->base = qrt_ref(qrcv->base);
+		job->shrink_factor = qrcv->shrink_factor;
+	}
+
+	qrt_job_post(job);
+
+	/*
+	 * Was the PATCH sequence fully received?  The new table will be
+	 * installed in the node once the QRP thread has applied all the patches.
+	 */
+
+	if (last)
+		*done = TRUE;
+
+	return TRUE;
+}
+
+/**
+ * Handle reception of the next QRP message in the stream for a given update.
+ *
+ * @returns whether we successfully handled the message.  If not, the node
+ * has been signalled if needed, and may have been BYE-ed.
+ *
+ * When the last message from the sequence has been processed, set `done'
+ * to TRUE.
+ */
+bool
+qrt_receive_next(struct qrt_receive *qrcv, bool *done)
+{
+	gnutella_node_t *n = qrcv->node;
+	uint8 type;
+
+	g_assert(qrcv->magic == QRT_RECEIVE_MAGIC);
+	g_assert(gnutella_header_get_function(&n->header) == GTA_MSG_QRP);
+
+	type = *n->data;
+
+	*done = FALSE;
+
+	switch (type) {
+	case GTA_MSGV_QRP_RESET:
+		{
+			struct qrp_reset reset;
+
+			if (!qrp_recv_reset(n, &reset))
+				goto dropped;
+
+			return qrt_handle_reset(n, qrcv, &reset);
+		}
+		break;
+	case GTA_MSGV_QRP_PATCH:
+		{
+			struct qrp_patch patch;
+
+			if (!qrp_recv_patch(n, &patch))
+				goto dropped;
+
+			return qrt_handle_patch(n, qrcv, &patch, done);
+		}
+		break;
+	default:
+		gnet_stats_count_dropped(n, MSG_DROP_UNKNOWN_TYPE);
+		/* FALL THROUGH */
+	}
+
+dropped:
+	return TRUE;		/* Everything is fine, even if we dropped message */
+}
+
+static bool qrt_leaf_change_notified = FALSE;
+
+/**
+ * Called when we get a new QRT from a leaf node, or when we loose a leaf
+ * that sent us its QRT.
+ */
+void
+qrp_leaf_changed(void)
+{
+	qrt_leaf_change_notified = TRUE;
+}
+
+/**
+ * Periodic monitor, to trigger recomputation of the merged table if we got
+ * a new leaf with a QRT or lost a leaf which sent us its QRT.
+ */
+static bool
+qrp_monitor(void *unused_obj)
+{
+	(void) unused_obj;
+
+	/*
+	 * If we're not running as an ultra node, or if the reconstruction thread
 	 * is already running, don't bother...
 	 */
 
-	if (!settings_is_ultra() || merge_comp != NULL)
-		return TRUE;
+	if (!settings_is_ultra() || merge_comp != NULL)
+		return TRUE;
+
+	/*
+	 * If we got notified of changes, relaunch the computation of the
+	 * merge_table.
+	 */
+
+	if (qrt_leaf_change_notified) {
+		if (mrg_compute(qrp_merge_routing_table))
+			qrt_leaf_change_notified = FALSE;
+	}
+
+	return TRUE;		/* Keep calling */
+}
+
+/**
+ * Initialize QRP.
+ */
+void G_COLD
+qrp_init(void)
+{
+	/*
+	 * Having a working hash function is critical.
+	 * Check that the implementation is not broken by accident.
+	 */
+
+	g_assert(qrp_hash("ebcklmenq", 13) == 3527);
+	g_assert(qrp_hash("ndflalem", 16) == 37658);
+	g_assert(qrp_hash("7777a88a8a8a8", 10) == 342);
+
+	test_hash();
+
+	/*
+	 * Install the periodic monitoring callback.
+	 */
+
+	qrp_monitor_ev = cq_periodic_main_add(
+		LEAF_MONITOR_PERIOD, qrp_monitor, NULL);
+
+	/*
+	 * Install an empty local table untill we compute our shared library.
+	 */
+
+	local_table = qrt_ref(qrt_empty_table("Empty local table"));
+
+	/*
+	 * If we have at least 2 CPUs available, create a thread to apply
+	 * the received QRP patches.  Otherwise, it is done by the main thread.
+	 */
+
+	if (getcpucount() >= 2) {
+		qrp_thread_id = qrp_thread_create();
+	} else {
+		qrp_thread_id = THREAD_MAIN_ID;
+	}
+}
+
+/**
+ * Called at servent shutdown to reclaim all the memory.
+ */
+void G_COLD
+qrp_close(void)
+{
+	/*
+	 * Let the QRP thread process all the jobs we posted, then handle the
+	 * results it reported back to us, before freeing the state they use.
+	 * When patches are applied by the main thread, jobs are plain events.
+	 */
+
+	if (THREAD_MAIN_ID != qrp_thread_id) {
+		teq_post(qrp_thread_id, qrp_thread_terminate, NULL);
+		if (-1 == thread_join(qrp_thread_id, NULL))
+			g_warning("%s(): cannot join with QRP thread: %m", G_STRFUNC);
+		qrp_thread_id = THREAD_MAIN_ID;		/* Any new job now runs here */
+	}
+
+	while (0 != atomic_uint_get(&qrp_thread_pending))
+		teq_dispatch();
+
+	teq_dispatch();		/* Results reported by the last jobs */
+
+	qrp_cancel_computation();
+	cq_periodic_remove(&qrp_monitor_ev);
+
+	if (routing_table)
+		qrt_unref(routing_table);
+
+	qrt_patches_clear();
+
+	if (local_table)
+		qrt_unref(local_table);
+
+	if (merged_table)
+		qrt_unref(merged_table);
+
+	if (qrt_pending != NULL) {
+		htable_foreach(qrt_pending, qrt_pending_free_kv, NULL);
+		htable_free_null(&qrt_pending);
+	}
+
+	qrp_index_free();
+	HFREE_NULL(buffer.arena);
+}
+
+/**
+ * Used by qrt_dump().
+ *
+ * @returns whether a slot in the table is present or not.
+ */
+static bool
+qrt_dump_is_slot_present(struct routing_table *rt, int slot)
+{
+	g_assert(slot < rt->slots);
+
+	if (!rt->compacted)
+		return rt->arena[slot] < rt->infinity;
+
+	return RT_SLOT_READ(rt->arena, slot);
+}
+
+/**
+ * Dump QRT to specified file.
+ * If `full' is true, we dump the whole table.
+ *
+ * @returns a unique 32-bit checksum.
+ */
+static uint32
+qrt_dump(struct routing_table *rt, bool full)
+{
+	struct sha1 digest;
+	SHA1_context ctx;
+	bool last_status = FALSE;
+	int last_slot = 0;
+	uint32 result;
+	int i;
+
+	g_debug("------ Query Routing Table \"%s\" "
+		"(gen=%d, slots=%d, %scompacted)",
+		rt->name, rt->generation, rt->slots, rt->compacted ? "" : "not ");
+
+	SHA1_reset(&ctx);
+
+	for (i = 0; i <= rt->slots; i++) {
+		bool status = FALSE;
+		uint8 value;
+
+		if (i == rt->slots)
+			goto final;
+
+		status = qrt_dump_is_slot_present(rt, i);
+		value = status ? 1 : 0;			/* 1 for presence */
+
+		SHA1_INPUT(&ctx, value);
+
+		if (i == 0) {
+			last_slot = i;
+			last_status = status;
+			continue;
+		}
+
+		if (!last_status == !status)
+			continue;
+
+	final:
+		if (full) {
+			if (i - 1 != last_slot)
+				g_debug("%d .. %d: %s", last_slot, i - 1,
+					last_status ? "PRESENT" : "nothing");
+			else
+				g_debug("%d: %s", last_slot,
+					last_status ? "PRESENT" : "nothing");
+
+			last_slot = i;
+			last_status = status;
+		}
+	}
+
+	SHA1_result(&ctx, &digest);
+
+	/*
+	 * Reduce SHA1 to a single uint32.
+	 */
+
+	result = sha1_hash(&digest);
+
+	g_debug("------ End Routing Table \"%s\" "
+		"(gen=%d, SHA1=%s, token=0x%x)",
+		rt->name, rt->generation, sha1_base32(&digest), result);
+
+	return result;
+}
+
+/***
+ *** Query routing management.
+ ***/
+
+/**
+ * Allocate a query hash container for at most `size' entries.
+ */
+query_hashvec_t *
+qhvec_alloc(uint size)
+{
+	query_hashvec_t *qhvec;
+
+	size = MIN(QRP_HVEC_MAX, size);
+
+	WALLOC(qhvec);
+	qhvec->count = 0;
+	qhvec->size = size;
+	qhvec->has_urn = FALSE;
+	WALLOC_ARRAY(qhvec->vec, size);
+
+	return qhvec;
+}
+
+/**
+ * Dispose of the query hash container.
+ */
+void
+qhvec_free(query_hashvec_t *qhvec)
+{
+	WFREE_ARRAY(qhvec->vec, qhvec->size);
+	WFREE(qhvec);
+}
+
+/**
+ * Empty query hash container.
+ */
+void
+qhvec_reset(query_hashvec_t *qhvec)
+{
+	qhvec->count = 0;
+	qhvec->has_urn = FALSE;
+	qhvec->whats_new = FALSE;
+}
+
+/**
+ * Clone query hash vector.
+ */
+query_hashvec_t *
+qhvec_clone(const query_hashvec_t *qsrc)
+{
+	query_hashvec_t *qhvec;
+	int vecsize;
+
+	g_assert(qsrc != NULL);
+
+	WALLOC0(qhvec);
+	qhvec->count = qsrc->count;
+	qhvec->size = qsrc->size;
+	qhvec->has_urn = qsrc->has_urn;
+	vecsize = qsrc->size * sizeof qhvec->vec[0];
+	qhvec->vec = walloc(vecsize);
+
+	memcpy(qhvec->vec, qsrc->vec, vecsize);
+
+	return qhvec;
+}
+
+/**
+ * Add the `word' coming from `src' into the query hash vector.
+ * If the vector is already full, do nothing.
+ */
+void
+qhvec_add(query_hashvec_t *qhvec, const char *word, enum query_hsrc src)
+{
+	struct query_hash *qh = NULL;
+
+	if G_UNLIKELY(qhvec->count >= qhvec->size)
+		return;
+
+	/*
+	 * To make qrp_can_route() efficient, we put first the items that are
+	 * optional (URNs) and last items that are mandatory (a word not matching
+	 * means we don't have to continue since we AND words).  If we did not put
+	 * optional items first, we'd still have to loop through all the words
+	 * until we find an URN.  Also, a matching URN means we can route the
+	 * the query immediately.
+	 */
+
+	switch (src) {
+	case QUERY_H_URN:			/* Prepend */
+		qhvec->has_urn = TRUE;
+		if (qhvec->count)
+			memmove(&qhvec->vec[1], &qhvec->vec[0],
+				qhvec->count * sizeof(qhvec->vec[0]));
+		qh = &qhvec->vec[0];
+		break;
+	case QUERY_H_WORD:			/* Append */
+		qh = &qhvec->vec[qhvec->count];
+		break;
+	}
+
+	g_assert(qh != NULL);
+
+	qhvec->count++;
+	qh->hashcode = qrp_hashcode(word);
+	qh->source = src;
+}
+
+/**
+ * Check whether we can route a query identified by its hash vector
+ * to a node given its routing table.
+ *
+ * @param qhv			the query hit vector containing QRP hashes and types
+ * @param rt			the routing table of the target node
+ *
+ * @note this routine expects the query hash vector to be sorted with
+ * URNs coming first and words later.  This is a default
+ * implementation.  The macros CAN_ROUTE and CAN_ROUTE_URN expand into
+ * routines that perform the same tests with pre-computed shifts.
+ */
+static bool
+qrp_can_route_default(const query_hashvec_t *qhv, const struct routing_table *rt)
+{
+	const struct query_hash *qh;
+	const uint8 *arena;
+	uint i, shift;
+	uint hit = 0, word = 0;
+
+	/*
+	 * This routine is a hot spot when running as an ultra node.
+	 * Prefetch constant items in local variables.
+	 */
+
+	arena = rt->arena;
+	shift = 32 - rt->bits;
+	qh = qhv->vec;
+
+	for (i = 0; i < qhv->count; i++) {
+		uint32 idx = qh[i].hashcode >> shift;
+
+		/* Tight loop -- g_assert(idx < (uint32) rt->slots); */
+
+		/*
+		 * If there is an entry in the table and the source is an URN,
+		 * we have to forward the query, as those are OR-ed.
+		 * Otherwise, 2/3rd of the keywords must be present, if there
+		 * are at least 3 words.
+		 *
+		 * When facing a SHA1 query, we require that at least one of the
+		 * URN matches or we don't forward the query.
+		 */
+
+		if (RT_SLOT_READ(arena, idx)) {
+			if (qh[i].source == QUERY_H_URN)	/* URN present */
+				return TRUE;					/* Will forward */
+			word++;
+			hit++;
+		} else {
+			if (qh[i].source == QUERY_H_WORD) {	/* Word NOT present */
+				/* We know no URN matched already because qhv is sorted */
+				word++;
+			}
+		}
+	}
 
 	/*
-	 * If we got notified of changes, relaunch the computation of the
-	 * merge_table.
+	 * If we had no URN, verify that 2/3rd of the words matched, or that
+	 * all matched if less than 3.
+	 * If we had some URNs, none matched so don't forward if there was no word.
 	 */
 
-	if (qrt_leaf_change_notified) {
-		if (mrg_compute(qrp_merge_routing_table))
-			qrt_leaf_change_notified = FALSE;
-	}
+	if (qhv->has_urn && 0 == word)
+		return FALSE;
 
-	return TRUE;		/* Keep calling */
+	return word < 3 ? hit == word : 3 * hit / word >= 2;
 }
 
 /**
- * Initialize QRP.
+ * Check whether we can route a query identified by its hash vector
+ * to a node.
  */
-void G_COLD
-qrp_init(void)
+bool
+qrp_node_can_route(const gnutella_node_t *n, const query_hashvec_t *qhv)
 {
-	/*
-	 * Having a working hash function is critical.
-	 * Check that the implementation is not broken by accident.
-	 */
-
-	g_assert(qrp_hash("ebcklmenq", 13) == 3527);
-	g_assert(qrp_hash("ndflalem", 16) == 37658);
-	g_assert(qrp_hash("7777a88a8a8a8", 10) == 342);
+	const struct routing_table *rt = n->recv_query_table;
 
-	test_hash();
+	if G_UNLIKELY(!NODE_IS_WRITABLE(n))
+		return FALSE;
 
 	/*
-	 * Install the periodic monitoring callback.
+	 * If we did not get any table for an UP, act as if it did not
+	 * support QRP-routing and send it everything.
 	 */
 
-	qrp_monitor_ev = cq_periodic_main_add(
-		LEAF_MONITOR_PERIOD, qrp_monitor, NULL);
-
-	/*
-	 * Install an empty local table untill we compute our shared library.
-	 */
+	if G_UNLIKELY(rt == NULL)
+		return NODE_IS_LEAF(n) ? FALSE : TRUE;
 
-	local_table = qrt_ref(qrt_empty_table("Empty local table"));
+	return qhv->has_urn ?
+	   rt->can_route_urn(qhv, rt) :
+	   rt->can_route(qhv, rt);
 }
 
 /**
- * Called at servent shutdown to reclaim all the memory.
+ * Amount of distinct table sizes for which a routing batch can cache the
+ * pre-computed slot locations of the query.  Leaves mostly use the same few
+ * table sizes, so we do not need to provision for all of them.
  */
-void G_COLD
-qrp_close(void)
-{
-	qrp_cancel_computation();
-	cq_periodic_remove(&qrp_monitor_ev);
-
-	if (routing_table)
-		qrt_unref(routing_table);
-
-	qrt_patches_clear();
+#define QRP_BATCH_SIZES		4
 
-	if (local_table)
-		qrt_unref(local_table);
+/**
+ * Location of a query hash within a compacted routing table of given size.
+ */
+struct qrp_slot {
+	uint32 offset;			/**< Byte offset within the arena */
+	uint8 mask;				/**< Mask to apply to that byte */
+	uint8 urn;				/**< Whether hash comes from an URN */
+};
 
-	if (merged_table)
-		qrt_unref(merged_table);
+/**
+ * A routing batch, used to check one query hash vector against the routing
+ * tables of all our neighbours.
+ *
+ * The slot locations of each query hash are computed once per table size
+ * and then shared by all the tables of that size, so that checking a table
+ * only requires the arena lookups.
+ */
+struct qrp_batch {
+	const query_hashvec_t *qhv;			/**< The query being routed */
+	uint8 index[MAX_TABLE_BITS + 1];	/**< Table bits -> 1 + index in `slots' */
+	uint8 used;							/**< Amount of `slots' rows used */
+	struct qrp_slot slots[QRP_BATCH_SIZES][QRP_HVEC_MAX];
+};
 
-	HFREE_NULL(buffer.arena);
+/**
+ * Initialize routing batch for given query hash vector.
+ */
+static void
+qrp_batch_init(struct qrp_batch *qb, const query_hashvec_t *qhv)
+{
+	qb->qhv = qhv;
+	qb->used = 0;
+	ZERO(&qb->index);
 }
 
 /**
- * Used by qrt_dump().
+ * Get the slot locations of the query for a table using ``bits'' bits,
+ * computing them on first usage.
  *
- * @returns whether a slot in the table is present or not.
+ * @return the slot vector, NULL if we cannot cache it.
  */
-static bool
-qrt_dump_is_slot_present(struct routing_table *rt, int slot)
+static const struct qrp_slot *
+qrp_batch_slots(struct qrp_batch *qb, int bits)
 {
-	g_assert(slot < rt->slots);
+	const struct query_hash *qh = qb->qhv->vec;
+	struct qrp_slot *s;
+	uint i, shift;
 
-	if (!rt->compacted)
-		return rt->arena[slot] < rt->infinity;
+	if G_UNLIKELY(bits < 1 || bits > MAX_TABLE_BITS)
+		return NULL;
 
-	return RT_SLOT_READ(rt->arena, slot);
+	if G_LIKELY(0 != qb->index[bits])
+		return qb->slots[qb->index[bits] - 1];
+
+	if G_UNLIKELY(qb->used >= QRP_BATCH_SIZES)
+		return NULL;
+
+	s = qb->slots[qb->used++];
+	qb->index[bits] = qb->used;
+	shift = 32 - bits;
+
+	for (i = 0; i < qb->qhv->count; i++) {
+		uint32 idx = qh[i].hashcode >> shift;
+
+		s[i].offset = idx >> 3;
+		s[i].mask = 0x80U >> (idx & 0x7);		/* Same as RT_SLOT_READ() */
+		s[i].urn = booleanize(QUERY_H_URN == qh[i].source);
+	}
+
+	return s;
 }
 
 /**
- * Dump QRT to specified file.
- * If `full' is true, we dump the whole table.
+ * Check whether we can route the query held in the routing batch to a node
+ * given its routing table.
  *
- * @returns a unique 32-bit checksum.
+ * This implements the same logic as qrp_can_route_default() but uses the
+ * slot locations pre-computed for the table size, and requests all the
+ * arena bytes we are going to probe before testing them, so that the
+ * cache misses, which dominate the cost of the lookup, can overlap.
+ *
+ * @param qb		the routing batch
+ * @param rt		the routing table of the target node
+ *
+ * @return TRUE if the query can be routed to the node.
  */
-static uint32
-qrt_dump(struct routing_table *rt, bool full)
+static bool G_HOT
+qrp_batch_can_route(struct qrp_batch *qb, const struct routing_table *rt)
 {
-	struct sha1 digest;
-	SHA1_context ctx;
-	bool last_status = FALSE;
-	int last_slot = 0;
-	uint32 result;
-	int i;
-
-	g_debug("------ Query Routing Table \"%s\" "
-		"(gen=%d, slots=%d, %scompacted)",
-		rt->name, rt->generation, rt->slots, rt->compacted ? "" : "not ");
-
-	SHA1_reset(&ctx);
-
-	for (i = 0; i <= rt->slots; i++) {
-		bool status = FALSE;
-		uint8 value;
-
-		if (i == rt->slots)
-			goto final;
+	const query_hashvec_t *qhv = qb->qhv;
+	const struct qrp_slot *s;
+	const uint8 *arena;
+	uint i, count;
+	uint hit = 0, word = 0;
 
-		status = qrt_dump_is_slot_present(rt, i);
-		value = status ? 1 : 0;			/* 1 for presence */
+	if G_UNLIKELY(rt->is_empty)
+		return FALSE;
 
-		SHA1_INPUT(&ctx, value);
+	s = qrp_batch_slots(qb, rt->bits);
 
-		if (i == 0) {
-			last_slot = i;
-			last_status = status;
-			continue;
-		}
+	if G_UNLIKELY(NULL == s) {
+		return qhv->has_urn ?
+			rt->can_route_urn(qhv, rt) : rt->can_route(qhv, rt);
+	}
 
-		if (!last_status == !status)
-			continue;
+	arena = rt->arena;
+	count = qhv->count;
 
-	final:
-		if (full) {
-			if (i - 1 != last_slot)
-				g_debug("%d .. %d: %s", last_slot, i - 1,
-					last_status ? "PRESENT" : "nothing");
-			else
-				g_debug("%d: %s", last_slot,
-					last_status ? "PRESENT" : "nothing");
+	for (i = 0; i < count; i++) {
+		G_PREFETCH_R(&arena[s[i].offset]);
+	}
 
-			last_slot = i;
-			last_status = status;
+	for (i = 0; i < count; i++) {
+		if (arena[s[i].offset] & s[i].mask) {
+			if (s[i].urn)			/* URN present */
+				return TRUE;		/* Will forward */
+			word++;
+			hit++;
+		} else if (!s[i].urn) {		/* Word NOT present */
+			word++;
 		}
 	}
 
-	SHA1_result(&ctx, &digest);
-
 	/*
-	 * Reduce SHA1 to a single uint32.
+	 * Same final decision as in qrp_can_route_default().
 	 */
 
-	result = sha1_hash(&digest);
-
-	g_debug("------ End Routing Table \"%s\" "
-		"(gen=%d, SHA1=%s, token=0x%x)",
-		rt->name, rt->generation, sha1_base32(&digest), result);
+	if (qhv->has_urn && 0 == word)
+		return FALSE;
 
-	return result;
+	return word < 3 ? hit == word : 3 * hit / word >= 2;
 }
 
 /***
- *** Query routing management.
+ *** Inverted index of the leaf routing tables.
  ***/
 
+#define QRP_INDEX_BITS		16		/**< 64 Kslots, the LimeWire table size */
+#define QRP_INDEX_SLOTS		(1 << QRP_INDEX_BITS)
+
 /**
- * Allocate a query hash container for at most `size' entries.
+ * An indexed leaf.
  */
-query_hashvec_t *
-qhvec_alloc(uint size)
+struct qrp_index_leaf {
+	gnutella_node_t *node;			/**< The leaf node, NULL if column free */
+	struct routing_table *rt;		/**< Its indexed routing table */
+};
+
+/**
+ * Inverted index of the routing tables of our leaves, maintained when we
+ * run as an ultrapeer and the "qrp_leaf_index" property is set.
+ *
+ * Each indexed leaf table is given a column, and for each slot of a virtual
+ * table of QRP_INDEX_SLOTS slots, we keep a row holding the bitset of the
+ * columns whose table has that slot set.  Larger tables are folded into the
+ * index, which can produce false positives but never false negatives, so
+ * the index only selects candidate leaves, whose own table is then checked.
+ *
+ * Rows are updated for a single column each time a leaf finishes patching
+ * its table, and the column is released when the table is freed.
+ */
+struct qrp_index {
+	bit_array_t *rows;				/**< QRP_INDEX_SLOTS rows of `words' */
+	bit_array_t *scratch;			/**< Scratch space of 4 * `words' */
+	struct qrp_index_leaf *leaf;	/**< Indexed leaves, by column */
+	size_t words;					/**< Amount of words in each row */
+	size_t count;					/**< Amount of columns used */
+};
+
+static struct qrp_index *qrp_index;
+
+#define QRP_INDEX_ROW(qi, s)	(&(qi)->rows[(size_t) (s) * (qi)->words])
+#define QRP_INDEX_COLUMNS(qi)	((qi)->words * BIT_ARRAY_BITSIZE)
+
+/**
+ * Allocate the rows and the scratch space for ``words'' words per row.
+ */
+static void
+qrp_index_alloc(struct qrp_index *qi, size_t words)
 {
-	query_hashvec_t *qhvec;
+	qi->words = words;
+	HALLOC0_ARRAY(qi->rows, QRP_INDEX_SLOTS * words);
+	HALLOC_ARRAY(qi->scratch, 4 * words);
+	HREALLOC_ARRAY(qi->leaf, QRP_INDEX_COLUMNS(qi));
+}
 
-	size = MIN(QRP_HVEC_MAX, size);
+/**
+ * Double the amount of columns in the index.
+ */
+static void
+qrp_index_grow(struct qrp_index *qi)
+{
+	bit_array_t *old_rows = qi->rows;
+	size_t old_words = qi->words;
+	size_t old_columns = QRP_INDEX_COLUMNS(qi);
+	uint i;
 
-	WALLOC(qhvec);
-	qhvec->count = 0;
-	qhvec->size = size;
-	qhvec->has_urn = FALSE;
-	WALLOC_ARRAY(qhvec->vec, size);
+	HFREE_NULL(qi->scratch);
+	qrp_index_alloc(qi, old_words * 2);
+
+	for (i = 0; i < QRP_INDEX_SLOTS; i++) {
+		memcpy(QRP_INDEX_ROW(qi, i), &old_rows[(size_t) i * old_words],
+			old_words * sizeof old_rows[0]);
+	}
+
+	memset(&qi->leaf[old_columns], 0,
+		(QRP_INDEX_COLUMNS(qi) - old_columns) * sizeof qi->leaf[0]);
+
+	hfree(old_rows);
+
+	if (qrp_debugging(0)) {
+		g_debug("QRP leaf index grown to %zu columns (%s)",
+			QRP_INDEX_COLUMNS(qi),
+			compact_size(QRP_INDEX_SLOTS * qi->words * sizeof qi->rows[0],
+				FALSE));
+	}
+}
+
+/**
+ * Clear column in all the rows of the index.
+ */
+static void
+qrp_index_clear_column(struct qrp_index *qi, size_t col)
+{
+	uint i;
+
+	for (i = 0; i < QRP_INDEX_SLOTS; i++) {
+		bit_array_clear(QRP_INDEX_ROW(qi, i), col);
+	}
+}
+
+/**
+ * Set column in the rows of the index corresponding to the slots set in
+ * the routing table.
+ */
+static void
+qrp_index_fill_column(struct qrp_index *qi, size_t col,
+	const struct routing_table *rt)
+{
+	uint i;
+
+	if (rt->is_empty)
+		return;
+
+	/*
+	 * Tables too small to have a compacted arena cannot be indexed, so
+	 * flag the leaf as a candidate for all queries: its table will still
+	 * be checked before routing.
+	 */
+
+	if G_UNLIKELY(rt->bits < 3) {
+		for (i = 0; i < QRP_INDEX_SLOTS; i++) {
+			bit_array_set(QRP_INDEX_ROW(qi, i), col);
+		}
+		return;
+	}
+
+	if (rt->bits >= QRP_INDEX_BITS) {
+		uint shift = rt->bits - QRP_INDEX_BITS;
+
+		for (i = 0; i < (uint) rt->slots; i++) {
+			if (0 == (i & 0x7) && 0 == rt->arena[i >> 3]) {
+				i += 7;			/* Skip empty byte */
+				continue;
+			}
+			if (RT_SLOT_READ(rt->arena, i))
+				bit_array_set(QRP_INDEX_ROW(qi, i >> shift), col);
+		}
+	} else {
+		uint shift = QRP_INDEX_BITS - rt->bits;
 
-	return qhvec;
+		for (i = 0; i < (uint) rt->slots; i++) {
+			uint j;
+
+			if (!RT_SLOT_READ(rt->arena, i))
+				continue;
+
+			for (j = i << shift; j < (i + 1) << shift; j++) {
+				bit_array_set(QRP_INDEX_ROW(qi, j), col);
+			}
+		}
+	}
 }
 
 /**
- * Dispose of the query hash container.
+ * Index the routing table of a leaf node, after it was fully received or
+ * patched.
  */
-void
-qhvec_free(query_hashvec_t *qhvec)
+static void
+qrp_index_update(gnutella_node_t *n, struct routing_table *rt)
 {
-	WFREE_ARRAY(qhvec->vec, qhvec->size);
-	WFREE(qhvec);
+	struct qrp_index *qi = qrp_index;
+	size_t col;
+
+	qrt_check(rt);
+
+	if (NULL == qi)
+		return;
+
+	if (0 != rt->leaf_column) {
+		col = rt->leaf_column - 1;
+		g_assert(qi->leaf[col].rt == rt);
+		qrp_index_clear_column(qi, col);
+	} else {
+		if (qi->count == QRP_INDEX_COLUMNS(qi))
+			qrp_index_grow(qi);
+
+		for (col = 0; col < QRP_INDEX_COLUMNS(qi); col++) {
+			if (NULL == qi->leaf[col].node)
+				break;
+		}
+
+		g_assert(col < QRP_INDEX_COLUMNS(qi));
+
+		qi->leaf[col].node = n;
+		qi->leaf[col].rt = rt;
+		qi->count++;
+		rt->leaf_column = col + 1;
+	}
+
+	qrp_index_fill_column(qi, col, rt);
 }
 
 /**
- * Empty query hash container.
+ * Remove routing table from the leaf index, if it was indexed.
+ *
+ * This must be called when the node drops its table: pending application
+ * states may hold references on the table and keep it alive for a while,
+ * but the node is no longer reachable through it.
  */
 void
-qhvec_reset(query_hashvec_t *qhvec)
+qrp_index_remove(struct routing_table *rt)
 {
-	qhvec->count = 0;
-	qhvec->has_urn = FALSE;
-	qhvec->whats_new = FALSE;
+	struct qrp_index *qi = qrp_index;
+	size_t col;
+
+	if (0 == rt->leaf_column)
+		return;
+
+	g_assert(qi != NULL);
+
+	col = rt->leaf_column - 1;
+	g_assert(qi->leaf[col].rt == rt);
+
+	qrp_index_clear_column(qi, col);
+	qi->leaf[col].node = NULL;
+	qi->leaf[col].rt = NULL;
+	qi->count--;
+	rt->leaf_column = 0;
 }
 
 /**
- * Clone query hash vector.
+ * Create the leaf index, indexing the routing tables of all our leaves.
  */
-query_hashvec_t *
-qhvec_clone(const query_hashvec_t *qsrc)
+static void
+qrp_index_create(void)
 {
-	query_hashvec_t *qhvec;
-	int vecsize;
+	struct qrp_index *qi;
+	const pslist_t *sl;
 
-	g_assert(qsrc != NULL);
+	g_assert(NULL == qrp_index);
 
-	WALLOC0(qhvec);
-	qhvec->count = qsrc->count;
-	qhvec->size = qsrc->size;
-	qhvec->has_urn = qsrc->has_urn;
-	vecsize = qsrc->size * sizeof qhvec->vec[0];
-	qhvec->vec = walloc(vecsize);
+	WALLOC0(qi);
+	qrp_index_alloc(qi, 1);
+	memset(qi->leaf, 0, QRP_INDEX_COLUMNS(qi) * sizeof qi->leaf[0]);
+	qrp_index = qi;
 
-	memcpy(qhvec->vec, qsrc->vec, vecsize);
+	PSLIST_FOREACH(node_all_gnet_nodes(), sl) {
+		gnutella_node_t *dn = sl->data;
 
-	return qhvec;
+		if (NODE_IS_LEAF(dn) && dn->recv_query_table != NULL)
+			qrp_index_update(dn, dn->recv_query_table);
+	}
+
+	if (qrp_debugging(0))
+		g_debug("QRP created leaf index with %zu leaves", qi->count);
 }
 
 /**
- * Add the `word' coming from `src' into the query hash vector.
- * If the vector is already full, do nothing.
+ * Dispose of the leaf index, if any.
  */
-void
-qhvec_add(query_hashvec_t *qhvec, const char *word, enum query_hsrc src)
+static void
+qrp_index_free(void)
 {
-	struct query_hash *qh = NULL;
+	struct qrp_index *qi = qrp_index;
+	size_t col;
 
-	if G_UNLIKELY(qhvec->count >= qhvec->size)
+	if (NULL == qi)
 		return;
 
-	/*
-	 * To make qrp_can_route() efficient, we put first the items that are
-	 * optional (URNs) and last items that are mandatory (a word not matching
-	 * means we don't have to continue since we AND words).  If we did not put
-	 * optional items first, we'd still have to loop through all the words
-	 * until we find an URN.  Also, a matching URN means we can route the
-	 * the query immediately.
-	 */
-
-	switch (src) {
-	case QUERY_H_URN:			/* Prepend */
-		qhvec->has_urn = TRUE;
-		if (qhvec->count)
-			memmove(&qhvec->vec[1], &qhvec->vec[0],
-				qhvec->count * sizeof(qhvec->vec[0]));
-		qh = &qhvec->vec[0];
-		break;
-	case QUERY_H_WORD:			/* Append */
-		qh = &qhvec->vec[qhvec->count];
-		break;
+	for (col = 0; col < QRP_INDEX_COLUMNS(qi); col++) {
+		if (qi->leaf[col].rt != NULL)
+			qi->leaf[col].rt->leaf_column = 0;
 	}
 
-	g_assert(qh != NULL);
+	HFREE_NULL(qi->rows);
+	HFREE_NULL(qi->scratch);
+	HFREE_NULL(qi->leaf);
+	WFREE(qi);
+	qrp_index = NULL;
+}
 
-	qhvec->count++;
-	qh->hashcode = qrp_hashcode(word);
-	qh->source = src;
+/**
+ * Make sure the leaf index exists only when it is configured and we are
+ * running as an ultrapeer.
+ *
+ * @return the leaf index, NULL if it is not in use.
+ */
+static struct qrp_index *
+qrp_index_sync(void)
+{
+	bool wanted = GNET_PROPERTY(qrp_leaf_index) && settings_is_ultra();
+
+	if G_UNLIKELY(wanted != (qrp_index != NULL)) {
+		if (wanted)
+			qrp_index_create();
+		else
+			qrp_index_free();
+	}
+
+	return qrp_index;
 }
 
 /**
- * Check whether we can route a query identified by its hash vector
- * to a node given its routing table.
+ * Compute the candidate leaves for a query, those for which the index
+ * shows the query could be routed.
  *
- * @param qhv			the query hit vector containing QRP hashes and types
- * @param rt			the routing table of the target node
+ * @param qi		the leaf index
+ * @param qhv		the query hash vector
  *
- * @note this routine expects the query hash vector to be sorted with
- * URNs coming first and words later.  This is a default
- * implementation.  The macros CAN_ROUTE and CAN_ROUTE_URN expand into
- * routines that perform the same tests with pre-computed shifts.
+ * @return the bitset of candidate columns, in the index scratch space.
  */
-static bool
-qrp_can_route_default(const query_hashvec_t *qhv, const struct routing_table *rt)
+static const bit_array_t *
+qrp_index_candidates(struct qrp_index *qi, const query_hashvec_t *qhv)
 {
-	const struct query_hash *qh;
-	const uint8 *arena;
-	uint i, shift;
-	uint hit = 0, word = 0;
+	bit_array_t *cand = &qi->scratch[0];
+	bit_array_t *all  = &qi->scratch[qi->words];
+	bit_array_t *ones = &qi->scratch[2 * qi->words];
+	bit_array_t *twos = &qi->scratch[3 * qi->words];
+	uint i, words = 0;
+	size_t w;
+
+	memset(cand, 0, qi->words * sizeof cand[0]);
+	memset(all, 0xff, qi->words * sizeof all[0]);
+	memset(ones, 0, qi->words * sizeof ones[0]);
+	memset(twos, 0, qi->words * sizeof twos[0]);
 
 	/*
-	 * This routine is a hot spot when running as an ultra node.
-	 * Prefetch constant items in local variables.
+	 * URNs are OR-ed, and we keep track of the leaves where all the words
+	 * are present, and of those where at least 2 words are: the latter are
+	 * a superset of the leaves where 2/3rd of the words are present when
+	 * there are at least 3 words.
 	 */
 
-	arena = rt->arena;
-	shift = 32 - rt->bits;
-	qh = qhv->vec;
-
 	for (i = 0; i < qhv->count; i++) {
-		uint32 idx = qh[i].hashcode >> shift;
-
-		/* Tight loop -- g_assert(idx < (uint32) rt->slots); */
-
-		/*
-		 * If there is an entry in the table and the source is an URN,
-		 * we have to forward the query, as those are OR-ed.
-		 * Otherwise, 2/3rd of the keywords must be present, if there
-		 * are at least 3 words.
-		 *
-		 * When facing a SHA1 query, we require that at least one of the
-		 * URN matches or we don't forward the query.
-		 */
+		const struct query_hash *qh = &qhv->vec[i];
+		const bit_array_t *row =
+			QRP_INDEX_ROW(qi, qh->hashcode >> (32 - QRP_INDEX_BITS));
 
-		if (RT_SLOT_READ(arena, idx)) {
-			if (qh[i].source == QUERY_H_URN)	/* URN present */
-				return TRUE;					/* Will forward */
-			word++;
-			hit++;
+		if (QUERY_H_URN == qh->source) {
+			for (w = 0; w < qi->words; w++)
+				cand[w] |= row[w];
 		} else {
-			if (qh[i].source == QUERY_H_WORD) {	/* Word NOT present */
-				/* We know no URN matched already because qhv is sorted */
-				word++;
+			words++;
+			for (w = 0; w < qi->words; w++) {
+				all[w] &= row[w];
+				twos[w] |= ones[w] & row[w];
+				ones[w] |= row[w];
 			}
 		}
 	}
 
-	/*
-	 * If we had no URN, verify that 2/3rd of the words matched, or that
-	 * all matched if less than 3.
-	 * If we had some URNs, none matched so don't forward if there was no word.
-	 */
+	if (0 != words) {
+		const bit_array_t *matching = words < 3 ? all : twos;
 
-	if (qhv->has_urn && 0 == word)
-		return FALSE;
+		for (w = 0; w < qi->words; w++)
+			cand[w] |= matching[w];
+	}
 
-	return word < 3 ? hit == word : 3 * hit / word >= 2;
+	return cand;
 }
 
 /**
- * Check whether we can route a query identified by its hash vector
- * to a node.
+ * Check whether a leaf node is a candidate for query routing, i.e. whether
+ * it sent us its routing table and is not a rogue node.
+ *
+ * @param dn			the leaf node
+ * @param rt			the routing table of the leaf, NULL if none yet
+ *
+ * @return TRUE if the leaf QRT must be looked at.
  */
-bool
-qrp_node_can_route(const gnutella_node_t *n, const query_hashvec_t *qhv)
+static bool
+qrt_leaf_has_table(const gnutella_node_t *dn, const struct routing_table *rt)
 {
-	const struct routing_table *rt = n->recv_query_table;
+	if (rt == NULL)				/* No QRT yet */
+		return FALSE;			/* Don't send anything */
+
+	if (NODE_HAS_BAD_GUID(dn)) {
+		if (!NODE_USES_DUP_GUID(dn))
+			return FALSE;		/* Rogue node, probably */
+		if (NODE_IS_FIREWALLED(dn))
+			return FALSE;		/* Will not be able to PUSH to it */
+	}
 
-	if G_UNLIKELY(!NODE_IS_WRITABLE(n))
+	return TRUE;
+}
+
+/**
+ * Check whether a query can be routed to a leaf node given its routing table,
+ * applying the restrictions we put on leaves when they cannot keep up.
+ *
+ * The leaf must have been vetted by qrt_leaf_has_table() beforehand.
+ *
+ * @param dn			the leaf node
+ * @param rt			the routing table of the leaf
+ * @param qb			the routing batch for the query
+ * @param sha1_query	whether query bears an URN
+ *
+ * @return TRUE if the query can be sent to the leaf.
+ */
+static bool
+qrt_leaf_can_route(gnutella_node_t *dn, const struct routing_table *rt,
+	struct qrp_batch *qb, bool sha1_query)
+{
+	if (!qrp_batch_can_route(qb, rt))
 		return FALSE;
 
 	/*
-	 * If we did not get any table for an UP, act as if it did not
-	 * support QRP-routing and send it everything.
+	 * If table for the leaf node is so full that we can't let all the
+	 * queries pass through, further restrict sending even though QRT says
+	 * we can let it go.
+	 *
+	 * We only do that when there are pending messages in the node's queue,
+	 * meaning we can't transmit all our packets fast enough.
 	 */
 
-	if G_UNLIKELY(rt == NULL)
-		return NODE_IS_LEAF(n) ? FALSE : TRUE;
+	if (rt->pass_throw < 100 && NODE_MQUEUE_COUNT(dn) != 0) {
+		if ((int) random_value(99) >= rt->pass_throw)
+			return FALSE;
+	}
 
-	return qhv->has_urn ?
-	   rt->can_route_urn(qhv, rt) :
-	   rt->can_route(qhv, rt);
+	/*
+	 * If leaf is flow-controlled, it has trouble reading or we don't
+	 * have enough bandwidth to send everything.  If we were not skipping
+	 * it, the flow-control would cause the message queue to prioritize
+	 * the query in the queue, removing queries coming far away in favor
+	 * of closer ones (hops-wise).  But if we skip it alltogether, we loose
+	 * some potential for a match.
+	 *
+	 * Therefore, let only 50% of the queries pass to flow-controlled nodes.
+	 *
+	 * We don't let SHA1 queries through, as the chances they will match
+	 * are very slim: not all servents include the SHA1 in their QRP, and
+	 * there can be many hashing conflicts, so the fact that it matched
+	 * an entry in the QRP table does not imply there will be a match
+	 * in the leaf node.
+	 *		--RAM, 31/12/2003
+	 */
+
+	if (NODE_IN_TX_FLOW_CONTROL(dn)) {
+		if (sha1_query)
+			return FALSE;
+		if (random_value(255) >= 128)
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+/**
+ * Severely limit traffic to transient nodes since we're going to shut them
+ * down soon anyway.  Send them something randomly to limit easy spotting
+ * and account for the fact that the query could be usefully relayed still
+ * (albeit it better have OOB delivery).  The more spam they return, the
+ * less we send them.
+ *		--RAM, 2011-11-24.
+ *
+ * @return TRUE if we must not send the query to the node.
+ */
+static inline bool
+qrt_transient_skip(const gnutella_node_t *dn)
+{
+	if (NODE_IS_TRANSIENT(dn)) {
+		unsigned ratio;
+		ratio = uint_saturate_mult(dn->n_spam, 100) / (dn->received + 1);
+		if (random_value(99) < ratio)
+			return TRUE;
+	}
+
+	return FALSE;
 }
 
 /**
@@ -5415,6 +6730,9 @@ qrp_node_can_route(const gnutella_node_t *n, const query_hashvec_t *qhv)
  * that needs to be forwarded to neighbouring ultra-nodes, but which leaves
  * already received.
  *
+ * When the leaf index is in use, leaves are not probed one by one but are
+ * taken from the candidates the index gives for the query.
+ *
  * @attention
  * NB: it is allowed to call this with TTL=0, in which case we won't
  * consider UPs for forwarding.  If TTL=1, we forward to all normal nodes
@@ -5431,6 +6749,8 @@ qrt_build_query_target(
 {
 	pslist_t *nodes = NULL;		/* Targets for the query */
 	const pslist_t *sl;
+	struct qrp_batch batch;		/* Slot locations shared by all tables */
+	struct qrp_index *qi;		/* Leaf index, NULL if not used */
 	bool sha1_query;
 	bool whats_new;
 
@@ -5456,6 +6776,16 @@ qrt_build_query_target(
 	}
 
 	sha1_query = qhvec_has_urn(qhvec);
+	qrp_batch_init(&batch, qhvec);
+
+	/*
+	 * "What's New?" queries are broadcasted to leaves regardless of their
+	 * QRT, so the leaf index is of no help for them.
+	 */
+
+	qi = qrp_index_sync();
+	if (!leaves || whats_new)
+		qi = NULL;
 
 	/*
 	 * We need to special case processing of queries with TTL=1 so that they
@@ -5467,7 +6797,6 @@ qrt_build_query_target(
 	PSLIST_FOREACH(node_all_gnet_nodes(), sl) {
 		gnutella_node_t *dn = sl->data;
 		struct routing_table *rt = dn->recv_query_table;
-		bool is_leaf;
 
 		/*
 		 * Avoid G_UNLIKELY() hints in the loop.  Either they are wrong hints
@@ -5490,9 +6819,7 @@ qrt_build_query_target(
 		 * a last-hop QRP capable ultra node).
 		 */
 
-		is_leaf = NODE_IS_LEAF(dn);
-
-		if (is_leaf) {
+		if (NODE_IS_LEAF(dn)) {
 			/* Leaf node */
 			if (!leaves) {
 				continue;				/* Routing duplicate query, skip! */
@@ -5505,14 +6832,21 @@ qrt_build_query_target(
 					continue;			/* Leaf won't understand it, skip! */
 				}
 			}
-			if (rt == NULL)				/* No QRT yet */
-				continue;				/* Don't send anything */
-			if (NODE_HAS_BAD_GUID(dn)) {
-				if (!NODE_USES_DUP_GUID(dn))
-					continue;			/* Rogue node, probably */
-				if (NODE_IS_FIREWALLED(dn))
-					continue;			/* Will not be able to PUSH to it */
-			}
+			if (!qrt_leaf_has_table(dn, rt))
+				continue;
+
+			/*
+			 * Routing attempts are accounted for here even when the index
+			 * selects the leaves, so that the statistics do not depend on
+			 * whether the index is used.
+			 */
+
+			node_inc_qrp_query(dn);		/* We have a QRT, mark we try routing */
+
+			if (qi != NULL)				/* Leaves selected via the index */
+				continue;
+			if (!qrt_leaf_can_route(dn, rt, &batch, sha1_query))
+				continue;
 		} else {
 			/* Ultra node */
 			if (0 == ttl)				/* Exclude routing to other UPs */
@@ -5528,54 +6862,10 @@ qrt_build_query_target(
 			}
 			if (rt == NULL)				/* UP has not sent us its table */
 				goto can_send;			/* Forward everything then */
-		}
-
-		node_inc_qrp_query(dn);			/* We have a QRT, mark we try routing */
-
-		if (!(qhvec->has_urn ?
-			  rt->can_route_urn(qhvec, rt) :
-			  rt->can_route(qhvec, rt)))
-			continue;
-
-		if (!is_leaf)
-			goto can_send;			/* Avoid indentation of remaining code */
-
-		/*
-		 * If table for the leaf node is so full that we can't let all the
-		 * queries pass through, further restrict sending even though QRT says
-		 * we can let it go.
-		 *
-		 * We only do that when there are pending messages in the node's queue,
-		 * meaning we can't transmit all our packets fast enough.
-		 */
-
-		if (rt->pass_throw < 100 && NODE_MQUEUE_COUNT(dn) != 0) {
-			if ((int) random_value(99) >= rt->pass_throw)
-				continue;
-		}
 
-		/*
-		 * If leaf is flow-controlled, it has trouble reading or we don't
-		 * have enough bandwidth to send everything.  If we were not skipping
-		 * it, the flow-control would cause the message queue to prioritize
-		 * the query in the queue, removing queries coming far away in favor
-		 * of closer ones (hops-wise).  But if we skip it alltogether, we loose
-		 * some potential for a match.
-		 *
-		 * Therefore, let only 50% of the queries pass to flow-controlled nodes.
-		 *
-		 * We don't let SHA1 queries through, as the chances they will match
-		 * are very slim: not all servents include the SHA1 in their QRP, and
-		 * there can be many hashing conflicts, so the fact that it matched
-		 * an entry in the QRP table does not imply there will be a match
-		 * in the leaf node.
-		 *		--RAM, 31/12/2003
-		 */
+			node_inc_qrp_query(dn);		/* We have a QRT, mark we try routing */
 
-		if (NODE_IN_TX_FLOW_CONTROL(dn)) {
-			if (sha1_query)
-				continue;
-			if (random_value(255) >= 128)
+			if (!qrp_batch_can_route(&batch, rt))
 				continue;
 		}
 
@@ -5584,28 +6874,61 @@ qrt_build_query_target(
 		 */
 
 	can_send:
-
-		/*
-		 * Severely limit traffic to transient nodes since we're going
-		 * to shut them down soon anyway.  Send them something randomly
-		 * to limit easy spotting and account for the fact that the query
-		 * could be usefully relayed still (albeit it better have OOB
-		 * delivery).  The more spam they return, the less we send them.
-		 *		--RAM, 2011-11-24.
-		 */
-
-		if (NODE_IS_TRANSIENT(dn)) {
-			unsigned ratio;
-			ratio = uint_saturate_mult(dn->n_spam, 100) / (dn->received + 1);
-			if (random_value(99) < ratio)
-				continue;
-		}
+		if (qrt_transient_skip(dn))
+			continue;
 
 		nodes = pslist_prepend(nodes, dn);
 		if (rt != NULL && !whats_new)
 			node_inc_qrp_match(dn);
 	}
 
+	/*
+	 * Now handle the leaves the index flags as possibly able to answer.
+	 */
+
+	if (qi != NULL) {
+		const bit_array_t *cand = qrp_index_candidates(qi, qhvec);
+		size_t w;
+
+		for (w = 0; w < qi->words; w++) {
+			bit_array_t m = cand[w];
+			size_t col;
+
+			for (col = w * BIT_ARRAY_BITSIZE; m != 0; col++, m >>= 1) {
+				const struct qrp_index_leaf *il = &qi->leaf[col];
+				gnutella_node_t *dn;
+
+				if (0 == (m & 1))
+					continue;
+
+				dn = il->node;
+				g_assert(dn != NULL);
+				g_assert(dn->recv_query_table == il->rt);
+
+				if (!NODE_IS_WRITABLE(dn))
+					continue;
+
+				if (hops >= dn->hops_flow)
+					continue;
+
+				if (dn == source)
+					continue;
+
+				if (!qrt_leaf_has_table(dn, il->rt))
+					continue;
+
+				if (!qrt_leaf_can_route(dn, il->rt, &batch, sha1_query))
+					continue;
+
+				if (qrt_transient_skip(dn))
+					continue;
+
+				nodes = pslist_prepend(nodes, dn);
+				node_inc_qrp_match(dn);
+			}
+		}
+	}
+
 	return nodes;
 }
 
@@ -75,6 +75,7 @@ void qrp_init(void);
 void qrp_close(void);
 
 void qrp_leaf_changed(void);
+void qrp_index_remove(struct routing_table *rt);
 void qrp_peermode_changed(void);
 
 void qrp_prepare_computation(void);
@@ -40,10 +40,23 @@
 #include "rx_inflate.h"
 #include "rxbuf.h"
 
+#include "if/gnet_property.h"
+#include "if/gnet_property_priv.h"
+
+#include "lib/atomic.h"
+#include "lib/barrier.h"
 #include "lib/base16.h"			/* For error messages */
+#include "lib/getcpucount.h"
+#include "lib/halloc.h"
+#include "lib/hstrfn.h"
 #include "lib/pmsg.h"
+#include "lib/pslist.h"
+#include "lib/spinlock.h"
 #include "lib/str.h"			/* For error messages */
 #include "lib/stringify.h"		/* For plural() */
+#include "lib/teq.h"
+#include "lib/thread.h"
+#include "lib/tsig.h"
 #include "lib/walloc.h"
 #include "lib/zlib_util.h"
 
@@ -51,27 +64,63 @@
 
 /**
  * Private attributes for the decompressing layer.
+ *
+ * When the layer is threaded, decompression happens in one of the inflating
+ * threads: the compressed data received from the lower layer are queued in
+ * `input' and the inflated data are queued in `output' by the inflating
+ * thread, then delivered to the upper layer by the main thread.  Once the
+ * layer is threaded, `inz' and `processed' are only accessed by the inflating
+ * thread, and the attributes are freed when the last reference goes.
  */
 struct attr {
 	const struct rx_inflate_cb *cb;	/**< Layer-specific callbacks */
 	z_streamp inz;					/**< Decompressing stream */
 	size_t processed;				/**< Input bytes decompressed so far */
-	int flags;
+	int flags;						/**< Updated under the lock */
+	rxdrv_t *rx;					/**< Our driver, NULL once destroyed */
+	spinlock_t lock;				/**< Protects the fields below */
+	pslist_t *input;				/**< Compressed data to inflate */
+	pslist_t *output;				/**< Inflated data to deliver */
+	char *error;					/**< Inflating error (halloc-ed) */
+	uint thread;					/**< Inflating thread ID */
+	int refcnt;						/**< Jobs in flight + driver */
 };
 
 #define IF_ENABLED	0x00000001		/**< Reception enabled */
+#define IF_THREADED	0x00000002		/**< Inflating done by a thread */
+#define IF_BUSY		0x00000004		/**< Inflating job posted */
+#define IF_DELIVER	0x00000008		/**< Delivery event posted */
+#define IF_FAILED	0x00000010		/**< Error reported, drop data */
+
+#define ATTR_LOCK(a)	spinlock(&(a)->lock)
+#define ATTR_UNLOCK(a)	spinunlock(&(a)->lock)
+
+/*
+ * The inflating threads, created on demand.
+ */
+#define RX_INFLATE_THREADS_MAX	16
+
+static uint rx_inflate_thread[RX_INFLATE_THREADS_MAX];
+static uint rx_inflate_threads;		/**< Amount of threads created */
+static uint rx_inflate_next;		/**< Next thread to assign */
+static bool rx_inflate_exiting;		/**< Set when threads must exit */
 
 /**
  * Decompress more data from the input buffer `mb'.
+ *
+ * @param attr		the layer attributes
+ * @param mb		the compressed data
+ * @param inflated	where the amount of inflated bytes is written
+ * @param error		where a new error message is returned, on error
+ *
  * @returns decompressed data in a new buffer, or NULL if no more data.
  */
 static pmsg_t *
-inflate_data(rxdrv_t *rx, pmsg_t *mb)
+inflate_buffer(struct attr *attr, pmsg_t *mb, int *inflated, char **error)
 {
-	struct attr *attr = rx->opaque;
 	pdata_t *db;					/* Inflated buffer */
 	z_streamp inz = attr->inz;
-	int ret, old_size, old_avail, inflated, consumed;
+	int ret, old_size, old_avail, consumed;
 
 	/*
 	 * Prepare call to inflate().
@@ -124,8 +173,7 @@ inflate_data(rxdrv_t *rx, pmsg_t *mb)
 			str_catf(s, " [first %zu hex byte%s: %s]", m/2, plural(m/2), data);
 		}
 
-		errno = EIO;
-		attr->cb->inflate_error(rx->owner, "%s", str_2c(s));
+		*error = h_strdup(str_2c(s));
 		str_destroy_null(&s);
 		goto cleanup;
 	}
@@ -152,18 +200,346 @@ inflate_data(rxdrv_t *rx, pmsg_t *mb)
 	 * Build message block with inflated data.
 	 */
 
-	inflated = old_avail - inz->avail_out;
+	*inflated = old_avail - inz->avail_out;
 
-	if (attr->cb->add_rx_inflated != NULL)
-		attr->cb->add_rx_inflated(rx->owner, inflated);
-
-	return pmsg_alloc(PMSG_P_DATA, db, 0, inflated);
+	return pmsg_alloc(PMSG_P_DATA, db, 0, *inflated);
 
 cleanup:
 	rxbuf_free(db);
 	return NULL;
 }
 
+/**
+ * Decompress more data from the input buffer `mb'.
+ * @returns decompressed data in a new buffer, or NULL if no more data.
+ */
+static pmsg_t *
+inflate_data(rxdrv_t *rx, pmsg_t *mb)
+{
+	struct attr *attr = rx->opaque;
+	pmsg_t *imb;
+	char *error = NULL;
+	int inflated;
+
+	imb = inflate_buffer(attr, mb, &inflated, &error);
+
+	if G_UNLIKELY(error != NULL) {
+		errno = EIO;
+		attr->cb->inflate_error(rx->owner, "%s", error);
+		HFREE_NULL(error);
+		return NULL;
+	}
+
+	if (imb != NULL && attr->cb->add_rx_inflated != NULL)
+		attr->cb->add_rx_inflated(rx->owner, inflated);
+
+	return imb;
+}
+
+/***
+ *** Threaded inflation.
+ ***/
+
+/**
+ * Free the layer attributes.
+ */
+static void
+rx_inflate_attr_free(struct attr *attr)
+{
+	int ret;
+
+	g_assert(attr->inz);
+
+	ret = inflateEnd(attr->inz);
+	if (ret != Z_OK)
+		g_warning("while freeing decompressor: %s", zlib_strerror(ret));
+
+	pslist_free_full_null(&attr->input, cast_to_free_fn(pmsg_free));
+	pslist_free_full_null(&attr->output, cast_to_free_fn(pmsg_free));
+	HFREE_NULL(attr->error);
+	spinlock_destroy(&attr->lock);
+	WFREE_TYPE_NULL(attr->inz);
+	WFREE(attr);
+}
+
+/**
+ * Remove a reference on the attributes, freeing them on the last one.
+ *
+ * This is only called from the main thread.
+ */
+static void
+rx_inflate_attr_unref(struct attr *attr)
+{
+	int refcnt;
+
+	g_assert(thread_is_main());
+
+	ATTR_LOCK(attr);
+	refcnt = --attr->refcnt;
+	ATTR_UNLOCK(attr);
+
+	g_assert(refcnt >= 0);
+
+	if (0 == refcnt)
+		rx_inflate_attr_free(attr);
+}
+
+/**
+ * TEQ callback to remove a reference on the attributes.
+ */
+static void
+rx_inflate_attr_release(void *data)
+{
+	rx_inflate_attr_unref(data);
+}
+
+static void rx_inflate_deliver(void *data);
+
+/**
+ * Schedule delivery of inflated data to the upper layer, in the main thread.
+ *
+ * @return TRUE if we need a reference for the posted event.
+ */
+static bool
+rx_inflate_schedule_locked(struct attr *attr)
+{
+	g_assert(spinlock_is_held(&attr->lock));
+
+	if (attr->flags & IF_DELIVER)
+		return FALSE;
+
+	attr->flags |= IF_DELIVER;
+	return TRUE;
+}
+
+/**
+ * Inflating job, run by the inflating thread.
+ *
+ * Inflates all the queued compressed data and hands the result back to the
+ * main thread.  The reference held by the job is transferred to the
+ * delivery event.
+ */
+static void
+rx_inflate_job(void *data)
+{
+	struct attr *attr = data;
+	bool dead;
+
+	for (;;) {
+		pslist_t *input, *output = NULL, *sl;
+		char *error = NULL;
+
+		ATTR_LOCK(attr);
+		dead = NULL == attr->rx || attr->error != NULL;
+		input = attr->input;
+		attr->input = NULL;
+		if (NULL == input)
+			attr->flags &= ~IF_BUSY;
+		ATTR_UNLOCK(attr);
+
+		if (NULL == input)
+			break;
+
+		/*
+		 * Once the driver is destroyed or after an error, simply discard
+		 * the compressed data.
+		 */
+
+		PSLIST_FOREACH(input, sl) {
+			pmsg_t *mb = sl->data;
+			pmsg_t *imb;
+			int inflated;
+
+			while (
+				!dead && error == NULL &&
+				NULL != (imb = inflate_buffer(attr, mb, &inflated, &error))
+			) {
+				output = pslist_prepend(output, imb);
+			}
+		}
+
+		pslist_free_full_null(&input, cast_to_free_fn(pmsg_free));
+		output = pslist_reverse(output);
+
+		ATTR_LOCK(attr);
+		attr->output = pslist_concat(attr->output, output);
+		if (error != NULL)
+			attr->error = error;
+		ATTR_UNLOCK(attr);
+	}
+
+	/*
+	 * Hand the inflated data to the main thread, transferring our reference
+	 * to the delivery event, unless one is already pending.
+	 */
+
+	ATTR_LOCK(attr);
+	if (rx_inflate_schedule_locked(attr)) {
+		ATTR_UNLOCK(attr);
+		teq_safe_post(THREAD_MAIN_ID, rx_inflate_deliver, attr);
+	} else {
+		ATTR_UNLOCK(attr);
+		teq_safe_post(THREAD_MAIN_ID, rx_inflate_attr_release, attr);
+	}
+}
+
+/**
+ * Deliver inflated data to the upper layer, in the main thread.
+ */
+static void
+rx_inflate_deliver(void *data)
+{
+	struct attr *attr = data;
+	char *error = NULL;
+
+	g_assert(thread_is_main());
+
+	ATTR_LOCK(attr);
+	attr->flags &= ~IF_DELIVER;
+	ATTR_UNLOCK(attr);
+
+	/*
+	 * At any time, a packet we forward can cause the reception to be
+	 * disabled, in which case we must stop, or the driver to be destroyed.
+	 */
+
+	while (
+		attr->rx != NULL &&
+		(attr->flags & (IF_ENABLED | IF_FAILED)) == IF_ENABLED
+	) {
+		rxdrv_t *rx = attr->rx;
+		pmsg_t *imb;
+
+		ATTR_LOCK(attr);
+		imb = pslist_shift(&attr->output);
+		if (NULL == imb) {
+			error = attr->error;
+			attr->error = NULL;
+		}
+		ATTR_UNLOCK(attr);
+
+		if (NULL == imb)
+			break;
+
+		if (attr->cb->add_rx_inflated != NULL)
+			attr->cb->add_rx_inflated(rx->owner, pmsg_size(imb));
+
+		if (!(*rx->data.ind)(rx, imb)) {
+			ATTR_LOCK(attr);
+			attr->flags |= IF_FAILED;
+			ATTR_UNLOCK(attr);
+		}
+	}
+
+	/*
+	 * Report the inflating error once all the data inflated before the
+	 * error was detected have been delivered.
+	 */
+
+	if (error != NULL) {
+		if (attr->rx != NULL && !(attr->flags & IF_FAILED)) {
+			ATTR_LOCK(attr);
+			attr->flags |= IF_FAILED;
+			ATTR_UNLOCK(attr);
+			errno = EIO;
+			attr->cb->inflate_error(attr->rx->owner, "%s", error);
+		}
+		HFREE_NULL(error);
+	}
+
+	rx_inflate_attr_unref(attr);
+}
+
+/**
+ * Signal handler to terminate the inflating threads.
+ */
+static void
+rx_inflate_thread_terminate(int sig)
+{
+	g_assert(TSIG_TERM == sig);
+
+	atomic_bool_set(&rx_inflate_exiting, TRUE);
+}
+
+/**
+ * Are inflating threads terminated?
+ *
+ * All the work is done by processing TEQ events whilst we wait.
+ */
+static bool
+rx_inflate_thread_has_work(void *unused_arg)
+{
+	(void) unused_arg;
+
+	return atomic_bool_get(&rx_inflate_exiting);
+}
+
+/**
+ * Inflating thread main loop.
+ */
+static void *
+rx_inflate_thread_main(void *arg)
+{
+	barrier_t *b = arg;
+
+	thread_set_name("inflater");
+	teq_create();				/* Queue to receive TEQ events */
+	thread_signal(TSIG_TERM, rx_inflate_thread_terminate);
+
+	barrier_wait(b);			/* Thread has initialized */
+	barrier_free_null(&b);
+
+	while (!atomic_bool_get(&rx_inflate_exiting))
+		teq_wait(rx_inflate_thread_has_work, NULL);
+
+	return NULL;
+}
+
+/**
+ * Select the inflating thread for a new layer, creating threads as needed.
+ *
+ * @return the thread ID, THREAD_INVALID_ID if inflation must be synchronous.
+ */
+static uint
+rx_inflate_thread_select(void)
+{
+	uint wanted = GNET_PROPERTY(rx_inflate_threads), id;
+
+	g_assert(thread_is_main());
+
+	if (0 == wanted || getcpucount() < 2)
+		return THREAD_INVALID_ID;
+
+	wanted = MIN(wanted, RX_INFLATE_THREADS_MAX);
+	wanted = MIN(wanted, getcpucount());
+
+	if (rx_inflate_threads < wanted) {
+		barrier_t *b = barrier_new(2);
+		int r;
+
+		r = thread_create(rx_inflate_thread_main, barrier_refcnt_inc(b),
+				THREAD_F_DETACH | THREAD_F_NO_CANCEL |
+					THREAD_F_NO_POOL | THREAD_F_WARN,
+				THREAD_STACK_MIN);
+
+		if (-1 == r) {
+			barrier_refcnt_dec(b);
+			barrier_free_null(&b);
+			if (0 == rx_inflate_threads)
+				return THREAD_INVALID_ID;
+			wanted = rx_inflate_threads;
+		} else {
+			barrier_wait(b);		/* Wait for thread to initialize */
+			barrier_free_null(&b);
+			rx_inflate_thread[rx_inflate_threads++] = r;
+		}
+	}
+
+	id = rx_inflate_thread[rx_inflate_next++ % wanted];
+
+	return id;
+}
+
 /***
  *** Polymorphic routines.
  ***/
@@ -199,6 +575,15 @@ rx_inflate_init(rxdrv_t *rx, const void *args)
 	WALLOC0(attr);
 	attr->cb = rargs->cb;
 	attr->inz = inz;
+	attr->rx = rx;
+	attr->refcnt = 1;
+	spinlock_init(&attr->lock);
+
+	if (rargs->threaded) {
+		attr->thread = rx_inflate_thread_select();
+		if (attr->thread != THREAD_INVALID_ID)
+			attr->flags |= IF_THREADED;
+	}
 
 	rx->opaque = attr;
 
@@ -212,17 +597,19 @@ static void
 rx_inflate_destroy(rxdrv_t *rx)
 {
 	struct attr *attr = rx->opaque;
-	int ret;
 
 	g_assert(attr->inz);
 
-	ret = inflateEnd(attr->inz);
-	if (ret != Z_OK)
-		g_warning("while freeing decompressor for peer %s: %s",
-			gnet_host_to_string(&rx->host), zlib_strerror(ret));
+	/*
+	 * Pending jobs or delivery events may still reference the attributes,
+	 * they will be freed when the last one is done.
+	 */
 
-	WFREE_TYPE_NULL(attr->inz);
-	WFREE(attr);
+	ATTR_LOCK(attr);
+	attr->rx = NULL;
+	ATTR_UNLOCK(attr);
+
+	rx_inflate_attr_unref(attr);
 	rx->opaque = NULL;
 }
 
@@ -239,6 +626,34 @@ rx_inflate_recv(rxdrv_t *rx, pmsg_t *mb)
 	rx_check(rx);
 	g_assert(mb);
 
+	/*
+	 * When threaded, queue the data for the inflating thread, which will
+	 * give us back inflated data asynchronously.
+	 */
+
+	if (attr->flags & IF_THREADED) {
+		bool post = FALSE;
+
+		if (attr->flags & IF_FAILED) {
+			pmsg_free(mb);
+			return FALSE;
+		}
+
+		ATTR_LOCK(attr);
+		attr->input = pslist_append(attr->input, mb);
+		if (!(attr->flags & IF_BUSY)) {
+			attr->flags |= IF_BUSY;
+			attr->refcnt++;				/* For the job */
+			post = TRUE;
+		}
+		ATTR_UNLOCK(attr);
+
+		if (post)
+			teq_post(attr->thread, rx_inflate_job, attr);
+
+		return TRUE;
+	}
+
 	/*
 	 * Decompress the stream, forwarding inflated data to the upper layer.
 	 * At any time, a packet we forward can cause the reception to be
@@ -262,8 +677,29 @@ static void
 rx_inflate_enable(rxdrv_t *rx)
 {
 	struct attr *attr = rx->opaque;
+	bool post = FALSE;
 
+	/*
+	 * The inflating thread updates the flags under the lock, hence we
+	 * must take it as well to update them.
+	 *
+	 * Resume delivery of data inflated whilst we were disabled.
+	 */
+
+	ATTR_LOCK(attr);
 	attr->flags |= IF_ENABLED;
+	if (
+		(attr->flags & IF_THREADED) &&
+		(attr->output != NULL || attr->error != NULL)
+	) {
+		post = rx_inflate_schedule_locked(attr);
+		if (post)
+			attr->refcnt++;			/* For the delivery event */
+	}
+	ATTR_UNLOCK(attr);
+
+	if (post)
+		teq_safe_post(THREAD_MAIN_ID, rx_inflate_deliver, attr);
 }
 
 /**
@@ -274,7 +710,9 @@ rx_inflate_disable(rxdrv_t *rx)
 {
 	struct attr *attr = rx->opaque;
 
+	ATTR_LOCK(attr);
 	attr->flags &= ~IF_ENABLED;
+	ATTR_UNLOCK(attr);
 }
 
 static const struct rxdrv_ops rx_inflate_ops = {
@@ -293,4 +731,18 @@ rx_inflate_get_ops(void)
 	return &rx_inflate_ops;
 }
 
+/**
+ * Terminate the inflating threads.
+ */
+void
+rx_inflate_close(void)
+{
+	uint i;
+
+	for (i = 0; i < rx_inflate_threads; i++)
+		thread_kill(rx_inflate_thread[i], TSIG_TERM);
+
+	rx_inflate_threads = 0;
+}
+
 /* vi: set ts=4 sw=4 cindent: */
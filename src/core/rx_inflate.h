@@ -39,6 +39,7 @@
 #include "rx.h"
 
 const struct rxdrv_ops* rx_inflate_get_ops(void);
+void rx_inflate_close(void);
 
 /**
  * Callbacks used by the inflating layer.
@@ -54,6 +55,7 @@ struct rx_inflate_cb {
  */
 struct rx_inflate_args {
 	const struct rx_inflate_cb *cb;		/**< Callbacks */
+	bool threaded;		/**< Whether inflation may be done by a thread */
 };
 
 #endif	/* _core_rx_inflate_h_ */
@@ -87,6 +87,7 @@
 #include "xml/xfmt.h"
 
 #include "lib/aging.h"
+#include "lib/arena.h"
 #include "lib/array.h"
 #include "lib/ascii.h"
 #include "lib/atoms.h"
@@ -145,6 +146,8 @@
 #define SEARCH_MIN_RETRY	1800 /**< Minimum search retry timeout */
 
 #define SEARCH_GC_PERIOD	120	 /**< Every 2 minutes */
+#define SEARCH_ARENA_CHUNK	8192 /**< Chunk size of result set arenas */
+#define SEARCH_ARENA_CACHE	16	 /**< Max amount of idle arenas kept */
 
 #define HUGE_FS				0x1c /**< HUGE Field Separator */
 #define DEFLATE_THRESHOLD	48	 /**< Minimum size to attempt GGEP deflate */
@@ -240,6 +243,16 @@ static htable_t *search_by_muid;
 static idtable_t *search_handle_map;
 static query_hashvec_t *query_hashvec;
 
+/*
+ * Result sets and their records usually only live whilst we process the
+ * message they come from: searches that keep results make their own copy
+ * of the records.  They are therefore allocated from an arena attached to
+ * the result set, and released with it so that a set kept longer does not
+ * pin the memory of the others.  Arenas of freed sets are kept for reuse.
+ */
+static arena_t *search_arena_cache[SEARCH_ARENA_CACHE];
+static uint search_arena_cached;	/**< Idle arenas in cache */
+
 /**
  * This structure is used to map the query MUIDs we relay as an ultrapeer with
  * the corresponding search string and media type filtering requested.
@@ -758,14 +771,8 @@ search_free_record(gnet_record_t *rc)
 {
 	g_assert(rc);
 
-	if (!(SR_ATOMIZED & rc->flags)) {
-		if (SR_ALLOC_NAME & rc->flags) {
-			char *p = deconstify_char(rc->filename);
-			if (p != NULL)
-				hfree(p);
-		}
-		rc->filename = NULL;
-	}
+	if (!(SR_ATOMIZED & rc->flags))
+		rc->filename = NULL;		/* In message or in the arena */
 	atom_str_free_null(&rc->filename);
 	atom_str_free_null(&rc->tag);
 	atom_str_free_null(&rc->xml);
@@ -773,7 +780,6 @@ search_free_record(gnet_record_t *rc)
 	atom_sha1_free_null(&rc->sha1);
 	atom_tth_free_null(&rc->tth);
 	search_free_alt_locs(rc);
-	WFREE(rc);
 }
 
 static gnet_results_set_t *
@@ -781,9 +787,16 @@ search_new_r_set(void)
 {
 	static const gnet_results_set_t zero_rs;
 	gnet_results_set_t *rs;
+	arena_t *ar;
+
+	if (search_arena_cached != 0)
+		ar = search_arena_cache[--search_arena_cached];
+	else
+		ar = arena_make(SEARCH_ARENA_CHUNK);
 
-	WALLOC(rs);
+	ARENA_ALLOC(ar, rs);
 	*rs = zero_rs;
+	rs->arena = ar;
 	return rs;
 }
 
@@ -794,6 +807,7 @@ static void
 search_free_r_set(gnet_results_set_t *rs)
 {
 	pslist_t *m;
+	arena_t *ar = rs->arena;
 
 	PSLIST_FOREACH(rs->records, m) {
 		search_free_record(m->data);
@@ -805,17 +819,28 @@ search_free_r_set(gnet_results_set_t *rs)
 	search_free_proxies(rs);
 
 	pslist_free_null(&rs->records);
-	WFREE(rs);
+
+	/*
+	 * The set and its records are now gone, nothing refers to the arena
+	 * any longer and it can be reused, keeping only its first chunk.
+	 */
+
+	arena_reset(ar);
+
+	if (search_arena_cached < N_ITEMS(search_arena_cache))
+		search_arena_cache[search_arena_cached++] = ar;
+	else
+		arena_free_null(&ar);
 }
 
 
 static gnet_record_t *
-search_record_new(void)
+search_record_new(const gnet_results_set_t *rs)
 {
 	static const gnet_record_t zero_record;
 	gnet_record_t *rc;
 
-	WALLOC(rc);
+	ARENA_ALLOC(rs->arena, rc);
 	*rc = zero_record;
 	rc->create_time = (time_t) -1;
 	return rc;
@@ -2828,7 +2853,7 @@ get_g2_results_record(const g2_tree_t *t, const gnutella_node_t *n,
 	bool has_sz = FALSE, has_url = FALSE;
 	const char *badmsg = NULL;
 
-	rc = search_record_new();
+	rc = search_record_new(rs);
 	rc->file_index = 1;			/* Not 0, not -1, otherwise does not matter */
 
 	G2_TREE_CHILD_FOREACH(t, c) {
@@ -2932,7 +2957,7 @@ get_g2_results_record(const g2_tree_t *t, const gnutella_node_t *n,
 			utf8_filename:
 
 				/* Must copy string since it is usually not NUL-terminated */
-				rc->filename = h_strndup(p, paylen);
+				rc->filename = arena_strndup(rs->arena, p, paylen);
 				rc->flags |= SR_ALLOC_NAME;
 
 				/*
@@ -3553,7 +3578,7 @@ get_results_set(gnutella_node_t *n, bool browse, hostiles_flags_t *hostile)
 
 		nr++;
 
-		rc = search_record_new();
+		rc = search_record_new(rs);
 		rc->file_index = idx;
 		rc->size = size;
 		rc->filename = filename;
@@ -5540,6 +5565,8 @@ search_shutdown(void)
 	sectoken_gen_free_null(&guess_stg);
 	sectoken_gen_free_null(&ora_stg);
 	aging_destroy(&ora_secure);
+	while (search_arena_cached != 0)
+		arena_free_null(&search_arena_cache[--search_arena_cached]);
 }
 
 /**
@@ -7318,7 +7345,7 @@ search_add_local_file(gnet_results_set_t *rs, shared_file_t *sf)
 	g_return_if_fail(sf);
 	g_return_if_fail(SHARE_REBUILDING != sf);
 
-	rc = search_record_new();
+	rc = search_record_new(rs);
 	if (sha1_hash_available(sf)) {
 		gnet_host_t hvec[LOCAL_MAX_ALT];
 		int hcnt;
@@ -7639,6 +7666,34 @@ shared_file_mark_found(struct query_context *ctx, const shared_file_t *sf)
 	hset_insert(ctx->shared_files, sf);
 }
 
+/**
+ * Fetch the search limits a query is placing on matching files.
+ *
+ * @param sri			the search request meta information
+ * @param media_types	where media type mask is written (0 if none)
+ * @param minsize		where minimum file size is written
+ * @param maxsize		where maximum file size is written
+ *
+ * When there are no size restrictions, the returned boundaries cover all
+ * the possible file sizes.
+ */
+void
+search_request_info_limits(const search_request_info_t *sri,
+	uint32 *media_types, filesize_t *minsize, filesize_t *maxsize)
+{
+	search_request_info_check(sri);
+
+	*media_types = sri->media_types;
+
+	if (sri->size_restrictions) {
+		*minsize = sri->minsize;
+		*maxsize = sri->maxsize;
+	} else {
+		*minsize = 0;
+		*maxsize = MAX_INT_VAL(filesize_t);
+	}
+}
+
 /**
  * Apply search limits.
  *
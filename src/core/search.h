@@ -188,6 +188,8 @@ void search_request(struct gnutella_node *n,
 	const search_request_info_t *sri, struct query_hashvec *qhv);
 bool search_apply_limits(const struct shared_file *sf,
 	const search_request_info_t *sri);
+void search_request_info_limits(const search_request_info_t *sri,
+	uint32 *media_types, filesize_t *minsize, filesize_t *maxsize);
 
 size_t compact_query(char *search);
 void search_compact(struct gnutella_node *n);
@@ -111,6 +111,7 @@
 #include "lib/stringify.h"
 #include "lib/teq.h"
 #include "lib/thread.h"
+#include "lib/tigertree.h"
 #include "lib/tm.h"
 #include "lib/tmalloc.h"
 #include "lib/vmm.h"
@@ -2697,6 +2698,17 @@ dbstore_debug_changed(property_t prop)
     return FALSE;
 }
 
+static bool
+dbstore_cache_budget_changed(property_t prop)
+{
+	uint32 val;
+
+	gnet_prop_get_guint32_val(prop, &val);
+	dbstore_set_cache_budget(val);
+
+    return FALSE;
+}
+
 static bool
 evq_debug_changed(property_t prop)
 {
@@ -2730,6 +2742,28 @@ inputevt_trace_changed(property_t prop)
     return FALSE;
 }
 
+static bool
+inputevt_edge_triggered_changed(property_t prop)
+{
+	bool val;
+
+	gnet_prop_get_boolean_val(prop, &val);
+	inputevt_set_edge_triggered(val);
+
+    return FALSE;
+}
+
+static bool
+tth_hashing_threads_changed(property_t prop)
+{
+	uint32 val;
+
+	gnet_prop_get_guint32_val(prop, &val);
+	tt_set_threads(val);
+
+    return FALSE;
+}
+
 static bool
 lock_sleep_trace_changed(property_t prop)
 {
@@ -3335,6 +3369,16 @@ static prop_map_t property_map[] = {
         inputevt_trace_changed,
         TRUE
     },
+    {
+        PROP_INPUTEVT_EDGE_TRIGGERED,
+        inputevt_edge_triggered_changed,
+        TRUE
+    },
+    {
+        PROP_TTH_HASHING_THREADS,
+        tth_hashing_threads_changed,
+        TRUE
+    },
     {
         PROP_LOCK_SLEEP_TRACE,
         lock_sleep_trace_changed,
@@ -3540,6 +3584,11 @@ static prop_map_t property_map[] = {
 		dht_tcache_debug_changed,
 		TRUE,
 	},
+	{
+		PROP_DBSTORE_CACHE_BUDGET,
+		dbstore_cache_budget_changed,
+		TRUE,
+	},
 };
 
 /***
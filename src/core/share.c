@@ -36,6 +36,10 @@
 
 #include "common.h"
 
+#ifdef HAS_INOTIFY
+#include <sys/inotify.h>
+#endif
+
 #include "share.h"
 
 #include "alias.h"
@@ -65,6 +69,7 @@
 #include "if/gnet_property_priv.h"
 #include "if/bridge/c2ui.h"
 
+#include "lib/aq.h"
 #include "lib/ascii.h"
 #include "lib/atomic.h"
 #include "lib/atoms.h"
@@ -73,16 +78,20 @@
 #include "lib/cq.h"
 #include "lib/crash.h"
 #include "lib/endian.h"
+#include "lib/fd.h"
 #include "lib/file.h"
 #include "lib/getcpucount.h"
 #include "lib/halloc.h"
 #include "lib/hashing.h"
+#include "lib/hashlist.h"
 #include "lib/hikset.h"
 #include "lib/hset.h"
 #include "lib/htable.h"
+#include "lib/inputevt.h"
 #include "lib/listener.h"
 #include "lib/mime_type.h"
 #include "lib/pslist.h"
+#include "lib/shuffle.h"
 #include "lib/str.h"
 #include "lib/stringify.h"
 #include "lib/teq.h"
@@ -147,6 +156,8 @@ struct shared_file {
 	enum mime_type mime_type;	/**< MIME type of the file */
 	uint media_type;			/**< Media type mask for queries */
 
+	struct qhit_record *qhit;	/**< Pre-serialized query hit entry */
+
 	int refcnt;					/**< Reference count */
 	uint32 flags;				/**< See below for definition */
 };
@@ -199,6 +210,7 @@ static struct shared_library {
 	search_table_t *partial_table;
 	shared_file_t **file_table;			/* Sorted by mtime */
 	shared_file_t **sorted_file_table;	/* Sorted by name */
+	uint generation;		/* Bumped each time the library changes */
 } shared_libfile;
 static spinlock_t shared_libfile_slk = SPINLOCK_INIT;
 
@@ -476,11 +488,15 @@ shared_file_alloc(void)
 	return sf;
 }
 
+/**
+ * Remove shared file from the library tables.
+ *
+ * The library lock must be held.
+ */
 static void
-shared_file_deindex(shared_file_t *sf)
+shared_file_deindex_locked(shared_file_t *sf)
 {
-	shared_file_check(sf);
-	shared_file_name_check(sf);
+	assert_shared_libfile_locked();
 
 	if (SHARE_F_BASENAME & sf->flags) {
 		if (shared_libfile.file_basenames != NULL) {
@@ -494,8 +510,6 @@ shared_file_deindex(shared_file_t *sf)
 	 * either because it hasn't been build yet or because of a rescan.
 	 */
 
-	SHARED_LIBFILE_LOCK;
-
 	if (
 		shared_libfile.file_table != NULL &&
 		sf->file_index > 0 &&
@@ -518,9 +532,14 @@ shared_file_deindex(shared_file_t *sf)
 	sf->file_index = 0;
 	sf->sort_index = 0;
 	sf->flags &= ~SHARE_F_INDEXED;
+}
 
-	SHARED_LIBFILE_UNLOCK;
-
+/**
+ * Remove shared file from the SHA1 map, if it was referenced there.
+ */
+static void
+shared_file_deindex_sha1(shared_file_t *sf)
+{
 	/*
 	 * Shared file is no longer indexed so it no longer belongs to the
 	 * shared set and needs to be removed if it was referenced there.
@@ -536,6 +555,19 @@ shared_file_deindex(shared_file_t *sf)
 	}
 }
 
+static void
+shared_file_deindex(shared_file_t *sf)
+{
+	shared_file_check(sf);
+	shared_file_name_check(sf);
+
+	SHARED_LIBFILE_LOCK;
+	shared_file_deindex_locked(sf);
+	SHARED_LIBFILE_UNLOCK;
+
+	shared_file_deindex_sha1(sf);
+}
+
 /**
  * Dispose of a shared_file_t structure and nullify the pointer.
  */
@@ -554,6 +586,7 @@ shared_file_free(shared_file_t **sf_ptr)
 		g_assert_log(0 == (sf->flags & SHARE_F_INDEXED),
 			"%s(): invoked on file still indexed", G_STRFUNC);
 
+		qhit_record_free_null(&sf->qhit);
 		atom_sha1_free_null(&sf->sha1);
 		atom_tth_free_null(&sf->tth);
 		atom_str_free_null(&sf->relative_path);
@@ -734,6 +767,289 @@ done:
 	return sf;
 }
 
+/*
+ * Library query cache.
+ *
+ * Popular queries are received over and over from different hosts, and
+ * running them against the search table each time is costly when the
+ * library is large.  We therefore remember the indices of the library files
+ * matching a query, along with the media type and size limits the query
+ * places on the files, so that the next identical query can be answered
+ * without searching.
+ *
+ * The cache is tied to a given library generation: as soon as the library
+ * is changed by a rescan, all the cached entries are discarded.
+ */
+
+#define SHARE_QCACHE_MAX_FILES	4096	/* Don't cache larger result sets */
+
+struct share_qcache {
+	const char *query;			/* Canonic query string (atom) */
+	uint32 media_types;			/* Media types requested, 0 if none */
+	filesize_t minsize;			/* Minimum file size */
+	filesize_t maxsize;			/* Maximum file size */
+	uint32 *files;				/* Indices of matching files */
+	uint count;					/* Amount of entries in files[] */
+};
+
+static hash_list_t *share_qcache;		/* LRU list of cached queries */
+static uint share_qcache_generation;	/* Library generation of cache */
+
+static uint
+share_qcache_hash(const void *key)
+{
+	const struct share_qcache *qc = key;
+
+	return string_mix_hash(qc->query) ^ u32_hash(qc->media_types) ^
+		integer_hash_fast(qc->minsize) ^ integer_hash2(qc->maxsize);
+}
+
+static bool
+share_qcache_eq(const void *a, const void *b)
+{
+	const struct share_qcache *qa = a, *qb = b;
+
+	return qa->media_types == qb->media_types &&
+		qa->minsize == qb->minsize &&
+		qa->maxsize == qb->maxsize &&
+		0 == strcmp(qa->query, qb->query);
+}
+
+static void
+share_qcache_free(void *data)
+{
+	struct share_qcache *qc = data;
+
+	atom_str_free_null(&qc->query);
+	HFREE_NULL(qc->files);
+	WFREE(qc);
+}
+
+/**
+ * Discard all the cached queries.
+ */
+static void
+share_qcache_clear(void)
+{
+	struct share_qcache *qc;
+
+	if (NULL == share_qcache)
+		return;
+
+	while (NULL != (qc = hash_list_shift(share_qcache)))
+		share_qcache_free(qc);
+}
+
+/**
+ * Record the files matching a query in the cache.
+ *
+ * @param key		the lookup key used for the query
+ * @param files		the matching files
+ * @param count		amount of matching files
+ */
+static void
+share_qcache_record(const struct share_qcache *key,
+	const shared_file_t **files, uint count)
+{
+	struct share_qcache *qc;
+	uint i, max = GNET_PROPERTY(query_cache_size);
+
+	if (count > SHARE_QCACHE_MAX_FILES)
+		return;
+
+	if G_UNLIKELY(NULL == share_qcache)
+		share_qcache = hash_list_new(share_qcache_hash, share_qcache_eq);
+
+	while (hash_list_length(share_qcache) >= max) {
+		qc = hash_list_shift(share_qcache);
+		share_qcache_free(qc);
+	}
+
+	WALLOC0(qc);
+	qc->query = atom_str_get(key->query);
+	qc->media_types = key->media_types;
+	qc->minsize = key->minsize;
+	qc->maxsize = key->maxsize;
+	qc->count = count;
+
+	if (count != 0) {
+		HALLOC_ARRAY(qc->files, count);
+		for (i = 0; i < count; i++)
+			qc->files[i] = files[i]->file_index;
+	}
+
+	hash_list_append(share_qcache, qc);
+}
+
+/**
+ * Fetch the library files listed in a cached query.
+ *
+ * Files that were removed from the library or which are no longer shareable
+ * since the query was cached are skipped.
+ *
+ * @param qc			the cached query
+ * @param generation	the library generation the cache was computed from
+ * @param count			where the amount of returned files is written
+ *
+ * @return vector of referenced files (to be freed by caller), NULL if the
+ * library changed since the query was cached.
+ */
+static const shared_file_t **
+share_qcache_files(const struct share_qcache *qc, uint generation, uint *count)
+{
+	const shared_file_t **files;
+	uint i, n = 0;
+
+	HALLOC_ARRAY(files, MAX(qc->count, 1));
+
+	SHARED_LIBFILE_LOCK;
+
+	if (
+		generation != shared_libfile.generation ||
+		NULL == shared_libfile.file_table
+	) {
+		SHARED_LIBFILE_UNLOCK;
+		HFREE_NULL(files);
+		return NULL;
+	}
+
+	for (i = 0; i < qc->count; i++) {
+		uint idx = qc->files[i];
+		shared_file_t *sf;
+
+		if G_UNLIKELY(idx < 1 || idx > shared_libfile.files_scanned)
+			continue;
+
+		sf = shared_libfile.file_table[idx - 1];
+		if (sf != NULL && shared_file_is_shareable(sf))
+			files[n++] = shared_file_ref(sf);
+	}
+
+	SHARED_LIBFILE_UNLOCK;
+
+	*count = n;
+	return files;
+}
+
+/**
+ * Supply matching files to the callback, picking at most ``max_res'' of
+ * them at random.
+ *
+ * @param files			the matching files (shuffled if needed)
+ * @param count			amount of matching files
+ * @param callback		routine to call on each hit
+ * @param user_data		opaque context passed to callback
+ * @param max_res		maximum number of results
+ */
+static void
+share_qcache_deliver(const shared_file_t **files, uint count,
+	st_search_callback callback, void *user_data, uint max_res)
+{
+	uint i, n;
+
+	if (count > max_res)
+		SHUFFLE_ARRAY_N(files, count);
+
+	/*
+	 * Limits were already applied when matching the files, hence the
+	 * trailing "FALSE" in the callback, as in st_search().
+	 */
+
+	for (i = n = 0; i < count && n < max_res; i++) {
+		if ((*callback)(user_data, files[i], FALSE))
+			n++;						/* Entry retained */
+	}
+}
+
+/**
+ * Apply query string to the library, using the query cache.
+ *
+ * @param gt			the library search table
+ * @param generation	the library generation matching the search table
+ * @param query			the query string to apply
+ * @param sri			meta-information about the query, for matching limits
+ * @param callback		routine to call on each hit
+ * @param user_data		opaque context passed to callback
+ * @param max_res		maximum number of results
+ * @param qhv			query hash vector, filled with query words if not NULL
+ *
+ * @return the amount of matching files.
+ */
+static int
+share_qcache_search(search_table_t *gt, uint generation,
+	const char *query, const search_request_info_t *sri,
+	st_search_callback callback, void *user_data,
+	int max_res, query_hashvec_t *qhv)
+{
+	struct share_qcache key;
+	const struct share_qcache *qc;
+	const shared_file_t **files = NULL;
+	uint i, count = 0;
+	char *search;
+
+	if (0 == GNET_PROPERTY(query_cache_size) || max_res <= 0) {
+		share_qcache_clear();
+		return st_search(gt, query, sri, callback, user_data, max_res, qhv);
+	}
+
+	if (generation != share_qcache_generation) {
+		share_qcache_clear();
+		share_qcache_generation = generation;
+	}
+
+	search = UNICODE_CANONIZE(query);
+	key.query = search;
+	search_request_info_limits(sri,
+		&key.media_types, &key.minsize, &key.maxsize);
+
+	qc = NULL == share_qcache ? NULL : hash_list_lookup(share_qcache, &key);
+
+	if (qc != NULL)
+		files = share_qcache_files(qc, generation, &count);
+
+	if (files != NULL) {
+		gnet_stats_inc_general(GNR_LOCAL_QUERY_CACHE_HITS);
+		hash_list_moveto_tail(share_qcache, qc);
+		st_fill_qhv(query, qhv);
+		share_qcache_deliver(files, count, callback, user_data, max_res);
+
+		for (i = 0; i < count; i++) {
+			shared_file_t *sf = deconstify_pointer(files[i]);
+			shared_file_unref(&sf);
+		}
+	} else {
+		pslist_t *result, *sl;
+
+		gnet_stats_inc_general(GNR_LOCAL_QUERY_CACHE_MISSES);
+
+		/*
+		 * The files listed in the result are held by the search table,
+		 * which we still reference, so we do not need to reference them.
+		 */
+
+		count = st_match(gt, query, sri, &result, qhv);
+		HALLOC_ARRAY(files, MAX(count, 1));
+
+		i = 0;
+		PSLIST_FOREACH(result, sl) {
+			files[i++] = sl->data;
+		}
+		g_assert(i == count);
+		pslist_free_null(&result);
+
+		if (generation == share_qcache_generation)
+			share_qcache_record(&key, files, count);
+
+		share_qcache_deliver(files, count, callback, user_data, max_res);
+	}
+
+	HFREE_NULL(files);
+	if (search != query)
+		HFREE_NULL(search);
+
+	return count;
+}
+
 /**
  * Apply query string to the library.
  *
@@ -754,6 +1070,7 @@ shared_files_match(const char *query,
 	int n;
 	int remain;
 	search_table_t *gt, *pt;
+	uint generation;
 	bool partials = booleanize(flags & SHARE_FM_PARTIALS);
 	bool g2_query = booleanize(flags & SHARE_FM_G2);
 
@@ -765,14 +1082,15 @@ shared_files_match(const char *query,
 	SHARED_LIBFILE_LOCK;
 	gt = st_refcnt_inc(shared_libfile.search_table);
 	pt = partials ? st_refcnt_inc(shared_libfile.partial_table) : NULL;
+	generation = shared_libfile.generation;
 	SHARED_LIBFILE_UNLOCK;
 
 	/*
-	 * First search from the library.
+	 * First search from the library, unless the query results are cached.
 	 */
 
-	n = st_search(gt, query, sri, callback, user_data, max_res, qhv);
-
+	n = share_qcache_search(gt, generation,
+			query, sri, callback, user_data, max_res, qhv);
 
 	gnet_stats_count_general(g2_query ? GNR_LOCAL_G2_HITS : GNR_LOCAL_HITS, n);
 	remain = max_res - n;
@@ -1357,6 +1675,22 @@ share_scan_add_file(const char *relative_path,
 	sf->mime_type = mime_type_from_filename(sf->name_nfc);
 	sf->media_type = shared_file_media_type(sf->mime_type);
 
+	return sf;
+}
+
+/**
+ * Check whether a file built by share_scan_add_file() is a partial file,
+ * which must not be shared.
+ *
+ * The SHA-1 cache is not thread-safe, so this is not done along with the
+ * rest of the file processing, which can happen in the scanning workers:
+ * it must be called by the thread collecting the scanned files.
+ *
+ * @return TRUE if the file must not be shared.
+ */
+static bool
+share_scan_is_partial(const shared_file_t *sf)
+{
 	if (!sha1_is_cached(sf)) {
 		int ret;
 
@@ -1367,7 +1701,7 @@ share_scan_add_file(const char *relative_path,
 		 * downloading directory...
 		 */
 
-		ret = file_info_has_trailer(pathname);
+		ret = file_info_has_trailer(sf->file_path);
 		switch (ret) {
 		case 1:
 			/*
@@ -1376,11 +1710,10 @@ share_scan_add_file(const char *relative_path,
 			 * case they choose to share their downloading
 			 * directory...
 			 */
-			g_warning("will not share partial file \"%s\"", pathname);
+			g_warning("will not share partial file \"%s\"", sf->file_path);
 			/* FALL THROUGH */
 		case -1:
-			shared_file_free(&sf);
-			return NULL;
+			return TRUE;
 		}
 	}
 
@@ -1389,7 +1722,7 @@ share_scan_add_file(const char *relative_path,
 	 * sha1_cache.  Good place to set the SHA1 in "sf".
 	 */
 
-	return sf;
+	return FALSE;
 }
 
 /**
@@ -1496,6 +1829,53 @@ share_tthset_free(hset_t *set)
 	hset_free_null(&set);
 }
 
+/**
+ * @return whether shared directories should be watched for changes.
+ */
+static inline bool
+share_watch_enabled(void)
+{
+#ifdef HAS_INOTIFY
+	return GNET_PROPERTY(library_watch);
+#else
+	return FALSE;
+#endif
+}
+
+/**
+ * A directory seen during the library scan, which we can watch for changes.
+ */
+struct share_watch_dir {
+	const char *path;			/**< Directory path (atom) */
+	const char *base;			/**< Shared base directory (atom) */
+	int wd;						/**< inotify watch descriptor */
+};
+
+static struct share_watch_dir *
+share_watch_dir_alloc(const char *path, const char *base)
+{
+	struct share_watch_dir *wdir;
+
+	WALLOC0(wdir);
+	wdir->path = atom_str_get(path);
+	wdir->base = atom_str_get(base);
+	wdir->wd = -1;
+
+	return wdir;
+}
+
+static void
+share_watch_dir_free(void *data)
+{
+	struct share_watch_dir *wdir = data;
+
+	atom_str_free_null(&wdir->path);
+	atom_str_free_null(&wdir->base);
+	WFREE(wdir);
+}
+
+static void share_watch_install(pslist_t *dirs);
+
 enum recursive_scan_magic { RECURSIVE_SCAN_MAGIC = 0x16926d87U };
 
 struct recursive_scan {
@@ -1525,8 +1905,15 @@ struct recursive_scan {
 	int idx;					/* iterating index */
 	int ticks;					/* ticks used */
 	size_t ftable_capacity;		/* Amount of entries in ftable[] */
+	aqueue_t *work;				/* entries for the scanning workers */
+	aqueue_t *done;				/* entries processed by the workers */
+	uint workers;				/* amount of scanning workers */
+	uint pending;				/* entries being processed by workers */
+	pslist_t *watch_dirs;		/* scanned dirs, struct share_watch_dir */
 };
 
+static void recursive_scan_workers_stop(struct recursive_scan *ctx);
+
 static inline void
 recursive_scan_check(const struct recursive_scan * const ctx)
 {
@@ -1618,6 +2005,7 @@ recursive_scan_context_free(void *data)
 
 	recursive_scan_check(ctx);
 
+	recursive_scan_workers_stop(ctx);
 	recursive_scan_closedir(ctx);
 
 	slist_iter_free(&ctx->iter);
@@ -1646,6 +2034,7 @@ recursive_scan_context_free(void *data)
 	}
 
 	shared_file_slist_free_null(&ctx->shared);
+	pslist_free_full_null(&ctx->watch_dirs, share_watch_dir_free);
 
 	ctx->task = NULL;
 	ctx->magic = 0;
@@ -1750,146 +2139,410 @@ recursive_scan_opendir(struct recursive_scan *ctx, const char * const dir)
 	}
 	ctx->current_dir = atom_str_get(dir);
 
+	if (share_watch_enabled()) {
+		ctx->watch_dirs = pslist_prepend(ctx->watch_dirs,
+			share_watch_dir_alloc(ctx->current_dir, ctx->base_dir));
+	}
+
 	if (GNET_PROPERTY(share_debug) > 5)
 		g_debug("SHARE scanning directory \"%s\"", ctx->current_dir);
 }
 
-static void
-recursive_scan_readdir(struct recursive_scan *ctx)
+/**
+ * Process an entry found in a shared directory, whose file type was not
+ * ruled out by its name or its directory entry.
+ *
+ * This can be invoked from the scanning worker threads.
+ *
+ * @param relative_path		relative path of the directory (atom, or NULL)
+ * @param fullpath			the full path of the entry
+ * @param sb				the stat buffer, with st_mode from dir entry
+ * @param is_dir			set to TRUE if entry is a directory to scan
+ *
+ * @return the shared file if entry is a file to share, NULL otherwise.
+ */
+static shared_file_t *
+recursive_scan_entry(const char *relative_path,
+	const char *fullpath, filestat_t *sb, bool *is_dir)
 {
-	char *fullpath = NULL;
-	struct dirent *dir_entry;
-
-	recursive_scan_check(ctx);
-	g_assert(ctx->directory);
-
-	dir_entry = readdir(ctx->directory);
-	if (dir_entry) {
-		const char *filename = dir_entry_filename(dir_entry);
-		filestat_t sb;
+	const char *filename = filepath_basename(fullpath);
 
-		if (GNET_PROPERTY(share_debug) > 19)
-			g_debug("SHARE considering entry \"%s\"", filename);
+	*is_dir = FALSE;
 
-		if ('.' == filename[0]) {
-			/* Hidden file, or "." or ".." */
-			goto finish;
+	if (S_ISREG(sb->st_mode) || S_ISDIR(sb->st_mode)) {
+		if (stat(fullpath, sb)) {
+			g_warning("stat() failed %s: %m", fullpath);
+			return NULL;
 		}
-
-		sb.st_mode = dir_entry_mode(dir_entry);
-		switch (sb.st_mode) {
-		case 0:
-		case S_IFREG:
-		case S_IFDIR:
-		case S_IFLNK:
-			break;
-		default:
-			if (GNET_PROPERTY(share_debug)) {
-				g_warning("skipping file of unknown type \"%s\" in \"%s\"",
-					ctx->current_dir, filename);
-			}
-			goto finish;
+	} else if (!S_ISLNK(sb->st_mode)) {
+		if (lstat(fullpath, sb)) {
+			g_warning("lstat() failed %s: %m", fullpath);
+			return NULL;
 		}
 
 		if (
-			S_ISLNK(sb.st_mode) &&
+			S_ISLNK(sb->st_mode) &&
 			GNET_PROPERTY(scan_ignore_symlink_dirs) &&
 			GNET_PROPERTY(scan_ignore_symlink_regfiles)
 		) {
+			/*
+			 * We check this again because dir_entry_mode() does not
+			 * work everywhere.
+			 */
 			if (GNET_PROPERTY(share_debug) > 15) {
 				g_debug("SHARE to-be-ignored symlink, discarding \"%s\"",
 					filename);
 			}
-			goto finish;
+			return NULL;
 		}
+	}
 
-		if (
-			S_ISREG(sb.st_mode) &&
-			!shared_file_valid_extension(filename)
-		) {
-			if (GNET_PROPERTY(share_debug) > 15) {
-				g_debug("SHARE unshared extension, discarding \"%s\"",
-					filename);
-			}
-			goto finish;
+	/* Get info on the symlinked file */
+	if (S_ISLNK(sb->st_mode)) {
+		if (stat(fullpath, sb)) {
+			g_warning("broken symlink %s: %m", fullpath);
+			return NULL;
 		}
 
-		ctx->ticks += 10;	/* Heavier work */
-
-		fullpath = make_pathname(ctx->current_dir, filename);
-		if (S_ISREG(sb.st_mode) || S_ISDIR(sb.st_mode)) {
-			if (stat(fullpath, &sb)) {
-				g_warning("stat() failed %s: %m", fullpath);
-				goto finish;
-			}
-		} else if (!S_ISLNK(sb.st_mode)) {
-			if (lstat(fullpath, &sb)) {
-				g_warning("lstat() failed %s: %m", fullpath);
-				goto finish;
+		/*
+		 * For symlinks, we check whether we are supposed to process
+		 * symlinks for that type of entry, then either proceed or skip the
+		 * entry.
+		 */
+
+		if (
+			S_ISDIR(sb->st_mode) &&
+			GNET_PROPERTY(scan_ignore_symlink_dirs)
+		) {
+			if (GNET_PROPERTY(share_debug) > 15)
+				g_debug("SHARE discarding symlink dir \"%s\"", filename);
+			return NULL;
+		}
+		if (
+			S_ISREG(sb->st_mode) &&
+			GNET_PROPERTY(scan_ignore_symlink_regfiles)
+		) {
+			if (GNET_PROPERTY(share_debug) > 15)
+				g_debug("SHARE discarding symlink file \"%s\"", filename);
+			return NULL;
+		}
+	}
+
+	if (S_ISDIR(sb->st_mode)) {
+		/* If a directory, caller will add to list for later processing */
+		*is_dir = TRUE;
+	} else if (S_ISREG(sb->st_mode)) {
+		if (GNET_PROPERTY(share_debug) > 10)
+			g_debug("SHARE adding file \"%s\"", filename);
+
+		return share_scan_add_file(relative_path, fullpath, sb);
+	}
+
+	return NULL;
+}
+
+/*
+ * Scanning pipeline.
+ *
+ * When the library is scanned from the library thread, the directories are
+ * read by that thread but the entries are handed to worker threads, which
+ * perform the stat() system calls and build the shared file, including the
+ * costly UTF-8 normalization of its name.  The results come back through
+ * another queue and are collected by the library thread, which keeps
+ * building the search table and the other data structures as before.
+ * Checks involving the SHA-1 cache, which is not thread-safe, are also
+ * done by the collecting thread.
+ *
+ * The amount of entries in the pipeline is bounded to limit memory usage
+ * and to keep the workers from running too far behind the directory reader.
+ */
+
+#define RECURSIVE_SCAN_WORKERS	4		/**< Max amount of worker threads */
+#define RECURSIVE_SCAN_PENDING	1024	/**< Max amount of entries in flight */
+#define RECURSIVE_SCAN_WAIT		100		/**< ms, wait for worker results */
+
+/**
+ * An entry processed by the scanning pipeline.
+ */
+struct recursive_scan_item {
+	char *fullpath;				/**< Full path of entry (halloc()ed) */
+	const char *relative_path;	/**< Relative path of directory (atom) */
+	shared_file_t *sf;			/**< File to share, from worker */
+	filestat_t sb;				/**< File type, then stat() results */
+	bool is_dir;				/**< Set by worker if entry is a directory */
+};
+
+/**
+ * Queues used by a scanning worker.
+ */
+struct recursive_scan_pipe {
+	aqueue_t *work;				/**< Entries to process */
+	aqueue_t *done;				/**< Processed entries */
+};
+
+/**
+ * Scanning worker thread.
+ */
+static void *
+recursive_scan_worker(void *arg)
+{
+	struct recursive_scan_pipe *p = arg;
+	struct recursive_scan_item *item;
+
+	thread_set_name("scanner");
+
+	/*
+	 * A NULL item signals the end of the scan.
+	 */
+
+	while (NULL != (item = aq_remove(p->work))) {
+		item->sf = recursive_scan_entry(item->relative_path,
+			item->fullpath, &item->sb, &item->is_dir);
+		aq_put(p->done, item);
+	}
+
+	aq_refcnt_dec(p->work);
+	aq_refcnt_dec(p->done);
+	WFREE(p);
+
+	return NULL;
+}
+
+/**
+ * Launch the scanning workers, if we run in the library thread.
+ */
+static void
+recursive_scan_workers_start(struct recursive_scan *ctx)
+{
+	uint i, n;
+
+	g_assert(0 == ctx->workers);
+
+	if (THREAD_MAIN_ID == share_thread_id)
+		return;
+
+	n = getcpucount();
+	n = n > 1 ? MIN(n - 1, RECURSIVE_SCAN_WORKERS) : 0;
+
+	if (0 == n)
+		return;
+
+	ctx->work = aq_make();
+	ctx->done = aq_make();
+
+	for (i = 0; i < n; i++) {
+		struct recursive_scan_pipe *p;
+		int r;
+
+		WALLOC(p);
+		p->work = aq_refcnt_inc(ctx->work);
+		p->done = aq_refcnt_inc(ctx->done);
+
+		r = thread_create(recursive_scan_worker, p,
+				THREAD_F_DETACH | THREAD_F_NO_CANCEL | THREAD_F_WARN,
+				THREAD_STACK_MIN);
+
+		if (-1 == r) {
+			aq_refcnt_dec(p->work);
+			aq_refcnt_dec(p->done);
+			WFREE(p);
+			break;
+		}
+
+		ctx->workers++;
+	}
+
+	if (0 == ctx->workers) {
+		aq_destroy_null(&ctx->work);
+		aq_destroy_null(&ctx->done);
+	}
+
+	if (GNET_PROPERTY(share_debug))
+		g_debug("SHARE scanning with %u worker thread%s",
+			ctx->workers, plural(ctx->workers));
+}
+
+/**
+ * Collect entry processed by a worker.
+ */
+static void
+recursive_scan_collect(struct recursive_scan *ctx,
+	struct recursive_scan_item *item)
+{
+	g_assert(ctx->pending != 0);
+
+	if (item->is_dir) {
+		slist_prepend(ctx->sub_dirs, item->fullpath);
+		item->fullpath = NULL;
+	} else if (item->sf != NULL) {
+		if (share_scan_is_partial(item->sf))
+			shared_file_free(&item->sf);
+		else
+			slist_append(ctx->shared_files, shared_file_ref(item->sf));
+	}
+
+	HFREE_NULL(item->fullpath);
+	atom_str_free_null(&item->relative_path);
+	WFREE(item);
+	ctx->pending--;
+}
+
+/**
+ * Collect entries processed by the workers.
+ *
+ * @param ctx		the scanning context
+ * @param wait		whether to wait for at least one result
+ */
+static void
+recursive_scan_drain(struct recursive_scan *ctx, bool wait)
+{
+	struct recursive_scan_item *item;
+
+	if (0 == ctx->pending)
+		return;
+
+	if (wait) {
+		tm_t timeout;
+
+		tm_fill_ms(&timeout, RECURSIVE_SCAN_WAIT);
+		item = aq_timed_remove(ctx->done, &timeout);
+		if (item != NULL)
+			recursive_scan_collect(ctx, item);
+	}
+
+	while (ctx->pending != 0 && NULL != (item = aq_remove_try(ctx->done)))
+		recursive_scan_collect(ctx, item);
+}
+
+/**
+ * Wait for all pending entries and stop the scanning workers.
+ */
+static void
+recursive_scan_workers_stop(struct recursive_scan *ctx)
+{
+	uint i;
+
+	if (0 == ctx->workers)
+		return;
+
+	while (ctx->pending != 0)
+		recursive_scan_collect(ctx, aq_remove(ctx->done));
+
+	for (i = 0; i < ctx->workers; i++)
+		aq_put(ctx->work, NULL);
+
+	ctx->workers = 0;
+	aq_destroy_null(&ctx->work);
+	aq_destroy_null(&ctx->done);
+}
+
+/**
+ * Hand entry to the scanning workers.
+ */
+static void
+recursive_scan_enqueue(struct recursive_scan *ctx,
+	char *fullpath, const filestat_t *sb)
+{
+	struct recursive_scan_item *item;
+
+	g_assert(ctx->workers != 0);
+
+	while (ctx->pending >= RECURSIVE_SCAN_PENDING)
+		recursive_scan_drain(ctx, TRUE);
+
+	WALLOC0(item);
+	item->fullpath = fullpath;
+	item->relative_path = NULL == ctx->relative_path ?
+		NULL : atom_str_get(ctx->relative_path);
+	item->sb = *sb;		/* Struct copy */
+
+	ctx->pending++;
+	aq_put(ctx->work, item);
+}
+
+static void
+recursive_scan_readdir(struct recursive_scan *ctx)
+{
+	char *fullpath = NULL;
+	struct dirent *dir_entry;
+
+	recursive_scan_check(ctx);
+	g_assert(ctx->directory);
+
+	dir_entry = readdir(ctx->directory);
+	if (dir_entry) {
+		const char *filename = dir_entry_filename(dir_entry);
+		filestat_t sb;
+		shared_file_t *sf;
+		bool is_dir;
+
+		if (GNET_PROPERTY(share_debug) > 19)
+			g_debug("SHARE considering entry \"%s\"", filename);
+
+		if ('.' == filename[0]) {
+			/* Hidden file, or "." or ".." */
+			goto finish;
+		}
+
+		sb.st_mode = dir_entry_mode(dir_entry);
+		switch (sb.st_mode) {
+		case 0:
+		case S_IFREG:
+		case S_IFDIR:
+		case S_IFLNK:
+			break;
+		default:
+			if (GNET_PROPERTY(share_debug)) {
+				g_warning("skipping file of unknown type \"%s\" in \"%s\"",
+					ctx->current_dir, filename);
 			}
+			goto finish;
+		}
 
-			if (
-				S_ISLNK(sb.st_mode) &&
-				GNET_PROPERTY(scan_ignore_symlink_dirs) &&
-				GNET_PROPERTY(scan_ignore_symlink_regfiles)
-			) {
-				/*
-				 * We check this again because dir_entry_mode() does not
-				 * work everywhere.
-				 */
-				if (GNET_PROPERTY(share_debug) > 15) {
-					g_debug("SHARE to-be-ignored symlink, discarding \"%s\"",
-						filename);
-				}
-				goto finish;
+		if (
+			S_ISLNK(sb.st_mode) &&
+			GNET_PROPERTY(scan_ignore_symlink_dirs) &&
+			GNET_PROPERTY(scan_ignore_symlink_regfiles)
+		) {
+			if (GNET_PROPERTY(share_debug) > 15) {
+				g_debug("SHARE to-be-ignored symlink, discarding \"%s\"",
+					filename);
 			}
+			goto finish;
 		}
 
-		/* Get info on the symlinked file */
-		if (S_ISLNK(sb.st_mode)) {
-			if (stat(fullpath, &sb)) {
-				g_warning("broken symlink %s: %m", fullpath);
-				goto finish;
+		if (
+			S_ISREG(sb.st_mode) &&
+			!shared_file_valid_extension(filename)
+		) {
+			if (GNET_PROPERTY(share_debug) > 15) {
+				g_debug("SHARE unshared extension, discarding \"%s\"",
+					filename);
 			}
+			goto finish;
+		}
 
-			/*
-			 * For symlinks, we check whether we are supposed to process
-			 * symlinks for that type of entry, then either proceed or skip the
-			 * entry.
-			 */
+		ctx->ticks += 10;	/* Heavier work */
 
-			if (
-				S_ISDIR(sb.st_mode) &&
-				GNET_PROPERTY(scan_ignore_symlink_dirs)
-			) {
-				if (GNET_PROPERTY(share_debug) > 15)
-					g_debug("SHARE discarding symlink dir \"%s\"", filename);
-				goto finish;
-			}
-			if (
-				S_ISREG(sb.st_mode) &&
-				GNET_PROPERTY(scan_ignore_symlink_regfiles)
-			) {
-				if (GNET_PROPERTY(share_debug) > 15)
-					g_debug("SHARE discarding symlink file \"%s\"", filename);
-				goto finish;
-			}
+		fullpath = make_pathname(ctx->current_dir, filename);
+
+		if (ctx->workers != 0) {
+			recursive_scan_enqueue(ctx, fullpath, &sb);
+			fullpath = NULL;
+			goto finish;
 		}
 
-		if (S_ISDIR(sb.st_mode)) {
+		sf = recursive_scan_entry(ctx->relative_path, fullpath, &sb, &is_dir);
+
+		if (is_dir) {
 			/* If a directory, add to list for later processing */
 			slist_prepend(ctx->sub_dirs, fullpath);
 			fullpath = NULL;
-		} else if (S_ISREG(sb.st_mode)) {
-			shared_file_t *sf;
-
-			if (GNET_PROPERTY(share_debug) > 10)
-				g_debug("SHARE adding file \"%s\"", filename);
-
-			sf = share_scan_add_file(ctx->relative_path, fullpath, &sb);
-			if (sf) {
+		} else if (sf != NULL) {
+			if (share_scan_is_partial(sf))
+				shared_file_free(&sf);
+			else
 				slist_append(ctx->shared_files, shared_file_ref(sf));
-			}
 		}
 	} else {
 		recursive_scan_closedir(ctx);
@@ -2012,6 +2665,8 @@ recursive_scan_step_setup(struct bgtask *bt, void *data, int uticks)
 
 	teq_safe_rpc(THREAD_MAIN_ID, recursive_rescan_starting, NULL);
 
+	recursive_scan_workers_start(ctx);
+
 	bg_task_ticks_used(bt, 0);
 	return BGR_NEXT;
 }
@@ -2026,6 +2681,9 @@ recursive_scan_next_dir(struct recursive_scan *ctx)
 
 	bg_task_cancel_test(ctx->task);
 
+	if (ctx->workers != 0)
+		recursive_scan_drain(ctx, FALSE);
+
 	if (ctx->directory) {
 		recursive_scan_readdir(ctx);
 		return FALSE;
@@ -2036,6 +2694,13 @@ recursive_scan_next_dir(struct recursive_scan *ctx)
 		recursive_scan_opendir(ctx, dir);
 		HFREE_NULL(dir);
 		return FALSE;
+	} else if (ctx->pending != 0) {
+		/*
+		 * Wait for the workers before moving to the next base directory:
+		 * they can still report sub-directories of the current one.
+		 */
+		recursive_scan_drain(ctx, TRUE);
+		return FALSE;
 	} else if (slist_length(ctx->base_dirs) > 0) {
 		atom_str_free_null(&ctx->base_dir);
 		ctx->base_dir = slist_shift(ctx->base_dirs);
@@ -2076,6 +2741,9 @@ recursive_scan_step_compute_done(struct bgtask *bt, void *data, int ticks)
 
 	g_assert(NULL == ctx->shared);
 	g_assert(NULL == ctx->search_tb);
+	g_assert(0 == ctx->pending);
+
+	recursive_scan_workers_stop(ctx);
 
 	ctx->files_scanned = slist_length(ctx->shared_files);
 	ctx->bytes_scanned = 0;
@@ -2304,9 +2972,19 @@ next:
 }
 
 static void *
-recursive_install_shared(void *unused)
+recursive_install_shared(void *data)
 {
-	(void) unused;
+	struct recursive_scan *ctx = data;
+
+	recursive_scan_check(ctx);
+
+	/*
+	 * Start watching the directories we just scanned, now that the
+	 * library reflects their content.
+	 */
+
+	share_watch_install(ctx->watch_dirs);
+	ctx->watch_dirs = NULL;
 
 	gcu_gui_update_files_scanned();		/* Final view */
 	gnet_prop_set_boolean_val(PROP_LIBRARY_REBUILDING, FALSE);
@@ -2405,6 +3083,7 @@ recursive_scan_step_install_shared(struct bgtask *bt, void *data, int ticks)
 	shared_libfile.sorted_file_table	= ctx->sorted;
 	shared_libfile.files_scanned		= ctx->files_scanned;
 	shared_libfile.bytes_scanned		= ctx->bytes_scanned;
+	shared_libfile.generation++;
 
 	/*
 	 * Reset these contextual variables, they are now held by the global ones.
@@ -2429,7 +3108,7 @@ recursive_scan_step_install_shared(struct bgtask *bt, void *data, int ticks)
 	 *		--RAM, 2013-10-29
 	 */
 
-	teq_safe_rpc(THREAD_MAIN_ID, recursive_install_shared, NULL);
+	teq_safe_rpc(THREAD_MAIN_ID, recursive_install_shared, ctx);
 
 	/*
 	 * The next step is going to request the SHA1 of all the library files,
@@ -3219,60 +3898,810 @@ share_thread_create(void)
 	return r;
 }
 
+/*
+ * Library watching.
+ *
+ * When the system supports inotify, the directories seen during the last
+ * library scan are monitored so that changes to shared files can be applied
+ * incrementally to the library instead of requiring a full rescan: files are
+ * individually added, removed or renamed in the search table, the file
+ * tables, the basename map and the SHA1 map.  The QRP table is then
+ * recomputed from the in-core library, without touching the disk, and the
+ * patches sent to our peers only cover the slots that changed.
+ *
+ * Anything that does not concern plain files (new or removed directories,
+ * events lost because the kernel queue overflowed, too many changes at once)
+ * triggers a regular rescan.
+ *
+ * All the watching logic runs in the main thread, which is the only thread
+ * searching the library, hence the search table can be updated in place
+ * whilst we hold the library lock.
+ */
+
+#ifdef HAS_INOTIFY
+
+#define SHARE_WATCH_DELAY	2000	/**< ms, delay before applying changes */
+#define SHARE_WATCH_MAX		512		/**< Max changes applied incrementally */
+
+static struct share_watch {
+	int fd;					/**< inotify file descriptor, -1 if none */
+	uint id;				/**< I/O event ID for the descriptor */
+	htable_t *dirs;			/**< wd -> struct share_watch_dir */
+	htable_t *changed;		/**< Changed path -> shared base dir (atoms) */
+	htable_t *moved;		/**< Renamed file: new path -> old path (atoms) */
+	htable_t *cookies;		/**< Pending rename: cookie -> old path (atom) */
+	cevent_t *ev;			/**< Callout event to apply changes */
+	bool rescan;			/**< Whether a full rescan is needed */
+} share_watch = {
+	-1,						/* fd */
+	0,						/* id */
+	NULL,					/* dirs */
+	NULL,					/* changed */
+	NULL,					/* moved */
+	NULL,					/* cookies */
+	NULL,					/* ev */
+	FALSE,					/* rescan */
+};
+
 /**
- * Perform scanning of the shared directories to build up the list of
- * shared files.
+ * Hash table iterator to free the atoms in the key and the value.
  */
-void
-share_scan(void)
+static bool
+share_watch_free_kv(const void *key, void *value, void *unused_data)
 {
-	share_lib_rescan();
+	(void) unused_data;
+
+	atom_str_free(key);
+	atom_str_free(value);
+	return TRUE;
 }
 
 /**
- * Hash table iterator callback to free the value.
+ * Hash table iterator to free the atom in the value.
  */
-static void
-special_free_kv(const void *unused_key, void *val, void *unused_udata)
+static bool
+share_watch_free_value(const void *unused_key, void *value, void *unused_data)
 {
-	shared_file_t *sf = val;
+	(void) unused_key;
+	(void) unused_data;
+
+	atom_str_free(value);
+	return TRUE;
+}
 
+/**
+ * Hash table iterator to free the watched directory in the value.
+ */
+static void
+share_watch_free_dir(const void *unused_key, void *value, void *unused_data)
+{
 	(void) unused_key;
-	(void) unused_udata;
+	(void) unused_data;
 
-	g_assert(SHARE_F_SPECIAL & sf->flags);
-	shared_file_unref(&sf);
+	share_watch_dir_free(value);
 }
 
 /**
- * Get rid of the special file descriptions, if any.
+ * Forget about all the changes recorded so far.
  */
 static void
-share_special_close(void)
+share_watch_clear_changes(void)
 {
-	htable_foreach(special_names, special_free_kv, NULL);
-	htable_free_null(&special_names);
+	struct share_watch *w = &share_watch;
+
+	htable_foreach_remove(w->changed, share_watch_free_kv, NULL);
+	htable_foreach_remove(w->moved, share_watch_free_kv, NULL);
+	htable_foreach_remove(w->cookies, share_watch_free_value, NULL);
+	w->rescan = FALSE;
 }
 
 /**
- * Shutdown cleanup.
+ * Stop watching directories.
  */
-void G_COLD
-share_close(void)
+static void
+share_watch_close(void)
 {
-	if (THREAD_MAIN_ID != share_thread_id)
-		thread_kill(share_thread_id, TSIG_TERM);
+	struct share_watch *w = &share_watch;
 
-	/*
-	 * This call must happen after node_close() to ensure the UDP TX scheduler
-	 * has been released and that no messages there could invoked callbacks
-	 * referring to OOB data that oob_close() is going to free up.
-	 */
+	inputevt_remove(&w->id);
+	fd_close(&w->fd);
 
-	share_special_close();
-	free_extensions();
-	pslist_foreach(shared_libfile.shared_files, shared_file_detach, NULL);
-	share_free();
+	if (w->dirs != NULL) {
+		htable_foreach(w->dirs, share_watch_free_dir, NULL);
+		htable_free_null(&w->dirs);
+	}
+}
+
+/**
+ * Get the inotify event mask to use for watched directories.
+ */
+static inline uint32
+share_watch_mask(void)
+{
+	return IN_CREATE | IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM |
+		IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+}
+
+static void share_watch_apply(cqueue_t *cq, void *unused_obj);
+
+/**
+ * Make sure changes will be processed soon.
+ */
+static void
+share_watch_schedule(void)
+{
+	struct share_watch *w = &share_watch;
+
+	if (NULL == w->ev)
+		w->ev = cq_main_insert(SHARE_WATCH_DELAY, share_watch_apply, NULL);
+}
+
+/**
+ * Request a full library rescan, because the changes cannot be applied
+ * incrementally.
+ */
+static void
+share_watch_need_rescan(const char *reason, const char *path)
+{
+	struct share_watch *w = &share_watch;
+
+	if (GNET_PROPERTY(share_debug) && !w->rescan) {
+		g_debug("SHARE %s%s%s%s, will rescan library", reason,
+			NULL == path ? "" : " \"",
+			NULL == path ? "" : path,
+			NULL == path ? "" : "\"");
+	}
+
+	w->rescan = TRUE;
+	share_watch_schedule();
+}
+
+/**
+ * Record a change for a file path.
+ *
+ * @param path		the full path of the file (atom, reference taken)
+ * @param base		the shared base directory under which the file lies
+ */
+static void
+share_watch_record(const char *path, const char *base)
+{
+	struct share_watch *w = &share_watch;
+
+	if (htable_contains(w->changed, path)) {
+		atom_str_free(path);
+	} else {
+		htable_insert(w->changed, path, deconstify_char(atom_str_get(base)));
+	}
+
+	if (htable_count(w->changed) > SHARE_WATCH_MAX)
+		share_watch_need_rescan("too many changes", NULL);
+	else
+		share_watch_schedule();
+}
+
+/**
+ * Process an inotify event.
+ */
+static void
+share_watch_event(const struct inotify_event *ie)
+{
+	struct share_watch *w = &share_watch;
+	struct share_watch_dir *wdir;
+	const char *path;
+	char *fullpath;
+
+	if (ie->mask & IN_Q_OVERFLOW) {
+		share_watch_need_rescan("lost directory change events", NULL);
+		return;
+	}
+
+	wdir = htable_lookup(w->dirs, int_to_pointer(ie->wd));
+
+	if (NULL == wdir)
+		return;				/* Watch was removed */
+
+	if (ie->mask & IN_IGNORED) {
+		htable_remove(w->dirs, int_to_pointer(ie->wd));
+		share_watch_dir_free(wdir);
+		return;
+	}
+
+	if (ie->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_UNMOUNT)) {
+		share_watch_need_rescan("lost directory", wdir->path);
+		return;
+	}
+
+	if (0 == ie->len || '.' == ie->name[0])
+		return;				/* Hidden entries are not shared */
+
+	fullpath = make_pathname(wdir->path, ie->name);
+
+	if (ie->mask & IN_ISDIR) {
+		/*
+		 * A new directory needs to be scanned and watched, and a removed
+		 * one can contain any amount of shared files: rescan.
+		 */
+
+		share_watch_need_rescan("changed directory", fullpath);
+		goto done;
+	}
+
+	if (!shared_file_valid_extension(ie->name))
+		goto done;
+
+	/*
+	 * Regular files are considered when they are closed after writing, to
+	 * avoid sharing files that are being copied.  A newly created entry
+	 * is only considered when it is a symbolic link, which will never be
+	 * written to.
+	 */
+
+	if (ie->mask & IN_CREATE) {
+		filestat_t sb;
+
+		if (-1 == lstat(fullpath, &sb) || !S_ISLNK(sb.st_mode))
+			goto done;
+	}
+
+	path = atom_str_get(fullpath);
+
+	/*
+	 * Pair renaming events so that the hashes of the file can be kept.
+	 */
+
+	if (ie->mask & IN_MOVED_FROM) {
+		const char *old;
+
+		if (htable_lookup_extended(w->cookies,
+				uint_to_pointer(ie->cookie), NULL, (void *) &old))
+			atom_str_free(old);
+
+		htable_insert(w->cookies, uint_to_pointer(ie->cookie),
+			deconstify_char(atom_str_get(path)));
+	} else if (ie->mask & IN_MOVED_TO) {
+		const char *old;
+
+		if (htable_lookup_extended(w->cookies,
+				uint_to_pointer(ie->cookie), NULL, (void *) &old)
+		) {
+			htable_remove(w->cookies, uint_to_pointer(ie->cookie));
+			if (htable_contains(w->moved, path)) {
+				atom_str_free(old);
+			} else {
+				htable_insert(w->moved,
+					atom_str_get(path), deconstify_char(old));
+			}
+		}
+	}
+
+	share_watch_record(path, wdir->base);
+
+	/* FALL THROUGH */
+
+done:
+	HFREE_NULL(fullpath);
+}
+
+/**
+ * I/O callback invoked when inotify events can be read.
+ */
+static void
+share_watch_read(void *unused_data, int unused_source, inputevt_cond_t cond)
+{
+	struct share_watch *w = &share_watch;
+	union {
+		struct inotify_event ie;
+		char buf[4096];
+	} u;
+	ssize_t r;
+	char *p;
+
+	(void) unused_data;
+	(void) unused_source;
+
+	if (cond & INPUT_EVENT_EXCEPTION) {
+		g_warning("%s(): error on inotify descriptor", G_STRFUNC);
+		share_watch_close();
+		share_watch_need_rescan("stopped watching", NULL);
+		return;
+	}
+
+	if (!share_watch_enabled()) {
+		share_watch_close();		/* Watching was disabled */
+		return;
+	}
+
+	r = read(w->fd, u.buf, sizeof u.buf);
+
+	if ((ssize_t) -1 == r) {
+		if (!is_temporary_error(errno)) {
+			g_warning("%s(): cannot read inotify events: %m", G_STRFUNC);
+			share_watch_close();
+			share_watch_need_rescan("stopped watching", NULL);
+		}
+		return;
+	}
+
+	for (p = u.buf; p < &u.buf[r]; /* empty */) {
+		const struct inotify_event *ie = (const void *) p;
+
+		share_watch_event(ie);
+		p += sizeof *ie + ie->len;
+	}
+}
+
+/**
+ * Watch the directories seen during the last library scan.
+ *
+ * @param dirs		list of struct share_watch_dir, taken over
+ */
+static void
+share_watch_install(pslist_t *dirs)
+{
+	struct share_watch *w = &share_watch;
+	pslist_t *sl;
+
+	g_assert(thread_is_main());
+
+	/*
+	 * Start from scratch, as the set of watched directories is the one we
+	 * have just scanned.
+	 */
+
+	share_watch_close();
+
+	if (NULL == dirs || !share_watch_enabled())
+		goto done;
+
+	w->fd = inotify_init();
+
+	if (-1 == w->fd) {
+		g_warning("%s(): cannot watch shared directories: %m", G_STRFUNC);
+		goto done;
+	}
+
+	fd_set_close_on_exec(w->fd);
+	fd_set_nonblocking(w->fd);
+	w->dirs = htable_create(HASH_KEY_SELF, 0);
+
+	if (NULL == w->changed) {
+		w->changed = htable_create(HASH_KEY_SELF, 0);
+		w->moved = htable_create(HASH_KEY_SELF, 0);
+		w->cookies = htable_create(HASH_KEY_SELF, 0);
+	}
+
+	PSLIST_FOREACH(dirs, sl) {
+		struct share_watch_dir *wdir = sl->data;
+
+		wdir->wd = inotify_add_watch(w->fd, wdir->path, share_watch_mask());
+
+		if (-1 == wdir->wd) {
+			g_warning("%s(): cannot watch \"%s\", "
+				"not monitoring shared directories: %m",
+				G_STRFUNC, wdir->path);
+			share_watch_close();
+			goto done;
+		}
+
+		/*
+		 * A symlinked directory can be reached twice, in which case we
+		 * get the same watch descriptor.
+		 */
+
+		if (htable_contains(w->dirs, int_to_pointer(wdir->wd)))
+			continue;
+
+		htable_insert(w->dirs, int_to_pointer(wdir->wd), wdir);
+		sl->data = NULL;
+	}
+
+	w->id = inputevt_add(w->fd, INPUT_EVENT_RX, share_watch_read, NULL);
+
+	if (GNET_PROPERTY(share_debug)) {
+		size_t n = htable_count(w->dirs);
+		g_debug("SHARE watching %zu director%s for changes",
+			n, plural_y(n));
+	}
+
+	/* FALL THROUGH */
+
+done:
+	PSLIST_FOREACH(dirs, sl) {
+		if (sl->data != NULL)
+			share_watch_dir_free(sl->data);
+	}
+	pslist_free(dirs);
+}
+
+/**
+ * Build a new shared file for a changed path, if it is still to be shared.
+ *
+ * @param path		the full path of the file
+ * @param base		the shared base directory under which the file lies
+ *
+ * @return a referenced shared file, NULL if the path is no longer shared.
+ */
+static shared_file_t *
+share_watch_file(const char *path, const char *base)
+{
+	shared_file_t *sf;
+	const char *relative_path = NULL;
+	filestat_t sb;
+	bool is_dir;
+
+	if (GNET_PROPERTY(search_results_expose_relative_paths)) {
+		char *dir = filepath_directory(path);
+
+		if (dir != NULL) {
+			relative_path = get_relative_path(base, dir);
+			HFREE_NULL(dir);
+		}
+	}
+
+	sb.st_mode = 0;		/* Unknown file type, will use lstat() */
+	sf = recursive_scan_entry(relative_path, path, &sb, &is_dir);
+	atom_str_free_null(&relative_path);
+
+	if (is_dir) {
+		share_watch_need_rescan("new directory", path);
+		return NULL;
+	}
+
+	if (NULL == sf)
+		return NULL;
+
+	if (share_scan_is_partial(sf)) {
+		shared_file_free(&sf);
+		return NULL;
+	}
+
+	return shared_file_ref(sf);
+}
+
+/**
+ * Insert new file in the library, the lock being held.
+ *
+ * @param sf		the new shared file, reference taken
+ * @param idx		file index to reuse, 0 to use a new index
+ */
+static void
+share_watch_insert_locked(shared_file_t *sf, uint idx)
+{
+	uint val;
+
+	assert_shared_libfile_locked();
+
+	if (0 == idx) {
+		idx = ++shared_libfile.files_scanned;
+		HREALLOC_ARRAY(shared_libfile.file_table, idx);
+		HREALLOC_ARRAY(shared_libfile.sorted_file_table, idx);
+		shared_libfile.sorted_file_table[idx - 1] = NULL;
+	}
+
+	g_assert(NULL == shared_libfile.file_table[idx - 1]);
+
+	shared_libfile.file_table[idx - 1] = sf;
+	sf->file_index = idx;
+	sf->flags |= SHARE_F_INDEXED | SHARE_F_BASENAME;
+
+	val = pointer_to_uint(
+		htable_lookup(shared_libfile.file_basenames, sf->name_nfc));
+	val = (val != 0) ? FILENAME_CLASH : sf->file_index;
+	htable_insert(shared_libfile.file_basenames,
+		sf->name_nfc, uint_to_pointer(val));
+
+	st_insert_item(shared_libfile.search_table,
+		ST_SET_PLAIN, sf->name_canonic, sf);
+	if (sf->name_normal != NULL) {
+		st_insert_item(shared_libfile.search_table,
+			ST_SET_ALIAS, sf->name_normal, sf);
+	}
+
+	shared_libfile.shared_files =
+		pslist_prepend(shared_libfile.shared_files, sf);
+	shared_libfile.bytes_scanned += sf->file_size;
+}
+
+/**
+ * Rebuild the table of shared files sorted by name, the lock being held.
+ */
+static void
+share_watch_resort_locked(void)
+{
+	shared_file_t **sorted = shared_libfile.sorted_file_table;
+	size_t i, n = 0;
+
+	assert_shared_libfile_locked();
+
+	for (i = 0; i < shared_libfile.files_scanned; i++) {
+		shared_file_t *sf = shared_libfile.file_table[i];
+
+		if (sf != NULL)
+			sorted[n++] = sf;
+	}
+
+	vsort(sorted, n, sizeof sorted[0], shared_file_sort_by_name);
+
+	for (i = 0; i < shared_libfile.files_scanned; i++) {
+		if (i < n)
+			sorted[i]->sort_index = i + 1;
+		else
+			sorted[i] = NULL;
+	}
+}
+
+/**
+ * Carry over the hashes of a renamed file to its new shared file.
+ *
+ * @return TRUE if hashes were given to the new file.
+ */
+static bool
+share_watch_keep_hashes(shared_file_t *sf, const pslist_t *removed)
+{
+	const char *old;
+	const pslist_t *sl;
+
+	old = htable_lookup(share_watch.moved, sf->file_path);
+
+	if (NULL == old)
+		return FALSE;
+
+	PSLIST_FOREACH(removed, sl) {
+		const shared_file_t *osf = sl->data;
+
+		if (osf->file_path != old)
+			continue;
+
+		if (
+			NULL == osf->sha1 || NULL == osf->tth ||
+			osf->file_size != sf->file_size || osf->mtime != sf->mtime
+		)
+			return FALSE;
+
+		return huge_update_hashes(sf, osf->sha1, osf->tth);
+	}
+
+	return FALSE;
+}
+
+/**
+ * Callout queue event to apply the recorded changes to the library.
+ */
+static void
+share_watch_apply(cqueue_t *cq, void *unused_obj)
+{
+	struct share_watch *w = &share_watch;
+	struct share_thread_vars *v = &share_thread_vars;
+	pslist_t *added = NULL, *removed = NULL, *sl;
+	htable_iter_t *iter;
+	const void *key;
+	void *value;
+	bool busy;
+	size_t i;
+
+	(void) unused_obj;
+
+	cq_zero(cq, &w->ev);
+
+	if (w->rescan) {
+		share_watch_clear_changes();
+		share_scan();
+		return;
+	}
+
+	/*
+	 * If the library is being rebuilt, wait until it is done: we need to
+	 * apply our changes to the library that will be installed.
+	 */
+
+	spinlock(&v->lock);
+	busy = v->task != NULL;
+	spinunlock(&v->lock);
+
+	if (busy || atomic_bool_get(&share_rebuilding)) {
+		share_watch_schedule();
+		return;
+	}
+
+	/*
+	 * Build the new shared files without holding the lock, since this
+	 * requires stat() calls and the normalization of the file names.
+	 */
+
+	iter = htable_iter_new(w->changed);
+
+	while (htable_iter_next(iter, &key, &value)) {
+		shared_file_t *sf = share_watch_file(key, value);
+
+		if (sf != NULL)
+			added = pslist_prepend(added, sf);
+	}
+
+	htable_iter_release(&iter);
+
+	if (w->rescan) {
+		shared_file_slist_free_null(&added);
+		share_watch_clear_changes();
+		share_scan();
+		return;
+	}
+
+	SHARED_LIBFILE_LOCK;
+
+	if (NULL == shared_libfile.file_table) {
+		SHARED_LIBFILE_UNLOCK;
+		shared_file_slist_free_null(&added);
+		share_watch_schedule();		/* Library not built yet */
+		return;
+	}
+
+	/*
+	 * Remove the files whose path changed from the library.
+	 *
+	 * A modified file keeps its index, so that the file table does not
+	 * grow each time the same file is updated.
+	 */
+
+	for (i = 0; i < shared_libfile.files_scanned; i++) {
+		shared_file_t *sf = shared_libfile.file_table[i];
+		uint idx;
+
+		if (NULL == sf || !htable_contains(w->changed, sf->file_path))
+			continue;
+
+		idx = sf->file_index;
+		st_remove_item(shared_libfile.search_table, sf);
+		shared_file_deindex_locked(sf);
+		shared_libfile.shared_files =
+			pslist_remove(shared_libfile.shared_files, sf);
+		shared_libfile.bytes_scanned -= sf->file_size;
+		removed = pslist_prepend(removed, sf);	/* Takes list reference */
+
+		PSLIST_FOREACH(added, sl) {
+			shared_file_t *nsf = sl->data;
+
+			if (nsf->file_path == sf->file_path && 0 == nsf->file_index) {
+				share_watch_insert_locked(shared_file_ref(nsf), idx);
+				break;
+			}
+		}
+	}
+
+	PSLIST_FOREACH(added, sl) {
+		shared_file_t *sf = sl->data;
+
+		if (0 == sf->file_index)
+			share_watch_insert_locked(shared_file_ref(sf), 0);
+	}
+
+	share_watch_resort_locked();
+	shared_libfile.generation++;
+
+	SHARED_LIBFILE_UNLOCK;
+
+	if (GNET_PROPERTY(share_debug)) {
+		size_t n = htable_count(w->changed);
+		uint na = pslist_length(added), nr = pslist_length(removed);
+
+		g_debug("SHARE applied %zu change%s: %u file%s added, %u removed",
+			n, plural(n), na, plural(na), nr);
+	}
+
+	/*
+	 * Now that the library is updated, deal with the hashes.
+	 */
+
+	PSLIST_FOREACH(removed, sl) {
+		shared_file_deindex_sha1(sl->data);
+	}
+
+	PSLIST_FOREACH(added, sl) {
+		shared_file_t *sf = sl->data;
+
+		upload_stats_enforce_local_filename(sf);
+
+		if (!share_watch_keep_hashes(sf, removed))
+			request_sha1(sf);
+	}
+
+	shared_file_slist_free_null(&added);
+	shared_file_slist_free_null(&removed);
+	share_watch_clear_changes();
+
+	gcu_gui_update_files_scanned();
+	share_lib_qrp_rebuild(FALSE);
+}
+
+/**
+ * Release all the resources used to watch directories.
+ */
+static void
+share_watch_free(void)
+{
+	struct share_watch *w = &share_watch;
+
+	cq_cancel(&w->ev);
+	share_watch_close();
+
+	if (w->changed != NULL) {
+		share_watch_clear_changes();
+		htable_free_null(&w->changed);
+		htable_free_null(&w->moved);
+		htable_free_null(&w->cookies);
+	}
+}
+#else	/* !HAS_INOTIFY */
+static void
+share_watch_install(pslist_t *dirs)
+{
+	pslist_free_full_null(&dirs, share_watch_dir_free);
+}
+
+static void
+share_watch_free(void)
+{
+	/* Nothing to do */
+}
+#endif	/* HAS_INOTIFY */
+
+/**
+ * Perform scanning of the shared directories to build up the list of
+ * shared files.
+ */
+void
+share_scan(void)
+{
+	share_lib_rescan();
+}
+
+/**
+ * Hash table iterator callback to free the value.
+ */
+static void
+special_free_kv(const void *unused_key, void *val, void *unused_udata)
+{
+	shared_file_t *sf = val;
+
+	(void) unused_key;
+	(void) unused_udata;
+
+	g_assert(SHARE_F_SPECIAL & sf->flags);
+	shared_file_unref(&sf);
+}
+
+/**
+ * Get rid of the special file descriptions, if any.
+ */
+static void
+share_special_close(void)
+{
+	htable_foreach(special_names, special_free_kv, NULL);
+	htable_free_null(&special_names);
+}
+
+/**
+ * Shutdown cleanup.
+ */
+void G_COLD
+share_close(void)
+{
+	if (THREAD_MAIN_ID != share_thread_id)
+		thread_kill(share_thread_id, TSIG_TERM);
+
+	share_watch_free();
+	share_qcache_clear();
+	hash_list_free(&share_qcache);
+
+	/*
+	 * This call must happen after node_close() to ensure the UDP TX scheduler
+	 * has been released and that no messages there could invoked callbacks
+	 * referring to OOB data that oob_close() is going to free up.
+	 */
+
+	share_special_close();
+	free_extensions();
+	pslist_foreach(shared_libfile.shared_files, shared_file_detach, NULL);
+	share_free();
 	shared_dirs_free();
 	huge_close();
 	qrp_close();
@@ -3703,6 +5132,35 @@ shared_file_needs_aliasing(const shared_file_t *sf)
 	return sf->name_normal != NULL;
 }
 
+/**
+ * @return the pre-serialized query hit entry of the file, NULL if none.
+ */
+struct qhit_record *
+shared_file_qhit_record(const shared_file_t *sf)
+{
+	shared_file_check(sf);
+	return sf->qhit;
+}
+
+/**
+ * Attach new pre-serialized query hit entry to the file, disposing of
+ * the previous one.
+ *
+ * This must only be called from the main thread, which is the only one
+ * building query hits.
+ */
+void
+shared_file_set_qhit_record(shared_file_t *sf, struct qhit_record *qr)
+{
+	shared_file_check(sf);
+	g_assert(thread_is_main());
+
+	if (qr != sf->qhit) {
+		qhit_record_free_null(&sf->qhit);
+		sf->qhit = qr;
+	}
+}
+
 /**
  * Returns the relative path of the shared files unless there was none
  * or exposing relative paths is disabled.
@@ -108,6 +108,10 @@ struct hset;
 struct hset *share_tthset_get(void);
 void share_tthset_free(struct hset *set);
 
+struct qhit_record;
+struct qhit_record *shared_file_qhit_record(const shared_file_t *sf) G_PURE;
+void shared_file_set_qhit_record(shared_file_t *sf, struct qhit_record *qr);
+
 void parse_extensions(const char *);
 char *get_file_path(int);
 void shared_dirs_update_prop(void);
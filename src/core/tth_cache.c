@@ -28,12 +28,22 @@
  *
  * Caching of tigertree data.
  *
- * The tigertree data for each shared file is stored in a file in the directory
- * GTK_GNUTELLA_DIR/tth_cache/ in raw binary form. For example, if the root
- * hash is 5EDB4PUVFGY2UKVISQ2DMACSPNRODTTODBS52RQ, the tigertree data is
- * stored in
- * $GTK_GNUTELLA_DIR/tth_cache/5E/DB4PUVFGY2UKVISQ2DMACSPNRODTTODBS52RQ.
- * This avoids storing too many files per directory.
+ * The tigertree leaves of shared files are packed into a few large segment
+ * files under GTK_GNUTELLA_DIR/tth_store/, named 000.seg, 001.seg, etc...
+ * An in-core index maps the TTH root of each cached tree to the segment,
+ * the offset within that segment and the amount of leaves, so that both
+ * lookups and retrieval of the leaves are O(1) operations.
+ *
+ * The index is made persistent through an append-only log in the "index"
+ * file, each insertion or removal appending a fixed-size record to it.  When
+ * loading, the last record seen for a given root wins.  The log is rewritten
+ * from the in-core index when it holds too many superseded records.
+ *
+ * Segments are only ever appended to, hence removed or superseded trees leave
+ * dead space behind them.  Segments with too much dead space are compacted
+ * online, a few trees at a time, by moving their live trees to the segment
+ * currently being written, until the old segment holds nothing and can be
+ * removed.
  *
  * Only the leaves at TTH_MAX_DEPTH or above are stored. The root hash and the
  * nodes at each level between above these leaves can be calculated from the
@@ -41,6 +51,14 @@
  *
  * If the depth is 1 (root only), nothing is stored.
  *
+ * Older versions stored each tree in its own file, in the directory
+ * GTK_GNUTELLA_DIR/tth_cache/.  For example, if the root hash was
+ * 5EDB4PUVFGY2UKVISQ2DMACSPNRODTTODBS52RQ, the tigertree data was stored in
+ * $GTK_GNUTELLA_DIR/tth_cache/5E/DB4PUVFGY2UKVISQ2DMACSPNRODTTODBS52RQ.
+ * These files are migrated to the packed store by a background thread at
+ * startup, and on demand when they are looked up before the migration
+ * reached them.
+ *
  * @author Christian Biere
  * @date 2007
  * @author Raphael Manfredi
@@ -54,22 +72,28 @@
 #include "settings.h"
 #include "share.h"
 
+#include "lib/atomic.h"
 #include "lib/atoms.h"
 #include "lib/base32.h"
+#include "lib/cq.h"
+#include "lib/crc.h"
+#include "lib/endian.h"
 #include "lib/fd.h"
 #include "lib/file.h"
 #include "lib/ftw.h"
 #include "lib/halloc.h"
+#include "lib/hikset.h"
 #include "lib/hset.h"
 #include "lib/hstrfn.h"
+#include "lib/mutex.h"
 #include "lib/path.h"
 #include "lib/pslist.h"
-#include "lib/spinlock.h"
 #include "lib/str.h"
 #include "lib/stringify.h"
 #include "lib/thread.h"
 #include "lib/tigertree.h"
 #include "lib/timestamp.h"
+#include "lib/tm.h"
 #include "lib/walloc.h"
 
 #include "if/gnet_property_priv.h"
@@ -83,14 +107,421 @@
 #define TTH_FILE_MODE (S_IRUSR | S_IWUSR | S_IRGRP) /* 0640 */
 #endif
 
+#define TTH_STORE_DIR		"tth_store"		/* Directory of the packed store */
+#define TTH_STORE_INDEX		"index"			/* Name of the index log */
+#define TTH_STORE_MAGIC		"GTKGTTHI"		/* Index file magic */
+#define TTH_STORE_VERSION	1				/* Index file version */
+#define TTH_STORE_HEADER	16				/* Magic + version + flags */
+#define TTH_STORE_SEGMAX	(64 * 1024 * 1024)	/* Max segment size */
+#define TTH_STORE_SEGMENTS	256				/* Max amount of segments */
+#define TTH_STORE_WASTE		2				/* Index compaction factor */
+#define TTH_STORE_MIN		1024			/* Min records before compacting */
+#define TTH_STORE_PERIOD	(10 * 1000)		/* ms: compaction period */
+#define TTH_STORE_STEP		256				/* Trees moved per compaction */
+
+/*
+ * Index records are laid out as follows, all integers being big-endian:
+ *
+ *    24 bytes	TTH root
+ *    uint32	offset within segment
+ *    uint32	amount of leaves
+ *    uint32	insertion time
+ *    uint16	segment number
+ *    uint8		operation (TTH_REC_PUT or TTH_REC_DEL)
+ *    uint8		reserved, zero
+ *    uint32	CRC-32 of the previous bytes
+ */
+#define TTH_REC_SIZE		44
+#define TTH_REC_PUT			1
+#define TTH_REC_DEL			2
+
+/**
+ * An entry of the in-core index.
+ */
+struct tth_entry {
+	struct tth tth;				/**< Root hash (embedded key) */
+	uint32 offset;				/**< Offset of leaves within segment */
+	uint32 nleaves;				/**< Amount of leaves */
+	uint32 stamp;				/**< Insertion time */
+	uint16 segment;				/**< Segment holding the leaves */
+};
+
+/**
+ * A segment file.
+ */
+struct tth_segment {
+	int fd;						/**< Opened file, -1 if not opened */
+	fileoffset_t size;			/**< Size of segment */
+	fileoffset_t live;			/**< Bytes referenced by the index */
+};
+
+static struct tth_store {
+	hikset_t *entries;			/**< struct tth_entry, by TTH root */
+	struct tth_segment seg[TTH_STORE_SEGMENTS];
+	cperiodic_t *compact_ev;	/**< Periodic compaction event */
+	size_t records;				/**< Records in the index log */
+	int index_fd;				/**< Index log, opened for appending */
+	uint current;				/**< Segment being appended to */
+	bool dirty;					/**< Index log missed some changes */
+	bool closed;				/**< Store was closed */
+} tth_store;
+
+/**
+ * This lock is used to protect the store, which can be concurrently accessed
+ * by the migration thread and by threads computing tigertrees.
+ */
+static mutex_t tth_store_mtx = MUTEX_INIT;
+
+#define TTH_STORE_LOCK		mutex_lock(&tth_store_mtx)
+#define TTH_STORE_UNLOCK	mutex_unlock(&tth_store_mtx)
+
+static bool tth_store_migrating;	/* Migration of old cache in progress */
+
+static const char *
+tth_store_directory(void)
+{
+	static char *directory;
+
+	if (!directory) {
+		directory = make_pathname(settings_config_dir(), TTH_STORE_DIR);
+	}
+	return NOT_LEAKING(directory);
+}
+
+static char *
+tth_store_segment_pathname(uint n)
+{
+	return h_strdup_printf("%s%c%03u.seg",
+			tth_store_directory(), G_DIR_SEPARATOR, n);
+}
+
+/**
+ * Get the file descriptor of a segment, opening it as needed.
+ *
+ * @param n			the segment number
+ * @param create	whether to create the segment if missing
+ *
+ * @return the file descriptor, -1 on error.
+ */
+static int
+tth_store_segment_fd(uint n, bool create)
+{
+	struct tth_segment *seg = &tth_store.seg[n];
+
+	g_assert(n < TTH_STORE_SEGMENTS);
+
+	if G_UNLIKELY(-1 == seg->fd) {
+		char *path = tth_store_segment_pathname(n);
+
+		seg->fd = create ?
+			file_create(path, O_RDWR, TTH_FILE_MODE) :
+			file_open_missing(path, O_RDWR);
+		HFREE_NULL(path);
+	}
+
+	return seg->fd;
+}
+
+/**
+ * Close and remove an empty segment.
+ */
+static void
+tth_store_segment_remove(uint n)
+{
+	struct tth_segment *seg = &tth_store.seg[n];
+	char *path;
+
+	g_assert(0 == seg->live);
+
+	fd_forget_and_close(&seg->fd);
+	path = tth_store_segment_pathname(n);
+	if (-1 == unlink(path) && ENOENT != errno)
+		g_warning("%s(): cannot remove %s: %m", G_STRFUNC, path);
+	HFREE_NULL(path);
+
+	seg->size = 0;
+
+	if (debugging(0))
+		g_debug("%s(): removed TTH segment #%u", G_STRFUNC, n);
+}
+
+/**
+ * Serialize an index record in the supplied buffer.
+ */
+static void
+tth_store_record(char buf[TTH_REC_SIZE], uint8 op, const struct tth_entry *e)
+{
+	memcpy(buf, e->tth.data, TTH_RAW_SIZE);
+	poke_be32(&buf[24], e->offset);
+	poke_be32(&buf[28], e->nleaves);
+	poke_be32(&buf[32], e->stamp);
+	poke_be16(&buf[36], e->segment);
+	buf[38] = op;
+	buf[39] = 0;
+	poke_be32(&buf[40], crc32_update(0, buf, 40));
+}
+
+/**
+ * Append a record to the index log.
+ *
+ * @attention
+ * Must be called with the store locked.
+ */
+static void
+tth_store_index_append(uint8 op, const struct tth_entry *e)
+{
+	char buf[TTH_REC_SIZE];
+	ssize_t w;
+
+	if G_UNLIKELY(-1 == tth_store.index_fd) {
+		tth_store.dirty = TRUE;
+		return;
+	}
+
+	tth_store_record(buf, op, e);
+	w = write(tth_store.index_fd, buf, sizeof buf);
+
+	if G_UNLIKELY(w != sizeof buf) {
+		g_warning("%s(): could not append to TTH index: %s",
+			G_STRFUNC, -1 == w ? english_strerror(errno) : "partial write");
+		fd_forget_and_close(&tth_store.index_fd);
+		tth_store.dirty = TRUE;		/* Will be rewritten at next compaction */
+		return;
+	}
+
+	tth_store.records++;
+}
+
+/**
+ * Open the index log for appending records.
+ */
+static void
+tth_store_index_open(void)
+{
+	char *path;
+
+	g_assert(-1 == tth_store.index_fd);
+
+	path = make_pathname(tth_store_directory(), TTH_STORE_INDEX);
+	tth_store.index_fd = file_open(path, O_WRONLY | O_APPEND, 0);
+	HFREE_NULL(path);
+}
+
+struct tth_store_dump_context {
+	FILE *f;
+	size_t records;
+	bool failed;
+};
+
+static void
+tth_store_dump_entry(void *value, void *udata)
+{
+	const struct tth_entry *e = value;
+	struct tth_store_dump_context *ctx = udata;
+	char buf[TTH_REC_SIZE];
+
+	if (ctx->failed)
+		return;
+
+	tth_store_record(buf, TTH_REC_PUT, e);
+
+	if (1 != fwrite(buf, sizeof buf, 1, ctx->f))
+		ctx->failed = TRUE;
+	else
+		ctx->records++;
+}
+
+/**
+ * Rewrite the index log from the in-core index.
+ *
+ * @attention
+ * Must be called with the store locked.
+ */
+static void
+tth_store_index_rewrite(void)
+{
+	FILE *f;
+	file_path_t fp;
+
+	file_path_set(&fp, tth_store_directory(), TTH_STORE_INDEX);
+	f = file_config_open_write("TTH index", &fp);
+
+	if (f != NULL) {
+		struct tth_store_dump_context ctx;
+		char header[TTH_STORE_HEADER];
+
+		ZERO(&header);
+		memcpy(header, TTH_STORE_MAGIC, CONST_STRLEN(TTH_STORE_MAGIC));
+		poke_be32(&header[8], TTH_STORE_VERSION);
+
+		ZERO(&ctx);
+		ctx.f = f;
+		ctx.failed = 1 != fwrite(ARYLEN(header), 1, f);
+		hikset_foreach(tth_store.entries, tth_store_dump_entry, &ctx);
+
+		if (ctx.failed) {
+			g_warning("%s(): could not write TTH index: %m", G_STRFUNC);
+			fclose(f);
+		} else if (file_config_close(f, &fp)) {
+			fd_close(&tth_store.index_fd);
+			tth_store.records = ctx.records;
+			tth_store.dirty = FALSE;
+			tth_store_index_open();
+		}
+	}
+}
+
+/**
+ * Remove entry from its segment, logging its removal.
+ *
+ * The entry is not removed from the index, nor freed.
+ *
+ * @attention
+ * Must be called with the store locked.
+ */
+static void
+tth_store_drop(struct tth_entry *e)
+{
+	struct tth_segment *seg = &tth_store.seg[e->segment];
+
+	g_assert(seg->live >= e->nleaves * TTH_RAW_SIZE);
+
+	seg->live -= e->nleaves * TTH_RAW_SIZE;
+	tth_store_index_append(TTH_REC_DEL, e);
+}
+
 /**
- * This lock is used to protect the creation / removal of directories
- * under the TTH cache.
+ * Select the segment to which we can append the amount of bytes.
+ *
+ * @return the segment number, -1 if the store is full.
+ *
+ * @attention
+ * Must be called with the store locked.
  */
-static spinlock_t tth_path_lk = SPINLOCK_INIT;
+static int
+tth_store_writable(size_t size)
+{
+	uint i, n;
+
+	if (tth_store.seg[tth_store.current].size + size <= TTH_STORE_SEGMAX)
+		return tth_store.current;
+
+	for (i = 1; i < TTH_STORE_SEGMENTS; i++) {
+		n = (tth_store.current + i) % TTH_STORE_SEGMENTS;
+		if (0 == tth_store.seg[n].size) {
+			tth_store.current = n;
+			return n;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * Store the leaves of a tree.
+ *
+ * @param tth		the root hash
+ * @param leaves	the leaves
+ * @param n			amount of leaves
+ * @param stamp		insertion time
+ *
+ * @return TRUE if stored.
+ *
+ * @attention
+ * Must be called with the store locked.
+ */
+static bool
+tth_store_put(const struct tth *tth,
+	const struct tth *leaves, size_t n, time_t stamp)
+{
+	struct tth_entry *e;
+	struct tth_segment *seg;
+	size_t size;
+	ssize_t ret;
+	int s, fd;
+
+	STATIC_ASSERT(TTH_RAW_SIZE == sizeof(leaves[0]));
+
+	if G_UNLIKELY(tth_store.closed)
+		return FALSE;
+
+	size = TTH_RAW_SIZE * n;
+	s = tth_store_writable(size);
+
+	if G_UNLIKELY(-1 == s) {
+		g_warning("%s(%s): TTH store is full", G_STRFUNC, tth_base32(tth));
+		return FALSE;
+	}
+
+	fd = tth_store_segment_fd(s, TRUE);
+	if G_UNLIKELY(-1 == fd)
+		return FALSE;
+
+	seg = &tth_store.seg[s];
+	ret = pwrite(fd, leaves, size, seg->size);
 
-#define TTH_PATH_LOCK		spinlock(&tth_path_lk)
-#define TTH_PATH_UNLOCK		spinunlock(&tth_path_lk)
+	if ((ssize_t) -1 == ret) {
+		g_warning("%s(%s): write() failed: %m", G_STRFUNC, tth_base32(tth));
+		return FALSE;
+	} else if ((size_t) ret != size) {
+		g_warning("%s(%s): incomplete write()", G_STRFUNC, tth_base32(tth));
+		seg->size += ret;		/* Dead space */
+		return FALSE;
+	}
+
+	e = hikset_lookup(tth_store.entries, tth);
+
+	if (e != NULL) {
+		struct tth_segment *old = &tth_store.seg[e->segment];
+		old->live -= e->nleaves * TTH_RAW_SIZE;
+	} else {
+		WALLOC0(e);
+		e->tth = *tth;
+		hikset_insert_key(tth_store.entries, &e->tth);
+	}
+
+	e->segment = s;
+	e->offset = seg->size;
+	e->nleaves = n;
+	e->stamp = stamp;
+
+	seg->size += size;
+	seg->live += size;
+
+	tth_store_index_append(TTH_REC_PUT, e);
+	return TRUE;
+}
+
+/**
+ * Read the leaves of an entry.
+ *
+ * @return the amount of leaves read, 0 on error.
+ *
+ * @attention
+ * Must be called with the store locked.
+ */
+static size_t
+tth_store_read(const struct tth_entry *e, struct tth *leaves, size_t n)
+{
+	size_t size;
+	ssize_t ret;
+	int fd;
+
+	n = MIN(n, e->nleaves);
+	size = TTH_RAW_SIZE * n;
+
+	fd = tth_store_segment_fd(e->segment, FALSE);
+	if G_UNLIKELY(-1 == fd)
+		return 0;
+
+	ret = pread(fd, &leaves[0].data, size, e->offset);
+	if ((ssize_t) -1 == ret) {
+		g_warning("%s(%s): read() failed: %m", G_STRFUNC, tth_base32(&e->tth));
+		return 0;
+	}
+
+	return (size_t) ret == size ? n : 0;
+}
 
 static const char *
 tth_cache_directory(void)
@@ -116,73 +547,101 @@ tth_cache_pathname(const struct tth *tth)
 			&hash[0], G_DIR_SEPARATOR, &hash[2]);
 }
 
-static int
-tth_cache_file_create(const struct tth *tth)
+/**
+ * Migrate a tree from its file in the old cache to the store, removing
+ * the file.
+ *
+ * @param tth		the root hash
+ * @param path		the file holding the leaves
+ * @param stamp		the insertion time to record
+ *
+ * @return TRUE if the tree was migrated.
+ */
+static bool
+tth_cache_migrate(const struct tth *tth, const char *path, time_t stamp)
 {
-	char *pathname;
-	int accmode;
+	filestat_t sb;
+	struct tth *leaves = NULL;
+	size_t n = 0;
+	bool ok = FALSE, keep = FALSE;
 	int fd;
 
-	g_return_val_if_fail(tth, -1);
+	fd = file_open_missing(path, O_RDONLY);
+	if (-1 == fd)
+		return FALSE;
 
-	accmode = O_WRONLY | O_TRUNC;
-	pathname = tth_cache_pathname(tth);
+	if (fstat(fd, &sb)) {
+		g_warning("%s(%s): fstat() failed: %m", G_STRFUNC, tth_base32(tth));
+	} else if (
+		!S_ISREG(sb.st_mode) ||
+		sb.st_size % TTH_RAW_SIZE ||
+		sb.st_size < 2 * TTH_RAW_SIZE ||
+		sb.st_size > TTH_MAX_LEAVES * TTH_RAW_SIZE
+	) {
+		g_warning("%s(%s): bad filesize %s", G_STRFUNC,
+			tth_base32(tth), fileoffset_t_to_string(sb.st_size));
+	} else {
+		n = sb.st_size / TTH_RAW_SIZE;
+		leaves = halloc(sb.st_size);
+		if (read(fd, leaves, sb.st_size) == sb.st_size) {
+			struct tth root = tt_root_hash(leaves, n);
+			ok = tth_eq(tth, &root);
+		}
+	}
+
+	fd_forget_and_close(&fd);
 
 	/*
-	 * Critical section required since we could have a concurrent thread
-	 * deciding to remove empty directories whilst we are attempting
-	 * to create a new directory to store the new cached entry!
+	 * An invalid file is discarded, but when the store cannot take a valid
+	 * tree, we keep the file so that migration can be attempted again.
 	 */
 
-	TTH_PATH_LOCK;
-
-	fd = file_create_missing(pathname, accmode, TTH_FILE_MODE);
-	if (fd < 0 && ENOENT == errno) {
-		char *dir = filepath_directory(pathname);
-		if (0 == create_directory(dir, DEFAULT_DIRECTORY_MODE)) {
-			fd = file_create(pathname, accmode, TTH_FILE_MODE);
-		}
-		HFREE_NULL(dir);
+	if (ok) {
+		TTH_STORE_LOCK;
+		keep = !tth_store_put(tth, leaves, n, stamp);
+		TTH_STORE_UNLOCK;
+		ok = !keep;
+	} else if (debugging(0)) {
+		g_debug("%s(): discarding old TTH cache entry %s", G_STRFUNC, path);
 	}
 
-	TTH_PATH_UNLOCK;
-
-	HFREE_NULL(pathname);
-	return fd;
-}
-
-static int
-tth_cache_file_open(const struct tth *tth)
-{
-	char *pathname;
-	int fd;
+	HFREE_NULL(leaves);
 
-	g_return_val_if_fail(tth, -1);
+	if (!keep && -1 == unlink(path) && ENOENT != errno)
+		g_warning("%s(): cannot remove %s: %m", G_STRFUNC, path);
 
-	pathname = tth_cache_pathname(tth);
-	fd = file_open_missing(pathname, O_RDONLY);
-	HFREE_NULL(pathname);
-	return fd;
+	return ok;
 }
 
-static bool
-tth_cache_file_exists(const struct tth *tth)
+/**
+ * Migrate tree from the old cache, if still there.
+ *
+ * @return the entry for the migrated tree, NULL if not found.
+ *
+ * @attention
+ * Must be called with the store unlocked, returns with the store locked.
+ */
+static struct tth_entry *
+tth_cache_migrate_on_demand(const struct tth *tth)
 {
-	bool ret;
-	char *pathname;
+	if (atomic_bool_get(&tth_store_migrating)) {
+		char *path = tth_cache_pathname(tth);
+		tth_cache_migrate(tth, path, tm_time());
+		HFREE_NULL(path);
+	}
+
+	TTH_STORE_LOCK;
 
-	g_return_val_if_fail(tth, FALSE);
+	if G_UNLIKELY(tth_store.closed)
+		return NULL;
 
-	pathname = tth_cache_pathname(tth);
-	ret = file_exists(pathname);
-	HFREE_NULL(pathname);
-	return ret;
+	return hikset_lookup(tth_store.entries, tth);
 }
 
 void
 tth_cache_insert(const struct tth *tth, const struct tth *leaves, int n_leaves)
 {
-	int fd;
+	struct tth_entry *e;
 
 	g_return_if_fail(tth);
 	g_return_if_fail(leaves);
@@ -198,45 +657,24 @@ tth_cache_insert(const struct tth *tth, const struct tth *leaves, int n_leaves)
 	if (1 == n_leaves)
 		return;
 
-	fd = tth_cache_file_create(tth);
-	if (fd >= 0) {
-		size_t size;
-		ssize_t ret;
-
-		STATIC_ASSERT(TTH_RAW_SIZE == sizeof(leaves[0]));
+	TTH_STORE_LOCK;
 
-		size = TTH_RAW_SIZE * n_leaves;
-		ret = write(fd, leaves, size);
-		if ((ssize_t) -1 == ret) {
-			g_warning("%s(%s): write() failed: %m", G_STRFUNC, tth_base32(tth));
-		} else if ((size_t) ret != size) {
-			g_warning("%s(%s): incomplete write()", G_STRFUNC, tth_base32(tth));
-		}
-		fd_forget_and_close(&fd);
+	if G_UNLIKELY(tth_store.closed) {
+		TTH_STORE_UNLOCK;
+		return;
 	}
-}
 
-static size_t
-tth_cache_leave_count(const struct tth *tth, const filestat_t *sb)
-{
-	g_return_val_if_fail(tth, 0);
-	g_return_val_if_fail(sb, 0);
+	/*
+	 * Since the root hash matches the leaves, there is nothing to do if
+	 * we already have the same amount of leaves for that root.
+	 */
 
-	if (!S_ISREG(sb->st_mode)) {
-		g_warning("%s(%s): not a regular file", G_STRFUNC, tth_base32(tth));
-		return 0;
-	}
-	if (
-		sb->st_size % TTH_RAW_SIZE ||
-		sb->st_size < TTH_RAW_SIZE ||
-		sb->st_size > TTH_MAX_LEAVES * TTH_RAW_SIZE
-	) {
-		g_warning("%s(%s): bad filesize %s", G_STRFUNC,
-			tth_base32(tth), fileoffset_t_to_string(sb->st_size));
-		return 0;
-	}
+	e = hikset_lookup(tth_store.entries, tth);
+
+	if (NULL == e || e->nleaves != UNSIGNED(n_leaves))
+		tth_store_put(tth, leaves, n_leaves, tm_time());
 
-	return sb->st_size / TTH_RAW_SIZE;
+	TTH_STORE_UNLOCK;
 }
 
 /**
@@ -251,20 +689,20 @@ tth_cache_lookup(const struct tth *tth, filesize_t filesize)
 
 	expected = tt_good_node_count(filesize);
 	if (expected > 1) {
-		filestat_t sb;
-		char *pathname;
-
-		pathname = tth_cache_pathname(tth);
-		if (stat(pathname, &sb)) {
-			leave_count = 0;
-			if (ENOENT != errno) {
-				g_warning("%s(%s): stat(\"%s\") failed: %m",
-					G_STRFUNC, tth_base32(tth), pathname);
-			}
-		} else {
-			leave_count = tth_cache_leave_count(tth, &sb);
+		const struct tth_entry *e;
+
+		TTH_STORE_LOCK;
+		if G_UNLIKELY(tth_store.closed) {
+			TTH_STORE_UNLOCK;
+			return 0;
 		}
-		HFREE_NULL(pathname);
+		e = hikset_lookup(tth_store.entries, tth);
+		if G_UNLIKELY(NULL == e && atomic_bool_get(&tth_store_migrating)) {
+			TTH_STORE_UNLOCK;
+			e = tth_cache_migrate_on_demand(tth);
+		}
+		leave_count = NULL == e ? 0 : e->nleaves;
+		TTH_STORE_UNLOCK;
 	} else {
 		leave_count = 1;
 	}
@@ -274,50 +712,55 @@ tth_cache_lookup(const struct tth *tth, filesize_t filesize)
 void
 tth_cache_remove(const struct tth *tth)
 {
-	char *pathname;
+	struct tth_entry *e;
 
 	g_return_if_fail(tth);
 
-	pathname = tth_cache_pathname(tth);
-	unlink(pathname);
-	HFREE_NULL(pathname);
+	TTH_STORE_LOCK;
+
+	if G_UNLIKELY(tth_store.closed) {
+		TTH_STORE_UNLOCK;
+		return;
+	}
+
+	e = hikset_lookup(tth_store.entries, tth);
+	if (e != NULL) {
+		tth_store_drop(e);
+		hikset_remove(tth_store.entries, &e->tth);
+		WFREE(e);
+	}
+
+	TTH_STORE_UNLOCK;
 }
 
 static size_t
 tth_cache_get_leaves(const struct tth *tth,
 	struct tth leaves[TTH_MAX_LEAVES], size_t n)
 {
-	int fd, num_leaves = 0;
+	const struct tth_entry *e;
+	size_t num_leaves = 0;
 
 	g_return_val_if_fail(tth, 0);
 	g_return_val_if_fail(leaves, 0);
 
-	fd = tth_cache_file_open(tth);
-	if (fd >= 0) {
-		filestat_t sb;
+	TTH_STORE_LOCK;
 
-		if (fstat(fd, &sb)) {
-			g_warning("%s(%s): fstat() failed: %m", G_STRFUNC, tth_base32(tth));
-		} else {
-			size_t n_leaves;
+	if G_UNLIKELY(tth_store.closed) {
+		TTH_STORE_UNLOCK;
+		return 0;
+	}
+
+	e = hikset_lookup(tth_store.entries, tth);
+	if G_UNLIKELY(NULL == e && atomic_bool_get(&tth_store_migrating)) {
+		TTH_STORE_UNLOCK;
+		e = tth_cache_migrate_on_demand(tth);
+	}
 
-			n_leaves = tth_cache_leave_count(tth, &sb);
-			n_leaves = MIN(n, n_leaves);
-			if (n_leaves > 0) {
-				size_t size;
-				ssize_t ret;
+	if (e != NULL)
+		num_leaves = tth_store_read(e, leaves, n);
 
-				STATIC_ASSERT(TTH_RAW_SIZE == sizeof(leaves[0]));
+	TTH_STORE_UNLOCK;
 
-				size = TTH_RAW_SIZE * n_leaves;
-				ret = read(fd, &leaves[0].data, size);
-				if ((size_t) ret == size) {
-					num_leaves = n_leaves;
-				}
-			}
-		}
-		fd_forget_and_close(&fd);
-	}
 	return num_leaves;
 }
 
@@ -364,7 +807,7 @@ tth_cache_get_tree(const struct tth *tth, filesize_t filesize,
 		}
 	}
 
-	if (tth_cache_file_exists(tth)) {
+	if (n_leaves != 0) {
 		g_warning("%s(): removing corrupted tigertree for %s",
 			G_STRFUNC, tth_base32(tth));
 		tth_cache_remove(tth);
@@ -382,26 +825,296 @@ tth_cache_get_tree(const struct tth *tth, filesize_t filesize,
 size_t
 tth_cache_get_nleaves(const struct tth *tth)
 {
-	int fd;
-	filesize_t nleaves = 0;
+	const struct tth_entry *e;
+	size_t nleaves;
 
 	g_return_val_if_fail(tth != NULL, 0);
 
-	fd = tth_cache_file_open(tth);
+	TTH_STORE_LOCK;
+
+	if G_UNLIKELY(tth_store.closed) {
+		TTH_STORE_UNLOCK;
+		return 0;
+	}
+
+	e = hikset_lookup(tth_store.entries, tth);
+	if G_UNLIKELY(NULL == e && atomic_bool_get(&tth_store_migrating)) {
+		TTH_STORE_UNLOCK;
+		e = tth_cache_migrate_on_demand(tth);
+	}
+	nleaves = NULL == e ? 0 : e->nleaves;
+
+	TTH_STORE_UNLOCK;
+
+	return nleaves;
+}
+
+struct tth_store_compact_context {
+	pslist_t *moved;		/* Entries to move */
+	size_t count;			/* Amount of entries in list */
+	uint segment;			/* Segment being compacted */
+};
+
+static void
+tth_store_compact_collect(void *value, void *udata)
+{
+	struct tth_entry *e = value;
+	struct tth_store_compact_context *ctx = udata;
+
+	if (e->segment == ctx->segment && ctx->count < TTH_STORE_STEP) {
+		ctx->moved = pslist_prepend(ctx->moved, e);
+		ctx->count++;
+	}
+}
+
+/**
+ * Select segment to compact.
+ *
+ * @return the segment number, -1 if no segment needs compacting.
+ */
+static int
+tth_store_compact_select(void)
+{
+	int i, victim = -1;
+	fileoffset_t dead = 0;
+
+	/*
+	 * Pick the segment with the most dead space, provided more than half
+	 * of it is dead.
+	 */
+
+	for (i = 0; i < TTH_STORE_SEGMENTS; i++) {
+		const struct tth_segment *seg = &tth_store.seg[i];
+
+		if (UNSIGNED(i) == tth_store.current || 0 == seg->size)
+			continue;
+
+		if (seg->size - seg->live > MAX(dead, seg->live)) {
+			dead = seg->size - seg->live;
+			victim = i;
+		}
+	}
+
+	return victim;
+}
+
+/**
+ * Periodic callback to compact the store, a few trees at a time.
+ */
+static bool
+tth_store_compact(void *unused_data)
+{
+	struct tth_store_compact_context ctx;
+	struct tth *leaves;
+	pslist_t *sl;
+	int victim;
+
+	(void) unused_data;
+
+	TTH_STORE_LOCK;
+
+	victim = tth_store_compact_select();
+
+	if (victim >= 0) {
+		ZERO(&ctx);
+		ctx.segment = victim;
+		hikset_foreach(tth_store.entries, tth_store_compact_collect, &ctx);
+
+		HALLOC_ARRAY(leaves, TTH_MAX_LEAVES);
+
+		PSLIST_FOREACH(ctx.moved, sl) {
+			struct tth_entry *e = sl->data;
+			size_t n = tth_store_read(e, leaves, TTH_MAX_LEAVES);
+
+			if (n != e->nleaves || !tth_store_put(&e->tth, leaves, n, e->stamp)) {
+				tth_store_drop(e);
+				hikset_remove(tth_store.entries, &e->tth);
+				WFREE(e);
+			}
+		}
+
+		HFREE_NULL(leaves);
+		pslist_free_null(&ctx.moved);
+
+		if (debugging(0)) {
+			g_debug("%s(): moved %zu tree%s out of TTH segment #%d",
+				G_STRFUNC, PLURAL(ctx.count), victim);
+		}
+
+		if (0 == tth_store.seg[victim].live)
+			tth_store_segment_remove(victim);
+	}
+
+	if (
+		tth_store.dirty ||
+		(tth_store.records >= TTH_STORE_MIN &&
+			tth_store.records >
+				TTH_STORE_WASTE * hikset_count(tth_store.entries))
+	)
+		tth_store_index_rewrite();
+
+	TTH_STORE_UNLOCK;
+
+	return TRUE;		/* Keep calling */
+}
+
+/**
+ * Apply the records held in the index log to the in-core index.
+ *
+ * @param data		the log data, starting after the file header
+ * @param len		the length of the data
+ *
+ * @return the length of the valid log data.
+ */
+static size_t G_COLD
+tth_store_load(const char *data, size_t len)
+{
+	const char *p = data, *end = data + len;
+
+	while (p + TTH_REC_SIZE <= end) {
+		struct tth_entry *e;
+		const struct tth *tth = (const struct tth *) p;
+		uint8 op = p[38];
 
-	if (fd >= 0) {
-		filestat_t sb;
+		if (peek_be32(&p[40]) != crc32_update(0, p, 40))
+			break;
 
-		if (fstat(fd, &sb)) {
-			g_warning("%s(%s): fstat() failed: %m", G_STRFUNC, tth_base32(tth));
+		e = hikset_lookup(tth_store.entries, tth);
+
+		if (TTH_REC_DEL == op) {
+			if (e != NULL) {
+				hikset_remove(tth_store.entries, tth);
+				WFREE(e);
+			}
+		} else if (TTH_REC_PUT == op) {
+			uint16 segment = peek_be16(&p[36]);
+
+			if (segment >= TTH_STORE_SEGMENTS)
+				break;
+
+			if (NULL == e) {
+				WALLOC0(e);
+				e->tth = *tth;
+				hikset_insert_key(tth_store.entries, &e->tth);
+			}
+			e->offset = peek_be32(&p[24]);
+			e->nleaves = peek_be32(&p[28]);
+			e->stamp = peek_be32(&p[32]);
+			e->segment = segment;
 		} else {
-			nleaves = tth_cache_leave_count(tth, &sb);
+			break;
 		}
 
-		fd_forget_and_close(&fd);
+		tth_store.records++;
+		p += TTH_REC_SIZE;
 	}
 
-	return nleaves;
+	return p - data;
+}
+
+/**
+ * Check entry against the segment sizes, accounting for its leaves.
+ *
+ * @return TRUE if entry is invalid and was freed.
+ */
+static bool
+tth_store_account(void *value, void *unused_udata)
+{
+	struct tth_entry *e = value;
+	struct tth_segment *seg = &tth_store.seg[e->segment];
+	fileoffset_t size = e->nleaves * TTH_RAW_SIZE;
+
+	(void) unused_udata;
+
+	if (
+		e->nleaves < 2 || e->nleaves > TTH_MAX_LEAVES ||
+		e->offset + size > seg->size
+	) {
+		g_warning("%s(): discarding invalid TTH index entry for %s",
+			G_STRFUNC, tth_base32(&e->tth));
+		tth_store.dirty = TRUE;
+		WFREE(e);
+		return TRUE;
+	}
+
+	seg->live += size;
+	return FALSE;
+}
+
+/**
+ * Load the index and the segments of the store.
+ */
+static void G_COLD
+tth_store_open(void)
+{
+	char *path;
+	filestat_t sb;
+	size_t len, valid = 0;
+	char *data = NULL;
+	uint i;
+	int fd;
+
+	for (i = 0; i < TTH_STORE_SEGMENTS; i++) {
+		tth_store.seg[i].fd = -1;
+
+		if (-1 != tth_store_segment_fd(i, FALSE)) {
+			if (0 == fstat(tth_store.seg[i].fd, &sb))
+				tth_store.seg[i].size = sb.st_size;
+			if (tth_store.seg[i].size != 0)
+				tth_store.current = i;
+		}
+	}
+
+	path = make_pathname(tth_store_directory(), TTH_STORE_INDEX);
+	fd = file_open_missing(path, O_RDWR);
+
+	if (-1 == fd || -1 == fstat(fd, &sb) || sb.st_size < TTH_STORE_HEADER) {
+		len = 0;
+	} else {
+		len = sb.st_size;
+		data = halloc(len);
+
+		if (UNSIGNED(pread(fd, data, len, 0)) != len) {
+			g_warning("%s(): cannot read \"%s\": %m", G_STRFUNC, path);
+		} else if (
+			0 != memcmp(data, TTH_STORE_MAGIC, CONST_STRLEN(TTH_STORE_MAGIC)) ||
+			peek_be32(&data[8]) != TTH_STORE_VERSION
+		) {
+			g_warning("%s(): ignoring \"%s\": bad magic or version",
+				G_STRFUNC, path);
+		} else {
+			valid = TTH_STORE_HEADER +
+				tth_store_load(&data[TTH_STORE_HEADER],
+					len - TTH_STORE_HEADER);
+		}
+		HFREE_NULL(data);
+	}
+
+	fd_forget_and_close(&fd);
+
+	hikset_foreach_remove(tth_store.entries, tth_store_account, NULL);
+
+	/*
+	 * Rewrite the index when we could not use all of it, which also
+	 * creates it initially.
+	 */
+
+	if (valid != len || 0 == len || tth_store.dirty) {
+		if (len != 0) {
+			g_warning("%s(): rewriting \"%s\" (%zu valid byte%s out of %zu)",
+				G_STRFUNC, path, PLURAL(valid), len);
+		}
+		tth_store_index_rewrite();
+	} else {
+		tth_store_index_open();
+	}
+
+	if (debugging(0)) {
+		g_debug("%s(): loaded %zu tree%s from TTH store", G_STRFUNC,
+			PLURAL(hikset_count(tth_store.entries)));
+	}
+
+	HFREE_NULL(path);
 }
 
 /**
@@ -414,27 +1127,12 @@ tth_cache_dir_rmdir(const char *path)
 	if (debugging(0))
 		g_message("%s(): removing TTH cache directory %s", G_STRFUNC, path);
 
-	/*
-	 * To avoid any conflicts with another thread attempting to create a
-	 * file under that directory, take a lock.
-	 *
-	 * Note that there is a race condition between the traversal that detects
-	 * the directory is empty and the time we actually attempt to remove it.
-	 * Hence, we silence any error having to deal with the directory being
-	 * non-empty and therefore non-removable.
-	 */
-
-	TTH_PATH_LOCK;
-
 	if (-1 == rmdir(path) && ENOTEMPTY != errno) {
 		g_warning("%s(): cannot remove TTH cache directory %s: %m",
 			G_STRFUNC, path);
 	}
-
-	TTH_PATH_UNLOCK;
 }
 
-
 /**
  * ftw_foreach() callback to remove empty directories.
  */
@@ -451,7 +1149,7 @@ tth_cache_cleanup_rmdir(
 			tth_cache_dir_rmdir(info->fpath);	/* Try, we can't read it */
 		} else if (FTW_F_DONE & info->flags) {
 			void *cnt = (*dirsp)->data;
-			if (NULL == cnt && 0 != info->level)
+			if (NULL == cnt)
 				tth_cache_dir_rmdir(info->fpath);
 			*dirsp = pslist_delete_link(*dirsp, *dirsp);	/* Strip head */
 		} else {
@@ -465,199 +1163,214 @@ tth_cache_cleanup_rmdir(
 }
 
 /**
- * Unlink cached file entry, warning if it cannot be done but otherwise not
- * logging anything on success.
- *
- * @return TRUE on success
- */
-static bool
-tth_cache_file_unlink(const char *path, const char *reason)
-{
-	if (-1 == unlink(path)) {
-		g_warning("%s(): cannot remove %s TTH cache entry %s: %m",
-			G_STRFUNC, reason, path);
-		return FALSE;
-	}
-
-	return TRUE;
-}
-
-/**
- * Remove cached file entry, logging success.
- */
-static void
-tth_cache_file_remove(const char *path, const char *reason)
-{
-	if (tth_cache_file_unlink(path, reason))
-		g_message("removed %s TTH cache entry: %s", reason, path);
-}
-
-/**
- * ftw_foreach() callback to remove obsolete / spurious files.
+ * ftw_foreach() callback to migrate cached trees to the store.
  */
 static ftw_status_t
-tth_cache_cleanup_unlink(
+tth_cache_migrate_file(
 	const ftw_info_t *info, const filestat_t *sb, void *data)
 {
-	const hset_t *shared = data;
+	size_t *migrated = data;
+	char **path;
+	struct tth tth;
+	char b32[TTH_BASE32_SIZE + 2];
+	size_t len;
 
-	if (FTW_F_DIR & info->flags)
-		return FTW_STATUS_OK;
+	if (atomic_bool_get(&tth_store.closed))
+		return FTW_STATUS_ABORT;
 
-	if ((FTW_F_OTHER | FTW_F_SYMLINK) & info->flags) {
-		tth_cache_file_remove(info->fpath, "alien");
+	if (!(FTW_F_FILE & info->flags) || (FTW_F_NOSTAT & info->flags))
 		return FTW_STATUS_OK;
-	}
-
-	if (FTW_F_FILE & info->flags) {
-		char **path;
-		struct tth tth;
-		char b32[TTH_BASE32_SIZE + 2];
-		size_t len;
-
-		if (FTW_F_NOSTAT & info->flags) {
-			g_warning("%s(): ignoring unaccessible cached TTH %s",
-				G_STRFUNC, info->fpath);
-			return FTW_STATUS_OK;
-		}
 
-		if (info->level != 2) {
-			tth_cache_file_remove(info->fpath, "spurious");
-			return FTW_STATUS_OK;
-		}
-
-		path = g_strsplit(info->rpath, "/", 2);
-
-		if (NULL == path)
-			return FTW_STATUS_ABORT;	/* Weird, empty relative path? */
-
-		len = str_bprintf(ARYLEN(b32), "%s", path[0]);
-		if (len != 2)		/* Expected first path component is 2-char long */
-			len = 0;
-		len += str_bprintf(ARYPOSLEN(b32, len), "%s", path[1]);
+	if (info->level != 2)
+		return FTW_STATUS_OK;
 
-		if (
-			TTH_BASE32_SIZE != len ||
-			TTH_RAW_SIZE != base32_decode(VARLEN(tth), b32, TTH_BASE32_SIZE)
-		) {
-			tth_cache_file_remove(info->fpath, "invalid");
-			goto done;
-		}
+	path = g_strsplit(info->rpath, "/", 2);
 
-		/*
-		 * At this point, we have a valid TTH cache filename.
-		 *
-		 * We want to only process files created before the session started.
-		 *
-		 * The rationale is that users could start unsharing directories,
-		 * moving files around, add new files, etc..  Each time a new library
-		 * rescan occurs, we're going to create new TTH cache files, or some
-		 * cached files could become unused for a while and then files will
-		 * reappear in the library.
-		 *
-		 * By only ever cleaning up files created before the current session,
-		 * we have a higher likelyhood of processing an obsolete cache entry.
-		 */
-
-		if (delta_time(sb->st_mtime, GNET_PROPERTY(session_start_stamp)) >= 0)
-			goto done;		/* Created after session started, skip */
-
-		if (!hset_contains(shared, &tth)) {
-			if (debugging(0))
-				g_debug("%s(): unshared TTH (%s)", G_STRFUNC, info->rpath);
-			(void) tth_cache_file_unlink(info->fpath, "unshared");
-		}
+	if (NULL == path)
+		return FTW_STATUS_ABORT;	/* Weird, empty relative path? */
 
-		/* FALL THROUGH */
+	len = str_bprintf(ARYLEN(b32), "%s", path[0]);
+	if (len != 2)		/* Expected first path component is 2-char long */
+		len = 0;
+	len += str_bprintf(ARYPOSLEN(b32, len), "%s", path[1]);
 
-	done:
-		g_strfreev(path);
-		return FTW_STATUS_OK;
+	if (
+		TTH_BASE32_SIZE == len &&
+		TTH_RAW_SIZE == base32_decode(VARLEN(tth), b32, TTH_BASE32_SIZE)
+	) {
+		if (tth_cache_migrate(&tth, info->fpath, sb->st_mtime))
+			(*migrated)++;
 	}
 
-	g_assert_not_reached();
-	return FTW_STATUS_ERROR;
+	g_strfreev(path);
+	return FTW_STATUS_OK;
 }
 
-static int tth_cache_cleanups;
-
 /**
- * Main entry point for the thread that cleans up the TTH cache.
+ * Main entry point for the thread migrating the old TTH cache to the store.
  */
 static void *
-tth_cache_cleanup_thread(void *unused_arg)
+tth_cache_migrate_thread(void *unused_arg)
 {
-	hset_t *shared;
 	const char *rootdir = tth_cache_directory();
-	pslist_t *dirstack;
+	pslist_t *dirstack = NULL;
 	uint32 flags;
+	size_t migrated = 0;
 	ftw_status_t res;
 
 	(void) unused_arg;
 
-	if (!is_directory(rootdir))
-		goto done;			/* No TTH cache */
-
-	/*
-	 * First pass: spot all file entries that are older than our start
-	 * time (i.e. were created in another session) and which cannot be
-	 * associated with a shared file.
-	 */
-
-	shared = share_tthset_get();
 	flags = FTW_O_PHYS | FTW_O_MOUNT | FTW_O_ALL;
-	res = ftw_foreach(rootdir, flags, 0, tth_cache_cleanup_unlink, shared);
-	share_tthset_free(shared);
+	res = ftw_foreach(rootdir, flags, 0, tth_cache_migrate_file, &migrated);
+
+	g_info("migrated %zu tigertree%s to the TTH store", PLURAL(migrated));
 
-	if (res != FTW_STATUS_OK) {
-		g_warning("%s(): initial traversal failed with %d, aborting",
-			G_STRFUNC, res);
-		goto done;
+	if (FTW_STATUS_OK == res) {
+		/* Remove the directories, now that they should be empty */
+		flags |= FTW_O_ENTRY | FTW_O_DEPTH;
+		(void) ftw_foreach(rootdir, flags, 0,
+			tth_cache_cleanup_rmdir, &dirstack);
+		pslist_free(dirstack);
 	}
 
+	atomic_bool_set(&tth_store_migrating, FALSE);
+	return NULL;
+}
+
+/**
+ * hikset_foreach_remove() callback to remove trees no longer shared.
+ *
+ * @return TRUE if the entry was freed.
+ */
+static bool
+tth_store_unshared(void *value, void *data)
+{
+	struct tth_entry *e = value;
+	const hset_t *shared = data;
+
 	/*
-	 * Second pass: spot empty directories and remove them.
+	 * We want to only remove trees inserted before the session started.
+	 *
+	 * The rationale is that users could start unsharing directories,
+	 * moving files around, add new files, etc..  Each time a new library
+	 * rescan occurs, we're going to insert new trees, or some cached trees
+	 * could become unused for a while and then files will reappear in the
+	 * library.
+	 *
+	 * By only ever cleaning up trees inserted before the current session,
+	 * we have a higher likelyhood of processing an obsolete cache entry.
 	 */
 
-	flags |= FTW_O_ENTRY | FTW_O_DEPTH;
-	dirstack = NULL;
-	(void) ftw_foreach(rootdir, flags, 0, tth_cache_cleanup_rmdir, &dirstack);
-	pslist_free(dirstack);
+	if (delta_time(e->stamp, GNET_PROPERTY(session_start_stamp)) >= 0)
+		return FALSE;		/* Inserted after session started, skip */
 
-	/* FALL THROUGH */
+	if (hset_contains(shared, &e->tth))
+		return FALSE;
 
-done:
-	atomic_int_dec(&tth_cache_cleanups);
-	return NULL;
+	if (debugging(0))
+		g_debug("%s(): unshared TTH %s", G_STRFUNC, tth_base32(&e->tth));
+
+	tth_store_drop(e);
+	WFREE(e);
+	return TRUE;
 }
 
 /**
  * Cleanup the TTH cache by removing needless entries.
+ *
+ * The space they occupied is reclaimed by the subsequent compactions.
  */
 void
 tth_cache_cleanup(void)
 {
-	if (0 == atomic_int_inc(&tth_cache_cleanups)) {
-		int id = thread_create(tth_cache_cleanup_thread,
-					NULL, THREAD_F_DETACH | THREAD_F_WARN, THREAD_STACK_MIN);
-		if (-1 == id)
-			atomic_int_dec(&tth_cache_cleanups);
-	} else if (debugging(0)) {
-		g_warning("%s(): concurrent cleanup in progress", G_STRFUNC);
-		atomic_int_dec(&tth_cache_cleanups);
+	hset_t *shared;
+	size_t removed;
+
+	shared = share_tthset_get();
+
+	TTH_STORE_LOCK;
+	removed = hikset_foreach_remove(tth_store.entries,
+		tth_store_unshared, shared);
+	TTH_STORE_UNLOCK;
+
+	share_tthset_free(shared);
+
+	if (debugging(0)) {
+		g_debug("%s(): removed %zu unshared tree%s",
+			G_STRFUNC, PLURAL(removed));
 	}
 }
 
-void
+void G_COLD
 tth_cache_init(void)
 {
-	/* NOTHING */
+	crc_init();
+
+	if (!is_directory(tth_store_directory())) {
+		if (-1 == create_directory(tth_store_directory(),
+				DEFAULT_DIRECTORY_MODE)) {
+			g_warning("%s(): cannot create %s: %m",
+				G_STRFUNC, tth_store_directory());
+		}
+	}
+
+	tth_store.index_fd = -1;
+	tth_store.entries = hikset_create(
+		offsetof(struct tth_entry, tth), HASH_KEY_FIXED, TTH_RAW_SIZE);
+
+	tth_store_open();
+
+	tth_store.compact_ev =
+		cq_periodic_main_add(TTH_STORE_PERIOD, tth_store_compact, NULL);
+
+	/*
+	 * Migrate the old cache, with one file per tree, in the background.
+	 */
+
+	if (is_directory(tth_cache_directory())) {
+		int id;
+
+		atomic_bool_set(&tth_store_migrating, TRUE);
+		id = thread_create(tth_cache_migrate_thread,
+				NULL, THREAD_F_DETACH | THREAD_F_WARN, THREAD_STACK_MIN);
+		if (-1 == id)
+			atomic_bool_set(&tth_store_migrating, FALSE);
+	}
 }
 
-void
+static void
+tth_store_free_entry(void *value, void *unused_udata)
+{
+	struct tth_entry *e = value;
+
+	(void) unused_udata;
+
+	WFREE(e);
+}
+
+void G_COLD
 tth_cache_close(void)
 {
-	/* NOTHING */
+	uint i;
+
+	cq_periodic_remove(&tth_store.compact_ev);
+
+	TTH_STORE_LOCK;
+
+	atomic_bool_set(&tth_store.closed, TRUE);
+
+	if (tth_store.dirty)
+		tth_store_index_rewrite();
+
+	fd_forget_and_close(&tth_store.index_fd);
+
+	for (i = 0; i < TTH_STORE_SEGMENTS; i++)
+		fd_forget_and_close(&tth_store.seg[i].fd);
+
+	hikset_foreach(tth_store.entries, tth_store_free_entry, NULL);
+	hikset_free_null(&tth_store.entries);
+
+	TTH_STORE_UNLOCK;
 }
 
 /* vi: set ts=4 sw=4 cindent: */
@@ -69,6 +69,9 @@
 #define BUFFER_NAGLE	500		/**< 500 ms */
 #define BUFFER_DELAY	2		/**< 2 secs -- max Nagle delay */
 
+#define DEFLATE_FAST_LEVEL	3		/**< Level used when link is not saturated */
+#define DEFLATE_POOR_RATIO	0.10	/**< Below that, data barely compress */
+
 struct buffer {
 	char *arena;				/**< Buffer arena */
 	char *end;					/**< First byte outside buffer */
@@ -100,6 +103,8 @@ struct attr {
 	tx_closed_t closed;			/**< Callback to invoke when layer closed */
 	void *closed_arg;			/**< Argument for closing routine */
 	time_t nagle_start;			/**< When we started the Nagle timer */
+	int level;					/**< Current compression level */
+	int max_level;				/**< Configured compression level */
 	struct {
 		bool		enabled;	/**< Whether to use gzip encapsulation */
 		uint32		size;		/**< Payload size counter for gzip */
@@ -116,6 +121,7 @@ struct attr {
 #define DF_NAGLE		0x00000002	/**< Nagle timer started */
 #define DF_FLUSH		0x00000004	/**< Flushing started */
 #define DF_SHUTDOWN		0x00000008	/**< Stack has shut down */
+#define DF_SATURATED	0x00000010	/**< Flow-controlled since last flush */
 
 static void deflate_nagle_timeout(cqueue_t *cq, void *arg);
 static size_t tx_deflate_pending(txdrv_t *tx);
@@ -318,7 +324,7 @@ deflate_set_flowc(txdrv_t *tx, bool on)
 	struct attr *attr = tx->opaque;
 
 	if (on) {
-		attr->flags |= DF_FLOWC;		/* Enter flow control */
+		attr->flags |= DF_FLOWC | DF_SATURATED;	/* Enter flow control */
 	} else {
 		attr->flags &= ~DF_FLOWC;		/* Leave flow control state */
 	}
@@ -335,6 +341,106 @@ deflate_set_flowc(txdrv_t *tx, bool on)
 		attr->cb->flow_control(tx->owner, on ? deflate_buffered(tx) : 0);
 }
 
+/**
+ * Compress data with deflate(), accounting for the time spent doing so.
+ *
+ * @return the deflate() status.
+ */
+static int
+deflate_timed(txdrv_t *tx, int flush)
+{
+	struct attr *attr = tx->opaque;
+	tm_nano_t start, end, elapsed;
+	int ret;
+
+	tm_precise_time(&start);
+	ret = deflate(attr->outz, flush);
+	tm_precise_time(&end);
+
+	if (NULL != attr->cb->add_tx_deflate_cost) {
+		tm_precise_elapsed(&elapsed, &end, &start);
+		attr->cb->add_tx_deflate_cost(tx->owner, tmn2ns(&elapsed));
+	}
+
+	return ret;
+}
+
+/**
+ * Compute the compression level to use for the next data.
+ *
+ * There is no point in spending CPU to get the best compression when the
+ * link is not saturated: we use a fast level and only go up to the configured
+ * level when the link entered flow-control since the last flush, meaning
+ * bandwidth is the bottleneck.  When the CPU is overloaded or the data do not
+ * compress well, we use the fastest level.
+ */
+static int
+deflate_adapt_level(const struct attr *attr)
+{
+	if (!GNET_PROPERTY(deflate_adaptive))
+		return attr->max_level;
+
+	if (GNET_PROPERTY(overloaded_cpu) || attr->ratio_ema < DEFLATE_POOR_RATIO)
+		return Z_BEST_SPEED;
+
+	if (attr->flags & DF_SATURATED)
+		return attr->max_level;
+
+	return MIN(DEFLATE_FAST_LEVEL, attr->max_level);
+}
+
+/**
+ * Adjust the compression level, if needed, once pending data were flushed.
+ */
+static void
+deflate_adapt(txdrv_t *tx)
+{
+	struct attr *attr = tx->opaque;
+	z_streamp outz = attr->outz;
+	struct buffer *b = &attr->buf[attr->fill_idx];
+	int level, ret, old_avail;
+
+	level = deflate_adapt_level(attr);
+	attr->flags &= ~DF_SATURATED;
+
+	if (level == attr->level || b->wptr >= b->end)
+		return;
+
+	/*
+	 * Since everything was flushed, deflateParams() has no pending data
+	 * to compress with the old parameters, but we supply the output buffer
+	 * anyway in case zlib emits an empty block.
+	 */
+
+	outz->next_out = cast_to_pointer(b->wptr);
+	outz->avail_out = old_avail = b->end - b->wptr;
+	outz->avail_in = 0;
+
+	ret = deflateParams(outz, level, Z_DEFAULT_STRATEGY);
+
+	b->wptr = cast_to_pointer(outz->next_out);
+
+	if (NULL != attr->cb->add_tx_deflated && old_avail != (int) outz->avail_out)
+		attr->cb->add_tx_deflated(tx->owner, old_avail - outz->avail_out);
+
+	if (Z_OK != ret) {
+		if (tx_deflate_debugging(0)) {
+			g_debug("TX %s: (%s) cannot switch to level %d: %s",
+				G_STRFUNC, gnet_host_to_string(&tx->host), level,
+				zlib_strerror(ret));
+		}
+		return;
+	}
+
+	if (tx_deflate_debugging(2)) {
+		g_debug("TX %s: (%s) compression level %d -> %d (EMA=%.2f%%)",
+			G_STRFUNC, gnet_host_to_string(&tx->host),
+			attr->level, level, 100 * attr->ratio_ema);
+	}
+
+	attr->level = level;
+}
+
 /**
  * Pending data were all flushed.
  */
@@ -375,6 +481,9 @@ deflate_flushed(txdrv_t *tx)
 done:
 	attr->unflushed = attr->flushed = 0;
 	attr->flags &= ~DF_FLUSH;
+
+	if (!(tx->flags & TX_CLOSING))
+		deflate_adapt(tx);
 }
 
 /**
@@ -418,7 +527,7 @@ retry:
 
 	g_assert(outz->avail_out > 0);
 
-	ret = deflate(outz, (tx->flags & TX_CLOSING) ? Z_FINISH : Z_SYNC_FLUSH);
+	ret = deflate_timed(tx, (tx->flags & TX_CLOSING) ? Z_FINISH : Z_SYNC_FLUSH);
 
 	switch (ret) {
 	case Z_BUF_ERROR:				/* Nothing to flush */
@@ -602,7 +711,7 @@ deflate_add(txdrv_t *tx, const void *data, int len)
 		 * that we have more room available for the output.
 		 */
 
-		ret = deflate(outz, flush_started ? Z_SYNC_FLUSH : 0);
+		ret = deflate_timed(tx, flush_started ? Z_SYNC_FLUSH : 0);
 
 		if (Z_OK != ret) {
 			attr->flags |= DF_SHUTDOWN;
@@ -826,7 +935,7 @@ tx_deflate_init(txdrv_t *tx, void *args)
 	struct attr *attr;
 	struct tx_deflate_args *targs = args;
 	z_streamp outz;
-	int ret;
+	int ret, max_level;
 	int i;
 
 	g_assert(tx);
@@ -879,13 +988,14 @@ tx_deflate_init(txdrv_t *tx, void *args)
 			/* Ultra -> Leaf connection */
 			window_bits = 14;
 			mem_level = 6;
-			level = Z_DEFAULT_COMPRESSION;
+			level = 6;				/* Z_DEFAULT_COMPRESSION */
 		}
 
 		g_assert(window_bits >= 8 && window_bits <= MAX_WBITS);
 		g_assert(mem_level >= 1 && mem_level <= MAX_MEM_LEVEL);
-		g_assert(level == Z_DEFAULT_COMPRESSION ||
-			(level >= Z_BEST_SPEED && level <= Z_BEST_COMPRESSION));
+		g_assert(level >= Z_BEST_SPEED && level <= Z_BEST_COMPRESSION);
+
+		max_level = level;
 
 		ret = deflateInit2(outz, level, Z_DEFLATED,
 				targs->gzip ? (-window_bits) : window_bits, mem_level,
@@ -906,6 +1016,7 @@ tx_deflate_init(txdrv_t *tx, void *args)
 	attr->buffer_flush = targs->buffer_flush;
 	attr->nagle = booleanize(targs->nagle);
 	attr->gzip.enabled = targs->gzip;
+	attr->level = attr->max_level = max_level;
 
 	attr->outz = outz;
 	attr->tm_ev = NULL;
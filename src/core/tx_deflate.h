@@ -48,6 +48,7 @@ struct tx_deflate_cb {
 	void (*add_tx_deflated)(void *owner, int amount);
 	void (*shutdown)(void *owner, const char *reason, ...);
 	void (*flow_control)(void *owner, size_t amount);
+	void (*add_tx_deflate_cost)(void *owner, uint64 ns);
 };
 
 /**
@@ -47,6 +47,13 @@
  * so each thread can use almost all its processing ticks to actually compute
  * the hash value.
  *
+ * Since hashing is I/O bound, the work is scheduled per device: files not
+ * requested with high priority are processed in increasing inode and offset
+ * order on each device (an approximation of their on-disk location), sweeping
+ * the device like an elevator, and the amount of threads concurrently reading
+ * from the same device is limited to avoid seek thrashing.  High-priority
+ * requests are served first and are not subject to that limit.
+ *
  * @author Raphael Manfredi
  * @date 2002-2003, 2013
  */
@@ -66,12 +73,16 @@
 #include "lib/constants.h"
 #include "lib/cq.h"
 #include "lib/entropy.h"
+#include "lib/erbtree.h"
 #include "lib/file.h"
 #include "lib/file_object.h"
 #include "lib/getcpucount.h"
 #include "lib/halloc.h"
 #include "lib/hashing.h"
 #include "lib/hashlist.h"
+#include "lib/hikset.h"
+#include "lib/pslist.h"
+#include "lib/spinlock.h"
 #include "lib/str.h"
 #include "lib/stringify.h"		/* For short_time_ascii() */
 #include "lib/teq.h"
@@ -86,9 +97,31 @@
 #define HASH_THREAD_MAX			2			/**< At most 2 hashing threads */
 #define VERIFY_DEFERRED			10			/**< ms: deferred free timeout */
 #define VERIFY_PROGRESS_NOTIFY	1			/**< s: progress notification */
+#define VERIFY_DEVICE_WAIT		50			/**< ms: wait for busy device */
+#define VERIFY_RATE_PERIOD		2			/**< s: rate computation period */
 
 #define VERIFY_INVALID_LOCAL_ID -1U
 
+/**
+ * Hashing activity on a device, shared by all the verification contexts.
+ */
+struct verify_device {
+	dev_t dev;					/**< Device (embedded key) */
+	uint readers;				/**< Threads currently reading from device */
+	size_t queued;				/**< Amount of queued files */
+	uint64 pending;				/**< Bytes remaining to hash */
+	uint64 hashed;				/**< Total bytes hashed */
+	uint64 window;				/**< Bytes hashed in current period */
+	uint64 rate;				/**< Average hashing rate, in bytes/s */
+	time_t window_start;		/**< Start of current period */
+};
+
+static hikset_t *verify_devices;	/**< struct verify_device, by dev_t */
+static spinlock_t verify_devices_slk = SPINLOCK_INIT;
+
+#define VERIFY_DEVICES_LOCK		spinlock(&verify_devices_slk)
+#define VERIFY_DEVICES_UNLOCK	spinunlock(&verify_devices_slk)
+
 enum verify_magic { VERIFY_MAGIC = 0x2dc84379U };
 
 /**
@@ -97,6 +130,8 @@ enum verify_magic { VERIFY_MAGIC = 0x2dc84379U };
 struct verify {
 	enum verify_magic magic;	/**< Magic number. */
 	hash_list_t *files_to_hash;	/**< Work queue */
+	erbtree_t pending;			/**< Normal-priority work, in disk order */
+	uint64 seq;					/**< Enqueuing sequence number */
 	const struct verify_hash hash;	/**< Hash-specific processing callbacks */
 	struct bgtask *task;		/**< Background task handling the processing */
 	bgsched_t *sched;			/**< Task scheduler for this thread */
@@ -110,6 +145,10 @@ struct verify {
 	time_t last_progress;		/**< Last time we informed about progress */
 	char *buffer;				/**< Read buffer */
 	size_t buffer_size;			/**< Size of buffer in bytes. */
+	struct verify_device *device;	/**< Device we are reading from */
+	dev_t dev;					/**< Device of last file started */
+	ino_t ino;					/**< Inode of last file started */
+	bool high_priority;			/**< Whether current file is high-priority */
 
 	enum verify_status status;	/**< Used for callback multiplexing. */
 	uint8 shutdowned;			/**< Flag indicating context was shutdown */
@@ -159,6 +198,11 @@ struct verify_file {
 	filesize_t amount;				/**< Amount of bytes to hash */
 	verify_callback	callback;		/**< User-specified callback function */
 	void *user_data;				/**< Callback argument */
+	dev_t dev;						/**< Device holding the file */
+	ino_t ino;						/**< Inode of the file */
+	uint64 seq;						/**< Enqueuing sequence number */
+	bool high_priority;				/**< Whether served first */
+	rbnode_t node;					/**< Embedded node in pending tree */
 };
 
 static inline void
@@ -187,6 +231,211 @@ verify_file_new(const char *pathname, filesize_t offset, filesize_t amount,
 	return item;
 }
 
+/**
+ * Comparison of pending files, by device, inode and offset.
+ *
+ * Items with the same location are sorted by sequence number so that each
+ * item has a unique position in the tree.
+ */
+static int
+verify_file_cmp(const void *p, const void *q)
+{
+	const struct verify_file *a = p, *b = q;
+	int c;
+
+	if (0 != (c = CMP(a->dev, b->dev)))
+		return c;
+	if (0 != (c = CMP(a->ino, b->ino)))
+		return c;
+	if (0 != (c = CMP(a->offset, b->offset)))
+		return c;
+	return CMP(a->seq, b->seq);
+}
+
+/**
+ * Get device information, creating it if missing.
+ *
+ * @attention
+ * Must be called with the device lock held.
+ */
+static struct verify_device *
+verify_device_get(dev_t dev)
+{
+	struct verify_device *d;
+
+	if G_UNLIKELY(NULL == verify_devices) {
+		verify_devices = hikset_create(
+			offsetof(struct verify_device, dev), HASH_KEY_FIXED, sizeof(dev_t));
+	}
+
+	d = hikset_lookup(verify_devices, &dev);
+
+	if G_UNLIKELY(NULL == d) {
+		WALLOC0(d);
+		d->dev = dev;
+		d->window_start = tm_time();
+		hikset_insert_key(verify_devices, &d->dev);
+	}
+
+	return d;
+}
+
+/**
+ * Account for a file being enqueued (positive sign) or dequeued (negative
+ * sign) without being hashed.
+ */
+static void
+verify_device_queue(const struct verify_file *item, int sign)
+{
+	struct verify_device *d;
+
+	VERIFY_DEVICES_LOCK;
+	d = verify_device_get(item->dev);
+	if (sign > 0) {
+		d->queued++;
+		d->pending += item->amount;
+	} else {
+		g_assert(d->queued != 0);
+		d->queued--;
+		d->pending -= MIN(d->pending, item->amount);
+	}
+	VERIFY_DEVICES_UNLOCK;
+}
+
+/**
+ * Attempt to start reading from the device of the file.
+ *
+ * @param ctx		the verification context
+ * @param item		the file we want to process
+ * @param force		whether to ignore the limit of concurrent readers
+ *
+ * @return TRUE if we can read from the device, FALSE if it is busy.
+ */
+static bool
+verify_device_acquire(struct verify *ctx, const struct verify_file *item,
+	bool force)
+{
+	struct verify_device *d;
+	bool ok = FALSE;
+
+	g_assert(NULL == ctx->device);
+
+	VERIFY_DEVICES_LOCK;
+	d = verify_device_get(item->dev);
+	if (force || d->readers < GNET_PROPERTY(verify_device_readers)) {
+		d->readers++;
+		g_assert(d->queued != 0);
+		d->queued--;
+		ctx->device = d;
+		ok = TRUE;
+	}
+	VERIFY_DEVICES_UNLOCK;
+
+	return ok;
+}
+
+/**
+ * Stop reading from the device, discarding any bytes we did not hash.
+ */
+static void
+verify_device_release(struct verify *ctx)
+{
+	struct verify_device *d = ctx->device;
+
+	if (NULL == d)
+		return;
+
+	VERIFY_DEVICES_LOCK;
+	g_assert(d->readers != 0);
+	d->readers--;
+	d->pending -= MIN(d->pending, ctx->end - ctx->offset);
+	VERIFY_DEVICES_UNLOCK;
+
+	ctx->device = NULL;
+}
+
+/**
+ * Account for bytes hashed from the device.
+ */
+static void
+verify_device_hashed(struct verify_device *d, size_t n)
+{
+	time_t now = tm_time();
+	time_delta_t elapsed;
+
+	VERIFY_DEVICES_LOCK;
+	d->hashed += n;
+	d->window += n;
+	d->pending -= MIN(d->pending, n);
+	elapsed = delta_time(now, d->window_start);
+	if (elapsed >= VERIFY_RATE_PERIOD) {
+		uint64 rate = d->window / elapsed;
+		d->rate = 0 == d->rate ? rate : (3 * d->rate + rate) / 4;
+		d->window = 0;
+		d->window_start = now;
+	}
+	VERIFY_DEVICES_UNLOCK;
+}
+
+static void
+verify_device_info_add(void *value, void *data)
+{
+	const struct verify_device *d = value;
+	pslist_t **list = data;
+	verify_device_info_t *vdi;
+
+	WALLOC(vdi);
+	vdi->dev = d->dev;
+	vdi->readers = d->readers;
+	vdi->queued = d->queued;
+	vdi->pending = d->pending;
+	vdi->hashed = d->hashed;
+	vdi->rate = d->rate;
+
+	*list = pslist_prepend(*list, vdi);
+}
+
+/**
+ * Get hashing information about all the devices.
+ *
+ * @return list of verify_device_info_t, to be freed with
+ * verify_device_info_list_free_null().
+ */
+pslist_t *
+verify_device_info_list(void)
+{
+	pslist_t *list = NULL;
+
+	VERIFY_DEVICES_LOCK;
+	if (verify_devices != NULL)
+		hikset_foreach(verify_devices, verify_device_info_add, &list);
+	VERIFY_DEVICES_UNLOCK;
+
+	return list;
+}
+
+static void
+verify_device_info_free(void *data, void *unused_udata)
+{
+	verify_device_info_t *vdi = data;
+
+	(void) unused_udata;
+
+	WFREE(vdi);
+}
+
+/**
+ * Free list returned by verify_device_info_list() and nullify its pointer.
+ */
+void
+verify_device_info_list_free_null(pslist_t **list_ptr)
+{
+	pslist_t *list = *list_ptr;
+
+	pslist_foreach(list, verify_device_info_free, NULL);
+	pslist_free_null(list_ptr);
+}
+
 static void
 verify_file_free(struct verify_file **ptr)
 {
@@ -611,6 +860,8 @@ verify_new(const struct verify_hash *hash)
 	*(struct verify_hash *) &ctx->hash = *hash;		/* Assignment to "const" */
 	ctx->files_to_hash = hash_list_new(verify_item_hash, verify_item_equal);
 	hash_list_thread_safe(ctx->files_to_hash);
+	erbtree_init(&ctx->pending, verify_file_cmp,
+		offsetof(struct verify_file, node));
 
 	verify_thread_create_if_needed(ctx);
 
@@ -715,7 +966,118 @@ verify_context_free(void *data)
 	}
 }
 
+/**
+ * Release the file being verified, and the device it was read from.
+ */
 static void
+verify_file_close(struct verify *ctx)
+{
+	verify_device_release(ctx);
+	file_object_release(&ctx->file);
+}
+
+/**
+ * Find the first pending item located at or after the given position.
+ */
+static struct verify_file *
+verify_pending_ceil(const erbtree_t *tree, const struct verify_file *key)
+{
+	rbnode_t *rn = erbtree_lower_bound(tree, key);
+
+	return NULL == rn ? NULL : erbtree_data(tree, rn);
+}
+
+/**
+ * Select next normal-priority item to process.
+ *
+ * We continue to sweep the device of the last file we processed, in
+ * increasing inode and offset order, provided we can still read from it.
+ * When we reach the end of the pending items, we wrap around.  Devices
+ * already read from by too many threads are skipped.
+ *
+ * @return the selected item, NULL if nothing can be processed now.
+ *
+ * @attention
+ * Must be called with the work queue locked.
+ */
+static struct verify_file *
+verify_elevator_next(struct verify *ctx)
+{
+	struct verify_file key, *item;
+	bool wrapped = FALSE;
+
+	ZERO(&key);
+	key.dev = ctx->dev;
+	key.ino = ctx->ino;
+	key.offset = ctx->end;
+
+	for (;;) {
+		item = verify_pending_ceil(&ctx->pending, &key);
+
+		if (NULL == item) {
+			if (wrapped)
+				return NULL;
+			wrapped = TRUE;
+			ZERO(&key);
+			continue;
+		}
+
+		if (verify_device_acquire(ctx, item, FALSE))
+			return item;
+
+		/* Device is busy, move to the next one */
+
+		ZERO(&key);
+		key.dev = item->dev + 1;
+
+		if G_UNLIKELY(0 == key.dev)
+			key.dev = item->dev;		/* Avoid wrapping, will stop */
+	}
+}
+
+/**
+ * Select the next file to process, if any.
+ *
+ * High-priority items are served in the order of the queue, regardless of
+ * the amount of threads reading from their device.
+ *
+ * @return the next item, NULL if none can be processed now.
+ */
+static struct verify_file *
+verify_queue_next(struct verify *ctx)
+{
+	struct verify_file *item;
+
+	hash_list_lock(ctx->files_to_hash);
+
+	item = hash_list_head(ctx->files_to_hash);
+
+	if (item != NULL) {
+		verify_file_check(item);
+
+		if (item->high_priority) {
+			verify_device_acquire(ctx, item, TRUE);
+		} else {
+			item = verify_elevator_next(ctx);
+			if (item != NULL)
+				erbtree_remove(&ctx->pending, &item->node);
+		}
+
+		if (item != NULL)
+			hash_list_remove(ctx->files_to_hash, item);
+	}
+
+	hash_list_unlock(ctx->files_to_hash);
+
+	return item;
+}
+
+/**
+ * Start processing the next queued file.
+ *
+ * @return FALSE if no file could be dequeued.
+ */
+static bool
 verify_next_file(struct verify *ctx)
 {
 	struct verify_file *item;
@@ -724,7 +1086,7 @@ verify_next_file(struct verify *ctx)
 	verify_check(ctx);
 	g_assert(NULL == ctx->file);
 
-	item = hash_list_shift(ctx->files_to_hash);
+	item = verify_queue_next(ctx);
 	if (item != NULL) {
 		verify_file_check(item);
 
@@ -733,6 +1095,9 @@ verify_next_file(struct verify *ctx)
 		ctx->start = item->offset;
 		ctx->end = item->offset + item->amount;
 		ctx->offset = ctx->start;
+		ctx->dev = item->dev;
+		ctx->ino = item->ino;
+		ctx->high_priority = item->high_priority;
 
 		if (verify_start(ctx)) {
 			ctx->file = file_object_open(item->pathname, O_RDONLY);
@@ -752,6 +1117,8 @@ verify_next_file(struct verify *ctx)
 
 		if (NULL == ctx->file)
 			goto done;
+	} else {
+		return FALSE;
 	}
 
 	if (ctx->file) {
@@ -763,7 +1130,7 @@ verify_next_file(struct verify *ctx)
 		file_object_fadvise_sequential(ctx->file);
 		ctx->last_progress = ctx->started = tm_time_exact();
 	}
-	return;
+	return TRUE;
 
 done:
 	if (skipped)
@@ -771,7 +1138,8 @@ done:
 	else
 		verify_failure(ctx);
 
-	file_object_release(&ctx->file);
+	verify_file_close(ctx);
+	return TRUE;
 }
 
 static void
@@ -789,7 +1157,7 @@ verify_final(struct verify *ctx)
 	} else {
 		verify_done(ctx);
 	}
-	file_object_release(&ctx->file);
+	verify_file_close(ctx);
 }
 
 static void
@@ -829,6 +1197,20 @@ verify_update(struct verify *ctx)
 			goto error;
 		}
 
+		verify_device_hashed(ctx->device, r);
+
+		/*
+		 * Files hashed at normal priority are typically the ones from the
+		 * library, being scanned: drop the pages we read from the cache
+		 * so that we do not evict the data of other files being actively
+		 * served or downloaded.
+		 */
+
+		if (!ctx->high_priority) {
+			compat_fadvise_dontneed(file_object_fd(ctx->file),
+				ctx->offset - r, r);
+		}
+
 		/*
 		 * Don't inform about progress too frequently: if we're running in
 		 * a dedicated thread, the notification will issue a cross-thread RPC
@@ -851,7 +1233,7 @@ verify_update(struct verify *ctx)
 
 error:
 	verify_failure(ctx);
-	file_object_release(&ctx->file);
+	verify_file_close(ctx);
 }
 
 /**
@@ -868,11 +1250,16 @@ verify_queue_flush(void *data)
 	verify_check(ctx);
 	g_assert(thread_is_main());
 
+	hash_list_lock(ctx->files_to_hash);
+	erbtree_clear(&ctx->pending);
+	hash_list_unlock(ctx->files_to_hash);
+
 	while (NULL != (item = hash_list_shift(ctx->files_to_hash))) {
 		/* Setup minimal context to call verify_shutdown() */
 		ctx->user_data = item->user_data;
 		ctx->callback = item->callback;
 
+		verify_device_queue(item, -1);
 		verify_shutdown(ctx);
 		verify_file_free(&item);
 	}
@@ -903,7 +1290,7 @@ verify_bg_sighandler(struct bgtask *bt, void *data, bgsig_t sig)
 
 	if (ctx->file != NULL) {
 		verify_shutdown(ctx);
-		file_object_release(&ctx->file);
+		verify_file_close(ctx);
 	}
 	HFREE_NULL(ctx->buffer);
 
@@ -949,8 +1336,15 @@ verify_step_compute(struct bgtask *bt, void *data, int ticks)
 
 	while (i-- > 0) {
 		bg_task_cancel_test(bt);
-		if (NULL == ctx->file) {
-			verify_next_file(ctx);
+		if (NULL == ctx->file && !verify_next_file(ctx)) {
+			/*
+			 * All the devices holding queued files are busy, being read
+			 * by other threads: wait for them to become available.
+			 */
+
+			if (0 != hash_list_length(ctx->files_to_hash))
+				thread_sleep_ms(VERIFY_DEVICE_WAIT);
+			break;
 		}
 		if (ctx->file) {
 			verify_update(ctx);
@@ -1075,6 +1469,7 @@ verify_enqueue(struct verify *ctx, int high_priority,
 	verify_callback callback, void *user_data)
 {
 	struct verify_file *item;
+	filestat_t sb;
 	int inserted;
 
 	verify_check(ctx);
@@ -1088,19 +1483,44 @@ verify_enqueue(struct verify *ctx, int high_priority,
 		VARLEN(amount), NULL);
 
 	item = verify_file_new(pathname, offset, amount, callback, user_data);
+	item->high_priority = booleanize(high_priority);
+
+	/*
+	 * The device and inode are used to schedule the work in disk order.
+	 * If we cannot stat() the file, it will fail to be opened anyway.
+	 */
+
+	if (0 == stat(pathname, &sb)) {
+		item->dev = sb.st_dev;
+		item->ino = sb.st_ino;
+	}
 
 	hash_list_lock(ctx->files_to_hash);
 
+	item->seq = ctx->seq++;
+
 	if (hash_list_contains(ctx->files_to_hash, item)) {
-		if (high_priority)
+		if (high_priority) {
+			struct verify_file *queued =
+				hash_list_lookup(ctx->files_to_hash, item);
+
+			verify_file_check(queued);
+
+			if (!queued->high_priority) {
+				erbtree_remove(&ctx->pending, &queued->node);
+				queued->high_priority = TRUE;
+			}
 			hash_list_moveto_head(ctx->files_to_hash, item);
+		}
 		inserted = FALSE;
 	} else {
 		if (high_priority) {
 			hash_list_prepend(ctx->files_to_hash, item);
 		} else {
 			hash_list_append(ctx->files_to_hash, item);
+			erbtree_insert(&ctx->pending, &item->node);
 		}
+		verify_device_queue(item, +1);
 		inserted = TRUE;
 	}
 
@@ -72,6 +72,23 @@ enum verify_status verify_status(const struct verify *);
 filesize_t verify_hashed(const struct verify *);
 uint verify_elapsed(const struct verify *);
 
+/**
+ * Hashing activity on a device, as returned by verify_device_info_list().
+ */
+typedef struct verify_device_info {
+	dev_t dev;				/**< Device */
+	uint readers;			/**< Threads currently reading from device */
+	size_t queued;			/**< Amount of queued files */
+	uint64 pending;			/**< Bytes remaining to hash */
+	uint64 hashed;			/**< Total bytes hashed */
+	uint64 rate;			/**< Average hashing rate, in bytes/s */
+} verify_device_info_t;
+
+struct pslist;
+
+struct pslist *verify_device_info_list(void);
+void verify_device_info_list_free_null(struct pslist **list_ptr);
+
 #endif	/* _core_verify_h_ */
 
 /* vi: set ts=4 sw=4 cindent: */
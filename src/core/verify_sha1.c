@@ -27,6 +27,9 @@
  *
  * Hash verification.
  *
+ * The SHA-1 verifier also computes the TTH of the data in the same pass,
+ * so that files are read only once to get their full bitprint.
+ *
  * @author Raphael Manfredi
  * @date 2002-2003
  */
@@ -35,9 +38,12 @@
 
 #include "verify.h"
 
+#include "lib/halloc.h"
 #include "lib/misc.h"
 #include "lib/once.h"
 #include "lib/sha1.h"
+#include "lib/tiger.h"
+#include "lib/tigertree.h"
 
 #include "core/verify_sha1.h"
 
@@ -46,13 +52,15 @@
 static struct {
 	struct verify	*verify;
 	SHA1_context	context;
+	TTH_CONTEXT		*tt;
 	struct sha1		digest;
+	struct tth		tth;
 } verify_sha1;
 
 static const char *
 verify_sha1_name(void)
 {
-	return "SHA-1";
+	return "SHA-1+TTH";
 }
 
 static void
@@ -60,9 +68,9 @@ verify_sha1_reset(filesize_t amount)
 {
 	int ret;
 
-	(void) amount;
 	ret = SHA1_reset(&verify_sha1.context);
 	g_assert(SHA_SUCCESS == ret);
+	tt_init(verify_sha1.tt, amount);
 }
 
 static int
@@ -71,7 +79,11 @@ verify_sha1_update(const void *data, size_t size)
 	int ret;
 
 	ret = SHA1_input(&verify_sha1.context, data, size);
-	return SHA_SUCCESS == ret ? 0 : -1;
+	if G_UNLIKELY(ret != SHA_SUCCESS)
+		return -1;
+
+	tt_update(verify_sha1.tt, data, size);
+	return 0;
 }
 
 static int
@@ -80,7 +92,11 @@ verify_sha1_final(void)
 	int ret;
 
 	ret = SHA1_result(&verify_sha1.context, &verify_sha1.digest);
-	return SHA_SUCCESS == ret ? 0 : -1;
+	if G_UNLIKELY(ret != SHA_SUCCESS)
+		return -1;
+
+	tt_digest(verify_sha1.tt, &verify_sha1.tth);
+	return 0;
 }
 
 static const struct verify_hash verify_hash_sha1 = {
@@ -106,9 +122,40 @@ verify_sha1_digest(const struct verify *ctx)
 	return &verify_sha1.digest;
 }
 
+/**
+ * @return the TTH computed along with the SHA-1.
+ */
+const struct tth *
+verify_sha1_tth_digest(const struct verify *ctx)
+{
+	g_return_val_if_fail(verify_status(ctx) == VERIFY_DONE, NULL);
+	return &verify_sha1.tth;
+}
+
+/**
+ * @return the TTH leaves computed along with the SHA-1.
+ */
+const struct tth *
+verify_sha1_tth_leaves(const struct verify *ctx)
+{
+	g_return_val_if_fail(verify_status(ctx) == VERIFY_DONE, NULL);
+	return tt_leaves(verify_sha1.tt);
+}
+
+/**
+ * @return the amount of TTH leaves computed along with the SHA-1.
+ */
+size_t
+verify_sha1_tth_leave_count(const struct verify *ctx)
+{
+	g_return_val_if_fail(verify_status(ctx) == VERIFY_DONE, 0);
+	return tt_leave_count(verify_sha1.tt);
+}
+
 static void G_COLD
 verify_sha1_init_once(void)
 {
+	verify_sha1.tt = halloc(tt_size());
 	verify_sha1.verify = verify_new(&verify_hash_sha1);
 }
 
@@ -130,10 +177,22 @@ verify_sha1_init(void)
 	once_flag_runwait(&initialized, verify_sha1_init_once);
 }
 
+/**
+ * Stops the background task for SHA-1 verification.
+ */
 void G_COLD
-verify_sha1_close(void)
+verify_sha1_shutdown(void)
 {
 	verify_free(&verify_sha1.verify);
 }
 
+/**
+ * Release memory resources used by SHA-1 verification.
+ */
+void G_COLD
+verify_sha1_close(void)
+{
+	HFREE_NULL(verify_sha1.tt);
+}
+
 /* vi: set ts=4 sw=4 cindent: */
@@ -53,6 +53,7 @@
 #include "lib/omalloc.h"
 #include "lib/parse.h"
 #include "lib/product.h"
+#include "lib/sha1.h"			/* For SHA1_engine() */
 #include "lib/str.h"			/* For str_bprintf()  and str_bcatf() */
 #include "lib/timestamp.h"
 #include "lib/tm.h"
@@ -1050,6 +1051,8 @@ version_string_dump_log(logagent_t *la, bool full)
 
 	if (tls_version_string() != NULL)
 		log_info(la, "%s", tls_version_string());
+
+	log_info(la, "SHA-1 engine: %s", SHA1_engine());
 }
 
 /**
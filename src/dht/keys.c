@@ -1638,6 +1638,9 @@ keys_init(void)
 		kv, packing, KEYS_DB_CACHE_SIZE, kuid_hash, kuid_eq,
 		GNET_PROPERTY(dht_storage_in_memory));
 
+	if (GNET_PROPERTY(dht_storage_wal))
+		dbmw_set_wal(db_keydata, TRUE);		/* Committed by keys_sync() */
+
 	for (i = 0; i < N_ITEMS(decimation_factor); i++)
 		decimation_factor[i] = pow(KEYS_DECIMATION_BASE, i);
 
@@ -533,6 +533,7 @@ stable_init(void)
 		GNET_PROPERTY(dht_storage_in_memory));
 
 	dbmw_set_map_cache(db_lifedata, STABLE_MAP_CACHE_SIZE);
+	dbmw_set_mmap(db_lifedata, TRUE);		/* Read-mostly */
 
 	if (!crash_was_restarted())
 		stable_prune_old();
@@ -57,9 +57,13 @@
  * be issued to that node -- that really is up to the lookup logic to decide
  * depending on the replies for FIND_NODE it gets from other contacted nodes.
  *
- * The cache is made of one single DBMW database which maps a KUID target to
+ * The cache is made of one DBMW database which maps a KUID target to
  * its latest known security token.
  *
+ * A second, sorted, database indexes the targets by the time we last updated
+ * their token, so that expired tokens can be pruned without iterating over
+ * all the cached tokens.
+ *
  * @author Raphael Manfredi
  * @date 2009
  */
@@ -82,6 +86,8 @@
 #include "lib/map.h"
 #include "lib/dbmw.h"
 #include "lib/dbstore.h"
+#include "lib/endian.h"
+#include "lib/hashing.h"
 #include "lib/misc.h"
 #include "lib/tm.h"
 #include "lib/stringify.h"
@@ -118,6 +124,18 @@ static dbmw_t *db_tokdata;
 static char db_tcache_base[] = "dht_tokens";
 static char db_tcache_what[] = "DHT security tokens";
 
+/**
+ * DBM wrapper indexing target KUIDs by the time of their last token update.
+ *
+ * Keys are the big-endian update time followed by the target KUID, so that
+ * the keys of the oldest tokens come first.  There are no values.
+ */
+static dbmw_t *db_tokexp;
+static char db_tokexp_base[] = "dht_tokens_expiry";
+static char db_tokexp_what[] = "DHT security token expiry";
+
+#define TOK_EXP_KEYLEN	(4 + KUID_RAW_SIZE)
+
 /**
  * Information about a target KUID that is stored to disk.
  * The structure is serialized first, not written as-is.
@@ -138,6 +156,58 @@ tcache_debugging_changed(void)
 	tcache_dbmw_dbg.flags = GNET_PROPERTY(dht_tcache_debug_flags);
 }
 
+/**
+ * Hash an expiry index key.
+ */
+static uint
+tokexp_hash(const void *key)
+{
+	return binary_hash(key, TOK_EXP_KEYLEN);
+}
+
+/**
+ * Test equality of two expiry index keys.
+ */
+static int
+tokexp_eq(const void *a, const void *b)
+{
+	return a == b || 0 == memcmp(a, b, TOK_EXP_KEYLEN);
+}
+
+/**
+ * Fill buffer with the expiry index key for a token updated at ``t''.
+ */
+static void
+tokexp_fill(char *buf, time_t t, const kuid_t *id)
+{
+	poke_be32(buf, (uint32) t);
+	memcpy(&buf[4], id->v, KUID_RAW_SIZE);
+}
+
+/**
+ * Index target KUID by the time its token was last updated.
+ */
+static void
+tokexp_insert(const kuid_t *id, time_t last_update)
+{
+	char buf[TOK_EXP_KEYLEN];
+
+	tokexp_fill(buf, last_update, id);
+	dbmw_write(db_tokexp, buf, NULL, 0);
+}
+
+/**
+ * Remove target KUID from the expiry index.
+ */
+static void
+tokexp_delete(const kuid_t *id, time_t last_update)
+{
+	char buf[TOK_EXP_KEYLEN];
+
+	tokexp_fill(buf, last_update, id);
+	dbmw_delete(db_tokexp, buf);
+}
+
 /**
  * Get tokdata from database, returning NULL if not found.
  */
@@ -163,8 +233,9 @@ get_tokdata(const kuid_t *id)
  * Delete known-to-be existing token data for specified KUID from database.
  */
 static void
-delete_tokdata(const kuid_t *id)
+delete_tokdata(const kuid_t *id, const struct tokdata *td)
 {
+	tokexp_delete(id, td->last_update);
 	dbmw_delete(db_tokdata, id);
 	gnet_stats_dec_general(GNR_DHT_CACHED_TOKENS_HELD);
 
@@ -236,6 +307,7 @@ record_token(void *key, void *value, void *unused_u)
 {
 	kuid_t *id = key;
 	lookup_token_t *ltok = value;
+	const struct tokdata *otd;
 	struct tokdata td;
 
 	(void) unused_u;
@@ -256,9 +328,14 @@ record_token(void *key, void *value, void *unused_u)
 	 * will be freed via free_tokdata() when the cached entry is released.
 	 */
 
-	if (!dbmw_exists(db_tokdata, id->v))
+	otd = dbmw_read(db_tokdata, id->v, NULL);
+
+	if (NULL == otd)
 		gnet_stats_inc_general(GNR_DHT_CACHED_TOKENS_HELD);
+	else if (otd->last_update != td.last_update)
+		tokexp_delete(id, otd->last_update);
 
+	tokexp_insert(id, td.last_update);
 	dbmw_write(db_tokdata, id->v, VARLEN(td));
 
 	if (GNET_PROPERTY(dht_tcache_debug_flags) & DBG_DSF_USR1) {
@@ -306,7 +383,7 @@ tcache_get(const kuid_t *id,
 		return FALSE;
 
 	if (delta_time(tm_time(), td->last_update) > token_life) {
-		delete_tokdata(id);
+		delete_tokdata(id, td);
 		return FALSE;
 	}
 
@@ -335,41 +412,45 @@ tcache_get(const kuid_t *id,
 bool
 tcache_remove(const kuid_t *id)
 {
-	if (!dbmw_exists(db_tokdata, id))
+	const struct tokdata *td;
+
+	td = dbmw_read(db_tokdata, id, NULL);
+
+	if (NULL == td)
 		return FALSE;
 
-	delete_tokdata(id);
+	delete_tokdata(id, td);
 	return TRUE;
 }
 
 /**
- * DBMW foreach iterator to remove old entries.
+ * DBMW foreach iterator to remove old entries from the expiry index.
+ *
+ * Only the keys of expired tokens are traversed, so all of them are removed,
+ * along with the token data of the target KUID.
+ *
  * @return  TRUE if entry must be deleted.
  */
 static bool
-tk_prune_old(void *key, void *value, size_t u_len, void *u_data)
+tk_prune_old(void *key, void *u_value, size_t u_len, void *u_data)
 {
-	const kuid_t *id = key;
-	const struct tokdata *td = value;
-	time_delta_t d;
+	const char *k = key;
+	kuid_t id;
 
+	(void) u_value;
 	(void) u_len;
 	(void) u_data;
 
-	d = delta_time(tm_time(), td->last_update);
+	memcpy(id.v, &k[4], KUID_RAW_SIZE);
 
-	if (GNET_PROPERTY(dht_tcache_debug) > 2 && d > token_life) {
+	if (GNET_PROPERTY(dht_tcache_debug) > 2) {
 		g_debug("DHT TCACHE security token from %s expired",
-			kuid_to_hex_string(id));
+			kuid_to_hex_string(&id));
 	}
 
-	if (GNET_PROPERTY(dht_tcache_debug) > 5) {
-		g_debug("DHT TCACHE %s: %s id=%s",
-			G_STRFUNC, d > token_life ? "prune" : "keep ",
-			kuid_to_hex_string(id));
-	}
+	dbmw_delete(db_tokdata, &id);
 
-	return d > token_life;
+	return TRUE;
 }
 
 /**
@@ -378,6 +459,8 @@ tk_prune_old(void *key, void *value, size_t u_len, void *u_data)
 static void
 tcache_prune_old(void)
 {
+	char hi[TOK_EXP_KEYLEN];
+	kuid_t zero;
 	size_t pruned;
 
 	if (GNET_PROPERTY(dht_tcache_debug)) {
@@ -385,7 +468,17 @@ tcache_prune_old(void)
 			dbmw_count(db_tokdata));
 	}
 
-	pruned = dbmw_foreach_remove(db_tokdata, tk_prune_old, NULL);
+	/*
+	 * Tokens expire when they were last updated more than ``token_life''
+	 * seconds ago, hence all the keys in the index before the one built
+	 * for that time with the smallest possible KUID are expired.
+	 */
+
+	ZERO(&zero);
+	tokexp_fill(hi, tm_time() - token_life, &zero);
+
+	pruned = dbmw_foreach_remove_range(db_tokexp, NULL, hi,
+		tk_prune_old, NULL);
 	gnet_stats_set_general(GNR_DHT_CACHED_TOKENS_HELD, dbmw_count(db_tokdata));
 
 	if (GNET_PROPERTY(dht_tcache_debug)) {
@@ -416,8 +509,11 @@ tcache_init(void)
 		sizeof(struct tokdata) + MAX_INT_VAL(uint8) };
 	dbstore_packing_t packing =
 		{ serialize_tokdata, deserialize_tokdata, free_tokdata };
+	dbstore_kv_t exp_kv = { TOK_EXP_KEYLEN, NULL, 0, 0 };
+	dbstore_packing_t no_packing = { NULL, NULL, NULL };
 
 	g_assert(NULL == db_tokdata);
+	g_assert(NULL == db_tokexp);
 	g_assert(NULL == tcache_prune_ev);
 
 	db_tokdata = dbstore_create(db_tcache_what, settings_dht_db_dir(),
@@ -427,6 +523,10 @@ tcache_init(void)
 	dbmw_set_map_cache(db_tokdata, TOK_MAP_CACHE_SIZE);
 	dbmw_set_debugging(db_tokdata, &tcache_dbmw_dbg);
 
+	db_tokexp = dbstore_create_sorted(db_tokexp_what, settings_dht_db_dir(),
+		db_tokexp_base, exp_kv, no_packing, 0, tokexp_hash, tokexp_eq,
+		GNET_PROPERTY(dht_storage_in_memory));
+
 	token_life = MIN(TOK_LIFE, token_lifetime());
 
 	if (GNET_PROPERTY(dht_tcache_debug))
@@ -444,7 +544,8 @@ void
 tcache_close(void)
 {
 	dbstore_delete(db_tokdata);
-	db_tokdata = NULL;
+	dbstore_delete(db_tokexp);
+	db_tokdata = db_tokexp = NULL;
 	cq_periodic_remove(&tcache_prune_ev);
 }
 
@@ -2116,6 +2116,17 @@ values_init(void)
 		raw_kv, no_packing, RAW_DB_CACHE_SIZE, uint64_mem_hash, uint64_mem_eq,
 		GNET_PROPERTY(dht_storage_in_memory));
 
+	/*
+	 * These are persistent databases with random writes all over the place:
+	 * a write-ahead log turns them into sequential writes, made durable by
+	 * values_sync().
+	 */
+
+	if (GNET_PROPERTY(dht_storage_wal)) {
+		dbmw_set_wal(db_valuedata, TRUE);
+		dbmw_set_wal(db_rawdata, TRUE);
+	}
+
 	db_expired = dbstore_create(db_expwhat, settings_dht_db_dir(), db_expbase,
 		expired_kv, no_packing, 0, kuid_pair_hash, kuid_pair_eq,
 		GNET_PROPERTY(dht_storage_in_memory));
@@ -243,6 +243,7 @@ struct download {
 	uint32 overlap_size;		/**< Size of the overlapping window on resume */
 	pmsg_t *req;				/**< HTTP request, when partially sent */
 	struct dl_buffers *buffers;	/**< Buffers for reading, only when active */
+	struct dl_tth_slice *tth_slice;	/**< Tigertree slice being verified */
 
 	time_t start_date;			/**< Download start date */
 	time_t last_update;			/**< Last status update or I/O */
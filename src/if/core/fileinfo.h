@@ -26,6 +26,7 @@
 
 #include "common.h"
 
+#include "lib/bit_array.h"
 #include "lib/eslist.h"
 #include "lib/http_range.h"
 #include "lib/path.h"
@@ -157,6 +158,8 @@ typedef struct dl_file_info {
 		struct tth *leaves;	/**< Tigertree leaves */
 		size_t num_leaves;	/**< Number of tigertree leaves */
 		filesize_t slice_size;	/* Slice size (bytes covered by a leaf) */
+		bit_array_t *verified;	/**< Slices verified whilst downloading */
+		size_t num_verified;	/**< Amount of verified slices */
 	} tigertree;
 	int32 refcount;			/**< Reference count of file (number of sources)*/
 	pslist_t *sources;		/**< list of sources (struct download *) */
@@ -233,6 +233,7 @@ typedef struct gnet_node_status {
     uint64 tx_bps;				/**< TX traffic rate */
     bool   tx_compressed;		/**< Is TX traffic compressed */
     float  tx_compression_ratio; /**< TX compression ratio */
+	uint64 tx_deflate_ns;		/**< Time spent compressing TX traffic (ns) */
 
 	uint64 rx_given;			/**< Bytes fed to the RX stack (from bottom) */
 	uint64 rx_inflated;			/**< Bytes inflated by the RX stack */
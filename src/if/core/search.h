@@ -125,6 +125,7 @@ typedef struct gnet_results_set {
 	const char *query;			/**< Optional: Original query string (atom) */
 	gnet_host_vec_t *proxies;	/**< Optional: known push proxies */
 	pslist_t *records;
+	struct arena *arena;		/**< Holds the set and its records */
 
 	time_t  stamp;				/**< Reception time of the hit */
 	vendor_code_t vcode;		/**< Vendor code */
@@ -145,7 +146,7 @@ typedef struct gnet_results_set {
  * Result record flags
  */
 enum {
-	SR_ALLOC_NAME	= (1 << 11),	/* Set if filename was halloc()'ed */
+	SR_ALLOC_NAME	= (1 << 11),	/* Set if filename was copied by core */
 	SR_MEDIA		= (1 << 10),	/* Media type filter mismatch */
 	SR_PARTIAL_HIT	= (1 << 9),		/* Got a hit for a partial file */
 	SR_PUSH			= (1 << 8),		/* Servent firewalled, will need a PUSH */
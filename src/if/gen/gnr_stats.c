@@ -1,5 +1,5 @@
 /*
- * Generated on Sun Mar 10 21:55:45 2019 by enum-msg.pl -- DO NOT EDIT
+ * Generated on Sat Oct 17 04:09:27 2026 by enum-msg.pl -- DO NOT EDIT
  *
  * Command: ../../../scripts/enum-msg.pl stats.lst
  */
@@ -37,6 +37,8 @@ static const char *stats_symbols[] = {
 	"local_g2_hits",
 	"local_g2_partial_hits",
 	"local_aliased_hits",
+	"local_query_cache_hits",
+	"local_query_cache_misses",
 	"oob_proxied_query_hits",
 	"oob_queries",
 	"oob_queries_stripped",
@@ -315,6 +317,9 @@ static const char *stats_symbols[] = {
 	"parq_queue_follow_ups",
 	"sha1_verifications",
 	"tth_verifications",
+	"tth_slices_verified",
+	"tth_slices_corrupted",
+	"tth_incremental_verifications",
 	"qhit_seeding_of_orphan",
 	"upload_seeding_of_orphan",
 	"rudp_tx_bytes",
@@ -473,6 +478,8 @@ static const char *stats_text[] = {
 	N_("G2 hits on local DB"),
 	N_("G2 hits on local partial files"),
 	N_("Hits on aliased queries"),
+	N_("Library queries answered from the query cache"),
+	N_("Library queries missing from the query cache"),
 	N_("Query hits received for OOB-proxied queries"),
 	N_("Queries requesting OOB hit delivery"),
 	N_("Stripped OOB flag on queries"),
@@ -751,6 +758,9 @@ static const char *stats_text[] = {
 	N_("PARQ QUEUE follow-up requests received"),
 	N_("Launched SHA-1 file verifications"),
 	N_("Launched TTH file verifications"),
+	N_("TTH slices verified whilst downloading"),
+	N_("Corrupted TTH slices detected whilst downloading"),
+	N_("Completed files verified without being read again"),
 	N_("Re-seeding of orphan downloads through query hits"),
 	N_("Re-seeding of orphan downloads through upload requests"),
 	N_("RUDP sent bytes"),
@@ -1,5 +1,5 @@
 /*
- * Generated on Sun Mar 10 21:55:45 2019 by enum-msg.pl -- DO NOT EDIT
+ * Generated on Sat Oct 17 04:09:27 2026 by enum-msg.pl -- DO NOT EDIT
  *
  * Command: ../../../scripts/enum-msg.pl stats.lst
  */
@@ -8,7 +8,7 @@
 #define _if_gen_gnr_stats_h_
 
 /*
- * Enum count: 415
+ * Enum count: 420
  */
 typedef enum {
 	GNR_ROUTING_ERRORS = 0,
@@ -33,6 +33,8 @@ typedef enum {
 	GNR_LOCAL_G2_HITS,
 	GNR_LOCAL_G2_PARTIAL_HITS,
 	GNR_LOCAL_ALIASED_HITS,
+	GNR_LOCAL_QUERY_CACHE_HITS,
+	GNR_LOCAL_QUERY_CACHE_MISSES,
 	GNR_OOB_PROXIED_QUERY_HITS,
 	GNR_OOB_QUERIES,
 	GNR_OOB_QUERIES_STRIPPED,
@@ -311,6 +313,9 @@ typedef enum {
 	GNR_PARQ_QUEUE_FOLLOW_UPS,
 	GNR_SHA1_VERIFICATIONS,
 	GNR_TTH_VERIFICATIONS,
+	GNR_TTH_SLICES_VERIFIED,
+	GNR_TTH_SLICES_CORRUPTED,
+	GNR_TTH_INCREMENTAL_VERIFICATIONS,
 	GNR_QHIT_SEEDING_OF_ORPHAN,
 	GNR_UPLOAD_SEEDING_OF_ORPHAN,
 	GNR_RUDP_TX_BYTES,
@@ -1134,6 +1134,26 @@ gboolean gnet_property_variable_running_topless     = FALSE;
 static const gboolean gnet_property_variable_running_topless_default = FALSE;
 gboolean gnet_property_variable_send_oob_ind_reliably     = TRUE;
 static const gboolean gnet_property_variable_send_oob_ind_reliably_default = TRUE;
+gboolean gnet_property_variable_qrp_leaf_index     = FALSE;
+static const gboolean gnet_property_variable_qrp_leaf_index_default = FALSE;
+gboolean gnet_property_variable_library_watch     = TRUE;
+static const gboolean gnet_property_variable_library_watch_default = TRUE;
+guint32  gnet_property_variable_query_cache_size     = 256;
+static const guint32  gnet_property_variable_query_cache_size_default = 256;
+gboolean gnet_property_variable_inputevt_edge_triggered     = FALSE;
+static const gboolean gnet_property_variable_inputevt_edge_triggered_default = FALSE;
+guint32  gnet_property_variable_rx_inflate_threads     = 0;
+static const guint32  gnet_property_variable_rx_inflate_threads_default = 0;
+guint32  gnet_property_variable_tth_hashing_threads     = 0;
+static const guint32  gnet_property_variable_tth_hashing_threads_default = 0;
+guint32  gnet_property_variable_verify_device_readers     = 1;
+static const guint32  gnet_property_variable_verify_device_readers_default = 1;
+gboolean gnet_property_variable_deflate_adaptive     = TRUE;
+static const gboolean gnet_property_variable_deflate_adaptive_default = TRUE;
+gboolean gnet_property_variable_dht_storage_wal     = TRUE;
+static const gboolean gnet_property_variable_dht_storage_wal_default = TRUE;
+guint32  gnet_property_variable_dbstore_cache_budget     = 16384;
+static const guint32  gnet_property_variable_dbstore_cache_budget_default = 16384;
 
 static prop_set_t *gnet_property;
 
@@ -11418,6 +11438,211 @@ gnet_prop_init(void) {
     gnet_property->props[488].data.boolean.def   = (void *) &gnet_property_variable_send_oob_ind_reliably_default;
     gnet_property->props[488].data.boolean.value = (void *) &gnet_property_variable_send_oob_ind_reliably;
 
+
+    /*
+     * PROP_QRP_LEAF_INDEX:
+     *
+     * General data:
+     */
+    gnet_property->props[489].name = "qrp_leaf_index";
+    gnet_property->props[489].desc = _("When running as an ultrapeer, whether to maintain an inverted index of the leaf query routing tables, mapping each slot to the set of leaves having it, to select the leaves to which queries are routed without probing each leaf table.");
+    gnet_property->props[489].ev_changed = event_new("qrp_leaf_index_changed");
+    gnet_property->props[489].save = TRUE;
+    gnet_property->props[489].internal = FALSE;
+    gnet_property->props[489].vector_size = 1;
+	mutex_init(&gnet_property->props[489].lock);
+
+    /* Type specific data: */
+    gnet_property->props[489].type               = PROP_TYPE_BOOLEAN;
+    gnet_property->props[489].data.boolean.def   = (void *) &gnet_property_variable_qrp_leaf_index_default;
+    gnet_property->props[489].data.boolean.value = (void *) &gnet_property_variable_qrp_leaf_index;
+
+
+    /*
+     * PROP_LIBRARY_WATCH:
+     *
+     * General data:
+     */
+    gnet_property->props[490].name = "library_watch";
+    gnet_property->props[490].desc = _("Whether shared directories should be monitored for changes, updating the library incrementally instead of rescanning it completely, when the system supports it.");
+    gnet_property->props[490].ev_changed = event_new("library_watch_changed");
+    gnet_property->props[490].save = TRUE;
+    gnet_property->props[490].internal = FALSE;
+    gnet_property->props[490].vector_size = 1;
+	mutex_init(&gnet_property->props[490].lock);
+
+    /* Type specific data: */
+    gnet_property->props[490].type               = PROP_TYPE_BOOLEAN;
+    gnet_property->props[490].data.boolean.def   = (void *) &gnet_property_variable_library_watch_default;
+    gnet_property->props[490].data.boolean.value = (void *) &gnet_property_variable_library_watch;
+
+
+    /*
+     * PROP_QUERY_CACHE_SIZE:
+     *
+     * General data:
+     */
+    gnet_property->props[491].name = "query_cache_size";
+    gnet_property->props[491].desc = _("Maximum amount of distinct queries for which we remember the matching library files, to answer repeated queries without searching the library again.  Setting it to 0 disables the cache.");
+    gnet_property->props[491].ev_changed = event_new("query_cache_size_changed");
+    gnet_property->props[491].save = TRUE;
+    gnet_property->props[491].internal = FALSE;
+    gnet_property->props[491].vector_size = 1;
+	mutex_init(&gnet_property->props[491].lock);
+
+    /* Type specific data: */
+    gnet_property->props[491].type               = PROP_TYPE_GUINT32;
+    gnet_property->props[491].data.guint32.def   = (void *) &gnet_property_variable_query_cache_size_default;
+    gnet_property->props[491].data.guint32.value = (void *) &gnet_property_variable_query_cache_size;
+    gnet_property->props[491].data.guint32.choices = NULL;
+    gnet_property->props[491].data.guint32.max   = 65536;
+    gnet_property->props[491].data.guint32.min   = 0;
+
+
+    /*
+     * PROP_INPUTEVT_EDGE_TRIGGERED:
+     *
+     * General data:
+     */
+    gnet_property->props[492].name = "inputevt_edge_triggered";
+    gnet_property->props[492].desc = _("Whether to use edge-triggered I/O events when the kernel supports it (epoll), draining ready descriptors at each wakeup instead of having them reported again until all their data are consumed.");
+    gnet_property->props[492].ev_changed = event_new("inputevt_edge_triggered_changed");
+    gnet_property->props[492].save = TRUE;
+    gnet_property->props[492].internal = FALSE;
+    gnet_property->props[492].vector_size = 1;
+	mutex_init(&gnet_property->props[492].lock);
+
+    /* Type specific data: */
+    gnet_property->props[492].type               = PROP_TYPE_BOOLEAN;
+    gnet_property->props[492].data.boolean.def   = (void *) &gnet_property_variable_inputevt_edge_triggered_default;
+    gnet_property->props[492].data.boolean.value = (void *) &gnet_property_variable_inputevt_edge_triggered;
+
+
+    /*
+     * PROP_RX_INFLATE_THREADS:
+     *
+     * General data:
+     */
+    gnet_property->props[493].name = "rx_inflate_threads";
+    gnet_property->props[493].desc = _("Amount of threads used to decompress the data received from compressed Gnutella connections, on multi-core machines.  When 0, decompression is done synchronously by the main thread.");
+    gnet_property->props[493].ev_changed = event_new("rx_inflate_threads_changed");
+    gnet_property->props[493].save = TRUE;
+    gnet_property->props[493].internal = FALSE;
+    gnet_property->props[493].vector_size = 1;
+	mutex_init(&gnet_property->props[493].lock);
+
+    /* Type specific data: */
+    gnet_property->props[493].type               = PROP_TYPE_GUINT32;
+    gnet_property->props[493].data.guint32.def   = (void *) &gnet_property_variable_rx_inflate_threads_default;
+    gnet_property->props[493].data.guint32.value = (void *) &gnet_property_variable_rx_inflate_threads;
+    gnet_property->props[493].data.guint32.choices = NULL;
+    gnet_property->props[493].data.guint32.max   = 16;
+    gnet_property->props[493].data.guint32.min   = 0;
+
+
+    /*
+     * PROP_TTH_HASHING_THREADS:
+     *
+     * General data:
+     */
+    gnet_property->props[494].name = "tth_hashing_threads";
+    gnet_property->props[494].desc = _("Amount of additional threads used to compute Tiger tree hashes of large files in parallel, on multi-core machines.  When 0, the TTH of a file is computed by a single thread.");
+    gnet_property->props[494].ev_changed = event_new("tth_hashing_threads_changed");
+    gnet_property->props[494].save = TRUE;
+    gnet_property->props[494].internal = FALSE;
+    gnet_property->props[494].vector_size = 1;
+	mutex_init(&gnet_property->props[494].lock);
+
+    /* Type specific data: */
+    gnet_property->props[494].type               = PROP_TYPE_GUINT32;
+    gnet_property->props[494].data.guint32.def   = (void *) &gnet_property_variable_tth_hashing_threads_default;
+    gnet_property->props[494].data.guint32.value = (void *) &gnet_property_variable_tth_hashing_threads;
+    gnet_property->props[494].data.guint32.choices = NULL;
+    gnet_property->props[494].data.guint32.max   = 16;
+    gnet_property->props[494].data.guint32.min   = 0;
+
+
+    /*
+     * PROP_VERIFY_DEVICE_READERS:
+     *
+     * General data:
+     */
+    gnet_property->props[495].name = "verify_device_readers";
+    gnet_property->props[495].desc = _("Maximum amount of hashing threads reading files concurrently from the same device. Files queued for hashing are processed in on-disk order within each device, and limiting concurrent readers avoids seek thrashing on spinning disks.");
+    gnet_property->props[495].ev_changed = event_new("verify_device_readers_changed");
+    gnet_property->props[495].save = TRUE;
+    gnet_property->props[495].internal = FALSE;
+    gnet_property->props[495].vector_size = 1;
+	mutex_init(&gnet_property->props[495].lock);
+
+    /* Type specific data: */
+    gnet_property->props[495].type               = PROP_TYPE_GUINT32;
+    gnet_property->props[495].data.guint32.def   = (void *) &gnet_property_variable_verify_device_readers_default;
+    gnet_property->props[495].data.guint32.value = (void *) &gnet_property_variable_verify_device_readers;
+    gnet_property->props[495].data.guint32.choices = NULL;
+    gnet_property->props[495].data.guint32.max   = 8;
+    gnet_property->props[495].data.guint32.min   = 1;
+
+
+    /*
+     * PROP_DEFLATE_ADAPTIVE:
+     *
+     * General data:
+     */
+    gnet_property->props[496].name = "deflate_adaptive";
+    gnet_property->props[496].desc = _("Whether the compression level of Gnutella connections adapts to the CPU load and to the link saturation: fast compression is used whilst the link is not saturated, best compression when bandwidth is the bottleneck, and the fastest level when the CPU is overloaded or traffic does not compress well.");
+    gnet_property->props[496].ev_changed = event_new("deflate_adaptive_changed");
+    gnet_property->props[496].save = TRUE;
+    gnet_property->props[496].internal = FALSE;
+    gnet_property->props[496].vector_size = 1;
+	mutex_init(&gnet_property->props[496].lock);
+
+    /* Type specific data: */
+    gnet_property->props[496].type               = PROP_TYPE_BOOLEAN;
+    gnet_property->props[496].data.boolean.def   = (void *) &gnet_property_variable_deflate_adaptive_default;
+    gnet_property->props[496].data.boolean.value = (void *) &gnet_property_variable_deflate_adaptive;
+
+
+    /*
+     * PROP_DHT_STORAGE_WAL:
+     *
+     * General data:
+     */
+    gnet_property->props[497].name = "dht_storage_wal";
+    gnet_property->props[497].desc = _("If TRUE, the DHT values and keys stores on disk use a write-ahead log, making random writes cheaper and letting the databases survive a crash without being rebuilt.");
+    gnet_property->props[497].ev_changed = event_new("dht_storage_wal_changed");
+    gnet_property->props[497].save = TRUE;
+    gnet_property->props[497].internal = FALSE;
+    gnet_property->props[497].vector_size = 1;
+	mutex_init(&gnet_property->props[497].lock);
+
+    /* Type specific data: */
+    gnet_property->props[497].type               = PROP_TYPE_BOOLEAN;
+    gnet_property->props[497].data.boolean.def   = (void *) &gnet_property_variable_dht_storage_wal_default;
+    gnet_property->props[497].data.boolean.value = (void *) &gnet_property_variable_dht_storage_wal;
+
+
+    /*
+     * PROP_DBSTORE_CACHE_BUDGET:
+     *
+     * General data:
+     */
+    gnet_property->props[498].name = "dbstore_cache_budget";
+    gnet_property->props[498].desc = _("Amount of memory, in KiB, shared by all the on-disk databases to cache their deserialized values.  Each database gets a share of this budget proportional to the usefulness of its cache, as measured by its hit rate.");
+    gnet_property->props[498].ev_changed = event_new("dbstore_cache_budget_changed");
+    gnet_property->props[498].save = TRUE;
+    gnet_property->props[498].internal = FALSE;
+    gnet_property->props[498].vector_size = 1;
+	mutex_init(&gnet_property->props[498].lock);
+
+    /* Type specific data: */
+    gnet_property->props[498].type               = PROP_TYPE_GUINT32;
+    gnet_property->props[498].data.guint32.def   = (void *) &gnet_property_variable_dbstore_cache_budget_default;
+    gnet_property->props[498].data.guint32.value = (void *) &gnet_property_variable_dbstore_cache_budget;
+    gnet_property->props[498].data.guint32.choices = NULL;
+    gnet_property->props[498].data.guint32.max   = 1048576;
+    gnet_property->props[498].data.guint32.min   = 256;
+
     gnet_property->by_name = htable_create(HASH_KEY_STRING, 0);
     for (n = 0; n < GNET_PROPERTY_NUM; n ++) {
         htable_insert(gnet_property->by_name,
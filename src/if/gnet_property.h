@@ -525,6 +525,16 @@ typedef enum {
     PROP_LOCK_SLEEP_TRACE,
     PROP_RUNNING_TOPLESS,
     PROP_SEND_OOB_IND_RELIABLY,
+    PROP_QRP_LEAF_INDEX,
+    PROP_LIBRARY_WATCH,
+    PROP_QUERY_CACHE_SIZE,
+    PROP_INPUTEVT_EDGE_TRIGGERED,
+    PROP_RX_INFLATE_THREADS,
+    PROP_TTH_HASHING_THREADS,
+    PROP_VERIFY_DEVICE_READERS,
+    PROP_DEFLATE_ADAPTIVE,
+    PROP_DHT_STORAGE_WAL,
+    PROP_DBSTORE_CACHE_BUDGET,
     GNET_PROPERTY_END
 } gnet_property_t;
 
@@ -539,6 +539,16 @@ extern const gboolean gnet_property_variable_lock_contention_trace;
 extern const gboolean gnet_property_variable_lock_sleep_trace;
 extern const gboolean gnet_property_variable_running_topless;
 extern const gboolean gnet_property_variable_send_oob_ind_reliably;
+extern const gboolean gnet_property_variable_qrp_leaf_index;
+extern const gboolean gnet_property_variable_library_watch;
+extern const guint32  gnet_property_variable_query_cache_size;
+extern const gboolean gnet_property_variable_inputevt_edge_triggered;
+extern const guint32  gnet_property_variable_rx_inflate_threads;
+extern const guint32  gnet_property_variable_tth_hashing_threads;
+extern const guint32  gnet_property_variable_verify_device_readers;
+extern const gboolean gnet_property_variable_deflate_adaptive;
+extern const gboolean gnet_property_variable_dht_storage_wal;
+extern const guint32  gnet_property_variable_dbstore_cache_budget;
 
 
 prop_set_t *gnet_prop_init(void);
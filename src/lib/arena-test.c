@@ -0,0 +1,333 @@
+/*
+ * arena-test -- arena allocator tests and benchmarking.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the authors nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "common.h"
+
+#include "arena.h"
+#include "log.h"
+#include "misc.h"
+#include "progname.h"
+#include "random.h"
+#include "stats.h"
+#include "tm.h"
+#include "walloc.h"
+#include "xmalloc.h"
+
+#define CHUNK_SIZE		8192
+#define BLOCKS			10000
+#define BLOCK_MAXSIZE	256
+
+#define BENCH_BLOCKS	1000
+#define BENCH_SIZE		96			/* Roughly a search record */
+
+#define POINTS			100
+#define OUTLIERS		3.0
+
+static void G_NORETURN
+usage(void)
+{
+	fprintf(stderr,
+			"Usage: %s [-bh] [-n loops]\n"
+			"  -b : benchmark arena against walloc()\n"
+			"  -h : prints this help message\n"
+			"  -n : run the tests that many times (default = 1)\n"
+			, getprogname());
+	exit(EXIT_FAILURE);
+}
+
+static uchar
+block_byte(size_t i)
+{
+	return (i * 37 + 11) & 0xff;
+}
+
+/**
+ * Allocate blocks of random sizes, some larger than the chunks, and make
+ * sure they are aligned and do not overlap.
+ */
+static void
+test_alloc(arena_t *ar)
+{
+	void **blocks;
+	size_t *sizes;
+	size_t i, total = 0;
+
+	XMALLOC_ARRAY(blocks, BLOCKS);
+	XMALLOC_ARRAY(sizes, BLOCKS);
+
+	for (i = 0; i < BLOCKS; i++) {
+		size_t len = 0 == random_value(99) ?
+			CHUNK_SIZE + random_value(3 * CHUNK_SIZE) :
+			1 + random_value(BLOCK_MAXSIZE - 1);
+
+		blocks[i] = arena_alloc(ar, len);
+		sizes[i] = len;
+		total += len;
+
+		if (0 != pointer_to_ulong(blocks[i]) % MEM_ALIGNBYTES) {
+			s_error("%s(): block #%zu at %p is not aligned",
+				G_STRFUNC, i, blocks[i]);
+		}
+
+		memset(blocks[i], block_byte(i), len);
+	}
+
+	for (i = 0; i < BLOCKS; i++) {
+		const uchar *p = blocks[i];
+		size_t j;
+
+		for (j = 0; j < sizes[i]; j++) {
+			if (p[j] != block_byte(i)) {
+				s_error("%s(): block #%zu was overwritten at offset %zu",
+					G_STRFUNC, i, j);
+			}
+		}
+	}
+
+	if (arena_allocated(ar) < total) {
+		s_error("%s(): arena reports %zu bytes allocated, expected %zu+",
+			G_STRFUNC, arena_allocated(ar), total);
+	}
+
+	xfree(blocks);
+	xfree(sizes);
+
+	s_info("%s(): all OK", G_STRFUNC);
+}
+
+/**
+ * Make sure reset recycles the first chunk.
+ */
+static void
+test_reset(arena_t *ar)
+{
+	void *first, *p;
+
+	arena_reset(ar);
+	first = arena_alloc(ar, 1);
+
+	(void) arena_alloc(ar, 4 * CHUNK_SIZE);		/* Needs another chunk */
+	arena_reset(ar);
+
+	if (arena_allocated(ar) != 0) {
+		s_error("%s(): %zu bytes still allocated after reset",
+			G_STRFUNC, arena_allocated(ar));
+	}
+
+	p = arena_alloc(ar, 1);
+
+	if (p != first)
+		s_error("%s(): first chunk was not reused", G_STRFUNC);
+
+	s_info("%s(): all OK", G_STRFUNC);
+}
+
+/**
+ * Make sure zeroed allocations are cleared even on recycled memory.
+ */
+static void
+test_alloc0(arena_t *ar)
+{
+	size_t i;
+
+	arena_reset(ar);
+	memset(arena_alloc(ar, CHUNK_SIZE / 2), 0xff, CHUNK_SIZE / 2);
+	arena_reset(ar);
+
+	for (i = 0; i < 16; i++) {
+		size_t j, len = 1 + random_value(BLOCK_MAXSIZE - 1);
+		const uchar *p = arena_alloc0(ar, len);
+
+		for (j = 0; j < len; j++) {
+			if (p[j] != 0)
+				s_error("%s(): byte #%zu not zeroed", G_STRFUNC, j);
+		}
+	}
+
+	s_info("%s(): all OK", G_STRFUNC);
+}
+
+static void
+test_strndup(arena_t *ar)
+{
+	static const char s[] = "arena allocator";
+	const char *p;
+
+	if (arena_strndup(ar, NULL, 10) != NULL)
+		s_error("%s(): NULL not preserved", G_STRFUNC);
+
+	p = arena_strndup(ar, s, sizeof s);
+	if (0 != strcmp(p, s))
+		s_error("%s(): got \"%s\" instead of \"%s\"", G_STRFUNC, p, s);
+
+	p = arena_strndup(ar, s, 5);
+	if (0 != strcmp(p, "arena"))
+		s_error("%s(): got \"%s\" instead of \"arena\"", G_STRFUNC, p);
+
+	p = arena_strndup(ar, s, 0);
+	if (p == NULL || *p != '\0')
+		s_error("%s(): expected empty string", G_STRFUNC);
+
+	s_info("%s(): all OK", G_STRFUNC);
+}
+
+static double
+timeit_arena(arena_t *ar)
+{
+	statx_t *sx;
+	size_t i;
+	double elapsed;
+
+	sx = statx_make();
+
+	for (i = 0; i < POINTS; i++) {
+		tm_nano_t start, end;
+		size_t j;
+
+		tm_precise_time(&start);
+
+		for (j = 0; j < BENCH_BLOCKS; j++) {
+			(void) arena_alloc(ar, BENCH_SIZE);
+		}
+		arena_reset(ar);
+
+		tm_precise_time(&end);
+		statx_add(sx, tm_precise_elapsed_f(&end, &start));
+	}
+
+	statx_remove_outliers(sx, OUTLIERS);
+	elapsed = statx_avg(sx);
+	statx_free_null(&sx);
+
+	return elapsed;
+}
+
+static double
+timeit_walloc(void)
+{
+	statx_t *sx;
+	size_t i;
+	double elapsed;
+	void **blocks;
+
+	XMALLOC_ARRAY(blocks, BENCH_BLOCKS);
+	sx = statx_make();
+
+	for (i = 0; i < POINTS; i++) {
+		tm_nano_t start, end;
+		size_t j;
+
+		tm_precise_time(&start);
+
+		for (j = 0; j < BENCH_BLOCKS; j++) {
+			blocks[j] = walloc(BENCH_SIZE);
+		}
+		for (j = 0; j < BENCH_BLOCKS; j++) {
+			wfree(blocks[j], BENCH_SIZE);
+		}
+
+		tm_precise_time(&end);
+		statx_add(sx, tm_precise_elapsed_f(&end, &start));
+	}
+
+	statx_remove_outliers(sx, OUTLIERS);
+	elapsed = statx_avg(sx);
+	statx_free_null(&sx);
+	xfree(blocks);
+
+	return elapsed;
+}
+
+static void
+benchmark(arena_t *ar)
+{
+	double e1, e2;
+
+	arena_reset(ar);
+
+	e1 = timeit_arena(ar);
+	e2 = timeit_walloc();
+
+	s_info("allocating and freeing %d blocks of %d bytes:",
+		BENCH_BLOCKS, BENCH_SIZE);
+	s_info("\tarena:    %'zu ns", (size_t) (e1 * 1e9));
+	s_info("\twalloc(): %'zu ns", (size_t) (e2 * 1e9));
+}
+
+int
+main(int argc, char **argv)
+{
+	extern int optind;
+	extern char *optarg;
+	int c;
+	const char options[] = "bhn:";
+	bool bench = FALSE;
+	size_t loops = 1;
+	arena_t *ar;
+
+	progstart(argc, argv);
+
+	while ((c = getopt(argc, argv, options)) != EOF) {
+		switch (c) {
+		case 'b':			/* benchmark */
+			bench = TRUE;
+			break;
+		case 'n':			/* amount of loops */
+			loops = atol(optarg);
+			break;
+		case 'h':			/* show help */
+			/* FALL THROUGH */
+		default:
+			usage();
+			break;
+		}
+	}
+
+	if (0 != (argc -= optind))
+		usage();
+
+	ar = arena_make(CHUNK_SIZE);
+
+	while (loops--) {
+		test_alloc(ar);
+		test_reset(ar);
+		test_alloc0(ar);
+		test_strndup(ar);
+		arena_reset(ar);
+	}
+
+	if (bench)
+		benchmark(ar);
+
+	arena_free_null(&ar);
+
+	return 0;
+}
+
+/* vi: set ts=4 sw=4 cindent: */
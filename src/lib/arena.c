@@ -0,0 +1,263 @@
+/*
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Arena allocator.
+ *
+ * An arena hands out memory by simply bumping a pointer within large chunks
+ * and never frees individual blocks: everything is released at once when
+ * the arena is reset.  This is meant for transient data that all share the
+ * same lifespan, such as the state built whilst parsing a single message,
+ * to avoid the cost of allocating and freeing many small blocks through
+ * the general allocators.
+ *
+ * The first chunk is kept when resetting the arena, so that a steady-state
+ * usage does not need to allocate any memory.  Additional chunks, needed
+ * when the arena had to grow, are given back to the system on reset.
+ *
+ * An arena is not thread-safe: it must be used by one thread only, or
+ * protected externally by the caller.
+ */
+
+#include "common.h"
+
+#include "arena.h"
+
+#include "mempcpy.h"
+#include "misc.h"
+#include "vmm.h"
+#include "walloc.h"
+
+#include "override.h"		/* Must be the last header included */
+
+#define ARENA_ALIGNBYTES	MEM_ALIGNBYTES
+#define ARENA_MASK			(ARENA_ALIGNBYTES - 1)
+
+#define arena_round(x)		(((size_t) (x) + ARENA_MASK) & ~ARENA_MASK)
+
+enum arena_magic { ARENA_MAGIC = 0x2c6e19a4 };
+
+/**
+ * A memory chunk, from which blocks are allocated.
+ *
+ * The header lies at the beginning of the chunk, the allocated blocks
+ * following immediately.
+ */
+struct arena_chunk {
+	struct arena_chunk *next;	/**< Next chunk in list */
+	size_t size;				/**< Total chunk size, including header */
+};
+
+#define ARENA_CHUNK_HEAD	arena_round(sizeof(struct arena_chunk))
+
+/**
+ * The arena descriptor.
+ */
+struct arena {
+	enum arena_magic magic;		/**< Magic number */
+	struct arena_chunk *chunks;	/**< Chunk list, the current one first */
+	char *avail;				/**< First free byte in current chunk */
+	char *end;					/**< First byte beyond current chunk */
+	size_t chunksize;			/**< Size of regular chunks */
+	size_t allocated;			/**< Bytes allocated since last reset */
+};
+
+static inline void
+arena_check(const struct arena * const ar)
+{
+	g_assert(ar != NULL);
+	g_assert(ARENA_MAGIC == ar->magic);
+}
+
+/**
+ * Allocate a new chunk, making it the current one.
+ *
+ * @param ar		the arena
+ * @param size		the minimal amount of bytes needed in the chunk
+ */
+static void
+arena_chunk_add(arena_t *ar, size_t size)
+{
+	struct arena_chunk *ck;
+	size_t len;
+
+	len = MAX(ar->chunksize, round_pagesize(size + ARENA_CHUNK_HEAD));
+
+	ck = vmm_alloc(len);
+	ck->size = len;
+	ck->next = ar->chunks;
+	ar->chunks = ck;
+	ar->avail = ptr_add_offset(ck, ARENA_CHUNK_HEAD);
+	ar->end = ptr_add_offset(ck, len);
+}
+
+/**
+ * Create a new arena.
+ *
+ * @param chunksize		size of the chunks, rounded up to the page size
+ *
+ * @return a new arena.
+ */
+arena_t *
+arena_make(size_t chunksize)
+{
+	arena_t *ar;
+
+	WALLOC0(ar);
+	ar->magic = ARENA_MAGIC;
+	ar->chunksize = round_pagesize(MAX(chunksize, 1));
+
+	arena_chunk_add(ar, 0);
+
+	return ar;
+}
+
+/**
+ * Allocate memory from the arena.
+ *
+ * @param ar		the arena
+ * @param size		amount of bytes to allocate
+ *
+ * @return a pointer to the start of the allocated block, suitably aligned.
+ */
+void *
+arena_alloc(arena_t *ar, size_t size)
+{
+	size_t len = arena_round(size);
+	void *p;
+
+	arena_check(ar);
+
+	if G_UNLIKELY(len > ptr_diff(ar->end, ar->avail))
+		arena_chunk_add(ar, len);
+
+	p = ar->avail;
+	ar->avail += len;
+	ar->allocated += len;
+
+	return p;
+}
+
+/**
+ * Allocate zeroed memory from the arena.
+ *
+ * @param ar		the arena
+ * @param size		amount of bytes to allocate
+ *
+ * @return a pointer to the start of the allocated block, suitably aligned.
+ */
+void *
+arena_alloc0(arena_t *ar, size_t size)
+{
+	void *p = arena_alloc(ar, size);
+
+	memset(p, 0, size);
+	return p;
+}
+
+/**
+ * Duplicate at most `n' bytes from the string into the arena, making sure
+ * the result is NUL-terminated.
+ *
+ * @return the duplicated string, NULL if `s' was NULL.
+ */
+char *
+arena_strndup(arena_t *ar, const char *s, size_t n)
+{
+	char *p, *q;
+	size_t len;
+
+	if (NULL == s)
+		return NULL;
+
+	len = clamp_strlen(s, n);
+	p = arena_alloc(ar, len + 1);
+	q = mempcpy(p, s, len);
+	*q = '\0';
+
+	return p;
+}
+
+/**
+ * Reset the arena, releasing all the blocks allocated since the last reset.
+ *
+ * Only the first chunk is kept, all the others being freed.
+ */
+void
+arena_reset(arena_t *ar)
+{
+	struct arena_chunk *ck;
+
+	arena_check(ar);
+
+	/*
+	 * The first chunk we allocated is the last one in the list.
+	 */
+
+	for (ck = ar->chunks; ck->next != NULL; ck = ar->chunks) {
+		ar->chunks = ck->next;
+		vmm_free(ck, ck->size);
+	}
+
+	ar->avail = ptr_add_offset(ck, ARENA_CHUNK_HEAD);
+	ar->end = ptr_add_offset(ck, ck->size);
+	ar->allocated = 0;
+}
+
+/**
+ * @return the amount of bytes allocated since the last reset.
+ */
+size_t
+arena_allocated(const arena_t *ar)
+{
+	arena_check(ar);
+
+	return ar->allocated;
+}
+
+/**
+ * Free the arena and nullify its pointer.
+ */
+void
+arena_free_null(arena_t **ar_ptr)
+{
+	arena_t *ar = *ar_ptr;
+
+	if (ar != NULL) {
+		struct arena_chunk *ck, *next;
+
+		arena_check(ar);
+
+		for (ck = ar->chunks; ck != NULL; ck = next) {
+			next = ck->next;
+			vmm_free(ck, ck->size);
+		}
+
+		ar->magic = 0;
+		WFREE(ar);
+		*ar_ptr = NULL;
+	}
+}
+
+/* vi: set ts=4 sw=4 cindent: */
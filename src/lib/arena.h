@@ -0,0 +1,52 @@
+/*
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Arena allocator.
+ */
+
+#ifndef _arena_h_
+#define _arena_h_
+
+typedef struct arena arena_t;
+
+/*
+ * Public interface.
+ */
+
+arena_t *arena_make(size_t chunksize);
+void arena_free_null(arena_t **ar_ptr);
+
+void *arena_alloc(arena_t *ar, size_t size) G_MALLOC G_NON_NULL;
+void *arena_alloc0(arena_t *ar, size_t size) G_MALLOC G_NON_NULL;
+char *arena_strndup(arena_t *ar, const char *s, size_t n) G_MALLOC;
+void arena_reset(arena_t *ar);
+size_t arena_allocated(const arena_t *ar) G_PURE;
+
+#define ARENA_ALLOC(ar,p)	((p) = arena_alloc((ar), sizeof *(p)))
+#define ARENA_ALLOC0(ar,p)	((p) = arena_alloc0((ar), sizeof *(p)))
+
+#endif /* _arena_h_ */
+
+/* vi: set ts=4 sw=4 cindent: */
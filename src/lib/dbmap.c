@@ -39,6 +39,13 @@
  * to an in-core version of a DBM database should there be a problem with
  * initialization of the DBM.
  *
+ * Neither hashed back-end keeps its keys in any order, so a range of keys
+ * can only be found by iterating over the whole map.  The sorted back-end
+ * stores its data in an SDBM database as well, but also maintains an ordered
+ * index of the keys in memory: ranges are then traversed in key order, and
+ * only the keys within the range are visited.  This makes it possible to
+ * prune expired entries by indexing them by expiration time.
+ *
  * @author Raphael Manfredi
  * @date 2008
  */
@@ -49,6 +56,7 @@
 
 #include "bstr.h"
 #include "debug.h"
+#include "erbtree.h"
 #include "map.h"
 #include "misc.h"				/* For english_strerror() */
 #include "pmsg.h"
@@ -76,6 +84,8 @@ struct dbmap {
 		} m;
 		struct {
 			DBM *sdbm;
+			erbtree_ext_t index;	/**< Sorted key index (DBMAP_SORTED) */
+			size_t ioffset;			/**< Offset of index node in key items */
 			time_t last_check;		/**< When we last checked keys */
 			unsigned is_volatile:1;	/**< Whether DB can be discarded */
 		} s;
@@ -97,6 +107,17 @@ dbmap_check(const dbmap_t *dm)
 	g_assert(DBMAP_MAGIC == dm->magic);
 }
 
+#define DBMAP_INDEX(dm)	((erbtree_t *) &(dm)->u.s.index)
+
+/**
+ * @return whether the DB map is backed by an SDBM database.
+ */
+static inline bool
+dbmap_is_sdbm(const dbmap_t *dm)
+{
+	return DBMAP_SDBM == dm->type || DBMAP_SORTED == dm->type;
+}
+
 /**
  * Special key used by dbmap_store() and used by dbmap_retrieve() to
  * persist informations necessary to reconstruct a DB map object easily.
@@ -136,6 +157,85 @@ dbmap_keylen(const dbmap_t *dm, const void *key)
 	}
 }
 
+/**
+ * Compare two keys of a sorted DB map.
+ *
+ * Keys are compared as byte strings, a key sorting before all the longer
+ * keys of which it is a prefix.
+ */
+static int
+dbmap_key_cmp(const void *a, const void *b, void *data)
+{
+	const dbmap_t *dm = data;
+	size_t alen = dbmap_keylen(dm, a);
+	size_t blen = dbmap_keylen(dm, b);
+	int c;
+
+	c = memcmp(a, b, MIN(alen, blen));
+
+	return 0 != c ? c : CMP(alen, blen);
+}
+
+/**
+ * Record key in the index of a sorted DB map, if not already present.
+ *
+ * Index items start with a copy of the key, so that the key supplied by
+ * the user can be directly used for lookups, followed by the tree node.
+ */
+static void
+dbmap_index_add(dbmap_t *dm, const void *key)
+{
+	void *item;
+
+	g_assert(DBMAP_SORTED == dm->type);
+
+	item = walloc(dm->u.s.ioffset + sizeof(rbnode_t));
+	memcpy(item, key, dbmap_keylen(dm, key));
+
+	if (erbtree_insert(DBMAP_INDEX(dm), ptr_add_offset(item, dm->u.s.ioffset)))
+		wfree(item, dm->u.s.ioffset + sizeof(rbnode_t));	/* Already there */
+}
+
+/**
+ * Free index item.
+ */
+static void
+dbmap_index_free(void *item, void *data)
+{
+	const dbmap_t *dm = data;
+
+	wfree(item, dm->u.s.ioffset + sizeof(rbnode_t));
+}
+
+/**
+ * Remove key from the index of a sorted DB map, if present.
+ */
+static void
+dbmap_index_remove(dbmap_t *dm, const void *key)
+{
+	rbnode_t *rn;
+
+	g_assert(DBMAP_SORTED == dm->type);
+
+	rn = erbtree_getnode(DBMAP_INDEX(dm), key);
+
+	if (rn != NULL) {
+		erbtree_remove(DBMAP_INDEX(dm), rn);
+		dbmap_index_free(erbtree_data(DBMAP_INDEX(dm), rn), dm);
+	}
+}
+
+/**
+ * Discard the whole index of a sorted DB map.
+ */
+static void
+dbmap_index_discard(dbmap_t *dm)
+{
+	g_assert(DBMAP_SORTED == dm->type);
+
+	erbtree_discard_with_data(DBMAP_INDEX(dm), dbmap_index_free, dm);
+}
+
 /**
  * Store a superblock in an SDBM DB map.
  * @return TRUE on success.
@@ -150,7 +250,7 @@ dbmap_sdbm_store_superblock(const dbmap_t *dm)
 	bool ok = TRUE;
 
 	dbmap_check(dm);
-	g_assert(DBMAP_SDBM == dm->type);
+	g_assert(dbmap_is_sdbm(dm));
 
 	sdbm = dm->u.s.sdbm;
 
@@ -272,7 +372,7 @@ static bool
 dbmap_sdbm_error_check(const dbmap_t *dm)
 {
 	dbmap_check(dm);
-	g_assert(DBMAP_SDBM == dm->type);
+	g_assert(dbmap_is_sdbm(dm));
 
 	if (sdbm_error(dm->u.s.sdbm)) {
 		dbmap_t *dmw = deconstify_pointer(dm);
@@ -304,7 +404,7 @@ dbmap_sdbm_count_keys(dbmap_t *dm, bool expect_superblock)
 	DBM* sdbm;
 
 	dbmap_check(dm);
-	g_assert(DBMAP_SDBM == dm->type);
+	g_assert(dbmap_is_sdbm(dm));
 
 	sdbm = dm->u.s.sdbm;
 
@@ -432,6 +532,22 @@ dbmap_type(const dbmap_t *dm)
 	return dm->type;
 }
 
+/**
+ * @return the name of the DB map type, for logging.
+ */
+const char *
+dbmap_type_to_string(enum dbmap_type type)
+{
+	switch (type) {
+	case DBMAP_MAP:		return "map";
+	case DBMAP_SDBM:	return "sdbm";
+	case DBMAP_SORTED:	return "sorted";
+	case DBMAP_MAXTYPE:	break;
+	}
+
+	return "unknown";
+}
+
 /**
  * @return amount of items held in map
  */
@@ -530,6 +646,55 @@ dbmap_create_sdbm(size_t ksize, dbmap_keylen_t klen,
 	return dm;
 }
 
+/**
+ * Create a DB map implemented as a SDBM database whose keys are also kept
+ * in a sorted index, allowing traversal of key ranges in key order.
+ *
+ * The parameters are the same as for dbmap_create_sdbm().  The index lies
+ * in memory only, being rebuilt from the database keys when it is opened.
+ *
+ * @return the opened database, or NULL if an error occurred during opening.
+ */
+dbmap_t *
+dbmap_create_sorted(size_t ksize, dbmap_keylen_t klen,
+	const char *name, const char *path, int flags, int mode)
+{
+	dbmap_t *dm;
+	DBM *sdbm;
+	datum key;
+
+	dm = dbmap_create_sdbm(ksize, klen, name, path, flags, mode);
+
+	if (NULL == dm)
+		return NULL;
+
+	dm->type = DBMAP_SORTED;
+	dm->u.s.ioffset = round_size(MEM_ALIGNBYTES, ksize);
+	erbtree_init_data(&dm->u.s.index, dbmap_key_cmp, dm, dm->u.s.ioffset);
+
+	sdbm = dm->u.s.sdbm;
+
+	for (
+		key = sdbm_firstkey_safe(sdbm);
+		key.dptr != NULL;
+		key = sdbm_nextkey(sdbm)
+	) {
+		if (dbmap_keylen(dm, key.dptr) != key.dsize)
+			continue;		/* Invalid key, corrupted file? */
+
+		dbmap_index_add(dm, key.dptr);
+	}
+	dbmap_sdbm_error_check(dm);
+
+	/*
+	 * The index is what we can traverse, so it defines the item count.
+	 */
+
+	dm->count = erbtree_count(DBMAP_INDEX(dm));
+
+	return dm;
+}
+
 /**
  * Create a map out of an existing map.
  * Use dbmap_release() to discard the dbmap encapsulation.
@@ -607,7 +772,7 @@ dbmap_sdbm_set_name(const dbmap_t *dm, const char *name)
 {
 	dbmap_check(dm);
 	g_assert(name != NULL);
-	g_assert(DBMAP_SDBM == dm->type);
+	g_assert(dbmap_is_sdbm(dm));
 
 	sdbm_set_name(dm->u.s.sdbm, name);
 }
@@ -658,6 +823,7 @@ dbmap_insert(dbmap_t *dm, const void *key, dbmap_datum_t value)
 		}
 		break;
 	case DBMAP_SDBM:
+	case DBMAP_SORTED:
 		{
 			datum dkey;
 			datum dval;
@@ -675,8 +841,11 @@ dbmap_insert(dbmap_t *dm, const void *key, dbmap_datum_t value)
 				dbmap_sdbm_error_check(dm);
 				return FALSE;
 			}
-			if (!existed)
+			if (!existed) {
 				dm->count++;
+				if (DBMAP_SORTED == dm->type)
+					dbmap_index_add(dm, key);
+			}
 		}
 		break;
 	case DBMAP_MAXTYPE:
@@ -720,6 +889,7 @@ dbmap_remove(dbmap_t *dm, const void *key)
 		}
 		break;
 	case DBMAP_SDBM:
+	case DBMAP_SORTED:
 		{
 			datum dkey;
 			int ret;
@@ -737,6 +907,8 @@ dbmap_remove(dbmap_t *dm, const void *key)
 					return FALSE;
 				}
 			} else {
+				if (DBMAP_SORTED == dm->type)
+					dbmap_index_remove(dm, key);
 				if G_UNLIKELY(0 == dm->count) {
 					if (dm->validated) {
 						s_critical("DBMAP on sdbm \"%s\": BUG: "
@@ -776,6 +948,7 @@ dbmap_contains(dbmap_t *dm, const void *key)
 	case DBMAP_MAP:
 		return map_contains(dm->u.m.map, key);
 	case DBMAP_SDBM:
+	case DBMAP_SORTED:
 		{
 			datum dkey;
 			int ret;
@@ -823,6 +996,7 @@ dbmap_lookup(dbmap_t *dm, const void *key)
 		}
 		break;
 	case DBMAP_SDBM:
+	case DBMAP_SORTED:
 		{
 			datum dkey;
 			datum value;
@@ -858,6 +1032,7 @@ dbmap_implementation(const dbmap_t *dm)
 	case DBMAP_MAP:
 		return dm->u.m.map;
 	case DBMAP_SDBM:
+	case DBMAP_SORTED:
 		return dm->u.s.sdbm;
 	case DBMAP_MAXTYPE:
 		g_assert_not_reached();
@@ -879,6 +1054,9 @@ dbmap_release(dbmap_t *dm)
 
 	implementation = dbmap_implementation(dm);
 
+	if (DBMAP_SORTED == dm->type)
+		dbmap_index_discard(dm);
+
 	dm->type = DBMAP_MAXTYPE;
 	dm->magic = 0;
 	WFREE(dm);
@@ -917,6 +1095,9 @@ dbmap_destroy(dbmap_t *dm)
 		map_foreach(dm->u.m.map, free_kv, dm);
 		map_destroy(dm->u.m.map);
 		break;
+	case DBMAP_SORTED:
+		dbmap_index_discard(dm);
+		/* FALL THROUGH */
 	case DBMAP_SDBM:
 		sdbm_close(dm->u.s.sdbm);
 		break;
@@ -971,6 +1152,20 @@ dbmap_all_keys(const dbmap_t *dm)
 			sl = ctx.sl;
 		}
 		break;
+	case DBMAP_SORTED:
+		{
+			rbnode_t *rn;
+
+			/*
+			 * Traverse the index backwards to return the keys in order.
+			 */
+
+			for (rn = erbtree_last(DBMAP_INDEX(dm)); rn; rn = erbtree_prev(rn)) {
+				void *key = erbtree_data(DBMAP_INDEX(dm), rn);
+				sl = pslist_prepend(sl, wcopy(key, dbmap_keylen(dm, key)));
+			}
+		}
+		break;
 	case DBMAP_SDBM:
 		{
 			datum key;
@@ -1097,8 +1292,11 @@ dbmap_foreach_remove_sdbm(const datum key, const datum value, void *arg)
 
 	to_remove = (*ctx->u.cbr)(deconstify_pointer(key.dptr), &d, ctx->arg);
 
-	if (to_remove)
+	if (to_remove) {
 		ctx->deleted++;
+		if (DBMAP_SORTED == ctx->dm->type)
+			dbmap_index_remove(deconstify_pointer(ctx->dm), key.dptr);
+	}
 
 	return to_remove;
 }
@@ -1145,6 +1343,7 @@ dbmap_foreach(const dbmap_t *dm, dbmap_cb_t cb, void *arg)
 		map_foreach(dm->u.m.map, dbmap_foreach_trampoline, &ctx);
 		break;
 	case DBMAP_SDBM:
+	case DBMAP_SORTED:
 		{
 			size_t count;
 
@@ -1191,6 +1390,7 @@ dbmap_foreach_remove(const dbmap_t *dm, dbmap_cbr_t cbr, void *arg)
 		}
 		break;
 	case DBMAP_SDBM:
+	case DBMAP_SORTED:
 		{
 			size_t count;
 
@@ -1212,6 +1412,213 @@ dbmap_foreach_remove(const dbmap_t *dm, dbmap_cbr_t cbr, void *arg)
 	return deleted;
 }
 
+/**
+ * Check whether key lies within the [lo, hi) range, each bound being optional.
+ */
+static bool
+dbmap_in_range(const dbmap_t *dm,
+	const void *key, const void *lo, const void *hi)
+{
+	void *data = deconstify_pointer(dm);
+
+	if (lo != NULL && dbmap_key_cmp(key, lo, data) < 0)
+		return FALSE;
+
+	if (hi != NULL && dbmap_key_cmp(key, hi, data) >= 0)
+		return FALSE;
+
+	return TRUE;
+}
+
+/**
+ * Context for range traversals on DB maps without a sorted index.
+ */
+struct range_ctx {
+	union {
+		dbmap_cb_t cb;
+		dbmap_cbr_t cbr;
+	} u;
+	void *arg;
+	const dbmap_t *dm;
+	const void *lo, *hi;	/* Range boundaries, each optional */
+};
+
+/**
+ * Iterator filtering keys outside the range.
+ */
+static void
+dbmap_range_filter(void *key, dbmap_datum_t *d, void *arg)
+{
+	struct range_ctx *ctx = arg;
+
+	if (dbmap_in_range(ctx->dm, key, ctx->lo, ctx->hi))
+		(*ctx->u.cb)(key, d, ctx->arg);
+}
+
+/**
+ * Removal iterator filtering keys outside the range.
+ */
+static bool
+dbmap_range_filter_remove(void *key, dbmap_datum_t *d, void *arg)
+{
+	struct range_ctx *ctx = arg;
+
+	if (!dbmap_in_range(ctx->dm, key, ctx->lo, ctx->hi))
+		return FALSE;
+
+	return (*ctx->u.cbr)(key, d, ctx->arg);
+}
+
+/**
+ * Traverse the [lo, hi) range of keys of a sorted DB map, in key order.
+ *
+ * @param dm		the sorted DB map
+ * @param lo		the lowest key to traverse (NULL means from first key)
+ * @param hi		the key ending the traversal (NULL means up to last key)
+ * @param removing	whether to remove items for which the callback says so
+ * @param ctx		the foreach context holding the callback and its argument
+ *
+ * @return the amount of items removed.
+ */
+static size_t
+dbmap_sorted_range(dbmap_t *dm, const void *lo, const void *hi,
+	bool removing, struct foreach_ctx *ctx)
+{
+	erbtree_t *tree = DBMAP_INDEX(dm);
+	DBM *sdbm = dm->u.s.sdbm;
+	rbnode_t *rn, *next;
+	size_t deleted = 0;
+
+	g_assert(DBMAP_SORTED == dm->type);
+
+	rn = NULL == lo ? erbtree_first(tree) : erbtree_lower_bound(tree, lo);
+
+	for (; rn != NULL; rn = next) {
+		void *key = erbtree_data(tree, rn);
+		dbmap_datum_t d;
+		datum dkey, value;
+
+		next = erbtree_next(rn);
+
+		if (hi != NULL && dbmap_key_cmp(key, hi, dm) >= 0)
+			break;
+
+		dkey.dptr = key;
+		dkey.dsize = dbmap_keylen(dm, key);
+
+		errno = 0;
+		value = sdbm_fetch(sdbm, dkey);
+
+		if G_UNLIKELY(NULL == value.dptr) {
+			if (0 == errno) {
+				/* Key vanished from the database, resynchronize index */
+				erbtree_remove(tree, rn);
+				dbmap_index_free(key, dm);
+			}
+			continue;
+		}
+
+		d.data = value.dptr;
+		d.len  = value.dsize;
+
+		if (!removing) {
+			(*ctx->u.cb)(key, &d, ctx->arg);
+			continue;
+		}
+
+		if ((*ctx->u.cbr)(key, &d, ctx->arg)) {
+			if (0 == sdbm_delete(sdbm, dkey)) {
+				erbtree_remove(tree, rn);
+				dbmap_index_free(key, dm);
+				deleted++;
+			}
+		}
+	}
+
+	dbmap_sdbm_error_check(dm);
+	dbmap_reset_count(dm, erbtree_count(tree));
+
+	return deleted;
+}
+
+/**
+ * Iterate over the keys within the [lo, hi) range, invoking the callback
+ * on each item along with the supplied argument.
+ *
+ * Either boundary can be NULL to leave the range open on that side.  Keys
+ * are compared as byte strings, so that integers which are part of keys
+ * must be serialized in big-endian order to get the proper ordering.
+ *
+ * Only the sorted back-end traverses items in key order and visits just
+ * the keys within the range; other back-ends need to iterate over all the
+ * items to find those within the range, which are visited in no particular
+ * order.
+ */
+void
+dbmap_foreach_range(const dbmap_t *dm, const void *lo, const void *hi,
+	dbmap_cb_t cb, void *arg)
+{
+	dbmap_check(dm);
+	g_assert(cb);
+
+	if (DBMAP_SORTED == dm->type) {
+		struct foreach_ctx ctx;
+
+		ctx.u.cb = cb;
+		ctx.arg = arg;
+		ctx.dm = dm;
+
+		dbmap_sorted_range(deconstify_pointer(dm), lo, hi, FALSE, &ctx);
+	} else {
+		struct range_ctx ctx;
+
+		ctx.u.cb = cb;
+		ctx.arg = arg;
+		ctx.dm = dm;
+		ctx.lo = lo;
+		ctx.hi = hi;
+
+		dbmap_foreach(dm, dbmap_range_filter, &ctx);
+	}
+}
+
+/**
+ * Iterate over the keys within the [lo, hi) range, invoking the callback
+ * on each item along with the supplied argument and removing the item when
+ * the callback returns TRUE.
+ *
+ * See dbmap_foreach_range() for the meaning of the boundaries.
+ *
+ * @return the amount of items deleted
+ */
+size_t
+dbmap_foreach_remove_range(const dbmap_t *dm,
+	const void *lo, const void *hi, dbmap_cbr_t cbr, void *arg)
+{
+	dbmap_check(dm);
+	g_assert(cbr);
+
+	if (DBMAP_SORTED == dm->type) {
+		struct foreach_ctx ctx;
+
+		ctx.u.cbr = cbr;
+		ctx.arg = arg;
+		ctx.dm = dm;
+
+		return dbmap_sorted_range(deconstify_pointer(dm), lo, hi, TRUE, &ctx);
+	} else {
+		struct range_ctx ctx;
+
+		ctx.u.cbr = cbr;
+		ctx.arg = arg;
+		ctx.dm = dm;
+		ctx.lo = lo;
+		ctx.hi = hi;
+
+		return dbmap_foreach_remove(dm, dbmap_range_filter_remove, &ctx);
+	}
+}
+
 static void
 dbmap_store_entry(void *key, dbmap_datum_t *d, void *arg)
 {
@@ -1240,7 +1647,7 @@ dbmap_store(dbmap_t *dm, const char *base, bool inplace)
 
 	dbmap_check(dm);
 
-	if (inplace && DBMAP_SDBM == dm->type) {
+	if (inplace && dbmap_is_sdbm(dm)) {
 		if (dbmap_sdbm_store_superblock(dm)) {
 			dbmap_set_volatile(dm, FALSE);
 			dbmap_sync(dm);
@@ -1340,6 +1747,7 @@ dbmap_sync(dbmap_t *dm)
 	case DBMAP_MAP:
 		return 0;
 	case DBMAP_SDBM:
+	case DBMAP_SORTED:
 		return sdbm_sync(dm->u.s.sdbm);
 	case DBMAP_MAXTYPE:
 		g_assert_not_reached();
@@ -1361,6 +1769,7 @@ dbmap_shrink(dbmap_t *dm)
 	case DBMAP_MAP:
 		return TRUE;
 	case DBMAP_SDBM:
+	case DBMAP_SORTED:
 		return sdbm_shrink(dm->u.s.sdbm);
 	case DBMAP_MAXTYPE:
 		g_assert_not_reached();
@@ -1382,6 +1791,7 @@ dbmap_rebuild(dbmap_t *dm)
 	case DBMAP_MAP:
 		return TRUE;
 	case DBMAP_SDBM:
+	case DBMAP_SORTED:
 		return 0 == sdbm_rebuild(dm->u.s.sdbm);
 	case DBMAP_MAXTYPE:
 		g_assert_not_reached();
@@ -1405,9 +1815,12 @@ dbmap_clear(dbmap_t *dm)
 		dm->count = 0;
 		return TRUE;
 	case DBMAP_SDBM:
+	case DBMAP_SORTED:
 		if (0 == sdbm_clear(dm->u.s.sdbm)) {
 			dm->ioerr = FALSE;
 			dm->count = 0;
+			if (DBMAP_SORTED == dm->type)
+				dbmap_index_discard(dm);
 			return TRUE;
 		}
 		return FALSE;
@@ -1431,6 +1844,7 @@ dbmap_set_cachesize(dbmap_t *dm, long pages)
 	case DBMAP_MAP:
 		return 0;
 	case DBMAP_SDBM:
+	case DBMAP_SORTED:
 		return sdbm_set_cache(dm->u.s.sdbm, pages);
 	case DBMAP_MAXTYPE:
 		g_assert_not_reached();
@@ -1452,6 +1866,7 @@ dbmap_set_deferred_writes(dbmap_t *dm, bool on)
 	case DBMAP_MAP:
 		return 0;
 	case DBMAP_SDBM:
+	case DBMAP_SORTED:
 		return sdbm_set_wdelay(dm->u.s.sdbm, on);
 	case DBMAP_MAXTYPE:
 		g_assert_not_reached();
@@ -1460,6 +1875,50 @@ dbmap_set_deferred_writes(dbmap_t *dm, bool on)
 	return 0;
 }
 
+/**
+ * Turn the SDBM write-ahead log on or off.
+ * @return 0 if OK, -1 on errors with errno set.
+ */
+int
+dbmap_set_wal(dbmap_t *dm, bool on)
+{
+	dbmap_check(dm);
+
+	switch (dm->type) {
+	case DBMAP_MAP:
+		return 0;
+	case DBMAP_SDBM:
+	case DBMAP_SORTED:
+		return sdbm_set_wal(dm->u.s.sdbm, on);
+	case DBMAP_MAXTYPE:
+		g_assert_not_reached();
+	}
+
+	return 0;
+}
+
+/**
+ * Turn reading of SDBM pages through a memory mapping on or off.
+ * @return 0 if OK, -1 on errors with errno set.
+ */
+int
+dbmap_set_mmap(dbmap_t *dm, bool on)
+{
+	dbmap_check(dm);
+
+	switch (dm->type) {
+	case DBMAP_MAP:
+		return 0;
+	case DBMAP_SDBM:
+	case DBMAP_SORTED:
+		return sdbm_set_mmap(dm->u.s.sdbm, on);
+	case DBMAP_MAXTYPE:
+		g_assert_not_reached();
+	}
+
+	return 0;
+}
+
 /**
  * Tell SDBM whether it is volatile.
  * @return 0 if OK, -1 on errors with errno set.
@@ -1473,6 +1932,7 @@ dbmap_set_volatile(dbmap_t *dm, bool is_volatile)
 	case DBMAP_MAP:
 		return 0;
 	case DBMAP_SDBM:
+	case DBMAP_SORTED:
 		dm->u.s.is_volatile = booleanize(is_volatile);
 		return sdbm_set_volatile(dm->u.s.sdbm, is_volatile);
 	case DBMAP_MAXTYPE:
@@ -1494,7 +1954,7 @@ dbmap_set_debugging(dbmap_t *dm, const dbg_config_t *dbg)
 
 	if (dbg_ds_debugging(dm->dbg, 1, DBG_DSF_DEBUGGING)) {
 		dbg_ds_log(dm->dbg, dm, "%s: attached with %s back-end (count=%zu)",
-			G_STRFUNC, DBMAP_SDBM == dm->type ? "sdbm" : "map", dm->count);
+			G_STRFUNC, dbmap_type_to_string(dm->type), dm->count);
 	}
 }
 
@@ -45,6 +45,7 @@
 enum dbmap_type {
 	DBMAP_MAP = 0,			/* Map in memory */
 	DBMAP_SDBM,				/* SDBM database */
+	DBMAP_SORTED,			/* SDBM database with a sorted key index */
 
 	DBMAP_MAXTYPE
 };
@@ -79,6 +80,8 @@ dbmap_t *dbmap_create_hash(size_t ks, dbmap_keylen_t kl,
 	hash_fn_t hashf, eq_fn_t key_eqf);
 dbmap_t * dbmap_create_sdbm(size_t ks, dbmap_keylen_t kl, const char *name,
 	const char *path, int flags, int mode);
+dbmap_t * dbmap_create_sorted(size_t ks, dbmap_keylen_t kl, const char *name,
+	const char *path, int flags, int mode);
 dbmap_t *dbmap_create_from_map(size_t ks, dbmap_keylen_t kl, map_t *map);
 dbmap_t *dbmap_create_from_sdbm(const char *name,
 	size_t ks, dbmap_keylen_t kl, DBM *sdbm);
@@ -101,10 +104,15 @@ dbmap_keylen_t dbmap_key_length(const dbmap_t *dm);
 bool dbmap_has_ioerr(const dbmap_t *dm);
 const char *dbmap_strerror(const dbmap_t *dm);
 enum dbmap_type dbmap_type(const dbmap_t *dm);
+const char *dbmap_type_to_string(enum dbmap_type type);
 size_t dbmap_count(const dbmap_t *dm);
 
 void dbmap_foreach(const dbmap_t *dm, dbmap_cb_t cb, void *arg);
 size_t dbmap_foreach_remove(const dbmap_t *dm, dbmap_cbr_t cbr, void *arg);
+void dbmap_foreach_range(const dbmap_t *dm, const void *lo, const void *hi,
+	dbmap_cb_t cb, void *arg);
+size_t dbmap_foreach_remove_range(const dbmap_t *dm,
+	const void *lo, const void *hi, dbmap_cbr_t cbr, void *arg);
 
 /**
  * Key snapshot utilities.
@@ -123,6 +131,8 @@ bool dbmap_clear(dbmap_t *dm);
 ssize_t dbmap_sync(dbmap_t *dm);
 int dbmap_set_cachesize(dbmap_t *dm, long pages);
 int dbmap_set_deferred_writes(dbmap_t *dm, bool on);
+int dbmap_set_wal(dbmap_t *dm, bool on);
+int dbmap_set_mmap(dbmap_t *dm, bool on);
 int dbmap_set_volatile(dbmap_t *dm, bool is_volatile);
 void dbmap_set_debugging(dbmap_t *dm, const struct dbg_config *dbg);
 
@@ -28,6 +28,19 @@
  * DBM wrapper for transparent serialization / deserialization
  * of data structures and cache management.
  *
+ * Deserialized values are cached using the "2Q" replacement policy: keys
+ * seen for the first time enter a FIFO probation queue, and only the keys
+ * we see again after they were evicted from that queue make it to the main
+ * LRU list.  Evicted probation keys are remembered in a "ghost" FIFO, with
+ * no value attached.  This protects the cache from database traversals or
+ * from bursts of lookups on keys we will not access again.
+ *
+ * The cache is bounded by the memory used by the cached entries, in addition
+ * to the maximum amount of items.  All the caches share a global memory
+ * budget, each DBMW getting a target proportional to the usefulness of its
+ * cache, as measured by the amount of hits it gets (or would get, for the
+ * ghost hits) during the latest accesses.
+ *
  * @author Raphael Manfredi
  * @date 2008-2009
  */
@@ -36,6 +49,7 @@
 
 #include "dbmw.h"
 
+#include "atoms.h"
 #include "bstr.h"
 #include "dbmap.h"
 #include "debug.h"
@@ -44,6 +58,7 @@
 #include "misc.h"				/* For english_strerror() */
 #include "pmsg.h"
 #include "pslist.h"
+#include "spinlock.h"
 #include "stacktrace.h"
 #include "stringify.h"
 #include "walloc.h"
@@ -52,6 +67,9 @@
 #include "override.h"			/* Must be the last header included */
 
 #define DBMW_CACHE	128			/**< Default amount of items to cache */
+#define DBMW_BUDGET	(16 * 1024 * 1024)	/**< Default global cache budget */
+#define DBMW_PERIOD	4096		/**< Accesses between target adjustments */
+#define DBMW_MIN_ITEMS	8		/**< Items a cache can hold, at least */
 
 enum dbmw_magic { DBMW_MAGIC = 0x28e7e7d2U };
 
@@ -64,12 +82,24 @@ struct dbmw {
 	const char *name;			/**< DB name, for logging */
 	pmsg_t *mb;					/**< Message block used for serialization */
 	bstr_t *bs;					/**< Binary stream used for deserialization */
-	hash_list_t *keys;			/**< LRU list of keys cached */
+	hash_list_t *keys;			/**< LRU list of keys cached (main queue) */
+	hash_list_t *fresh;			/**< FIFO of keys cached (probation queue) */
+	hash_list_t *ghosts;		/**< FIFO of keys evicted from probation */
 	map_t *values;				/**< Map of values cached */
 	uint64 r_access;			/**< Number of read accesses */
 	uint64 w_access;			/**< Number of write accesses */
 	uint64 r_hits;				/**< Number of read cache hits */
 	uint64 w_hits;				/**< Number of write cache hits */
+	uint64 g_hits;				/**< Number of ghost hits on cache misses */
+	uint64 evictions;			/**< Number of entries evicted */
+	size_t items;				/**< Amount of cached entries */
+	size_t bytes;				/**< Memory used by cached entries */
+	size_t fresh_bytes;			/**< Memory used by probation entries */
+	size_t target;				/**< Memory target, from global budget */
+	size_t share;				/**< Budget share, whilst rebalancing */
+	uint period_access;			/**< Accesses during current period */
+	uint period_hits;			/**< Hits and ghost hits during period */
+	uint utility;				/**< Smoothed hit rate, per 1/1000 */
 	size_t key_size;			/**< Size of keys (constant or maximum) */
 	dbmap_keylen_t key_len;		/**< Optional, computes actual key length */
 	size_t value_size;			/**< Maximum size of values (structure) */
@@ -109,8 +139,19 @@ struct cached {
 	unsigned absent:1;			/**< Whether entry is absent from database */
 	unsigned traversed:1;		/**< Whether entry was traversed by iteration */
 	unsigned removable:1;		/**< Entry must be removed after iteration? */
+	unsigned fresh:1;			/**< Whether entry is in probation queue */
 };
 
+/**
+ * All the DBMW having a cache, sharing the global memory budget.
+ */
+static pslist_t *dbmw_caches;
+static size_t dbmw_budget = DBMW_BUDGET;
+static spinlock_t dbmw_caches_slk = SPINLOCK_INIT;
+
+#define DBMW_CACHES_LOCK	spinlock(&dbmw_caches_slk)
+#define DBMW_CACHES_UNLOCK	spinunlock(&dbmw_caches_slk)
+
 /**
  * Computes key length.
  */
@@ -126,6 +167,118 @@ dbmw_keylen(const dbmw_t *dw, const void *key)
 	}
 }
 
+/**
+ * @return memory used by a cached entry, including its key.
+ */
+static inline size_t
+cached_size(const dbmw_t *dw, const void *key, const struct cached *entry)
+{
+	return sizeof(struct cached) + entry->len + dbmw_keylen(dw, key);
+}
+
+/**
+ * @return maximum memory used by a cached entry, including its key.
+ */
+static inline size_t
+cached_max_size(const dbmw_t *dw)
+{
+	return sizeof(struct cached) + dw->value_size + dw->key_size;
+}
+
+/**
+ * Share the global memory budget among all the caches.
+ *
+ * Each cache gets a part of the budget proportional to its utility, but
+ * never more than what its maximum amount of items can use, the excess
+ * being shared among the other caches, and never less than what is needed
+ * to hold DBMW_MIN_ITEMS of the largest entries.
+ *
+ * The target of each DBMW is updated without its owner knowing: this is
+ * only used to determine when entries must be evicted, so reading a stale
+ * value is harmless.
+ */
+static void
+dbmw_rebalance(void)
+{
+	pslist_t *sl;
+	size_t remain;
+	uint64 weights = 0;
+	bool capped;
+
+	DBMW_CACHES_LOCK;
+
+	remain = dbmw_budget;
+
+	PSLIST_FOREACH(dbmw_caches, sl) {
+		dbmw_t *dw = sl->data;
+
+		dw->share = 0;
+		weights += 1 + dw->utility;
+	}
+
+	/*
+	 * Give their maximum to the caches whose share would exceed it, and
+	 * loop since the remaining caches now get a larger share.
+	 */
+
+	do {
+		capped = FALSE;
+
+		PSLIST_FOREACH(dbmw_caches, sl) {
+			dbmw_t *dw = sl->data;
+			size_t max = dw->max_cached * cached_max_size(dw);
+			uint64 w = 1 + dw->utility;
+
+			if (dw->share != 0)
+				continue;
+
+			if (remain * w / weights >= max) {
+				dw->share = max;
+				remain -= max;
+				weights -= w;
+				capped = TRUE;
+			}
+		}
+	} while (capped && weights != 0);
+
+	PSLIST_FOREACH(dbmw_caches, sl) {
+		dbmw_t *dw = sl->data;
+
+		if (0 == dw->share) {
+			size_t min = DBMW_MIN_ITEMS * cached_max_size(dw);
+			dw->share = MAX(min, remain * (1 + dw->utility) / weights);
+		}
+		dw->target = dw->share;
+	}
+
+	DBMW_CACHES_UNLOCK;
+}
+
+/**
+ * Account for a cache access, which was a hit if ``hit'' is TRUE.
+ *
+ * At the end of each period, the utility of the cache is updated with the
+ * hit rate observed during the period, including the ghost hits, and the
+ * global budget is shared again.
+ */
+static inline void
+dbmw_cache_access(dbmw_t *dw, bool hit)
+{
+	dw->period_access++;
+	if (hit)
+		dw->period_hits++;
+
+	if G_UNLIKELY(dw->period_access >= DBMW_PERIOD) {
+		uint rate = MIN(1000, dw->period_hits * 1000 / dw->period_access);
+
+		dw->utility = (dw->utility + rate) / 2;
+		dw->period_access = dw->period_hits = 0;
+
+		if (dw->max_cached > 1)
+			dbmw_rebalance();
+	}
+}
+
 /**
  * Check whether I/O error has occurred during last operation.
  */
@@ -198,6 +351,9 @@ dbmw_count(dbmw_t *dw)
  * If serialization and deserialization routines are NULL pointers, data
  * will be stored and retrieved as-is.  In that case, they must be both
  * NULL.
+ *
+ * The cache_size only sets the maximum amount of cached items: the memory
+ * used by the cache is further limited by its share of the global budget.
  */
 dbmw_t *
 dbmw_create(dbmap_t *dm, const char *name,
@@ -247,6 +403,9 @@ dbmw_create(dbmap_t *dm, const char *name,
 	}
 
 	dw->keys = hash_list_new(hash_func, eq_func);
+	dw->fresh = hash_list_new(hash_func, eq_func);
+	dw->ghosts = hash_list_new(hash_func, eq_func);
+	dw->target = SIZE_MAX;
 	dw->pack = pack;
 	dw->unpack = unpack;
 	dw->valfree = valfree;
@@ -281,12 +440,25 @@ dbmw_create(dbmap_t *dm, const char *name,
 	else
 		dw->max_cached = cache_size;
 
+	/*
+	 * A real cache takes its share of the global memory budget.
+	 */
+
+	if (dw->max_cached > 1) {
+		DBMW_CACHES_LOCK;
+		dbmw_caches = pslist_prepend(dbmw_caches, dw);
+		DBMW_CACHES_UNLOCK;
+
+		dbmw_rebalance();
+	}
+
 	if (common_dbg)
 		s_debug("DBMW created \"%s\" with %s back-end "
-			"(max cached = %zu, key=%zu bytes, value=%zu bytes, "
-			"%zu max serialized)",
-			dw->name, dbmw_map_type(dw) == DBMAP_SDBM ? "sdbm" : "map",
-			dw->max_cached, dw->key_size, dw->value_size, dw->value_data_size);
+			"(max cached = %zu, target=%zu bytes, key=%zu bytes, "
+			"value=%zu bytes, %zu max serialized)",
+			dw->name, dbmap_type_to_string(dbmw_map_type(dw)),
+			dw->max_cached, dw->target,
+			dw->key_size, dw->value_size, dw->value_data_size);
 
 	return dw;
 }
@@ -402,6 +574,60 @@ free_value(const dbmw_t *dw, struct cached *cv, bool reclaim)
 	}
 }
 
+/**
+ * Remove key from the cache queues, accounting for the memory released.
+ * The key must still be present in the values map.
+ */
+static void
+cache_unlink(dbmw_t *dw, const void *key, const struct cached *entry)
+{
+	size_t size = cached_size(dw, key, entry);
+
+	g_assert(dw->items != 0);
+	g_assert(dw->bytes >= size);
+
+	dw->items--;
+	dw->bytes -= size;
+
+	if (entry->fresh) {
+		g_assert(dw->fresh_bytes >= size);
+		dw->fresh_bytes -= size;
+		hash_list_remove(dw->fresh, key);
+	} else {
+		hash_list_remove(dw->keys, key);
+	}
+}
+
+/**
+ * Record a cache hit on key.
+ *
+ * As in 2Q, a hit on the probation queue is considered to be correlated
+ * with the access that brought the key in the cache and does not change
+ * the entry position.  A hit on the main queue makes the key the most
+ * recently used one.
+ */
+static inline void
+cache_touch(dbmw_t *dw, const void *key, const struct cached *entry)
+{
+	if (!entry->fresh)
+		hash_list_moveto_tail(dw->keys, key);
+}
+
+/**
+ * Account for the new length of a cached entry, before it is updated.
+ */
+static void
+cache_resized(dbmw_t *dw, const struct cached *entry, size_t length)
+{
+	size_t old = entry->len;
+
+	g_assert(dw->bytes >= old);
+
+	dw->bytes = dw->bytes - old + length;
+	if (entry->fresh)
+		dw->fresh_bytes = dw->fresh_bytes - old + length;
+}
+
 /**
  * Remove cached entry for key, optionally disposing of the whole structure.
  * Cached entry is flushed if it was dirty and flush is set.
@@ -433,7 +659,7 @@ remove_entry(dbmw_t *dw, const void *key, bool dispose, bool flush)
 	if (old->dirty && flush)
 		write_back(dw, key, old);
 
-	hash_list_remove(dw->keys, key);
+	cache_unlink(dw, key, old);
 	map_remove(dw->values, key);
 	wfree(old_key, dbmw_keylen(dw, old_key));
 
@@ -450,65 +676,127 @@ remove_entry(dbmw_t *dw, const void *key, bool dispose, bool flush)
 	return NULL;
 }
 
+/**
+ * Evict cached entry for key, which must be at the head of the probation
+ * queue if ``fresh'' is TRUE, or at the head of the main queue otherwise.
+ *
+ * Keys evicted from the probation queue are remembered as ghosts.
+ */
+static void
+cache_evict(dbmw_t *dw, void *key, bool fresh)
+{
+	void *ghost = NULL;
+
+	if (fresh && dw->max_cached > 1)
+		ghost = wcopy(key, dbmw_keylen(dw, key));
+
+	(void) remove_entry(dw, key, TRUE, TRUE);	/* Frees ``key'' */
+	dw->evictions++;
+
+	if (ghost != NULL) {
+		hash_list_append(dw->ghosts, ghost);
+
+		while (hash_list_length(dw->ghosts) > dw->max_cached / 2) {
+			void *old = hash_list_shift(dw->ghosts);
+			wfree(old, dbmw_keylen(dw, old));
+		}
+	}
+}
+
+/**
+ * Evict entries until the cache is within its limits, in amount of items
+ * and in memory used.
+ *
+ * @param dw		the DBM wrapper
+ * @param keep		the (cached) key of the entry we just inserted
+ */
+static void
+cache_trim(dbmw_t *dw, const void *keep)
+{
+	while (dw->items > 1) {
+		void *head;
+		bool fresh;
+
+		if (dw->items <= dw->max_cached && dw->bytes <= dw->target)
+			break;
+
+		/*
+		 * As in 2Q, we evict from the probation queue when it holds more
+		 * than a quarter of the cache, from the main queue otherwise.
+		 *
+		 * The entry we just inserted is never evicted: the caller may
+		 * return its value.
+		 */
+
+		fresh = 0 == hash_list_length(dw->keys) ||
+			(dw->fresh_bytes > dw->target / 4 &&
+				0 != hash_list_length(dw->fresh));
+
+		head = hash_list_head(fresh ? dw->fresh : dw->keys);
+
+		if (keep == head) {
+			fresh = !fresh;
+			head = hash_list_head(fresh ? dw->fresh : dw->keys);
+			if (NULL == head)
+				break;
+		}
+
+		cache_evict(dw, head, fresh);
+	}
+}
+
 /**
  * Allocate a new entry in the cache to hold the deserialized value.
  *
+ * Keys that we evicted recently from the probation queue go straight to
+ * the main queue since we would have had a hit with a larger cache: the
+ * other keys are put on probation.
+ *
  * @param dw		the DBM wrapper
  * @param key		key we want a cache entry for
  * @param filled	optionally, a new cache entry already filled with the data
  *
- * @attention
- * An older cache entry structure can be returned, and it will still
- * point to the previous data.  Caller should normally invoke fill_entry()
- * immediately to make sure these stale data are not associated wrongly
- * with the new key, or supply his own filled structure directly.
- *
  * @return a cache entry object that can be filled with the value.
  */
 static struct cached *
 allocate_entry(dbmw_t *dw, const void *key, struct cached *filled)
 {
 	struct cached *entry;
-	void *saved_key;
+	void *saved_key, *ghost;
+	size_t size;
 
-	g_assert(!hash_list_contains(dw->keys, key));
 	g_assert(!map_contains(dw->values, key));
 	g_assert(!filled || (!filled->len == !filled->data));
 
 	saved_key = wcopy(key, dbmw_keylen(dw, key));
 
-	/*
-	 * If we have less keys cached than our maximum, add it.
-	 * Otherwise evict the least recently used key, at the head.
-	 */
-
-	if (hash_list_length(dw->keys) < dw->max_cached) {
-		if (filled)
-			entry = filled;
-		else
-			WALLOC0(entry);
-	} else {
-		void *head;
-
-		g_assert(hash_list_length(dw->keys) == dw->max_cached);
-
-		head = hash_list_head(dw->keys);
-		entry = remove_entry(dw, head, filled != NULL, TRUE);
+	if (filled)
+		entry = filled;
+	else
+		WALLOC0(entry);
 
-		g_assert(filled != NULL || entry != NULL);
+	ghost = hash_list_remove(dw->ghosts, key);
 
-		if (filled)
-			entry = filled;
+	if (ghost != NULL) {
+		wfree(ghost, dbmw_keylen(dw, ghost));
+		dw->g_hits++;
+		dw->period_hits++;
+		entry->fresh = FALSE;
+		hash_list_append(dw->keys, saved_key);
+	} else {
+		entry->fresh = TRUE;
+		hash_list_append(dw->fresh, saved_key);
 	}
 
-	/*
-	 * Add entry into cache.
-	 */
+	map_insert(dw->values, saved_key, entry);
 
-	g_assert(entry);
+	size = cached_size(dw, saved_key, entry);
+	dw->items++;
+	dw->bytes += size;
+	if (entry->fresh)
+		dw->fresh_bytes += size;
 
-	hash_list_append(dw->keys, saved_key);
-	map_insert(dw->values, saved_key, entry);
+	cache_trim(dw, saved_key);
 
 	return entry;
 }
@@ -517,8 +805,7 @@ allocate_entry(dbmw_t *dw, const void *key, struct cached *filled)
  * Fill cache entry structure with value data, marking it dirty and present.
  */
 static void
-fill_entry(const dbmw_t *dw,
-	struct cached *entry, void *value, size_t length)
+fill_entry(dbmw_t *dw, struct cached *entry, void *value, size_t length)
 {
 	/*
 	 * Try to reuse old entry arena if same size.
@@ -534,6 +821,7 @@ fill_entry(const dbmw_t *dw,
 
 		if (length)
 			arena = wcopy(value, length);
+		cache_resized(dw, entry, length);
 		free_value(dw, entry, TRUE);
 		entry->data = arena;
 		entry->len = length;
@@ -680,8 +968,8 @@ cache_free_removable(void *key, void *value, void *data)
 	if (!entry->removable)
 		return FALSE;
 
+	cache_unlink(dw, key, entry);
 	free_value(dw, entry, TRUE);
-	hash_list_remove(dw->keys, key);
 	wfree(key, dbmw_keylen(dw, key));
 	WFREE(entry);
 
@@ -939,6 +1227,8 @@ dbmw_write(dbmw_t *dw, const void *key, void *value, size_t length)
 	dw->w_access++;
 
 	entry = map_lookup(dw->values, key);
+	dbmw_cache_access(dw, entry != NULL);
+
 	if (entry) {
 		if (dbg_ds_debugging(dw->dbg, 2, DBG_DSF_CACHING | DBG_DSF_UPDATE)) {
 			dbg_ds_log(dw->dbg, dw, "%s: %s key=%s%s",
@@ -952,7 +1242,7 @@ dbmw_write(dbmw_t *dw, const void *key, void *value, size_t length)
 		if (entry->absent)
 			dw->cached++;			/* Key exists now, in unflushed status */
 		fill_entry(dw, entry, value, length);
-		hash_list_moveto_tail(dw->keys, key);
+		cache_touch(dw, key, entry);
 
 	} else if (dw->max_cached > 1) {
 		if (dbg_ds_debugging(dw->dbg, 2, DBG_DSF_CACHING | DBG_DSF_UPDATE)) {
@@ -1002,6 +1292,8 @@ dbmw_read(dbmw_t *dw, const void *key, size_t *lenptr)
 	dw->r_access++;
 
 	entry = map_lookup(dw->values, key);
+	dbmw_cache_access(dw, entry != NULL);
+
 	if (entry) {
 		if (dbg_ds_debugging(dw->dbg, 5, DBG_DSF_CACHING | DBG_DSF_ACCESS)) {
 			dbg_ds_log(dw->dbg, dw, "%s: read cache hit on %s key=%s%s",
@@ -1011,6 +1303,7 @@ dbmw_read(dbmw_t *dw, const void *key, size_t *lenptr)
 		}
 
 		dw->r_hits++;
+		cache_touch(dw, key, entry);
 		if (lenptr)
 			*lenptr = entry->len;
 		return entry->data;
@@ -1113,6 +1406,8 @@ dbmw_exists(dbmw_t *dw, const void *key)
 	dw->r_access++;
 
 	entry = map_lookup(dw->values, key);
+	dbmw_cache_access(dw, entry != NULL);
+
 	if (entry) {
 		if (dbg_ds_debugging(dw->dbg, 5, DBG_DSF_CACHING | DBG_DSF_ACCESS)) {
 			dbg_ds_log(dw->dbg, dw, "%s: read cache hit on %s key=%s%s",
@@ -1122,6 +1417,7 @@ dbmw_exists(dbmw_t *dw, const void *key)
 		}
 
 		dw->r_hits++;
+		cache_touch(dw, key, entry);
 		return !entry->absent;
 	}
 
@@ -1178,6 +1474,8 @@ dbmw_delete(dbmw_t *dw, const void *key)
 	dw->w_access++;
 
 	entry = map_lookup(dw->values, key);
+	dbmw_cache_access(dw, entry != NULL);
+
 	if (entry) {
 		if (dbg_ds_debugging(dw->dbg, 2, DBG_DSF_CACHING | DBG_DSF_DELETE)) {
 			dbg_ds_log(dw->dbg, dw, "%s: %s key=%s%s",
@@ -1209,7 +1507,7 @@ dbmw_delete(dbmw_t *dw, const void *key)
 			fill_entry(dw, entry, NULL, 0);
 			entry->absent = TRUE;
 		}
-		hash_list_moveto_tail(dw->keys, key);
+		cache_touch(dw, key, entry);
 
 	} else {
 		if (dbg_ds_debugging(dw->dbg, 2, DBG_DSF_DELETE)) {
@@ -1277,13 +1575,23 @@ dbmw_clear_cache(dbmw_t *dw)
 	dbmw_check(dw);
 
 	/*
-	 * In the cache, the hash list and the value cache share the same
+	 * In the cache, the hash lists and the value cache share the same
 	 * key pointers.  Therefore, we need to iterate on the map only
 	 * to free both at the same time.
+	 *
+	 * Ghost keys are only held in their list.
 	 */
 
 	hash_list_clear(dw->keys);
+	hash_list_clear(dw->fresh);
 	map_foreach_remove(dw->values, free_cached, dw);
+
+	while (0 != hash_list_length(dw->ghosts)) {
+		void *key = hash_list_shift(dw->ghosts);
+		wfree(key, dbmw_keylen(dw, key));
+	}
+
+	dw->items = dw->bytes = dw->fresh_bytes = 0;
 }
 
 /**
@@ -1316,19 +1624,21 @@ dbmw_destroy(dbmw_t *dw, bool close_map)
 	if (common_stats) {
 		s_debug("DBMW destroying \"%s\" with %s back-end "
 			"(read cache hits = %.2f%% on %s request%s, "
-			"write cache hits = %.2f%% on %s request%s)",
-			dw->name, dbmw_map_type(dw) == DBMAP_SDBM ? "sdbm" : "map",
+			"write cache hits = %.2f%% on %s request%s, "
+			"%s eviction%s)",
+			dw->name, dbmap_type_to_string(dbmw_map_type(dw)),
 			dw->r_hits * 100.0 / MAX(1, dw->r_access),
 			uint64_to_string(dw->r_access), plural(dw->r_access),
 			dw->w_hits * 100.0 / MAX(1, dw->w_access),
-			uint64_to_string2(dw->w_access), plural(dw->w_access));
+			uint64_to_string2(dw->w_access), plural(dw->w_access),
+			uint64_to_string3(dw->evictions), plural(dw->evictions));
 	}
 
 	if (dbg_ds_debugging(dw->dbg, 1, DBG_DSF_DESTROY)) {
 		dbg_ds_log(dw->dbg, dw, "%s: with %s back-end "
 			"(read cache hits = %.2f%% on %s request%s, "
 			"write cache hits = %.2f%% on %s request%s)",
-			G_STRFUNC, dbmw_map_type(dw) == DBMAP_SDBM ? "sdbm" : "map",
+			G_STRFUNC, dbmap_type_to_string(dbmw_map_type(dw)),
 			dw->r_hits * 100.0 / MAX(1, dw->r_access),
 			uint64_to_string(dw->r_access), plural(dw->r_access),
 			dw->w_hits * 100.0 / MAX(1, dw->w_access),
@@ -1344,8 +1654,18 @@ dbmw_destroy(dbmw_t *dw, bool close_map)
 		dbmw_sync(dw, DBMW_SYNC_CACHE);
 	}
 
+	if (dw->max_cached > 1) {
+		DBMW_CACHES_LOCK;
+		dbmw_caches = pslist_remove(dbmw_caches, dw);
+		DBMW_CACHES_UNLOCK;
+
+		dbmw_rebalance();
+	}
+
 	dbmw_clear_cache(dw);
 	hash_list_free(&dw->keys);
+	hash_list_free(&dw->fresh);
+	hash_list_free(&dw->ghosts);
 	map_destroy(dw->values);
 
 	if (dw->mb)
@@ -1624,6 +1944,62 @@ dbmw_foreach_remove(dbmw_t *dw, dbmw_cbr_t cbr, void *arg)
 	return pruned + fctx.removed;
 }
 
+/**
+ * Iterate over the keys of the DB within the [lo, hi) range, invoking the
+ * callback on each item along with the supplied argument and removing the
+ * item when the callback returns TRUE.
+ *
+ * Either boundary may be NULL to leave the range open on that side.  When
+ * the underlying map is sorted, only the keys within the range are visited,
+ * in key order.  See dbmap_foreach_range() for details.
+ *
+ * @return the amount of removed entries.
+ */
+size_t
+dbmw_foreach_remove_range(dbmw_t *dw, const void *lo, const void *hi,
+	dbmw_cbr_t cbr, void *arg)
+{
+	struct foreach_ctx ctx;
+	size_t pruned;
+
+	dbmw_check(dw);
+
+	if (dbg_ds_debugging(dw->dbg, 1, DBG_DSF_ITERATOR)) {
+		dbg_ds_log(dw->dbg, dw, "%s: starting with %s(%p)", G_STRFUNC,
+			stacktrace_function_name(cbr), arg);
+	}
+
+	/*
+	 * Unlike dbmw_foreach_remove(), we flush all the dirty values: the
+	 * values present only in the cache would otherwise have to be checked
+	 * against the range, defeating the purpose of a range traversal.
+	 * Once flushed, the underlying map holds all the keys.
+	 */
+
+	dbmw_sync(dw, DBMW_SYNC_CACHE);
+
+	ctx.u.cbr = cbr;
+	ctx.arg = arg;
+	ctx.dw = dw;
+
+	map_foreach(dw->values, cache_reset_before_traversal, NULL);
+	pruned = dbmap_foreach_remove_range(dw->dm, lo, hi,
+		dbmw_foreach_remove_trampoline, &ctx);
+
+	/*
+	 * Cached entries removed by the callback were marked as "removable".
+	 */
+
+	map_foreach_remove(dw->values, cache_free_removable, dw);
+
+	if (dbg_ds_debugging(dw->dbg, 1, DBG_DSF_ITERATOR)) {
+		dbg_ds_log(dw->dbg, dw, "%s: done with %s(%p): pruned %zu",
+			G_STRFUNC, stacktrace_function_name(cbr), arg, pruned);
+	}
+
+	return pruned;
+}
+
 /**
  * Snapshot all the keys, returning them into a singly linked list.
  * To free the returned keys, use the dbmw_free_all_keys() helper.
@@ -1703,6 +2079,35 @@ dbmw_set_map_cache(dbmw_t *dw, long pages)
 	return 0 == dbmap_set_cachesize(dw->dm, pages);
 }
 
+/**
+ * Turn the write-ahead log of the underlying map on or off.
+ *
+ * @return TRUE on success.
+ */
+bool
+dbmw_set_wal(dbmw_t *dw, bool on)
+{
+	dbmw_check(dw);
+
+	return 0 == dbmap_set_wal(dw->dm, on);
+}
+
+/**
+ * Turn memory-mapped page reads of the underlying map on or off.
+ *
+ * This is meant for read-mostly databases, whose pages can then be
+ * accessed directly from the kernel page cache.
+ *
+ * @return TRUE on success.
+ */
+bool
+dbmw_set_mmap(dbmw_t *dw, bool on)
+{
+	dbmw_check(dw);
+
+	return 0 == dbmap_set_mmap(dw->dm, on);
+}
+
 /**
  * Flag whether database is volatile (never outlives a close).
  *
@@ -1731,7 +2136,7 @@ dbmw_set_debugging(dbmw_t *dw, const dbg_config_t *dbg)
 		dbg_ds_log(dw->dbg, dw, "%s: attached with %s back-end "
 			"(max cached = %zu, key=%zu bytes, value=%zu bytes, "
 			"%zu max serialized)", G_STRFUNC,
-			dbmw_map_type(dw) == DBMAP_SDBM ? "sdbm" : "map",
+			dbmap_type_to_string(dbmw_map_type(dw)),
 			dw->max_cached, dw->key_size, dw->value_size, dw->value_data_size);
 	}
 
@@ -1748,4 +2153,83 @@ dbmw_set_debugging(dbmw_t *dw, const dbg_config_t *dbg)
 	dbmap_set_debugging(dw->dm, dw->dbmap_dbg);
 }
 
+/**
+ * Set the global memory budget shared by all the DBMW caches.
+ *
+ * @param bytes		the budget, in bytes
+ */
+void
+dbmw_set_cache_budget(size_t bytes)
+{
+	DBMW_CACHES_LOCK;
+	dbmw_budget = bytes;
+	DBMW_CACHES_UNLOCK;
+
+	dbmw_rebalance();
+}
+
+/**
+ * Get cache information about all the DBMW sharing the global budget.
+ *
+ * The counters are read without synchronizing with the threads using
+ * the DBMW objects, so they are only approximate.
+ *
+ * @return list of dbmw_cache_info_t, to be freed with
+ * dbmw_cache_info_list_free_null().
+ */
+pslist_t *
+dbmw_cache_info_list(void)
+{
+	pslist_t *list = NULL, *sl;
+
+	DBMW_CACHES_LOCK;
+
+	PSLIST_FOREACH(dbmw_caches, sl) {
+		const dbmw_t *dw = sl->data;
+		dbmw_cache_info_t *dci;
+
+		WALLOC(dci);
+		dci->name = atom_str_get(dw->name);
+		dci->type = dbmap_type(dw->dm);
+		dci->items = dw->items;
+		dci->bytes = dw->bytes;
+		dci->target = dw->target;
+		dci->r_access = dw->r_access;
+		dci->r_hits = dw->r_hits;
+		dci->w_access = dw->w_access;
+		dci->w_hits = dw->w_hits;
+		dci->g_hits = dw->g_hits;
+		dci->evictions = dw->evictions;
+
+		list = pslist_prepend(list, dci);
+	}
+
+	DBMW_CACHES_UNLOCK;
+
+	return list;
+}
+
+static void
+dbmw_cache_info_free(void *data, void *unused_udata)
+{
+	dbmw_cache_info_t *dci = data;
+
+	(void) unused_udata;
+
+	atom_str_free_null(&dci->name);
+	WFREE(dci);
+}
+
+/**
+ * Free list returned by dbmw_cache_info_list() and nullify its pointer.
+ */
+void
+dbmw_cache_info_list_free_null(pslist_t **list_ptr)
+{
+	pslist_t *list = *list_ptr;
+
+	pslist_foreach(list, dbmw_cache_info_free, NULL);
+	pslist_free_null(list_ptr);
+}
+
 /* vi: set ts=4 sw=4 cindent: */
@@ -91,7 +91,25 @@ typedef bool (*dbmw_cbr_t)(void *key, void *value, size_t len, void *u);
 #define DBMW_SYNC_MAP		(1 << 1)	/**< Sync DBMW underlying map */
 #define DBMW_DELETED_ONLY	(1 << 2)	/**< Only sync deleted keys */
 
+/**
+ * Cache information, as returned by dbmw_cache_info_list().
+ */
+typedef struct dbmw_cache_info {
+	const char *name;			/**< DB name (atom) */
+	enum dbmap_type type;		/**< Type of underlying map */
+	size_t items;				/**< Amount of cached entries */
+	size_t bytes;				/**< Memory used by cached entries */
+	size_t target;				/**< Memory target, from global budget */
+	uint64 r_access;			/**< Number of read accesses */
+	uint64 r_hits;				/**< Number of read cache hits */
+	uint64 w_access;			/**< Number of write accesses */
+	uint64 w_hits;				/**< Number of write cache hits */
+	uint64 g_hits;				/**< Number of ghost hits on cache misses */
+	uint64 evictions;			/**< Number of entries evicted */
+} dbmw_cache_info_t;
+
 struct dbg_config;
+struct pslist;
 
 dbmw_t *dbmw_create(dbmap_t *dm, const char *name,
 	size_t value_size, size_t value_data_size,
@@ -111,6 +129,8 @@ bool dbmw_has_ioerr(const dbmw_t *dw);
 const char *dbmw_name(const dbmw_t *dw);
 bool dbmw_set_map_cache(dbmw_t *dw, long pages);
 bool dbmw_set_volatile(dbmw_t *dw, bool is_volatile);
+bool dbmw_set_wal(dbmw_t *dw, bool on);
+bool dbmw_set_mmap(dbmw_t *dw, bool on);
 void dbmw_set_debugging(dbmw_t *dw, const struct dbg_config *dbg);
 bool dbmw_shrink(dbmw_t *dw);
 bool dbmw_rebuild(dbmw_t *dw);
@@ -122,10 +142,16 @@ void dbmw_free_all_keys(const dbmw_t *dw, struct pslist *keys);
 
 void dbmw_foreach(dbmw_t *dw, dbmw_cb_t cb, void *arg);
 size_t dbmw_foreach_remove(dbmw_t *dw, dbmw_cbr_t cbr, void *arg);
+size_t dbmw_foreach_remove_range(dbmw_t *dw, const void *lo, const void *hi,
+	dbmw_cbr_t cbr, void *arg);
 
 bool dbmw_store(dbmw_t *dw, const char *base, bool inplace);
 bool dbmw_copy(dbmw_t *from, dbmw_t *to);
 
+void dbmw_set_cache_budget(size_t bytes);
+struct pslist *dbmw_cache_info_list(void);
+void dbmw_cache_info_list_free_null(struct pslist **list_ptr);
+
 #endif /* _dbmw_h_ */
 
 /* vi: set ts=4 sw=4 cindent: */
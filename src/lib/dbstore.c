@@ -48,6 +48,7 @@
 #include "halloc.h"
 #include "hstrfn.h"
 #include "log.h"
+#include "misc.h"				/* For compact_kb_size() */
 #include "path.h"
 #include "stringify.h"
 
@@ -65,6 +66,20 @@ dbstore_set_debug(unsigned level)
 	dbstore_debug = level;
 }
 
+/**
+ * Set the memory budget shared by the caches of all the databases.
+ *
+ * @param kib		the budget, in KiB
+ */
+void
+dbstore_set_cache_budget(uint32 kib)
+{
+	if (dbstore_debug)
+		g_debug("DBSTORE caches now share %s", compact_kb_size(kib, FALSE));
+
+	dbmw_set_cache_budget((size_t) kib * 1024);
+}
+
 /**
  * Creates a disk database with an SDBM or memory map back-end.
  *
@@ -81,6 +96,7 @@ dbstore_set_debug(unsigned level)
  * @param hash_func			Key hash function
  * @param eq_func			Key equality test function
  * @param incore			If TRUE, use a RAM-only database
+ * @param sorted			If TRUE, keep an ordered index of the SDBM keys
  *
  * @return the DBMW wrapping object.
  */
@@ -88,7 +104,7 @@ static dbmw_t *
 dbstore_create_internal(const char *name, const char *dir, const char *base,
 	int flags, dbstore_kv_t kv, dbstore_packing_t packing,
 	size_t cache_size, hash_fn_t hash_func, eq_fn_t eq_func,
-	bool incore)
+	bool incore, bool sorted)
 {
 	dbmap_t *dm;
 	dbmw_t *dw;
@@ -100,8 +116,13 @@ dbstore_create_internal(const char *name, const char *dir, const char *base,
 		g_assert(base != NULL);
 
 		path = make_pathname(dir, base);
-		dm = dbmap_create_sdbm(kv.key_size, kv.key_len,
-				name, path, flags, STORAGE_FILE_MODE);
+		if (sorted) {
+			dm = dbmap_create_sorted(kv.key_size, kv.key_len,
+					name, path, flags, STORAGE_FILE_MODE);
+		} else {
+			dm = dbmap_create_sdbm(kv.key_size, kv.key_len,
+					name, path, flags, STORAGE_FILE_MODE);
+		}
 
 		/*
 		 * For performance reasons, always use deferred writes.  Maps which
@@ -164,7 +185,36 @@ dbstore_create(const char *name, const char *dir, const char *base,
 	dbmw_t *dw;
 
 	dw = dbstore_create_internal(name, dir, base, O_CREAT | O_TRUNC | O_RDWR,
-			kv, packing, cache_size, hash_func, eq_func, incore);
+			kv, packing, cache_size, hash_func, eq_func, incore, FALSE);
+
+	dbmw_set_volatile(dw, TRUE);
+
+	return dw;
+}
+
+/**
+ * Creates a disk database with an SDBM back-end whose keys are also kept
+ * sorted, so that ranges of keys can be efficiently traversed by
+ * dbmw_foreach_remove_range().
+ *
+ * If we can't create the SDBM files on disk, we'll transparently use
+ * an in-core version, which does not keep the keys sorted: range traversals
+ * then need to iterate over all the keys.
+ *
+ * The parameters are the same as for dbstore_create().
+ *
+ * @return the DBMW wrapping object.
+ */
+dbmw_t *
+dbstore_create_sorted(const char *name, const char *dir, const char *base,
+	dbstore_kv_t kv, dbstore_packing_t packing,
+	size_t cache_size, hash_fn_t hash_func, eq_fn_t eq_func,
+	bool incore)
+{
+	dbmw_t *dw;
+
+	dw = dbstore_create_internal(name, dir, base, O_CREAT | O_TRUNC | O_RDWR,
+			kv, packing, cache_size, hash_func, eq_func, incore, TRUE);
 
 	dbmw_set_volatile(dw, TRUE);
 
@@ -199,7 +249,7 @@ dbstore_open(const char *name, const char *dir, const char *base,
 	dbmw_t *dw;
 
 	dw = dbstore_create_internal(name, dir, base, O_CREAT | O_RDWR,
-			kv, packing, cache_size, hash_func, eq_func, FALSE);
+			kv, packing, cache_size, hash_func, eq_func, FALSE, FALSE);
 
 	if (dw != NULL && dbstore_debug > 0) {
 		size_t count = dbmw_count(dw);
@@ -222,7 +272,7 @@ dbstore_open(const char *name, const char *dir, const char *base,
 		}
 
 		dram = dbstore_create_internal(name, NULL, NULL, 0,
-				kv, packing, cache_size, hash_func, eq_func, TRUE);
+				kv, packing, cache_size, hash_func, eq_func, TRUE, FALSE);
 
 		if (!dbmw_copy(dw, dram)) {
 			g_warning("DBSTORE could not load DBMW \"%s\" (%u key%s) from %s",
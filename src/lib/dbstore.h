@@ -68,12 +68,19 @@ typedef struct dbstore_packing {
  */
 
 void dbstore_set_debug(unsigned level);
+void dbstore_set_cache_budget(uint32 kib);
 
 dbmw_t *dbstore_create(const char *name, const char *dir, const char *base,
 	dbstore_kv_t kv, dbstore_packing_t packing,
 	size_t cache_size, hash_fn_t hash_func, eq_fn_t eq_func,
 	bool incore);
 
+dbmw_t *dbstore_create_sorted(const char *name,
+	const char *dir, const char *base,
+	dbstore_kv_t kv, dbstore_packing_t packing,
+	size_t cache_size, hash_fn_t hash_func, eq_fn_t eq_func,
+	bool incore);
+
 dbmw_t *dbstore_open(const char *name, const char *dir, const char *base,
 	dbstore_kv_t kv, dbstore_packing_t packing,
 	size_t cache_size, hash_fn_t hash_func, eq_fn_t eq_func,
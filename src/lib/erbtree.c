@@ -571,6 +571,48 @@ erbtree_getnode(const erbtree_t *tree, const void *key)
 	}
 }
 
+/**
+ * Look up the first node whose key is greater than or equal to the given key.
+ *
+ * This allows in-order traversal of the tree starting at an arbitrary key,
+ * whether it is present in the tree or not, with erbtree_next().
+ *
+ * @param tree		the red-black tree
+ * @param key		pointer to the key structure (NOT a node)
+ *
+ * @return node of the smallest key not less than ``key'', NULL if all the
+ * keys in the tree are smaller.
+ */
+rbnode_t *
+erbtree_lower_bound(const erbtree_t *tree, const void *key)
+{
+	rbnode_t *parent, *rn;
+	bool is_left;
+
+	erbtree_check(tree);
+	g_assert(key != NULL);
+
+	if (erbtree_is_extended(tree)) {
+		rn = do_lookup_ext(ERBTREE_E(tree), key, &parent, &is_left);
+	} else {
+		rn = do_lookup(tree, key, &parent, &is_left);
+	}
+
+	if (rn != NULL)
+		return rn;
+
+	/*
+	 * The key would be inserted as a child of ``parent'': as its left child,
+	 * the parent immediately follows the key, otherwise the key would come
+	 * right after the parent.
+	 */
+
+	if (NULL == parent || is_left)
+		return parent;
+
+	return erbtree_next(parent);
+}
+
 static void
 set_child(rbnode_t *node, rbnode_t *child, bool left)
 {
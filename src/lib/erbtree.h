@@ -120,6 +120,7 @@ rbnode_t *erbtree_prev(const rbnode_t *node);
 bool erbtree_contains(const erbtree_t *tree, const void *key);
 void *erbtree_lookup(const erbtree_t *tree, const void *key);
 rbnode_t *erbtree_getnode(const erbtree_t *tree, const void *key);
+rbnode_t *erbtree_lower_bound(const erbtree_t *tree, const void *key);
 void *erbtree_insert(erbtree_t *tree, rbnode_t *node);
 void erbtree_remove(erbtree_t *tree, rbnode_t *node);
 void erbtree_replace(erbtree_t *tree, rbnode_t *old, rbnode_t *new);
@@ -99,6 +99,7 @@ typedef struct {
 
 #ifdef HAS_EPOLL
 #include <sys/epoll.h>
+#include <sys/ioctl.h>		/* For FIONREAD */
 #endif /* HAS_EPOLL */
 
 #ifdef HAS_DEV_POLL
@@ -110,6 +111,7 @@ typedef struct {
 
 #include "bit_array.h"
 #include "compat_poll.h"
+#include "dump_options.h"
 #include "fd.h"
 #include "glib-missing.h"	/* For g_main_context_get_poll_func() with GTK1 */
 #include "halloc.h"
@@ -131,8 +133,30 @@ typedef struct {
 
 static unsigned inputevt_debug;
 static bool inputevt_trace;
+static bool inputevt_edge_wanted;
 static unsigned inputevt_stid = THREAD_INVALID_ID;
 
+#define INPUTEVT_DRAIN_MAX	8	/**< Max extra reads per edge-triggered event */
+
+/**
+ * Dispatching statistics.
+ *
+ * These are only updated by the thread running the I/O event loop.
+ */
+static struct inputevt_stats {
+	uint64 wakeups;				/**< Dispatching rounds */
+	uint64 idle_wakeups;		/**< Rounds without any event to dispatch */
+	uint64 events;				/**< Events dispatched */
+	uint64 fake_events;			/**< Forced readable events dispatched */
+	uint64 drained;				/**< Extra reads on edge-triggered events */
+	uint64 rearmed;				/**< Edge-triggered descriptors re-armed */
+	uint max_events;			/**< Max amount of events in a round */
+	uint wakeups_this_sec;		/**< Rounds during current second */
+	uint wakeups_last_sec;		/**< Rounds during previous second */
+	time_t second;				/**< Current second */
+	time_t started;				/**< When dispatching started */
+} inputevt_stats;
+
 /**
  * Set debugging level.
  */
@@ -230,6 +254,8 @@ struct poll_ctx {
 	unsigned initialized:1;		/**< TRUE if the context has been initialized */
 	unsigned dispatching:1;		/**< TRUE if dispatching events */
 	unsigned collecting:1;		/**< TRUE when collecing / waiting for events */
+	unsigned can_edge:1;		/**< TRUE if edge-triggered mode is supported */
+	unsigned edge_triggered:1;	/**< TRUE if using edge-triggered events */
 
 #ifdef HAS_KQUEUE
 	struct kevent *kev_arr;
@@ -240,6 +266,8 @@ struct poll_ctx {
 #endif	/* HAS_EPOLL */
 
 	struct pollfd *pfd_arr;
+	struct event *batch;		/**< Events being dispatched */
+	unsigned batch_size;		/**< Length of the "batch" array */
 
 	/**
 	 * The following members must be provided by the I/O event handler
@@ -524,6 +552,8 @@ event_set_mask_with_epoll(struct poll_ctx *ctx, int fd,
 		ev.events |= EPOLLIN | EPOLLPRI;
 	if (INPUT_EVENT_W & cur)
 		ev.events |= EPOLLOUT;
+	if (ctx->edge_triggered)
+		ev.events |= EPOLLET;
 
 	if (0 == old)
 		op = EPOLL_CTL_ADD;
@@ -544,6 +574,49 @@ event_check_all_with_epoll(struct poll_ctx *ctx)
 
 	return epoll_wait(ctx->master_fd, ctx->ep_arr, ctx->num_ev, 0);
 }
+
+/**
+ * Re-register file descriptor with its current event mask, which forces
+ * the kernel to report it again if it is still ready when edge-triggered.
+ *
+ * @return 0 if OK, -1 on error with errno set.
+ */
+static int
+event_rearm_with_epoll(struct poll_ctx *ctx, int fd, inputevt_cond_t cur)
+{
+	static const struct epoll_event zero_ev;
+	struct epoll_event ev;
+
+	g_assert(CTX_IS_LOCKED(ctx));
+	g_assert(0 != (cur & INPUT_EVENT_RW));
+
+	ev = zero_ev;
+	ev.data.ptr = int_to_pointer(fd);
+
+	if (INPUT_EVENT_R & cur)
+		ev.events |= EPOLLIN | EPOLLPRI;
+	if (INPUT_EVENT_W & cur)
+		ev.events |= EPOLLOUT;
+	if (ctx->edge_triggered)
+		ev.events |= EPOLLET;
+
+	return epoll_ctl(ctx->master_fd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+/**
+ * @return amount of bytes pending for reading on the file descriptor,
+ * -1 if unknown (e.g. listening socket).
+ */
+static int
+inputevt_pending_input(int fd)
+{
+	int n;
+
+	if (-1 == ioctl(fd, FIONREAD, &n))
+		return -1;
+
+	return n;
+}
 #endif	/* HAS_EPOLL */
 
 #ifdef HAS_DEV_POLL
@@ -1012,6 +1085,77 @@ inputevt_handle(const struct poll_ctx *ctx, int fd, inputevt_cond_t condition)
 	}
 }
 
+/**
+ * Handle edge-triggered event on given file descriptor.
+ *
+ * The kernel will not report the descriptor again until its state changes,
+ * but handlers may not consume all the pending data (bandwidth limits for
+ * instance), or may leave their writing handler installed after a partial
+ * write.  We therefore drain the input by invoking the reading handlers
+ * again a few times, and re-arm the descriptor when it may still be ready.
+ */
+static void
+inputevt_handle_edge(struct poll_ctx *ctx, int fd, inputevt_cond_t condition)
+#ifdef HAS_EPOLL
+{
+	relay_list_t *rl;
+	inputevt_cond_t cur;
+	int pending = 0;
+	unsigned i;
+
+	inputevt_handle(ctx, fd, condition);
+
+	if (condition & INPUT_EVENT_R) {
+		for (i = 0; i < INPUTEVT_DRAIN_MAX; i++) {
+			rl = htable_lookup(ctx->ht, int_to_pointer(fd));
+			if (NULL == rl || 0 == rl->readers)
+				break;
+
+			pending = inputevt_pending_input(fd);
+			if (pending <= 0)
+				break;
+
+			inputevt_stats.drained++;
+			inputevt_handle(ctx, fd, INPUT_EVENT_R);
+		}
+	}
+
+	CTX_LOCK(ctx);
+
+	rl = htable_lookup(ctx->ht, int_to_pointer(fd));
+
+	if (NULL == rl) {
+		CTX_UNLOCK(ctx);
+		return;
+	}
+
+	cur = (rl->readers ? INPUT_EVENT_R : 0) |
+		(rl->writers ? INPUT_EVENT_W : 0);
+
+	/*
+	 * Re-arm when there is still (or may still be) input left, or when
+	 * a writer is still installed after having been triggered.
+	 */
+
+	if (
+		((condition & INPUT_EVENT_R) && rl->readers != 0 && pending != 0) ||
+		((condition & INPUT_EVENT_W) && rl->writers != 0)
+	) {
+		if (0 == event_rearm_with_epoll(ctx, fd, cur)) {
+			inputevt_stats.rearmed++;
+		} else if (inputevt_debug) {
+			s_debug("%s(): cannot re-arm fd #%d: %m", G_STRFUNC, fd);
+		}
+	}
+
+	CTX_UNLOCK(ctx);
+}
+#else
+{
+	inputevt_handle(ctx, fd, condition);
+}
+#endif	/* HAS_EPOLL */
+
 /**
  * Our main I/O event dispatching loop.
  */
@@ -1043,12 +1187,41 @@ inputevt_timer(struct poll_ctx *ctx)
 
 	ctx->dispatching = TRUE;
 
+	{
+		time_t now = tm_time();
+
+		if G_UNLIKELY(0 == inputevt_stats.started)
+			inputevt_stats.started = now;
+
+		if (now != inputevt_stats.second) {
+			inputevt_stats.wakeups_last_sec =
+				now == inputevt_stats.second + 1 ?
+					inputevt_stats.wakeups_this_sec : 0;
+			inputevt_stats.wakeups_this_sec = 0;
+			inputevt_stats.second = now;
+		}
+
+		inputevt_stats.wakeups++;
+		inputevt_stats.wakeups_this_sec++;
+	}
+
 	if (num_events > 0) {
-		unsigned idx;
-		pslist_t *evlist = NULL, *es;
+		unsigned idx, n = 0;
+		bool edge = ctx->edge_triggered;
 
 		g_assert(UNSIGNED(num_events) <= ctx->num_ev);
 
+		/*
+		 * Collect the events into the dispatching batch, which is only
+		 * used by the dispatching code and therefore cannot be resized
+		 * by handlers adding new sources.
+		 */
+
+		if G_UNLIKELY(ctx->batch_size < UNSIGNED(num_events)) {
+			ctx->batch_size = ctx->num_ev;
+			XREALLOC_ARRAY(ctx->batch, ctx->batch_size);
+		}
+
 		for (idx = 0; num_events > 0 && idx < ctx->num_ev; idx++) {
 			struct event event;
 
@@ -1059,9 +1232,12 @@ inputevt_timer(struct poll_ctx *ctx)
 				continue;
 
 			num_events--;
-			evlist = pslist_prepend(evlist, WCOPY(&event));
+			ctx->batch[n++] = event;
 		}
 
+		inputevt_stats.events += n;
+		inputevt_stats.max_events = MAX(inputevt_stats.max_events, n);
+
 		/*
 		 * Invoke I/O callbacks without any locks.
 		 *
@@ -1071,15 +1247,18 @@ inputevt_timer(struct poll_ctx *ctx)
 
 		CTX_UNLOCK(ctx);
 
-		PSLIST_FOREACH(evlist, es) {
-			struct event *event = es->data;
+		for (idx = 0; idx < n; idx++) {
+			const struct event *event = &ctx->batch[idx];
 
-			inputevt_handle(ctx, event->fd, event->condition);
-			WFREE(event);
+			if (edge)
+				inputevt_handle_edge(ctx, event->fd, event->condition);
+			else
+				inputevt_handle(ctx, event->fd, event->condition);
 		}
 
-		pslist_free_null(&evlist);
 		CTX_LOCK(ctx);
+	} else {
+		inputevt_stats.idle_wakeups++;
 	}
 
 	if (hash_list_length(ctx->readable) > 0) {
@@ -1097,6 +1276,8 @@ inputevt_timer(struct poll_ctx *ctx)
 		 * processing whilst we no longer hold the lock.	--RAM
 		 */
 
+		inputevt_stats.fake_events += plist_length(list);
+
 		if (inputevt_debug > 2) {
 			unsigned long count = plist_length(list);
 			s_debug("%s(): %lu fake event%s", G_STRFUNC, count, plural(count));
@@ -1518,6 +1699,7 @@ init_with_epoll(struct poll_ctx *ctx)
 	g_main_context_set_poll_func(NULL, default_poll_func);
 	ctx->master_fd = fd;
 	ctx->polling_method = "epoll()";
+	ctx->can_edge = TRUE;
 	ctx->collect_events = NULL; /* master fd can be polled */
 	ctx->event_check_all = event_check_all_with_epoll;
 	ctx->event_get = event_get_with_epoll;
@@ -1603,6 +1785,8 @@ inputevt_init(int use_poll)
 		}
 	}
 
+	ctx->edge_triggered = ctx->can_edge && inputevt_edge_wanted;
+
 	CTX_UNLOCK(ctx);
 
 	if (is_valid_fd(ctx->master_fd)) {
@@ -1620,8 +1804,8 @@ inputevt_init(int use_poll)
 	}
 
 #ifdef INPUTEVT_DEBUGGING
-	s_info("INPUTEVT using customized I/O dispatching with %s",
-		ctx->polling_method);
+	s_info("INPUTEVT using customized I/O dispatching with %s%s",
+		ctx->polling_method, ctx->edge_triggered ? " (edge-triggered)" : "");
 #endif
 }
 
@@ -1740,6 +1924,120 @@ inputevt_dispatch(void)
 	inputevt_timer(ctx);
 }
 
+#ifdef HAS_EPOLL
+/**
+ * htable_foreach() callback to re-register a file descriptor after the
+ * triggering mode changed.
+ */
+static void
+inputevt_rearm_fd(const void *key, void *value, void *data)
+{
+	struct poll_ctx *ctx = data;
+	const relay_list_t *rl = value;
+	int fd = pointer_to_int(key);
+	inputevt_cond_t cur;
+
+	cur = (rl->readers ? INPUT_EVENT_R : 0) |
+		(rl->writers ? INPUT_EVENT_W : 0);
+
+	if (0 == cur)
+		return;
+
+	if (-1 == event_rearm_with_epoll(ctx, fd, cur))
+		s_warning("%s(): cannot re-register fd #%d: %m", G_STRFUNC, fd);
+}
+#endif	/* HAS_EPOLL */
+
+/**
+ * Select between level-triggered and edge-triggered I/O events.
+ *
+ * Edge-triggered events are only supported with epoll(), the setting being
+ * otherwise ignored.  When used, ready descriptors are reported once per
+ * state change and dispatching drains them, instead of getting them
+ * reported again at each round until all the data are consumed.
+ */
+void
+inputevt_set_edge_triggered(bool on)
+{
+	struct poll_ctx *ctx = get_global_poll_ctx();
+
+	inputevt_edge_wanted = on;
+
+	if (!ctx->initialized)
+		return;			/* Will be applied by inputevt_init() */
+
+	CTX_LOCK(ctx);
+
+	if (ctx->can_edge && booleanize(on) != ctx->edge_triggered) {
+		ctx->edge_triggered = booleanize(on);
+
+		/*
+		 * Re-register all the file descriptors with the new mode.  When
+		 * turning on edge-triggering, this also ensures that ready
+		 * descriptors will be reported.
+		 */
+
+#ifdef HAS_EPOLL
+		htable_foreach(ctx->ht, inputevt_rearm_fd, ctx);
+#endif
+
+		if (inputevt_debug) {
+			s_debug("%s(): now using %s-triggered events",
+				G_STRFUNC, ctx->edge_triggered ? "edge" : "level");
+		}
+	}
+
+	CTX_UNLOCK(ctx);
+}
+
+/**
+ * Dump I/O dispatching statistics to specified log agent.
+ */
+void G_COLD
+inputevt_dump_stats_log(logagent_t *la, unsigned options)
+{
+	struct poll_ctx *ctx = get_global_poll_ctx();
+	struct inputevt_stats stats;
+	bool groupped = booleanize(options & DUMP_OPT_PRETTY);
+	time_delta_t elapsed;
+	const char *method = "none";
+	bool edge = FALSE;
+
+	if (ctx->initialized) {
+		CTX_LOCK(ctx);
+		method = ctx->polling_method;
+		edge = ctx->edge_triggered;
+		CTX_UNLOCK(ctx);
+	}
+
+	stats = inputevt_stats;		/* Struct copy */
+
+	elapsed = 0 == stats.started ? 0 : delta_time(tm_time(), stats.started);
+
+#define DUMP(x)	log_info(la, "INPUTEVT %s = %s", #x,		\
+	uint64_to_string_grp(stats.x, groupped))
+
+	log_info(la, "INPUTEVT method = %s", method);
+	log_info(la, "INPUTEVT edge_triggered = %s", edge ? "yes" : "no");
+
+	DUMP(wakeups);
+	DUMP(idle_wakeups);
+	DUMP(events);
+	DUMP(fake_events);
+	DUMP(drained);
+	DUMP(rearmed);
+	DUMP(max_events);
+
+#undef DUMP
+
+	log_info(la, "INPUTEVT events_per_wakeup = %.2f",
+		0 == stats.wakeups ? 0.0 : (double) stats.events / stats.wakeups);
+	log_info(la, "INPUTEVT wakeups_per_sec = %.2f",
+		elapsed <= 0 ? 0.0 : (double) stats.wakeups / elapsed);
+	log_info(la, "INPUTEVT wakeups_last_sec = %s",
+		uint_to_string_grp(stats.wakeups_last_sec, groupped));
+}
+
 /**
  * Performs module cleanup.
  */
@@ -1760,6 +2058,7 @@ inputevt_close(void)
 	HFREE_NULL(ctx->used_event_id);
 	XFREE_NULL(ctx->relay);
 	XFREE_NULL(ctx->pfd_arr);
+	XFREE_NULL(ctx->batch);
 	fd_close(&ctx->master_fd);
 	ctx->initialized = FALSE;
 
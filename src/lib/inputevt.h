@@ -75,6 +75,7 @@ void inputevt_dispatch(void);
 
 void inputevt_set_debug(unsigned level);
 void inputevt_set_trace(bool on);
+void inputevt_set_edge_triggered(bool on);
 unsigned inputevt_thread_id(void);
 
 /**
@@ -88,6 +89,9 @@ size_t inputevt_data_available(void);
 void inputevt_remove(unsigned *id_ptr);
 void inputevt_set_readable(int fd);
 
+struct logagent;
+void inputevt_dump_stats_log(struct logagent *la, unsigned options);
+
 #endif  /* _inputevt_h_ */
 
 /* vi: set ts=4 sw=4 cindent: */
@@ -0,0 +1,500 @@
+/*
+ * postings-test -- replays queries against compressed posting lists.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the authors nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * The index is built the way the search table of the core indexes shared
+ * file names: each pair of consecutive alphanumeric characters of a name
+ * is a key, and the name is listed in the bin of all its keys.  A query
+ * is then resolved by intersecting the bins of all the keys of its words.
+ *
+ * Names and queries can be captured from a running servent and replayed
+ * here, so that changes to the posting lists can be measured on real data.
+ * Every query is resolved both through the posting lists and through plain
+ * sorted arrays of indices, which serve as reference for the results and
+ * as baseline for the timings.
+ */
+
+#include "common.h"
+
+#include "ascii.h"
+#include "halloc.h"
+#include "log.h"
+#include "misc.h"
+#include "postings.h"
+#include "progname.h"
+#include "random.h"
+#include "stats.h"
+#include "str.h"
+#include "tm.h"
+#include "xmalloc.h"
+
+#define KEY_CHARS		36			/* a-z and 0-9 */
+#define KEY_COUNT		(KEY_CHARS * KEY_CHARS)
+#define LINE_MAX_LEN	1024
+#define QUERY_MAX_KEYS	64
+
+#define NAME_WORDS_MAX	8			/* Max words in synthetic names */
+#define WORD_LEN_MIN	2
+#define WORD_LEN_MAX	10
+
+#define POINTS			20
+#define OUTLIERS		3.0
+
+static const char letters[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+
+/**
+ * Reference bin, a plain sorted array of indices.
+ */
+struct array_bin {
+	uint32 *vals;
+	uint32 count, size;
+};
+
+static postings_t bins[KEY_COUNT];
+static struct array_bin abins[KEY_COUNT];
+
+static char **names;
+static size_t names_count;
+
+static char **queries;
+static size_t queries_count;
+
+static bool verbose;
+
+static void G_NORETURN
+usage(void)
+{
+	fprintf(stderr,
+			"Usage: %s [-hv] [-f names] [-q queries] [-n count] [-Q count]\n"
+			"  -f : read shared file names from file, one per line\n"
+			"  -n : amount of synthetic names when -f is not given\n"
+			"  -q : read queries from file, one per line\n"
+			"  -Q : amount of synthetic queries when -q is not given\n"
+			"  -h : prints this help message\n"
+			"  -v : be verbose\n"
+			, getprogname());
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * @return key character index for c, -1 if not indexed.
+ */
+static int
+key_char(int c)
+{
+	c = ascii_tolower(c);
+
+	if (c >= 'a' && c <= 'z')
+		return c - 'a';
+	if (c >= '0' && c <= '9')
+		return 26 + c - '0';
+
+	return -1;
+}
+
+/**
+ * Compute the distinct keys of a string.
+ *
+ * @return amount of keys filled in the keys[] array.
+ */
+static uint
+string_keys(const char *s, uint *keys, uint max)
+{
+	const char *p;
+	uint n = 0;
+	int prev = -1;
+
+	for (p = s; *p != '\0'; p++) {
+		int k = key_char(*p);
+
+		if (k >= 0 && prev >= 0) {
+			uint key = prev * KEY_CHARS + k, i;
+
+			for (i = 0; i < n; i++) {
+				if (keys[i] == key)
+					break;
+			}
+			if (i == n && n < max)
+				keys[n++] = key;
+		}
+		prev = k;
+	}
+
+	return n;
+}
+
+static char **
+read_lines(const char *file, size_t *count)
+{
+	FILE *f;
+	char line[LINE_MAX_LEN];
+	char **lines = NULL;
+	size_t n = 0, size = 0;
+
+	f = fopen(file, "r");
+	if (NULL == f)
+		s_fatal_exit(EXIT_FAILURE, "can't open \"%s\": %m", file);
+
+	while (fgets(line, sizeof line, f)) {
+		strchomp(line, 0);
+		if ('\0' == line[0])
+			continue;
+		if (n == size) {
+			size = MAX(1024, size * 2);
+			XREALLOC_ARRAY(lines, size);
+		}
+		lines[n++] = xstrdup(line);
+	}
+
+	fclose(f);
+	*count = n;
+
+	return lines;
+}
+
+static void
+fill_random_word(str_t *s)
+{
+	size_t len = WORD_LEN_MIN + random_value(WORD_LEN_MAX - WORD_LEN_MIN);
+	size_t i;
+
+	/*
+	 * Bias towards the first letters to get a skewed key distribution,
+	 * like natural text does.
+	 */
+
+	for (i = 0; i < len; i++) {
+		uint32 r = random_value(CONST_STRLEN(letters) - 1);
+		str_putc(s, letters[r * r / CONST_STRLEN(letters)]);
+	}
+}
+
+static char **
+random_lines(size_t count, size_t maxwords)
+{
+	char **lines;
+	size_t i;
+	str_t *s = str_new(0);
+
+	XMALLOC_ARRAY(lines, count);
+
+	for (i = 0; i < count; i++) {
+		size_t j, words = 1 + random_value(maxwords - 1);
+
+		str_reset(s);
+		for (j = 0; j < words; j++) {
+			if (j != 0)
+				str_putc(s, ' ');
+			fill_random_word(s);
+		}
+		lines[i] = xstrdup(str_2c(s));
+	}
+
+	str_destroy_null(&s);
+
+	return lines;
+}
+
+static void
+index_names(void)
+{
+	size_t i;
+	uint keys[LINE_MAX_LEN];
+
+	for (i = 0; i < names_count; i++) {
+		uint n = string_keys(names[i], keys, N_ITEMS(keys)), j;
+
+		for (j = 0; j < n; j++) {
+			struct array_bin *ab = &abins[keys[j]];
+
+			postings_append(&bins[keys[j]], i);
+
+			if (ab->count == ab->size) {
+				ab->size = MAX(8, ab->size * 2);
+				XREALLOC_ARRAY(ab->vals, ab->size);
+			}
+			ab->vals[ab->count++] = i;
+		}
+	}
+
+	for (i = 0; i < KEY_COUNT; i++) {
+		postings_compact(&bins[i]);
+	}
+}
+
+static void
+free_index(void)
+{
+	size_t i;
+
+	for (i = 0; i < KEY_COUNT; i++) {
+		postings_discard(&bins[i]);
+		XFREE_NULL(abins[i].vals);
+	}
+}
+
+static void
+index_memory(size_t *plmem, size_t *armem)
+{
+	size_t i;
+
+	*plmem = *armem = 0;
+
+	for (i = 0; i < KEY_COUNT; i++) {
+		*plmem += postings_memory(&bins[i]);
+		*armem += abins[i].count * sizeof abins[i].vals[0];
+	}
+}
+
+/**
+ * Resolve query through the posting lists.
+ *
+ * @return amount of matching names.
+ */
+static uint
+query_postings(const uint *keys, uint n)
+{
+	const postings_t *lists[QUERY_MAX_KEYS];
+	uint32 *vals;
+	uint i, count;
+
+	for (i = 0; i < n; i++) {
+		if (0 == postings_count(&bins[keys[i]]))
+			return 0;
+		lists[i] = &bins[keys[i]];
+	}
+
+	vals = postings_intersect(lists, n, &count);
+	hfree(vals);
+
+	return count;
+}
+
+/**
+ * Resolve query through the plain arrays, merging with the smallest one.
+ *
+ * @return amount of matching names.
+ */
+static uint
+query_arrays(const uint *keys, uint n)
+{
+	const struct array_bin *small = NULL;
+	uint32 *vals;
+	uint i, count;
+
+	for (i = 0; i < n; i++) {
+		const struct array_bin *ab = &abins[keys[i]];
+
+		if (0 == ab->count)
+			return 0;
+		if (NULL == small || ab->count < small->count)
+			small = ab;
+	}
+
+	count = small->count;
+	XMALLOC_ARRAY(vals, count);
+	memcpy(vals, small->vals, count * sizeof vals[0]);
+
+	for (i = 0; i < n && count != 0; i++) {
+		const struct array_bin *ab = &abins[keys[i]];
+		uint j, k, m;
+
+		if (ab == small)
+			continue;
+
+		for (j = k = m = 0; j < count && m < ab->count; /* empty */) {
+			if (vals[j] < ab->vals[m]) {
+				j++;
+			} else if (vals[j] > ab->vals[m]) {
+				m++;
+			} else {
+				vals[k++] = vals[j];
+				j++, m++;
+			}
+		}
+		count = k;
+	}
+
+	xfree(vals);
+
+	return count;
+}
+
+typedef uint (query_routine_t)(const uint *keys, uint n);
+
+static double
+timeit(query_routine_t *q, size_t *matches)
+{
+	statx_t *sx;
+	size_t i, total = 0;
+	uint keys[QUERY_MAX_KEYS];
+	double elapsed;
+
+	sx = statx_make();
+
+	for (i = 0; i < POINTS; i++) {
+		size_t j;
+		tm_nano_t start, end;
+
+		total = 0;
+		tm_precise_time(&start);
+
+		for (j = 0; j < queries_count; j++) {
+			uint n = string_keys(queries[j], keys, N_ITEMS(keys));
+			if (n != 0)
+				total += (*q)(keys, n);
+		}
+
+		tm_precise_time(&end);
+		statx_add(sx, tm_precise_elapsed_f(&end, &start));
+	}
+
+	statx_remove_outliers(sx, OUTLIERS);
+	elapsed = statx_avg(sx);
+	statx_free_null(&sx);
+
+	*matches = total;
+	return elapsed;
+}
+
+static void
+check_results(void)
+{
+	size_t i;
+	uint keys[QUERY_MAX_KEYS];
+
+	for (i = 0; i < queries_count; i++) {
+		uint n = string_keys(queries[i], keys, N_ITEMS(keys));
+		uint c1, c2;
+
+		if (0 == n)
+			continue;
+
+		c1 = query_postings(keys, n);
+		c2 = query_arrays(keys, n);
+
+		if (c1 != c2) {
+			s_fatal_exit(EXIT_FAILURE, "query \"%s\": %u hits, expected %u",
+				queries[i], c1, c2);
+		}
+
+		if (verbose)
+			s_info("query \"%s\": %u hits", queries[i], c1);
+	}
+
+	s_info("%s(): all OK for %zu queries", G_STRFUNC, queries_count);
+}
+
+static void
+run_benchmark(void)
+{
+	double e1, e2;
+	size_t m1, m2, plmem, armem;
+
+	index_memory(&plmem, &armem);
+
+	e1 = timeit(query_postings, &m1);
+	e2 = timeit(query_arrays, &m2);
+
+	g_assert(m1 == m2);
+
+	s_info("replayed %zu queries over %zu names (%zu hits):",
+		queries_count, names_count, m1);
+	s_info("\tposting lists: %'zu queries/s, %'zu bytes",
+		(size_t) (queries_count / e1), plmem);
+	s_info("\tplain arrays:  %'zu queries/s, %'zu bytes",
+		(size_t) (queries_count / e2), armem);
+}
+
+int
+main(int argc, char **argv)
+{
+	extern int optind;
+	extern char *optarg;
+	int c;
+	const char options[] = "Q:f:hn:q:v";
+	const char *names_file = NULL, *queries_file = NULL;
+	size_t synth_names = 100000, synth_queries = 10000;
+
+	progstart(argc, argv);
+
+	while ((c = getopt(argc, argv, options)) != EOF) {
+		switch (c) {
+		case 'Q':			/* amount of synthetic queries */
+			synth_queries = atol(optarg);
+			break;
+		case 'f':			/* file names */
+			names_file = optarg;
+			break;
+		case 'n':			/* amount of synthetic names */
+			synth_names = atol(optarg);
+			break;
+		case 'q':			/* queries */
+			queries_file = optarg;
+			break;
+		case 'v':			/* verbose */
+			verbose = TRUE;
+			break;
+		case 'h':			/* show help */
+			/* FALL THROUGH */
+		default:
+			usage();
+			break;
+		}
+	}
+
+	if (0 != (argc -= optind))
+		usage();
+
+	if (NULL == names_file && 0 == synth_names)
+		usage();
+
+	if (names_file != NULL) {
+		names = read_lines(names_file, &names_count);
+	} else {
+		names = random_lines(synth_names, NAME_WORDS_MAX);
+		names_count = synth_names;
+	}
+
+	if (queries_file != NULL) {
+		queries = read_lines(queries_file, &queries_count);
+	} else {
+		queries = random_lines(synth_queries, 3);
+		queries_count = synth_queries;
+	}
+
+	index_names();
+	check_results();
+	run_benchmark();
+	free_index();
+
+	return 0;
+}
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -0,0 +1,339 @@
+/*
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Compressed posting lists.
+ *
+ * A posting list is a strictly increasing sequence of 32-bit values, such
+ * as the indices of the items in which an inverted index key appears.
+ * Values can only be appended, and the list is stored as a sequence of
+ * variable-length encoded deltas, which usually takes 1 or 2 bytes per
+ * posting instead of the size of a pointer.
+ *
+ * To be able to skip quickly over long posting lists, we record the
+ * decoding state every POSTINGS_SKIP_STEP postings.  Intersecting lists
+ * can then gallop through the skip entries of the larger lists.
+ */
+
+#include "common.h"
+
+#include "postings.h"
+
+#include "halloc.h"
+#include "vsort.h"
+
+#include "override.h"		/* Must be the last header included */
+
+#define POSTINGS_MIN_SIZE	8		/**< Initial data[] size, bytes */
+#define POSTINGS_SKIP_SHIFT	6
+#define POSTINGS_SKIP_STEP	(1U << POSTINGS_SKIP_SHIFT)	/**< Postings/skip */
+#define POSTINGS_SKIP_MASK	(POSTINGS_SKIP_STEP - 1)
+#define POSTINGS_VARINT_MAX	5		/**< Max length of a 32-bit varint */
+
+/**
+ * Append a variable-length encoded value at the given pointer.
+ *
+ * @return pointer to the next byte.
+ */
+static inline uchar *
+postings_varint_put(uchar *p, uint32 v)
+{
+	while (v >= 0x80) {
+		*p++ = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+/**
+ * Decode a variable-length encoded value at the given pointer.
+ *
+ * @return pointer to the next byte.
+ */
+static inline const uchar *
+postings_varint_get(const uchar *p, uint32 *vp)
+{
+	uint32 v = 0;
+	uint shift = 0;
+	uchar c;
+
+	do {
+		c = *p++;
+		v |= (uint32) (c & 0x7f) << shift;
+		shift += 7;
+	} while (c & 0x80);
+
+	*vp = v;
+	return p;
+}
+
+/**
+ * Initialize an empty posting list.
+ */
+void
+postings_init(postings_t *pl)
+{
+	ZERO(pl);
+}
+
+/**
+ * Free the memory used by the posting list, leaving it empty.
+ */
+void
+postings_discard(postings_t *pl)
+{
+	HFREE_NULL(pl->data);
+	HFREE_NULL(pl->skips);
+	ZERO(pl);
+}
+
+/**
+ * Append a value to the posting list.
+ *
+ * Values must be appended in strictly increasing order, hence the list
+ * is always sorted.
+ */
+void
+postings_append(postings_t *pl, uint32 value)
+{
+	g_assert(0 == pl->nvals || value > pl->last);
+
+	if (pl->len + POSTINGS_VARINT_MAX > pl->size) {
+		pl->size = MAX(POSTINGS_MIN_SIZE, pl->size * 2);
+		HREALLOC_ARRAY(pl->data, pl->size);
+	}
+
+	pl->len = postings_varint_put(&pl->data[pl->len],
+		0 == pl->nvals ? value : value - pl->last) - pl->data;
+
+	if (0 == (pl->nvals & POSTINGS_SKIP_MASK)) {
+		if (pl->nskips == pl->skipsize) {
+			pl->skipsize = MAX(1, pl->skipsize * 2);
+			HREALLOC_ARRAY(pl->skips, pl->skipsize);
+		}
+		pl->skips[pl->nskips].value = value;
+		pl->skips[pl->nskips].offset = pl->len;
+		pl->nskips++;
+	}
+
+	pl->last = value;
+	pl->nvals++;
+}
+
+/**
+ * Makes the posting list take as little memory as needed.
+ */
+void
+postings_compact(postings_t *pl)
+{
+	if (pl->size != pl->len) {
+		HREALLOC_ARRAY(pl->data, pl->len);
+		pl->size = pl->len;
+	}
+	if (pl->skipsize != pl->nskips) {
+		HREALLOC_ARRAY(pl->skips, pl->nskips);
+		pl->skipsize = pl->nskips;
+	}
+}
+
+/**
+ * @return the amount of memory allocated for the postings.
+ */
+size_t
+postings_memory(const postings_t *pl)
+{
+	return pl->size + pl->skipsize * sizeof pl->skips[0];
+}
+
+/**
+ * Decode all the postings of a list.
+ *
+ * @param pl		the posting list to decode
+ * @param vals		where postings are written, must hold pl->nvals items
+ */
+void
+postings_decode(const postings_t *pl, uint32 *vals)
+{
+	const uchar *p = pl->data;
+	uint32 i, v = 0;
+
+	for (i = 0; i < pl->nvals; i++) {
+		uint32 delta;
+
+		p = postings_varint_get(p, &delta);
+		v = 0 == i ? delta : v + delta;
+		vals[i] = v;
+	}
+
+	g_assert(p == &pl->data[pl->len]);
+}
+
+/**
+ * Initialize cursor on the first posting of a non-empty list.
+ */
+void
+postings_cursor_init(postings_cursor_t *c, const postings_t *pl)
+{
+	g_assert(pl->nvals != 0);
+
+	c->pl = pl;
+	c->pos = 0;
+	c->value = pl->skips[0].value;
+	c->offset = pl->skips[0].offset;
+}
+
+/**
+ * Move the cursor to the first posting greater or equal to the target.
+ *
+ * We first gallop through the skip entries, then linearly decode the
+ * postings within the block.
+ *
+ * @return TRUE if such a posting exists, FALSE if the list is exhausted.
+ */
+bool
+postings_cursor_seek(postings_cursor_t *c, uint32 target)
+{
+	const postings_t *pl = c->pl;
+	uint32 k, lo, hi, step;
+
+	if (c->value >= target)
+		return TRUE;
+
+	/*
+	 * Galloping search for the last skip whose value is <= target,
+	 * starting after the skip of the current block.
+	 */
+
+	k = c->pos >> POSTINGS_SKIP_SHIFT;
+	lo = k;
+	hi = k + 1;
+	step = 1;
+
+	while (hi < pl->nskips && pl->skips[hi].value <= target) {
+		lo = hi;
+		step <<= 1;
+		hi += step;
+	}
+
+	hi = MIN(hi, pl->nskips);
+
+	while (hi - lo > 1) {
+		uint32 mid = lo + (hi - lo) / 2;
+
+		if (pl->skips[mid].value <= target)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	if (lo != k) {
+		c->pos = lo << POSTINGS_SKIP_SHIFT;
+		c->value = pl->skips[lo].value;
+		c->offset = pl->skips[lo].offset;
+		if (c->value >= target)
+			return TRUE;
+	}
+
+	/*
+	 * Linear decoding within the block.
+	 */
+
+	while (c->pos + 1 < pl->nvals) {
+		uint32 delta;
+		const uchar *p;
+
+		p = postings_varint_get(&pl->data[c->offset], &delta);
+		c->offset = p - pl->data;
+		c->value += delta;
+		c->pos++;
+
+		if (c->value >= target)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/**
+ * vsort() callback to order posting lists by increasing length.
+ */
+static int
+postings_cmp(const void *a, const void *b)
+{
+	const postings_t * const *p1 = a, * const *p2 = b;
+
+	return CMP((*p1)->nvals, (*p2)->nvals);
+}
+
+/**
+ * Compute the values listed in all the posting lists.
+ *
+ * @param lists		the non-empty lists to intersect, re-ordered by the routine
+ * @param n			amount of lists
+ * @param count		written with the amount of values returned
+ *
+ * @return sorted array of values, to be freed with hfree().
+ */
+uint32 *
+postings_intersect(const postings_t **lists, uint n, uint *count)
+{
+	uint32 *vals;
+	uint i, cnt;
+
+	g_assert(n != 0);
+
+	/*
+	 * Start with the smallest list, so that we have less candidates to
+	 * check against the others, and so that we can gallop through the
+	 * larger lists.
+	 */
+
+	vsort(lists, n, sizeof lists[0], postings_cmp);
+
+	cnt = lists[0]->nvals;
+	HALLOC_ARRAY(vals, MAX(cnt, 1));
+	postings_decode(lists[0], vals);
+
+	for (i = 1; i < n && cnt != 0; i++) {
+		postings_cursor_t c;
+		uint j, k;
+
+		postings_cursor_init(&c, lists[i]);
+
+		for (j = k = 0; j < cnt; j++) {
+			if (!postings_cursor_seek(&c, vals[j]))
+				break;			/* Exhausted list, no more matches */
+			if (c.value == vals[j])
+				vals[k++] = vals[j];
+		}
+
+		cnt = k;
+	}
+
+	*count = cnt;
+	return vals;
+}
+
+/* vi: set ts=4 sw=4 cindent: */
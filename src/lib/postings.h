@@ -0,0 +1,101 @@
+/*
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Compressed posting lists.
+ */
+
+#ifndef _postings_h_
+#define _postings_h_
+
+/**
+ * Decoding state within a posting list, recorded every POSTINGS_SKIP_STEP
+ * postings.
+ */
+struct postings_skip {
+	uint32 value;				/**< Value of the posting */
+	uint32 offset;				/**< Offset of the next posting in data[] */
+};
+
+/**
+ * A posting list, holding a strictly increasing sequence of values.
+ *
+ * The structure is meant to be embedded in the structures of the user.
+ */
+typedef struct postings {
+	uint32 nvals;				/**< Amount of postings */
+	uint32 last;				/**< Value of the last posting */
+	uint32 len, size;			/**< Used and allocated bytes in data[] */
+	uint32 nskips, skipsize;	/**< Used and allocated skips[] */
+	uchar *data;				/**< Delta-encoded postings (varints) */
+	struct postings_skip *skips;	/**< Skip entries */
+} postings_t;
+
+/**
+ * Cursor on a posting list.
+ */
+typedef struct postings_cursor {
+	const postings_t *pl;		/**< The posting list */
+	uint32 value;				/**< Current posting value */
+	uint32 pos;					/**< Index of current posting */
+	uint32 offset;				/**< Offset of the next posting */
+} postings_cursor_t;
+
+/*
+ * Public interface.
+ */
+
+void postings_init(postings_t *pl);
+void postings_discard(postings_t *pl);
+void postings_append(postings_t *pl, uint32 value);
+void postings_compact(postings_t *pl);
+void postings_decode(const postings_t *pl, uint32 *vals);
+size_t postings_memory(const postings_t *pl) G_PURE;
+
+void postings_cursor_init(postings_cursor_t *c, const postings_t *pl);
+bool postings_cursor_seek(postings_cursor_t *c, uint32 target);
+
+uint32 *postings_intersect(const postings_t **lists, uint n, uint *count);
+
+/**
+ * @return the amount of postings in the list.
+ */
+static inline uint32
+postings_count(const postings_t *pl)
+{
+	return pl->nvals;
+}
+
+/**
+ * @return whether the last posting of a non-empty list is the given value.
+ */
+static inline bool
+postings_last_is(const postings_t *pl, uint32 value)
+{
+	return pl->nvals != 0 && value == pl->last;
+}
+
+#endif /* _postings_h_ */
+
+/* vi: set ts=4 sw=4 cindent: */
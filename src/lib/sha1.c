@@ -65,6 +65,19 @@
  */
 
 #include "common.h"
+
+/*
+ * On x86, we can use the SHA extensions when the CPU supports them.
+ * The code is compiled with the proper target attributes, so that we do
+ * not need special compiling flags, and is selected at runtime.
+ */
+#if (defined(__x86_64__) || defined(__i386__)) && \
+	(HAS_GCC(5, 0) || defined(__clang__))
+#define SHA1_SHANI
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
 #include "endian.h"
 #include "sha1.h"
 #include "misc.h"			/* For RCSID */
@@ -75,6 +88,172 @@
 /* Local Function Prototyptes */
 static void SHA1_pad_message(SHA1_context *);
 static void SHA1_process_message_block(SHA1_context *, const void *mblock);
+static void SHA1_process_select(SHA1_context *, const void *data, size_t n);
+
+/**
+ * Block processing routine, processing `n' consecutive message blocks.
+ *
+ * This is selected at runtime, depending on the CPU capabilities, the
+ * first time it is called.
+ */
+static void (*SHA1_process)(SHA1_context *, const void *data, size_t n) =
+	SHA1_process_select;
+
+static const char *SHA1_process_name = "generic";
+
+/**
+ * Portable block processing routine.
+ */
+static void
+SHA1_process_generic(SHA1_context *context, const void *data, size_t n)
+{
+	const uint8 *p = data;
+
+	for (/**/; n != 0; n--, p += SHA1_BLEN)
+		SHA1_process_message_block(context, p);
+}
+
+#ifdef SHA1_SHANI
+/*
+ * Perform 4 rounds of SHA-1 using the SHA extensions.
+ *
+ * Message words are held in m[] and rotated: group `i' consumes m[i % 4]
+ * and prepares the schedule for the next groups.  The `e' and `n' values
+ * alternate between groups.  Unnecessary schedule computations for the
+ * last groups are harmless and optimized away by the compiler.
+ */
+#define SHA1_SHANI_ROUNDS(i, e, n) G_STMT_START {					\
+	if (0 == (i))													\
+		e = _mm_add_epi32(e, m[0]);									\
+	else															\
+		e = _mm_sha1nexte_epu32(e, m[(i) % 4]);						\
+	n = abcd;														\
+	if ((i) >= 3 && (i) < 19)										\
+		m[((i) + 1) % 4] = _mm_sha1msg2_epu32(m[((i) + 1) % 4], m[(i) % 4]);\
+	abcd = _mm_sha1rnds4_epu32(abcd, e, (i) / 5);					\
+	if ((i) >= 1 && (i) < 17)										\
+		m[((i) + 3) % 4] = _mm_sha1msg1_epu32(m[((i) + 3) % 4], m[(i) % 4]);\
+	if ((i) >= 2 && (i) < 18)										\
+		m[((i) + 2) % 4] = _mm_xor_si128(m[((i) + 2) % 4], m[(i) % 4]);	\
+} G_STMT_END
+
+/**
+ * Block processing routine using the SHA extensions of x86 CPUs.
+ */
+static void __attribute__((target("sha,ssse3,sse4.1"))) G_HOT
+SHA1_process_shani(SHA1_context *context, const void *data, size_t n)
+{
+	const __m128i mask =
+		_mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+	const uint8 *p = data;
+	__m128i abcd, e0, e1, m[4];
+
+	abcd = _mm_loadu_si128((const __m128i *) context->ihash);
+	abcd = _mm_shuffle_epi32(abcd, 0x1b);
+	e0 = _mm_set_epi32(context->ihash[4], 0, 0, 0);
+
+	for (/**/; n != 0; n--, p += SHA1_BLEN) {
+		__m128i abcd_save = abcd, e_save = e0;
+		uint i;
+
+		for (i = 0; i < N_ITEMS(m); i++) {
+			m[i] = _mm_loadu_si128((const __m128i *) (p + 16 * i));
+			m[i] = _mm_shuffle_epi8(m[i], mask);
+		}
+
+		SHA1_SHANI_ROUNDS(0, e0, e1);
+		SHA1_SHANI_ROUNDS(1, e1, e0);
+		SHA1_SHANI_ROUNDS(2, e0, e1);
+		SHA1_SHANI_ROUNDS(3, e1, e0);
+		SHA1_SHANI_ROUNDS(4, e0, e1);
+		SHA1_SHANI_ROUNDS(5, e1, e0);
+		SHA1_SHANI_ROUNDS(6, e0, e1);
+		SHA1_SHANI_ROUNDS(7, e1, e0);
+		SHA1_SHANI_ROUNDS(8, e0, e1);
+		SHA1_SHANI_ROUNDS(9, e1, e0);
+		SHA1_SHANI_ROUNDS(10, e0, e1);
+		SHA1_SHANI_ROUNDS(11, e1, e0);
+		SHA1_SHANI_ROUNDS(12, e0, e1);
+		SHA1_SHANI_ROUNDS(13, e1, e0);
+		SHA1_SHANI_ROUNDS(14, e0, e1);
+		SHA1_SHANI_ROUNDS(15, e1, e0);
+		SHA1_SHANI_ROUNDS(16, e0, e1);
+		SHA1_SHANI_ROUNDS(17, e1, e0);
+		SHA1_SHANI_ROUNDS(18, e0, e1);
+		SHA1_SHANI_ROUNDS(19, e1, e0);
+
+		e0 = _mm_sha1nexte_epu32(e0, e_save);
+		abcd = _mm_add_epi32(abcd, abcd_save);
+	}
+
+	abcd = _mm_shuffle_epi32(abcd, 0x1b);
+	_mm_storeu_si128((__m128i *) context->ihash, abcd);
+	context->ihash[4] = _mm_extract_epi32(e0, 3);
+}
+
+#undef SHA1_SHANI_ROUNDS
+
+/**
+ * @return whether the CPU supports the SHA extensions.
+ */
+static bool
+SHA1_cpu_has_shani(void)
+{
+	uint eax, ebx, ecx, edx;
+
+	if (__get_cpuid_max(0, NULL) < 7)
+		return FALSE;
+
+	__cpuid(1, eax, ebx, ecx, edx);
+
+	if (0 == (ecx & (1U << 9)) || 0 == (ecx & (1U << 19)))
+		return FALSE;		/* No SSSE3 or no SSE4.1 */
+
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+
+	return 0 != (ebx & (1U << 29));
+}
+#endif	/* SHA1_SHANI */
+
+/**
+ * Select the block processing routine to use, then process the blocks.
+ *
+ * Several threads may concurrently select the routine, but they will
+ * all pick the same one.
+ */
+static void
+SHA1_process_select(SHA1_context *context, const void *data, size_t n)
+{
+#ifdef SHA1_SHANI
+	if (SHA1_cpu_has_shani()) {
+		SHA1_process_name = "SHA-NI";
+		SHA1_process = SHA1_process_shani;
+	} else
+#endif
+	{
+		SHA1_process = SHA1_process_generic;
+	}
+
+	(*SHA1_process)(context, data, n);
+}
+
+/**
+ * @return the name of the SHA-1 block processing engine in use.
+ */
+const char *
+SHA1_engine(void)
+{
+	if G_UNLIKELY(SHA1_process_select == SHA1_process) {
+		SHA1_context ctx;
+		struct sha1 digest;
+
+		/* Force selection of the processing routine */
+		SHA1_reset(&ctx);
+		SHA1_result(&ctx, &digest);
+	}
+
+	return SHA1_process_name;
+}
 
 /**
  *  SHA1_reset
@@ -252,16 +431,20 @@ SHA1_input(SHA1_context *context, const void *data, size_t length)
 		goto slowpath;
 
 fastpath:
-	for (/**/; length >= SHA1_BLEN; mp += SHA1_BLEN, length -= SHA1_BLEN) {
-		context->length += 8 * SHA1_BLEN;		/* Counts bits, not bytes */
+	if (length >= SHA1_BLEN) {
+		size_t n = length / SHA1_BLEN;
+		uint64 bits = (uint64) n * 8 * SHA1_BLEN;	/* Counts bits, not bytes */
 
-		if G_UNLIKELY(context->length < 8 * SHA1_BLEN) {
+		if G_UNLIKELY(context->length + bits < context->length) {
 			/* Message is too long */
 			context->corrupted = SHA_INPUT_TOO_LONG;
 			return SHA_INPUT_TOO_LONG;
 		}
 
-		SHA1_process_message_block(context, mp);
+		context->length += bits;
+		(*SHA1_process)(context, mp, n);
+		mp += n * SHA1_BLEN;
+		length -= n * SHA1_BLEN;
 	}
 
 	/* FALL THROUGH */
@@ -282,7 +465,7 @@ slowpath:
 		}
 
 		if G_UNLIKELY(SHA1_BLEN == context->midx) {
-			SHA1_process_message_block(context, context->mblock);
+			(*SHA1_process)(context, context->mblock, 1);
 			if (length >= SHA1_BLEN && 0 == pointer_to_long(mp) % 4)
 				goto fastpath;		/* Can use faster processing now */
 		}
@@ -534,7 +717,7 @@ SHA1_pad_message(SHA1_context *context)
 			context->mblock[context->midx++] = 0;
 		}
 
-		SHA1_process_message_block(context, context->mblock);
+		(*SHA1_process)(context, context->mblock, 1);
 
 		while (context->midx < SHA1_BUP) {
 			context->mblock[context->midx++] = 0;
@@ -551,7 +734,62 @@ SHA1_pad_message(SHA1_context *context)
 	 */
 
 	poke_be64(&context->mblock[SHA1_BUP], context->length);
-	SHA1_process_message_block(context, context->mblock);
+	(*SHA1_process)(context, context->mblock, 1);
+}
+
+/**
+ * Runs the test cases from RFC 3174 to check whether the SHA-1 engine
+ * selected for the CPU is computing the proper digests.
+ */
+void G_COLD
+SHA1_selftest(void)
+{
+	static const struct {
+		const char *digest;
+		const char *data;
+		size_t repeat;
+	} tests[] = {
+		{ "a9993e364706816aba3e25717850c26c9cd0d89d", "abc", 1 },
+		{ "84983e441c3bd26ebaae4aa1f95129e5e54670f1",
+			"abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1 },
+		{ "34aa973cd4c4daa4f61eeb2bdbad27316534016f", "a", 1000000 },
+		{ "dea356a2cddd90c7a7ecedc5ebb563934f460452",
+			"01234567012345670123456701234567"
+			"01234567012345670123456701234567", 10 },
+	};
+	static uint32 buf[1024];		/* Aligned, to exercise the fast path */
+	uint i;
+
+	for (i = 0; i < N_ITEMS(tests); i++) {
+		SHA1_context ctx;
+		struct sha1 digest;
+		size_t len = vstrlen(tests[i].data), n = tests[i].repeat;
+		size_t chunk = (sizeof buf / len) * len;
+		const char *hex;
+		char *p;
+
+		/*
+		 * Fill the buffer with as many copies of the data as we can, then
+		 * feed it as many times as needed.
+		 */
+
+		for (p = (char *) buf; p + len <= (char *) buf + chunk; p += len)
+			memcpy(p, tests[i].data, len);
+
+		SHA1_reset(&ctx);
+		while (n != 0) {
+			size_t m = MIN(n, chunk / len);
+			SHA1_input(&ctx, buf, m * len);
+			n -= m;
+		}
+		SHA1_result(&ctx, &digest);
+
+		hex = sha1_base16(&digest);
+		if (0 != strcmp(tests[i].digest, hex)) {
+			g_warning("i=%u, engine=%s, digest=%s", i, SHA1_engine(), hex);
+			g_assert_not_reached();
+		}
+	}
 }
 
 /* vi: set ts=4 sw=4 cindent: */
@@ -85,6 +85,9 @@ int SHA1_input(SHA1_context *, const void *, size_t);
 int SHA1_result(SHA1_context *, struct sha1 *digest);
 int SHA1_intermediate(const SHA1_context *, struct sha1 *digest);
 
+const char *SHA1_engine(void);
+void SHA1_selftest(void);
+
 /**
  * Feed the SHA1 context with the content of a variable.
  */
@@ -80,11 +80,21 @@
 
 #include "tigertree.h"
 
+#include "atomic.h"
+#include "barrier.h"
 #include "base32.h"
+#include "cond.h"
 #include "endian.h"
+#include "getcpucount.h"
 #include "halloc.h"
 #include "misc.h"
+#include "mutex.h"
+#include "spinlock.h"
+#include "teq.h"
+#include "thread.h"
+#include "tsig.h"
 #include "unsigned.h"
+#include "walloc.h"
 
 #include "override.h"		/* Must be the last header included */
 
@@ -102,6 +112,45 @@ enum {
 	TTH_F_FINISHED		= 1 << 1
 };
 
+/*
+ * Parallel hashing of leaf blocks.
+ *
+ * When tt_update() is given large enough buffers and hashing threads were
+ * configured, the 1 KiB leaf blocks are hashed concurrently by the calling
+ * thread and the hashing threads, which pick chunks of TT_PAR_CHUNK blocks.
+ * The resulting leaf hashes are then merged serially into the tree.
+ *
+ * The thread processing the last chunk of a batch wakes up the caller if it
+ * had to wait for the other threads.  The hashing threads record the epoch
+ * at which they were created and exit when tt_close() moves to a new one,
+ * so that threads created by a later tt_set_threads() are not affected.
+ */
+#define TT_PAR_MIN			32		/* Min amount of blocks to go parallel */
+#define TT_PAR_MAX			256		/* Max amount of blocks per batch */
+#define TT_PAR_CHUNK		8		/* Blocks per chunk */
+#define TT_PAR_THREADS_MAX	16		/* Max amount of hashing threads */
+
+struct tt_batch {
+	const char *data;		/* Start of first block */
+	struct tth *dst;		/* Where block hashes are written */
+	int blocks;				/* Amount of blocks to hash */
+	int chunks;				/* Amount of chunks */
+	int next;				/* Next chunk to process */
+	int done;				/* Amount of chunks processed */
+	int refcnt;				/* Reference count */
+};
+
+static uint tt_par_thread[TT_PAR_THREADS_MAX];
+static uint tt_par_created;			/* Amount of threads created */
+static uint tt_par_threads;			/* Amount of threads to use */
+static uint tt_par_epoch;			/* Bumped when threads must exit */
+static spinlock_t tt_par_slk = SPINLOCK_INIT;
+static mutex_t tt_par_done_mtx = MUTEX_INIT;
+static cond_t tt_par_done_cond = COND_INIT;	/* Signals batch completion */
+
+#define TT_PAR_LOCK		spinlock(&tt_par_slk)
+#define TT_PAR_UNLOCK	spinunlock(&tt_par_slk)
+
 struct TTH_CONTEXT {
 	filesize_t bpl;       	/* blocks per leave at TTH_MAX_DEPTH */
 	filesize_t n;         	/* number of blocks processed */
@@ -301,19 +350,19 @@ tt_collapse(TTH_CONTEXT *ctx)
 	}
 }
 
+/**
+ * Account for the leaf block hash stored at the top of the stack.
+ */
 static void
-tt_block(TTH_CONTEXT *ctx)
+tt_leaf(TTH_CONTEXT *ctx)
 {
 	g_assert(ctx);
 
-	tiger(ctx->block.bytes, ctx->block_fill, ctx->stack[ctx->si].data);
 	if (ctx->bpl == 1) {
 		ctx->leaves[ctx->li] = ctx->stack[ctx->si];
 		ctx->li++;
 	}
 
-	ctx->block_fill = 1;
-
 	ctx->si++;
 	ctx->n++;
 
@@ -324,6 +373,244 @@ tt_block(TTH_CONTEXT *ctx)
 	tt_collapse(ctx);
 }
 
+static void
+tt_block(TTH_CONTEXT *ctx)
+{
+	g_assert(ctx);
+
+	tiger(ctx->block.bytes, ctx->block_fill, ctx->stack[ctx->si].data);
+	ctx->block_fill = 1;
+	tt_leaf(ctx);
+}
+
+/**
+ * Hash consecutive full leaf blocks.
+ *
+ * @param data		start of the first block
+ * @param n			amount of blocks
+ * @param dst		where the block hashes are written
+ */
+static void
+tt_hash_blocks(const char *data, size_t n, struct tth *dst)
+{
+	union {
+		uint64 u64;	/* Better alignment */
+		char bytes[TTH_BLOCKSIZE + 1];
+	} buf;
+	size_t i;
+
+	buf.bytes[0] = 0x00;
+
+	for (i = 0; i < n; i++, data += TTH_BLOCKSIZE) {
+		memcpy(&buf.bytes[1], data, TTH_BLOCKSIZE);
+		tiger(ARYLEN(buf.bytes), dst[i].data);
+	}
+}
+
+/**
+ * Remove a reference on the batch, freeing it on the last one.
+ */
+static void
+tt_batch_unref(struct tt_batch *b)
+{
+	if (atomic_int_dec_is_zero(&b->refcnt))
+		WFREE(b);
+}
+
+/**
+ * Process chunks of the batch until there are none left.
+ */
+static void
+tt_batch_process(struct tt_batch *b)
+{
+	for (;;) {
+		int c = atomic_int_inc(&b->next);
+		int first, n;
+
+		if (c >= b->chunks)
+			break;
+
+		first = c * TT_PAR_CHUNK;
+		n = MIN(TT_PAR_CHUNK, b->blocks - first);
+
+		tt_hash_blocks(&b->data[first * TTH_BLOCKSIZE], n, &b->dst[first]);
+
+		if (atomic_int_inc(&b->done) + 1 == b->chunks) {
+			mutex_lock(&tt_par_done_mtx);
+			cond_broadcast(&tt_par_done_cond, &tt_par_done_mtx);
+			mutex_unlock(&tt_par_done_mtx);
+		}
+	}
+}
+
+/**
+ * TEQ event processed by the hashing threads.
+ */
+static void
+tt_batch_job(void *arg)
+{
+	struct tt_batch *b = arg;
+
+	tt_batch_process(b);
+	tt_batch_unref(b);
+}
+
+/**
+ * Hash consecutive full leaf blocks, using the hashing threads.
+ *
+ * The calling thread participates to the hashing and only waits for the
+ * chunks being processed by other threads when there is nothing left.
+ *
+ * @param data		start of the first block
+ * @param n			amount of blocks
+ * @param dst		where the block hashes are written
+ */
+static void
+tt_hash_blocks_parallel(const char *data, size_t n, struct tth *dst)
+{
+	struct tt_batch *b;
+	uint i;
+
+	g_assert(n <= TT_PAR_MAX);
+
+	WALLOC0(b);
+	b->data = data;
+	b->dst = dst;
+	b->blocks = n;
+	b->chunks = (n + TT_PAR_CHUNK - 1) / TT_PAR_CHUNK;
+	b->refcnt = 1;
+
+	TT_PAR_LOCK;
+	for (i = 0; i < tt_par_threads && i + 1 < UNSIGNED(b->chunks); i++) {
+		atomic_int_inc(&b->refcnt);
+		teq_post(tt_par_thread[i], tt_batch_job, b);
+	}
+	TT_PAR_UNLOCK;
+
+	tt_batch_process(b);
+
+	if (atomic_int_get(&b->done) != b->chunks) {
+		mutex_lock(&tt_par_done_mtx);
+		while (atomic_int_get(&b->done) != b->chunks)
+			cond_wait(&tt_par_done_cond, &tt_par_done_mtx);
+		mutex_unlock(&tt_par_done_mtx);
+	}
+
+	tt_batch_unref(b);
+}
+
+/**
+ * Signal handler to terminate the hashing threads.
+ *
+ * The signal only interrupts the TEQ waiting, the thread will notice that
+ * tt_close() moved to a new epoch.
+ */
+static void
+tt_par_terminate(int sig)
+{
+	g_assert(TSIG_TERM == sig);
+}
+
+/**
+ * Are the hashing threads of the given epoch terminated?
+ *
+ * All the work is done by processing TEQ events whilst we wait.
+ */
+static bool
+tt_par_has_work(void *arg)
+{
+	const uint *epoch = arg;
+
+	return *epoch != atomic_uint_get(&tt_par_epoch);
+}
+
+/**
+ * Hashing thread main loop.
+ */
+static void *
+tt_par_main(void *arg)
+{
+	barrier_t *b = arg;
+	uint epoch = atomic_uint_get(&tt_par_epoch);
+
+	thread_set_name("TTH");
+	teq_create();				/* Queue to receive TEQ events */
+	thread_signal(TSIG_TERM, tt_par_terminate);
+
+	barrier_wait(b);			/* Thread has initialized */
+	barrier_free_null(&b);
+
+	while (!tt_par_has_work(&epoch))
+		teq_wait(tt_par_has_work, &epoch);
+
+	return NULL;
+}
+
+/**
+ * Set the amount of threads used to hash leaf blocks in parallel.
+ *
+ * Threads are created as needed but are only terminated by tt_close(),
+ * reducing the amount simply leaves the surplus threads idle.
+ *
+ * @param n		amount of threads, 0 disabling parallel hashing
+ */
+void
+tt_set_threads(uint n)
+{
+	n = MIN(n, TT_PAR_THREADS_MAX);
+
+	if (n != 0 && getcpucount() < 2)
+		n = 0;
+
+	while (tt_par_created < n) {
+		barrier_t *b = barrier_new(2);
+		int r;
+
+		r = thread_create(tt_par_main, barrier_refcnt_inc(b),
+				THREAD_F_DETACH | THREAD_F_NO_CANCEL |
+					THREAD_F_NO_POOL | THREAD_F_WARN,
+				THREAD_STACK_MIN);
+
+		if (-1 == r) {
+			barrier_refcnt_dec(b);
+			barrier_free_null(&b);
+			n = tt_par_created;
+			break;
+		}
+
+		barrier_wait(b);		/* Wait for thread to initialize */
+		barrier_free_null(&b);
+
+		TT_PAR_LOCK;
+		tt_par_thread[tt_par_created++] = r;
+		TT_PAR_UNLOCK;
+	}
+
+	TT_PAR_LOCK;
+	tt_par_threads = n;
+	TT_PAR_UNLOCK;
+}
+
+/**
+ * Terminate the hashing threads.
+ */
+void G_COLD
+tt_close(void)
+{
+	uint i;
+
+	TT_PAR_LOCK;
+	tt_par_threads = 0;
+	TT_PAR_UNLOCK;
+
+	atomic_uint_inc(&tt_par_epoch);
+
+	for (i = 0; i < tt_par_created; i++)
+		thread_kill(tt_par_thread[i], TSIG_TERM);
+
+	tt_par_created = 0;
+}
+
 static void
 tt_finish(TTH_CONTEXT *ctx)
 {
@@ -428,6 +715,30 @@ tt_update(TTH_CONTEXT *ctx, const void *data, size_t size)
 	g_assert(!(TTH_F_FINISHED & ctx->flags));
 	g_assert(size == 0 || NULL != data);
 
+	/*
+	 * When no partial block is pending and there are enough full blocks,
+	 * hash them in parallel before merging them into the tree.
+	 */
+
+	while (
+		1 == ctx->block_fill && size >= TT_PAR_MIN * TTH_BLOCKSIZE &&
+		0 != atomic_uint_get(&tt_par_threads)
+	) {
+		struct tth hashes[TT_PAR_MAX];
+		size_t i, n = size / TTH_BLOCKSIZE;
+
+		n = MIN(n, N_ITEMS(hashes));
+		tt_hash_blocks_parallel(block, n, hashes);
+
+		for (i = 0; i < n; i++) {
+			ctx->stack[ctx->si] = hashes[i];
+			tt_leaf(ctx);
+		}
+
+		block += n * TTH_BLOCKSIZE;
+		size -= n * TTH_BLOCKSIZE;
+	}
+
 	while (size > 0) {
 		size_t n = sizeof ctx->block.bytes - ctx->block_fill;
 
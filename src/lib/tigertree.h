@@ -78,6 +78,8 @@ typedef struct TTH_CONTEXT TTH_CONTEXT;
 
 size_t tt_size(void);
 void tt_check(void);
+void tt_set_threads(uint n);
+void tt_close(void);
 
 void tt_init(TTH_CONTEXT *ctx, filesize_t filesize);
 void tt_update(TTH_CONTEXT *ctx, const void *data, size_t len);
@@ -74,6 +74,7 @@
 #include "htable.h"
 #include "mempcpy.h"
 #include "misc.h"
+#include "mutex.h"
 #include "path.h"
 #include "pslist.h"
 #include "random.h"
@@ -2974,10 +2975,18 @@ locale_to_utf8_normalized(const char *src, uni_norm_t norm)
 	return convert_to_utf8_normalized(cd_locale_to_utf8, src, norm);
 }
 
+/*
+ * The iconv() descriptors of the filename character sets are shared and
+ * can be used concurrently by the library scanning threads.
+ */
+static mutex_t filename_charsets_mtx = MUTEX_INIT;
+
 /**
  * Converts a string from the filename character set to UTF-8 encoding and
  * the specified Unicode normalization form.
  *
+ * This routine is thread-safe.
+ *
  * @param src	the string to convert.
  * @param norm	the Unicode normalization form to use.
  *
@@ -3025,7 +3034,9 @@ filename_to_utf8_normalized(const char *src, uni_norm_t norm)
 			}
 		}
 
+		mutex_lock(&filename_charsets_mtx);
 		dbuf = hyper_iconv(t->cd, NULL, 0, src, (size_t) -1, TRUE);
+		mutex_unlock(&filename_charsets_mtx);
 		if (dbuf) {
 			s = dbuf;
 			break;
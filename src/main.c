@@ -86,6 +86,7 @@
 #include "core/publisher.h"
 #include "core/routing.h"
 #include "core/rx.h"
+#include "core/rx_inflate.h"
 #include "core/search.h"
 #include "core/settings.h"
 #include "core/share.h"
@@ -94,6 +95,7 @@
 #include "core/sq.h"
 #include "core/tls_common.h"
 #include "core/topless.h"
+#include "core/tth_cache.h"
 #include "core/tsync.h"
 #include "core/tx.h"
 #include "core/udp.h"
@@ -718,7 +720,7 @@ gtk_gnutella_exit(int exit_code)
 	DO(upload_close);	/* Done before upload_stats_close() for stats update */
 	DO(upload_stats_close);
 	DO(parq_close_pre);
-	DO(verify_sha1_close);
+	DO(verify_sha1_shutdown);
 	DO(verify_tth_shutdown);
 	DO(download_close);
 	DO(file_info_store_if_dirty);	/* In case downloads had buffered data */
@@ -943,6 +945,7 @@ gtk_gnutella_exit(int exit_code)
 	DO(node_close);
 	DO(g2_node_close);
 	DO(share_close);	/* After node_close() */
+	DO(tth_cache_close);
 	DO(udp_close);
 	DO(urpc_close);
 	DO(g2_rpc_close);
@@ -954,6 +957,7 @@ gtk_gnutella_exit(int exit_code)
 	DO(bogons_close);	/* Idem, since host_close() can touch the cache */
 	DO(tx_collect);		/* Prevent spurious leak notifications */
 	DO(rx_collect);		/* Idem */
+	DO(rx_inflate_close);
 	DO(hostiles_close);
 	DO(spam_close);
 	DO(gip_close);
@@ -981,7 +985,9 @@ gtk_gnutella_exit(int exit_code)
 	DO(tls_global_close);
 	DO(misc_close);
 	DO(mingw_close);
+	DO(verify_sha1_close);
 	DO(verify_tth_close);
+	DO(tt_close);
 	DO(inputevt_close);
 	DO(locale_close);
 	DO(wq_close);
@@ -2483,6 +2489,7 @@ main(int argc, char **argv)
 	inputevt_init(OPT(use_poll));
 	teq_io_create();
 	teq_set_throttle(70, 50);	/* 70 ms max for TEQ events, every 50 ms */
+	SHA1_selftest();
 	tiger_check();
 	tt_check();
 	tea_test();
@@ -2568,6 +2575,7 @@ main(int argc, char **argv)
     hcache_retrieve_all();	/* after settings_init() and node_init() */
 	routing_init();
 	search_init();
+	tth_cache_init();		/* MUST be done BEFORE share_init() */
 	share_init();
 	dmesh_init();			/* MUST be done BEFORE download_init() */
 	download_init();		/* MUST be done AFTER file_info_init() */
@@ -81,6 +81,9 @@ struct DBMBIG {
 	bit_field_t *bitcheck;	/* array of ``bitmaps'' entries, for checks */
 	buf_t *keybuf;			/* scratch buffer where keys are read */
 	buf_t *valbuf;			/* scratch buffer where values are read */
+	void *freed;			/* blocks freed since last WAL commit (BE32) */
+	int freecnt;			/* amount of blocks in freed */
+	int freesize;			/* amount of blocks freed can hold */
 	long bitbno;			/* page number of the bitmap in bitbuf */
 	int fd;					/* data file descriptor */
 	long bitmaps;			/* amount of bitmaps allocated */
@@ -99,6 +102,8 @@ struct DBMBIG {
 	uint8 bitbuf_dirty;		/* whether bitbuf needs flushing to disk */
 };
 
+static void big_file_mark_used(DBM *, const void *, int);
+
 static inline void
 sdbm_big_check(const struct DBMBIG * const dbg)
 {
@@ -292,6 +297,7 @@ big_free(DBM *db)
 
 	WFREE_NULL(dbg->bitbuf, BIG_BLKSIZE);
 	HFREE_NULL(dbg->bitcheck);
+	HFREE_NULL(dbg->freed);
 	buf_free_null(&dbg->keybuf);
 	buf_free_null(&dbg->valbuf);
 	fd_forget_and_close(&dbg->fd);
@@ -471,6 +477,14 @@ big_check_end(DBM *db, bool completed)
 	if (!completed)
 		goto incomplete;		/* Avoid extra indentation of loop below */
 
+	/*
+	 * Blocks whose release is deferred until the next commit are no longer
+	 * referenced, yet they must remain allocated until then.
+	 */
+
+	if (dbg->freecnt != 0)
+		big_file_mark_used(db, dbg->freed, dbg->freecnt);
+
 	for (i = 0; i < dbg->bitmaps; i++) {
 		if (!fetch_bitbuf(db, i)) {
 			adjustments += BIG_BITCOUNT;	/* Say, everything was wrong */
@@ -1142,36 +1156,42 @@ corrupted_page:
 }
 
 /**
- * Replace value data in-place.
+ * Release allocated blocks from the .dat file, making them reusable.
  *
  * @param db		the sdbm database
- * @param bval		start of big value in the page
- * @param data		the new value
- * @param len		length of data
- *
- * @return 0 if OK, -1 on error with errno set.
+ * @param bvec		vector where allocated block numbers are stored
+ * @param bcnt		amount of blocks in vector to release
  */
-int
-big_replace(DBM *db, char *bval, const char *data, size_t len)
+static void
+big_file_release(DBM *db, const void *bvec, int bcnt)
 {
-	size_t old_len = big_length(bval);
+	size_t bno;
+	const void *q;
+	int n;
 
-	g_assert(size_is_non_negative(len));
-	g_assert(bigblocks(old_len) == bigblocks(len));
-	g_assert(len <= MAX_INT_VAL(uint32));
+	for (q = bvec, n = bcnt; n > 0; n--) {
+		bno = peek_be32(q);
+		big_ffree(db, bno);
+		q = const_ptr_add_offset(q, sizeof(uint32));
+	}
 
 	/*
-	 * Write data on the same blocks as before, since we know it will fit.
+	 * If database is not volatile, sync the bitmap to make sure the freed
+	 * blocks are reusable even if we crash later.
 	 */
 
-	poke_be32(bval, (uint32) len);		/* First 4 bytes: real data length */
-
-	return big_store(db, bigval_blocks(bval), data, len);
+	if (!db->is_volatile)
+		big_sync(db);
 }
 
 /**
  * Free allocated blocks from the .dat file.
  *
+ * When the database is logged, the pages referring to these blocks may
+ * still be replayed from the log after a crash, so the blocks are only
+ * released by big_commit(), once the pages no longer referring to them
+ * have been committed.  Otherwise, they could be reused and overwritten.
+ *
  * @param db		the sdbm database
  * @param bvec		vector where allocated block numbers are stored
  * @param bcnt		amount of blocks in vector to free
@@ -1179,23 +1199,23 @@ big_replace(DBM *db, char *bval, const char *data, size_t len)
 static void
 big_file_free(DBM *db, const void *bvec, int bcnt)
 {
-	size_t bno;
-	const void *q;
-	int n;
+#ifdef WAL
+	if (db->wal != NULL) {
+		DBMBIG *dbg = db->big;
 
-	for (q = bvec, n = bcnt; n > 0; n--) {
-		bno = peek_be32(q);
-		big_ffree(db, bno);
-		q = const_ptr_add_offset(q, sizeof(uint32));
-	}
+		if (dbg->freecnt + bcnt > dbg->freesize) {
+			dbg->freesize = MAX(dbg->freecnt + bcnt, 2 * dbg->freesize);
+			dbg->freed = hrealloc(dbg->freed, dbg->freesize * sizeof(uint32));
+		}
 
-	/*
-	 * If database is not volatile, sync the bitmap to make sure the freed
-	 * blocks are reusable even if we crash later.
-	 */
+		memcpy(ptr_add_offset(dbg->freed, dbg->freecnt * sizeof(uint32)),
+			bvec, bcnt * sizeof(uint32));
+		dbg->freecnt += bcnt;
+		return;
+	}
+#endif	/* WAL */
 
-	if (!db->is_volatile)
-		big_sync(db);
+	big_file_release(db, bvec, bcnt);
 }
 
 /**
@@ -1319,6 +1339,62 @@ success:
 	return TRUE;		/* Succeeded */
 }
 
+/**
+ * Replace value data in-place, unless the database is logged.
+ *
+ * @param db		the sdbm database
+ * @param bval		start of big value in the page
+ * @param data		the new value
+ * @param len		length of data
+ *
+ * @return 0 if OK, -1 on error with errno set.
+ */
+int
+big_replace(DBM *db, char *bval, const char *data, size_t len)
+{
+	size_t old_len = big_length(bval);
+
+	g_assert(size_is_non_negative(len));
+	g_assert(bigblocks(old_len) == bigblocks(len));
+	g_assert(len <= MAX_INT_VAL(uint32));
+
+#ifdef WAL
+	/*
+	 * When the database is logged, the old data must survive until the
+	 * page is committed: write the new value to other blocks.
+	 */
+
+	if (db->wal != NULL) {
+		int bcnt = bigbcnt(len);
+		size_t bsize = bcnt * sizeof(uint32);
+		void *bvec = walloc(bsize);
+		int r = -1;
+
+		if (big_file_alloc(db, bvec, bcnt)) {
+			if (0 == big_store(db, bvec, data, len)) {
+				big_file_free(db, bigval_blocks(bval), bcnt);
+				memcpy(bigval_blocks(bval), bvec, bsize);
+				poke_be32(bval, (uint32) len);
+				r = 0;
+			} else {
+				big_file_release(db, bvec, bcnt);	/* Never committed */
+			}
+		}
+
+		wfree(bvec, bsize);
+		return r;
+	}
+#endif	/* WAL */
+
+	/*
+	 * Write data on the same blocks as before, since we know it will fit.
+	 */
+
+	poke_be32(bval, (uint32) len);		/* First 4 bytes: real data length */
+
+	return big_store(db, bigval_blocks(bval), data, len);
+}
+
 /**
  * Get key data from the block numbers held in the .pag value.
  *
@@ -1730,6 +1806,48 @@ big_datfno(DBM *db)
 	return db->big->fd;
 }
 
+/**
+ * Release the blocks freed since the last commit, now that the pages which
+ * referred to them have been committed to the write-ahead log.
+ */
+void
+big_commit(DBM *db)
+{
+	DBMBIG *dbg = db->big;
+	int n;
+
+	if (NULL == dbg)
+		return;
+
+	sdbm_big_check(dbg);
+
+	if (0 == (n = dbg->freecnt))
+		return;
+
+	dbg->freecnt = 0;
+	big_file_release(db, dbg->freed, n);
+}
+
+/**
+ * Forget about the blocks freed since the last commit, which will never
+ * be released.
+ *
+ * This is used when the log is discarded, the .dat file being cleared as
+ * well, or when it could not be committed, the blocks being then leaked.
+ */
+void
+big_discard(DBM *db)
+{
+	DBMBIG *dbg = db->big;
+
+	if (NULL == dbg)
+		return;
+
+	sdbm_big_check(dbg);
+
+	dbg->freecnt = 0;
+}
+
 /**
  * Synchronize the .dat file, if opened.
  *
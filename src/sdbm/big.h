@@ -16,6 +16,8 @@
 #define bigkey_put sdbm__bigkey_put
 #define bigval_put sdbm__bigval_put
 #define big_sync sdbm__big_sync
+#define big_commit sdbm__big_commit
+#define big_discard sdbm__big_discard
 #define big_close sdbm__big_close
 #define big_reopen sdbm__big_reopen
 #define bigkey_free sdbm__bigkey_free
@@ -39,6 +41,8 @@ int big_replace(DBM *, char *, const char *, size_t);
 void big_free(DBM *);
 int big_datfno(DBM *);
 bool big_sync(DBM *);
+void big_commit(DBM *);
+void big_discard(DBM *);
 bool big_shrink(DBM *);
 bool big_clear(DBM *);
 bool big_close(DBM *);
@@ -0,0 +1,297 @@
+/*
+ * sdbm - ndbm work-alike hashed database library
+ *
+ * Latches for concurrent readers.
+ * status: public domain.
+ *
+ * A thread-safe database serializes all the operations behind its lock.
+ * Since fetching a key is by far the most frequent operation, lookups
+ * which can be satisfied from a single page are allowed to proceed without
+ * taking that lock, concurrently with each other and with the thread that
+ * owns the lock to update the database.
+ *
+ * The following latches are used to coordinate them:
+ *
+ * - The structure latch is taken in shared mode by readers, and exclusively
+ *   by the lock owner whenever it changes the shape of the database: page
+ *   splits, truncation, renaming, rebuilding, or changes made to the cache
+ *   or the logging settings.
+ *
+ * - Page latches, striped by page number, are taken in shared mode by
+ *   readers around the page they need, and exclusively by the lock owner
+ *   whilst it loads a page in the LRU cache or modifies a page in place.
+ *   Using stripes lets us latch a page before it is even cached.
+ *
+ * - The directory latch protects the swapping of the .dir block buffer.
+ *
+ * - The cache latch protects the index of the LRU cache, and lets a reader
+ *   copy a cached page knowing it cannot be evicted meanwhile.
+ *
+ * Readers only handle pages holding no big keys or values, leaving these
+ * to the serialized path, so the .dat file is only accessed under the lock.
+ *
+ * Readers never modify the database nor the LRU cache, and latches are
+ * always taken in the order listed above, so there is no possible deadlock
+ * between the readers and the lock owner.
+ *
+ * @ingroup sdbm
+ * @file
+ */
+
+#include "common.h"
+
+#include "sdbm.h"
+#include "tune.h"
+#include "private.h"
+#include "latch.h"
+
+#include "lib/mutex.h"
+#include "lib/qlock.h"
+#include "lib/rwlock.h"
+#include "lib/walloc.h"
+
+#include "lib/override.h"		/* Must be the last header included */
+
+#ifdef THREADS
+
+#define LATCH_PAGES		16		/* Amount of page latch stripes (power of 2) */
+#define LATCH_MASK		(LATCH_PAGES - 1)
+
+enum sdbm_latch_magic { SDBM_LATCH_MAGIC = 0x5c7d0e23 };
+
+struct dbm_latch {
+	enum sdbm_latch_magic magic;	/* Magic number */
+	rwlock_t structure;				/* Database structure latch */
+	rwlock_t page[LATCH_PAGES];		/* Page latches, striped by number */
+	mutex_t dir;					/* Directory buffer latch */
+	mutex_t cache;					/* LRU cache index latch */
+};
+
+static inline void
+sdbm_latch_check(const struct dbm_latch * const l)
+{
+	g_assert(l != NULL);
+	g_assert(SDBM_LATCH_MAGIC == l->magic);
+}
+
+static inline rwlock_t *
+latch_page(const DBM *db, long num)
+{
+	struct dbm_latch *l = db->latch;
+
+	sdbm_latch_check(l);
+	g_assert(num >= 0);
+
+	return &l->page[num & LATCH_MASK];
+}
+
+/**
+ * Create the latches allowing concurrent readers on the database.
+ */
+void
+latch_init(DBM *db)
+{
+	struct dbm_latch *l;
+	uint i;
+
+	sdbm_check(db);
+	g_assert(NULL == db->latch);
+
+	WALLOC0(l);
+	l->magic = SDBM_LATCH_MAGIC;
+	rwlock_init(&l->structure);
+	for (i = 0; i < N_ITEMS(l->page); i++)
+		rwlock_init(&l->page[i]);
+	mutex_init(&l->dir);
+	mutex_init(&l->cache);
+
+	db->latch = l;
+}
+
+/**
+ * Free the latches, if any.
+ */
+void
+latch_free(DBM *db)
+{
+	struct dbm_latch *l = db->latch;
+
+	if (l != NULL) {
+		uint i;
+
+		sdbm_latch_check(l);
+
+		rwlock_destroy(&l->structure);
+		for (i = 0; i < N_ITEMS(l->page); i++)
+			rwlock_destroy(&l->page[i]);
+		mutex_destroy(&l->dir);
+		mutex_destroy(&l->cache);
+		l->magic = 0;
+		WFREE(l);
+		db->latch = NULL;
+	}
+}
+
+/**
+ * Take the structure latch in shared mode, as a reader.
+ */
+void
+latch_shared(const DBM *db)
+{
+	sdbm_latch_check(db->latch);
+
+	rwlock_rlock(&db->latch->structure);
+}
+
+/**
+ * Release the shared structure latch.
+ */
+void
+latch_unshared(const DBM *db)
+{
+	sdbm_latch_check(db->latch);
+
+	rwlock_runlock(&db->latch->structure);
+}
+
+/**
+ * Take the structure latch exclusively, waiting for all readers to be gone.
+ *
+ * This is only done by the thread owning the database lock, before it
+ * changes the shape of the database.
+ */
+void
+latch_exclusive(const DBM *db)
+{
+	if G_UNLIKELY(db->latch != NULL) {
+		sdbm_latch_check(db->latch);
+		assert_sdbm_locked(db);
+
+		rwlock_wlock(&db->latch->structure);
+	}
+}
+
+/**
+ * Release the exclusive structure latch.
+ */
+void
+latch_unexclusive(const DBM *db)
+{
+	if G_UNLIKELY(db->latch != NULL) {
+		sdbm_latch_check(db->latch);
+
+		rwlock_wunlock(&db->latch->structure);
+	}
+}
+
+/**
+ * Take the latch of page ``num'' in shared mode, as a reader.
+ */
+void
+latch_page_rlock(const DBM *db, long num)
+{
+	rwlock_rlock(latch_page(db, num));
+}
+
+/**
+ * Release the shared latch of page ``num''.
+ */
+void
+latch_page_runlock(const DBM *db, long num)
+{
+	rwlock_runlock(latch_page(db, num));
+}
+
+/**
+ * Take the latch of page ``num'' exclusively, before loading or modifying
+ * that page.
+ *
+ * Since pages are latched by stripes, this also blocks readers of other
+ * pages sharing the same stripe, but only for the duration of the change.
+ */
+void
+latch_page_wlock(const DBM *db, long num)
+{
+	if G_UNLIKELY(db->latch != NULL) {
+		assert_sdbm_locked(db);
+		rwlock_wlock(latch_page(db, num));
+	}
+}
+
+/**
+ * Release the exclusive latch of page ``num''.
+ */
+void
+latch_page_wunlock(const DBM *db, long num)
+{
+	if G_UNLIKELY(db->latch != NULL)
+		rwlock_wunlock(latch_page(db, num));
+}
+
+/**
+ * Check whether the lock owner can modify page ``num'', which requires that
+ * the page be latched exclusively or that the whole structure be latched.
+ */
+bool
+latch_page_writable(const DBM *db, long num)
+{
+	if G_LIKELY(NULL == db->latch)
+		return TRUE;
+
+	sdbm_latch_check(db->latch);
+
+	return rwlock_is_owned(&db->latch->structure) ||
+		rwlock_is_owned(latch_page(db, num));
+}
+
+/**
+ * Take the directory buffer latch.
+ */
+void
+latch_dir_lock(const DBM *db)
+{
+	if G_UNLIKELY(db->latch != NULL) {
+		sdbm_latch_check(db->latch);
+		mutex_lock(&db->latch->dir);
+	}
+}
+
+/**
+ * Release the directory buffer latch.
+ */
+void
+latch_dir_unlock(const DBM *db)
+{
+	if G_UNLIKELY(db->latch != NULL) {
+		sdbm_latch_check(db->latch);
+		mutex_unlock(&db->latch->dir);
+	}
+}
+
+/**
+ * Take the LRU cache index latch.
+ */
+void
+latch_cache_lock(const DBM *db)
+{
+	if G_UNLIKELY(db->latch != NULL) {
+		sdbm_latch_check(db->latch);
+		mutex_lock(&db->latch->cache);
+	}
+}
+
+/**
+ * Release the LRU cache index latch.
+ */
+void
+latch_cache_unlock(const DBM *db)
+{
+	if G_UNLIKELY(db->latch != NULL) {
+		sdbm_latch_check(db->latch);
+		mutex_unlock(&db->latch->cache);
+	}
+}
+
+#endif	/* THREADS */
+
+/* vi: set ts=4 sw=4 cindent: */
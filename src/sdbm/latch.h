@@ -0,0 +1,48 @@
+/* Mini EMBED (latch.c) */
+#define latch_init sdbm__latch_init
+#define latch_free sdbm__latch_free
+#define latch_shared sdbm__latch_shared
+#define latch_unshared sdbm__latch_unshared
+#define latch_exclusive sdbm__latch_exclusive
+#define latch_unexclusive sdbm__latch_unexclusive
+#define latch_page_rlock sdbm__latch_page_rlock
+#define latch_page_runlock sdbm__latch_page_runlock
+#define latch_page_wlock sdbm__latch_page_wlock
+#define latch_page_wunlock sdbm__latch_page_wunlock
+#define latch_page_writable sdbm__latch_page_writable
+#define latch_dir_lock sdbm__latch_dir_lock
+#define latch_dir_unlock sdbm__latch_dir_unlock
+#define latch_cache_lock sdbm__latch_cache_lock
+#define latch_cache_unlock sdbm__latch_cache_unlock
+
+struct dbm_latch;
+
+#ifdef THREADS
+void latch_init(DBM *);
+void latch_free(DBM *);
+void latch_shared(const DBM *);
+void latch_unshared(const DBM *);
+void latch_exclusive(const DBM *);
+void latch_unexclusive(const DBM *);
+void latch_page_rlock(const DBM *, long);
+void latch_page_runlock(const DBM *, long);
+void latch_page_wlock(const DBM *, long);
+void latch_page_wunlock(const DBM *, long);
+bool latch_page_writable(const DBM *, long);
+void latch_dir_lock(const DBM *);
+void latch_dir_unlock(const DBM *);
+void latch_cache_lock(const DBM *);
+void latch_cache_unlock(const DBM *);
+#else	/* !THREADS */
+#define latch_exclusive(d)			((void) (d))
+#define latch_unexclusive(d)		((void) (d))
+#define latch_page_wlock(d,n)		((void) (d), (void) (n))
+#define latch_page_wunlock(d,n)		((void) (d), (void) (n))
+#define latch_page_writable(d,n)	((void) (d), (void) (n), TRUE)
+#define latch_dir_lock(d)			((void) (d))
+#define latch_dir_unlock(d)			((void) (d))
+#define latch_cache_lock(d)			((void) (d))
+#define latch_cache_unlock(d)		((void) (d))
+#endif	/* THREADS */
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -18,6 +18,7 @@
 #include "private.h"
 #include "lru.h"
 #include "pair.h"
+#include "wal.h"
 
 #include "lib/array_util.h"
 #include "lib/hset.h"
@@ -465,6 +466,15 @@ loose_iterate(DBM *db, struct loose_type *type, void *arg, int flags,
 	if (lrutail > pagtail)
 		pagtail = lrutail - 1;		/* This is the true current DB end */
 
+#ifdef WAL
+	if (db->wal != NULL) {
+		fileoffset_t waltail = wal_tail_offset(db);
+
+		if (waltail > pagtail)
+			pagtail = waltail - 1;	/* Logged pages past the .pag end */
+	}
+#endif
+
 	if (pagtail < 0)
 		goto done;
 
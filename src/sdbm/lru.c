@@ -16,8 +16,10 @@
 #include "sdbm.h"
 #include "tune.h"
 #include "lru.h"
+#include "latch.h"
 #include "pair.h"				/* For sdbm_page_dump() */
 #include "private.h"
+#include "wal.h"
 
 #include "lib/atomic.h"
 #include "lib/compat_pio.h"
@@ -203,6 +205,32 @@ sdbm_lru_cpage_get(const DBM *db, const char *pag, bool safe)
 	return deconstify_pointer(cp);
 }
 
+/*
+ * The page number index is also looked up by concurrent readers, so it must
+ * only be updated under the cache latch.  Only the thread owning the DB lock
+ * updates the index, hence it can look it up without taking the latch.
+ */
+
+static inline void
+lru_index_insert(const DBM *db, struct lru_cpage *cp)
+{
+	latch_cache_lock(db);
+	hevset_insert(db->cache->pagnum, cp);
+	latch_cache_unlock(db);
+}
+
+static inline bool
+lru_index_remove(const DBM *db, long num)
+{
+	bool found;
+
+	latch_cache_lock(db);
+	found = hevset_remove(db->cache->pagnum, &num);
+	latch_cache_unlock(db);
+
+	return found;
+}
+
 /**
  * Setup allocated LRU page cache.
  */
@@ -262,7 +290,9 @@ init_cache(DBM *db, uint pages, bool wdelay)
 	WALLOC0(cache);
 	cache->magic = SDBM_LRU_MAGIC;
 	setup_cache(cache, pages, wdelay);
+	latch_cache_lock(db);
 	db->cache = cache;
+	latch_cache_unlock(db);
 
 	return 0;		/* Always OK */
 }
@@ -523,6 +553,7 @@ setcache(DBM *db, uint pages)
 
 		db->pagbno = -1;		/* Current page address could become invalid */
 		db->pagbuf = NULL;
+		db->pagbuf_mapped = FALSE;
 
 		/*
 		 * If there are still some wired pages, we cannot free the cache right
@@ -537,8 +568,10 @@ setcache(DBM *db, uint pages)
 		 */
 
 		if (0 == wired) {
-			free_cache(cache);
+			latch_cache_lock(db);
 			db->cache = NULL;
+			latch_cache_unlock(db);
+			free_cache(cache);
 		} else {
 			s_carp_once("%s(): attempting to disable cache on SDBM \"%s\""
 				"whilst still holding %zu wired page%s",
@@ -563,10 +596,11 @@ setcache(DBM *db, uint pages)
 	 * provided it is not already wired..
 	 *
 	 * Note that db->pagbuf MUST be a cached page since caching was on,
-	 * provided that db->pagbno is valid.
+	 * provided that db->pagbno is valid and the page was not read from
+	 * the mapped .pag file.
 	 */
 
-	if (db->pagbno != -1) {
+	if (db->pagbno != -1 && !db->pagbuf_mapped) {
 		struct lru_cpage *cp = sdbm_lru_cpage_get(db, db->pagbuf, TRUE);
 
 		g_assert_log(cp != NULL,
@@ -593,7 +627,7 @@ setcache(DBM *db, uint pages)
 
 		while (excess-- != 0) {
 			struct lru_cpage *cp = elist_pop(&cache->lru);
-			bool found = hevset_remove(cache->pagnum, &cp->numpag);
+			bool found = lru_index_remove(db, cp->numpag);
 			g_assert(found);
 			sdbm_lru_cpage_free(cp);
 		}
@@ -662,8 +696,10 @@ lru_close(DBM *db)
 		if (common_stats)
 			log_lrustats(db);
 
-		free_cache(cache);
+		latch_cache_lock(db);
 		db->cache = NULL;
+		latch_cache_unlock(db);
+		free_cache(cache);
 	}
 }
 
@@ -680,6 +716,9 @@ modifypag(const DBM *db, const char *pag)
 		G_STRFUNC, sdbm_name(db), pag, db->pagbuf, db->pagbno);
 
 	assert_sdbm_locked(db);
+	g_assert_log(latch_page_writable(db, cp->numpag),
+		"%s(): sdbm \"%s\": page #%ld modified without latching",
+		G_STRFUNC, sdbm_name(db), cp->numpag);
 
 	/*
 	 * If the page is wired, this is our hook to identify that it is about
@@ -750,7 +789,7 @@ lru_wire(DBM *db, long num, ulong *mstamp)
 			return NULL;			/* Could not read the page from disk */
 		}
 		cp->numpag = num;
-		hevset_insert(cache->pagnum, cp);
+		lru_index_insert(db, cp);
 	}
 
 	g_assert(cp->wired);
@@ -830,7 +869,7 @@ lru_unwire(DBM *db, const char *pag)
 				if (db->pagbno == old->numpag)
 					db->pagbno = -1;
 				elist_remove(&cache->lru, old);
-				found = hevset_remove(cache->pagnum, &old->numpag);
+				found = lru_index_remove(db, old->numpag);
 				g_assert(found);
 				sdbm_lru_cpage_free(old);
 			}
@@ -858,9 +897,10 @@ freepage:
 	if (db->pagbno == cp->numpag) {
 		db->pagbuf = NULL;		/* Reference to cp->page becoming invalid */
 		db->pagbno = -1;
+		db->pagbuf_mapped = FALSE;
 	}
 
-	found = hevset_remove(cache->pagnum, &cp->numpag);
+	found = lru_index_remove(db, cp->numpag);
 	g_assert(found);
 	sdbm_lru_cpage_free(cp);
 
@@ -872,8 +912,10 @@ freepage:
 		0 == cache->pages &&
 		0 == elist_count(&cache->wired) + elist_count(&cache->lru)
 	) {
-		free_cache(cache);
+		latch_cache_lock(db);
 		db->cache = NULL;
+		latch_cache_unlock(db);
+		free_cache(cache);
 	}
 }
 
@@ -914,7 +956,12 @@ dirtypag(DBM *db, bool force)
 
 	if (flushpag(db, db->pagbuf, db->pagbno)) {
 		cp->dirty = FALSE;
+#ifdef WAL
+		/* With a write-ahead log, durability comes with the next commit */
+		if G_UNLIKELY(force && NULL == db->wal)
+#else
 		if G_UNLIKELY(force)
+#endif
 			fd_fdatasync(db->pagf);
 		return TRUE;
 	}
@@ -1008,7 +1055,7 @@ getcpage(DBM *db, long num)
 		sdbm_lru_cpage_valid(cp, db);
 
 		elist_moveto_head(&cache->lru, cp);
-		found = hevset_remove(cache->pagnum, &cp->numpag);
+		found = lru_index_remove(db, cp->numpag);
 		g_assert(found);
 
 		if (db->pagbno == cp->numpag)
@@ -1022,7 +1069,7 @@ getcpage(DBM *db, long num)
 	 */
 
 	cp->numpag = num;
-	hevset_insert(cache->pagnum, cp);
+	lru_index_insert(db, cp);
 
 	g_assert_log(hevset_count(cache->pagnum) ==
 		elist_count(&cache->lru) + elist_count(&cache->wired),
@@ -1078,7 +1125,7 @@ lru_discard_page(void *data, void *udata)
 		cache = db->cache;
 		sdbm_lru_check(cache);
 
-		found = hevset_remove(cache->pagnum, &cp->numpag);
+		found = lru_index_remove(db, cp->numpag);
 		g_assert(found);
 		sdbm_lru_cpage_free(cp);
 		cache->cp_discarded++;
@@ -1167,7 +1214,7 @@ lru_invalidate(DBM *db, long bno)
 		} else {
 			bool found;
 			elist_remove(&cache->lru, cp);
-			found = hevset_remove(cache->pagnum, &bno);
+			found = lru_index_remove(db, bno);
 			g_assert(found);
 			sdbm_lru_cpage_free(cp);
 		}
@@ -1247,6 +1294,7 @@ readbuf(DBM *db, long num, bool *loaded)
 	}
 
 	db->pagbuf = cp->page;
+	db->pagbuf_mapped = FALSE;
 	if (loaded != NULL)
 		*loaded = cached;
 
@@ -1388,6 +1436,16 @@ readpag(DBM *db, char *pag, long num)
 	 */
 
 	db->pagread++;
+
+#ifdef WAL
+	/*
+	 * The latest version of the page lies in the write-ahead log if the
+	 * page was modified since the last checkpoint.
+	 */
+
+	got = NULL == db->wal ? 0 : wal_read(db, WAL_PAG, pag, num);
+	if (0 == got)
+#endif
 	got = compat_pread(db->pagf, pag, DBM_PBLKSIZ, OFF_PAG(num));
 	if G_UNLIKELY(got < 0) {
 		s_critical("sdbm: \"%s\": cannot read page #%ld: %m",
@@ -1453,6 +1511,12 @@ flushpag(DBM *db, char *pag, long num)
 	}
 
 	db->pagwrite++;
+
+#ifdef WAL
+	if (db->wal != NULL)
+		w = wal_write(db, WAL_PAG, pag, num);
+	else
+#endif
 	w = compat_pwrite(db->pagf, pag, DBM_PBLKSIZ, OFF_PAG(num));
 
 	if (w < 0 || w != DBM_PBLKSIZ) {
@@ -1473,4 +1537,255 @@ flushpag(DBM *db, char *pag, long num)
 	return TRUE;
 }
 
+/**
+ * Copy page ``num'' into the supplied buffer if it is held in the cache,
+ * on behalf of a concurrent reader not owning the DB lock.
+ *
+ * The caller must hold the latch of the page, preventing the lock owner
+ * from loading or modifying it meanwhile.  The cache latch we take here
+ * prevents the page from being evicted whilst we copy it.
+ *
+ * @return TRUE if the page was copied, FALSE if it is not cached, meaning
+ * the version on disk is the current one.
+ */
+bool
+lru_shared_copy(const DBM *db, long num, char *buf)
+{
+	const struct lru_cache *cache;
+	bool copied = FALSE;
+
+	latch_cache_lock(db);
+
+	cache = db->cache;
+
+	if (cache != NULL) {
+		const struct lru_cpage *cp;
+
+		sdbm_lru_check(cache);
+		cp = hevset_lookup(cache->pagnum, &num);
+
+		/* An invalidated page was superseded by the version on disk */
+
+		if (cp != NULL && !cp->invalid) {
+			sdbm_lru_cpage_valid(cp, db);
+			memcpy(buf, cp->page, DBM_PBLKSIZ);
+			copied = TRUE;
+		}
+	}
+
+	latch_cache_unlock(db);
+
+	return copied;
+}
+
+/*
+ * Memory-mapped read path.
+ *
+ * When enabled, the .pag file is mapped read-only and shared, so that
+ * clean pages which are not held in the LRU cache can be read straight
+ * from the kernel page cache, without any copy: db->pagbuf then points
+ * within the mapping.
+ *
+ * Before modifying such a page, it must be brought into the LRU cache via
+ * ownpagbuf().  The LRU cache therefore only holds pages we modified, pages
+ * which are wired, or pages which were read outside of the mapped area.
+ *
+ * Since writes are done through the file descriptor and the mapping is
+ * shared, the mapping is always coherent with what we write to the file.
+ * It needs to be dropped however before the file is truncated.
+ */
+
+#define LRU_MAP_SLACK	(64 * DBM_PBLKSIZ)	/* Minimal growth to remap */
+
+/**
+ * Discard the mapping of the .pag file, if any.
+ */
+void
+lru_unmap(DBM *db)
+{
+	if G_UNLIKELY(db->pagbuf_mapped) {
+		db->pagbuf = NULL;		/* Reference to mapping becoming invalid */
+		db->pagbno = -1;
+		db->pagbuf_mapped = FALSE;
+	}
+
+	if (db->pagmap != NULL) {
+		if (-1 == vmm_munmap(db->pagmap, db->pagmaplen)) {
+			s_warning("sdbm: \"%s\": cannot unmap %zu bytes of .pag: %m",
+				sdbm_name(db), db->pagmaplen);
+		}
+		db->pagmap = NULL;
+		db->pagmaplen = 0;
+	}
+}
+
+/**
+ * Map the .pag file so that page ``num'' is covered by the mapping.
+ *
+ * @return TRUE if page can now be read from the mapping.
+ */
+static bool
+lru_remap(DBM *db, long num)
+{
+#ifdef HAS_MMAP
+	filestat_t buf;
+	size_t len;
+	void *p;
+
+	if G_UNLIKELY(-1 == fstat(db->pagf, &buf))
+		return FALSE;
+
+	/*
+	 * Only full pages can be mapped, and it is pointless to remap the file
+	 * if it did not grow enough since the last time we mapped it.  Pages
+	 * outside of the mapping are simply read through the LRU cache.
+	 */
+
+	if (buf.st_size <= 0 || UNSIGNED(buf.st_size) >= MAX_INT_VAL(size_t))
+		return FALSE;
+
+	len = buf.st_size - buf.st_size % DBM_PBLKSIZ;
+
+	if (UNSIGNED(OFF_PAG(num + 1)) > len)
+		return FALSE;
+
+	if (db->pagmap != NULL && len < db->pagmaplen + LRU_MAP_SLACK)
+		return FALSE;
+
+	lru_unmap(db);
+
+	p = vmm_mmap(NULL, len, PROT_READ, MAP_SHARED, db->pagf, 0);
+
+	if G_UNLIKELY(MAP_FAILED == p) {
+		s_warning_once_per(LOG_PERIOD_MINUTE,
+			"sdbm: \"%s\": cannot map %zu bytes of .pag: %m",
+			sdbm_name(db), len);
+		return FALSE;
+	}
+
+	db->pagmap = p;
+	db->pagmaplen = len;
+
+	return TRUE;
+#else
+	(void) db;
+	(void) num;
+	return FALSE;
+#endif	/* HAS_MMAP */
+}
+
+/**
+ * Attempt to read page ``num'' straight from the mapped .pag file, setting
+ * db->pagbuf accordingly.
+ *
+ * This is only possible when the page is not held in the LRU cache, which
+ * has the authoritative copy otherwise.
+ *
+ * @return TRUE if db->pagbuf now points to the page within the mapping.
+ */
+bool
+mappedbuf(DBM *db, long num)
+{
+	const struct lru_cache *cache = db->cache;
+	char *pag;
+
+	if (!db->mmapped)
+		return FALSE;
+
+	sdbm_lru_check(cache);
+	assert_sdbm_locked(db);
+	g_assert(num >= 0);
+
+#ifdef WAL
+	if (db->wal != NULL)
+		return FALSE;		/* Latest page version could lie in the log */
+#endif
+
+	if (hevset_contains(cache->pagnum, &num))
+		return FALSE;
+
+	if (UNSIGNED(OFF_PAG(num + 1)) > db->pagmaplen && !lru_remap(db, num))
+		return FALSE;
+
+	pag = db->pagmap + OFF_PAG(num);
+
+	/*
+	 * Let readpag() deal with corrupted pages, which requires a private copy.
+	 */
+
+	if G_UNLIKELY(!sdbm_chkpage(pag))
+		return FALSE;
+
+	db->pagbuf = pag;
+	db->pagbuf_mapped = TRUE;
+	db->pagmapread++;
+
+	return TRUE;
+}
+
+/**
+ * Make sure db->pagbuf can be modified, copying the page from the mapping
+ * into the LRU cache if needed.
+ *
+ * @return TRUE if OK, FALSE if we could not get a cached page, leaving
+ * db->pagbuf intact.
+ */
+bool
+ownpagbuf(DBM *db)
+{
+	const char *pag = db->pagbuf;
+	bool loaded;
+
+	assert_sdbm_locked(db);
+
+	if G_LIKELY(!db->pagbuf_mapped)
+		return TRUE;
+
+	g_assert(db->pagbno >= 0);
+
+	if G_UNLIKELY(!readbuf(db, db->pagbno, &loaded))
+		return FALSE;
+
+	/* Page cannot be cached, or mappedbuf() would not have been used */
+	g_assert(!loaded);
+
+	memcpy(db->pagbuf, pag, DBM_PBLKSIZ);
+	db->pagowned++;
+
+	return TRUE;
+}
+
+/**
+ * Turn the memory-mapped read path on or off.
+ * @return -1 on error with errno set, 0 if OK.
+ */
+int
+setmmap(DBM *db, bool on)
+{
+	assert_sdbm_locked(db);
+
+#ifdef HAS_MMAP
+	if (!on)
+		lru_unmap(db);
+
+	db->mmapped = booleanize(on);
+	return 0;
+#else
+	if (!on)
+		return 0;
+
+	errno = ENOTSUP;
+	return -1;
+#endif
+}
+
+/**
+ * @return whether the memory-mapped read path is enabled.
+ */
+bool
+getmmap(const DBM *db)
+{
+	return db->mmapped;
+}
+
 /* vi: set ts=4 sw=4 cindent: */
@@ -19,6 +19,12 @@
 #define getwdelay sdbm__getwdelay
 #define cachepag sdbm__cachepag
 #define readpag sdbm__readpag
+#define lru_unmap sdbm__lru_unmap
+#define mappedbuf sdbm__mappedbuf
+#define ownpagbuf sdbm__ownpagbuf
+#define setmmap sdbm__setmmap
+#define getmmap sdbm__getmmap
+#define lru_shared_copy sdbm__lru_shared_copy
 
 void lru_init(DBM *);
 void lru_close(DBM *);
@@ -41,5 +47,11 @@ const char *lru_wire(DBM *, long, ulong *);
 ulong lru_wired_mstamp(DBM *, const char *);
 void lru_unwire(DBM *, const char *);
 void lru_page_log(const DBM *, const char *);
+void lru_unmap(DBM *);
+bool mappedbuf(DBM *, long);
+bool ownpagbuf(DBM *);
+int setmmap(DBM *, bool);
+bool getmmap(const DBM *);
+bool lru_shared_copy(const DBM *, long, char *);
 
 /* vi: set ts=4 sw=4 cindent: */
@@ -671,6 +671,51 @@ exipair(DBM *db, const char *pag, datum key)
 	return seepair(db, pag, ino[0], key.dptr, key.dsize) != 0;
 }
 
+/**
+ * Look for the key in a private copy of a page, on behalf of a concurrent
+ * reader which cannot use the database context.
+ *
+ * The page must have been validated by sdbm_chkpage() already.
+ *
+ * @return 1 if found, with ``val'' pointing into the page, 0 if not found,
+ * -1 if the lookup cannot be completed without the database context because
+ * the page holds big keys or the value is a big one.
+ */
+int
+sharedpair(const char *pag, datum key, datum *val)
+{
+	unsigned i, n;
+	size_t off = DBM_PBLKSIZ;
+	const unsigned short *ino = INO(pag);
+
+	n = ino[0];
+
+	for (i = 1; i < n; i += 2) {
+		unsigned short koff = poffset(ino[i]);
+
+		if G_UNLIKELY(is_big(ino[i]))
+			return -1;		/* Comparing requires reading the .dat file */
+
+		if (
+			key.dsize == off - koff &&
+			0 == memcmp(key.dptr, pag + koff, key.dsize)
+		) {
+			unsigned short voff = poffset(ino[i + 1]);
+
+			if G_UNLIKELY(is_big(ino[i + 1]))
+				return -1;
+
+			val->dptr = deconstify_char(pag + voff);
+			val->dsize = koff - voff;
+			return 1;
+		}
+
+		off = poffset(ino[i + 1]);
+	}
+
+	return 0;
+}
+
 #ifdef SEEDUPS
 bool
 duppair(DBM *db, const char *pag, datum key)
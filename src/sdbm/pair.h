@@ -16,6 +16,7 @@
 #define replaceable sdbm__replaceable
 #define paircount sdbm__paircount
 #define readpairv sdbm__readpairv
+#define sharedpair sdbm__sharedpair
 
 #define INO(p)		((unsigned short *) (p))
 #define INO_MAX		(DBM_PBLKSIZ / sizeof(unsigned short) - 1)
@@ -67,6 +68,7 @@ extern bool fitpair(const DBM *, const char *, size_t);
 extern bool putpair(DBM *, char *, datum, datum);
 extern datum getpair(DBM *, char *, datum);
 extern bool exipair(DBM *, const char *, datum);
+extern int sharedpair(const char *, datum, datum *);
 extern bool delpair(DBM *, char *, datum);
 extern bool delnpair(DBM *, char *, int);
 extern bool delipair(DBM *, char *, int, bool);
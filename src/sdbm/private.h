@@ -7,6 +7,8 @@
 struct DBMBIG;
 struct qlock;			/* Avoid including "qlock.h" here */
 struct lru_cache;
+struct DBMWAL;
+struct dbm_latch;
 
 enum sdbm_magic { SDBM_MAGIC = 0x1dac340e };
 
@@ -28,9 +30,15 @@ struct DBM {
 	char *dirbuf;		/* directory file block buffer (size: DBM_DBLKSIZ) */
 #ifdef LRU
 	struct lru_cache *cache;	/* LRU page cache */
+	char *pagmap;		/* read-only mapping of .pag file, NULL if none */
+	size_t pagmaplen;	/* length of the .pag mapping */
+#endif
+#ifdef WAL
+	struct DBMWAL *wal;	/* write-ahead log, NULL if not enabled */
 #endif
 #ifdef THREADS
 	struct qlock *lock;	/* thread-safe lock at the API level */
+	struct dbm_latch *latch;	/* latches for concurrent readers */
 	int refcnt;			/* reference count */
 #endif
 	struct DBM *rdb;	/* if non-NULL, concurrent DB rebuild in progress */
@@ -74,11 +82,17 @@ struct DBM {
 	uint8 is_volatile;	/* whether consistency of database matters */
 #endif
 #ifdef LRU
+	ulong pagmapread;	/* stats: amount of pages read from the mapping */
+	ulong pagowned;		/* stats: amount of mapped pages copied to modify */
 	uint8 dirbuf_dirty;	/* whether dirbuf needs flushing to disk */
+	uint8 mmapped;		/* whether .pag reads can use a mapping */
+	uint8 pagbuf_mapped;	/* whether pagbuf points within the mapping */
 #endif
 #ifdef THREADS
 	struct dbm_returns *returned;	/* per-thread returned values */
 	uint iterid;		/* thread small ID for iterating */
+	ulong shared_reads;	/* stats: amount of lookups done concurrently */
+	ulong shared_fallbacks;	/* stats: concurrent lookups left to the lock */
 #endif
 };
 
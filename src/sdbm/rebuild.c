@@ -18,6 +18,7 @@
 #include "private.h"
 #include "big.h"
 #include "lru.h"
+#include "latch.h"
 #include "tmp.h"
 
 #include "lib/halloc.h"
@@ -92,6 +93,8 @@ sdbm_attr_propagate(DBM *ndb, const DBM *db)
 
 	if (sdbm_is_volatile(db))	sdbm_set_volatile(ndb, TRUE);
 	if (sdbm_get_wdelay(db))	sdbm_set_wdelay(ndb, TRUE);
+	if (sdbm_get_wal(db))		sdbm_set_wal(ndb, TRUE);
+	if (sdbm_get_mmap(db))		sdbm_set_mmap(ndb, TRUE);
 	if (cache != 0)				sdbm_set_cache(ndb, cache);
 }
 
@@ -141,14 +144,22 @@ sdbm_replace_descriptor(DBM *db, DBM *ndb)
 #ifdef THREADS
 	g_assert(NULL == ndb->lock);		/* Since `ndb' was not thread-safe */
 	g_assert(NULL == ndb->returned);
+	g_assert(NULL == ndb->latch);
 	ndb->lock = db->lock;
 	ndb->returned = db->returned;
 	ndb->refcnt = db->refcnt;
+	ndb->latch = db->latch;
 #endif
 #ifdef BIGDATA
 	big_free(ndb);
 	ndb->big = db->big;			/* We're going to keep this db->big object */
 #endif
+	/*
+	 * Concurrent readers must not see the descriptor whilst we swap it.
+	 */
+
+	latch_exclusive(db);
+
 #ifdef LRU
 	lru_close(ndb);				/* We only keep the current LRU cache */
 	lru_discard(db, 0);			/* All pages invalid since DB was rebuilt */
@@ -161,6 +172,7 @@ sdbm_replace_descriptor(DBM *db, DBM *ndb)
 #ifdef THREADS
 	ndb->lock = NULL;							/* was copied over */
 	ndb->returned = NULL;
+	ndb->latch = NULL;
 #endif
 
 	/*
@@ -171,6 +183,8 @@ sdbm_replace_descriptor(DBM *db, DBM *ndb)
 	if (-1 == sdbm_rename_files(db, dirname, pagname, datname))
 		error = errno;
 
+	latch_unexclusive(db);
+
 	HFREE_NULL(dirname);
 	HFREE_NULL(pagname);
 	HFREE_NULL(datname);
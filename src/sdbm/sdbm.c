@@ -13,9 +13,11 @@
 #include "tune.h"
 #include "pair.h"
 #include "lru.h"
+#include "latch.h"
 #include "big.h"
 #include "tmp.h"
 #include "private.h"
+#include "wal.h"
 
 #include "lib/atomic.h"
 #include "lib/compat_misc.h"
@@ -334,6 +336,9 @@ sdbm_prep(const char *dirname, const char *pagname,
 {
 	DBM *db;
 	filestat_t dstat;
+#ifdef WAL
+	bool recovered = FALSE;
+#endif
 
 	if (
 		(db = sdbm_alloc()) == NULL ||
@@ -374,6 +379,16 @@ sdbm_prep(const char *dirname, const char *pagname,
 	if ((db->pagf = file_open(pagname, flags, mode)) > -1) {
 		if ((db->dirf = file_open(dirname, flags, mode)) > -1) {
 
+#ifdef WAL
+			/*
+			 * Replay any write-ahead log left over by a crash before
+			 * looking at the dirfile, which the log can extend.
+			 */
+
+			if (!wal_recover(pagname, db->pagf, db->dirf, flags, &recovered))
+				goto error;
+#endif
+
 			/*
 			 * need the dirfile size to establish max bit number.
 			 */
@@ -443,6 +458,30 @@ success:
 
 	tmp_clean(db);
 
+#if defined(WAL) && defined(BIGDATA)
+	/*
+	 * After a crash, the .dat blocks allocated since the last commit remain
+	 * flagged as used although no page refers to them.  Iterating over the
+	 * whole database in safe mode rebuilds the .dat bitmap from the live
+	 * pages, releasing these blocks.
+	 */
+
+	if (recovered && db->big != NULL) {
+		datum key;
+
+		for (key = sdbm_firstkey_safe(db); key.dptr; key = sdbm_nextkey(db))
+			/* empty */;
+
+		if (sdbm_error(db)) {
+			s_warning("sdbm: \"%s\": I/O error whilst checking keys",
+				sdbm_name(db));
+			sdbm_clearerr(db);
+		}
+	}
+#elif defined(WAL)
+	(void) recovered;
+#endif
+
 	return db;
 }
 
@@ -461,6 +500,7 @@ sdbm_thread_safe(DBM *db)
 	WALLOC0(db->lock);
 	qlock_recursive_init(db->lock);
 	XMALLOC0_ARRAY(db->returned, THREAD_MAX);
+	latch_init(db);
 }
 
 /**
@@ -730,6 +770,18 @@ log_sdbmstats(DBM *db)
 	s_info("sdbm: \"%s\" inplace value writes = %.2f%% on %lu occurence%s",
 		sdbm_name(db), db->repl_inplace * 100.0 / MAX(db->repl_stores, 1),
 		db->repl_stores, plural(db->repl_stores));
+#ifdef LRU
+	if (db->pagmapread != 0) {
+		s_info("sdbm: \"%s\" mapped page reads = %lu (%lu copied to modify)",
+			sdbm_name(db), db->pagmapread, db->pagowned);
+	}
+#endif
+#ifdef THREADS
+	if (db->shared_reads != 0 || db->shared_fallbacks != 0) {
+		s_info("sdbm: \"%s\" concurrent lookups = %lu (%lu serialized)",
+			sdbm_name(db), db->shared_reads, db->shared_fallbacks);
+	}
+#endif
 }
 
 static void
@@ -793,16 +845,37 @@ fetch_pagbuf(DBM *db, long pagnum)
 	 */
 
 	if (pagnum != db->pagbno) {
+		bool ok;
+
 #ifdef LRU
 		{
 			bool loaded;
 
+			/*
+			 * Clean pages not held in the LRU cache can be read straight
+			 * from the mapped .pag file, when enabled.
+			 */
+
+			if (mappedbuf(db, pagnum)) {
+				db->pagbno = pagnum;
+				return TRUE;
+			}
+
+			/*
+			 * Concurrent readers must not see the page in the LRU cache
+			 * before it is completely loaded.
+			 */
+
+			latch_page_wlock(db, pagnum);
+
 			if G_UNLIKELY(!readbuf(db, pagnum, &loaded)) {
+				latch_page_wunlock(db, pagnum);
 				db->pagbno = -1;
 				return FALSE;
 			}
 
 			if (loaded) {
+				latch_page_wunlock(db, pagnum);
 				db->pagbno = pagnum;
 				return TRUE;
 			}
@@ -811,19 +884,46 @@ fetch_pagbuf(DBM *db, long pagnum)
 		}
 #endif	/* LRU */
 
-		if (readpag(db, db->pagbuf, pagnum)) {
-			db->pagbno = pagnum;
-			return TRUE;
-		} else {
-			db->pagbno = -1;
-			return FALSE;
-		}
+		ok = readpag(db, db->pagbuf, pagnum);
+		db->pagbno = ok ? pagnum : -1;
+
+#ifdef LRU
+		latch_page_wunlock(db, pagnum);
+#endif
+
+		return ok;
 	}
 
 	db->pagbno_hit++;
 	return TRUE;
 }
 
+/**
+ * Make sure db->pagbuf, which holds a valid page, can be modified.
+ *
+ * When the page was read from the mapped .pag file, it is copied into the
+ * LRU cache first.
+ *
+ * @return TRUE on success, FALSE on error with errno set.
+ */
+static bool
+modifiable_pagbuf(DBM *db)
+{
+	assert_sdbm_locked(db);
+	g_assert(db->pagbno >= 0);
+
+#ifdef LRU
+	if G_UNLIKELY(!ownpagbuf(db)) {
+		errno = ENOMEM;
+		return FALSE;
+	}
+#else
+	(void) db;
+#endif
+
+	return TRUE;
+}
+
 /**
  * Flush db->pagbuf to disk.
  * @return TRUE on success
@@ -868,6 +968,21 @@ flush_dirbuf(DBM *db)
 	assert_sdbm_locked(db);
 
 	db->dirwrite++;
+
+#ifdef WAL
+	/*
+	 * With a write-ahead log, the block is made durable at the next commit,
+	 * along with the pages it refers to.
+	 */
+
+	if (db->wal != NULL) {
+		w = wal_write(db, WAL_DIR, db->dirbuf, db->dirbno);
+		if (DBM_DBLKSIZ == w) {
+			db->dirbuf_dirty = FALSE;
+			return TRUE;
+		}
+	} else
+#endif
 	w = compat_pwrite(db->dirf, db->dirbuf, DBM_DBLKSIZ, OFF_DIR(db->dirbno));
 
 	/*
@@ -895,6 +1010,31 @@ flush_dirbuf(DBM *db)
 	return TRUE;
 }
 
+#ifdef WAL
+/**
+ * Checkpoint the write-ahead log, after having logged the blocks still
+ * dirty in memory so that the commit only covers complete operations.
+ *
+ * @return TRUE if OK, FALSE on error with errno set.
+ */
+static bool
+sdbm_checkpoint(DBM *db)
+{
+	if (-1 == flush_dirtypag(db))
+		return FALSE;
+
+	if (db->dirbuf_dirty && !flush_dirbuf(db))
+		return FALSE;
+
+#ifdef BIGDATA
+	if (!big_sync(db))
+		return FALSE;
+#endif
+
+	return wal_checkpoint(db);
+}
+#endif	/* WAL */
+
 static void
 sdbm_unlink_file(const char *name, const char *path)
 {
@@ -924,12 +1064,18 @@ sdbm_close_internal(DBM *db, bool clearfiles, bool destroy)
 #endif
 
 #ifdef LRU
+	lru_unmap(db);
 	if (is_valid_fd(db->pagf))
 		lru_close(db);
 #else
 	WFREE_NULL(db->pagbuf, DBM_PBLKSIZ);
 #endif	/* LRU */
 
+#ifdef WAL
+	/* No need to write back logged blocks if files are going away */
+	wal_close(db, !clearfiles && !(db->flags & DBM_BROKEN));
+#endif
+
 	WFREE_NULL(db->dirbuf, DBM_DBLKSIZ);
 	fd_forget_and_close(&db->dirf);
 	fd_forget_and_close(&db->pagf);
@@ -972,6 +1118,7 @@ sdbm_close_internal(DBM *db, bool clearfiles, bool destroy)
 			qlock_destroy(db->lock);
 			WFREE(db->lock);
 		}
+		latch_free(db);
 		sdbm_free(db);
 	}
 }
@@ -1098,6 +1245,126 @@ sdbm_close(DBM *db)
 	}													\
 } G_STMT_END
 
+#ifdef THREADS
+/**
+ * Compute the page number where a key hashing to the specified hash would lie,
+ * on behalf of a concurrent reader which does not own the database lock.
+ *
+ * This is the same trie traversal as getpageb() but db->dirbuf is only used
+ * when it holds the block we need, otherwise blocks are read in ``dirbuf''.
+ * The caller must hold the shared structure latch.
+ *
+ * @return the page number, -1 on error.
+ */
+static long
+shared_getpageb(const DBM *db, long hash, char *dirbuf)
+{
+	long dirbno = -1;
+	long dbit = 0;
+	int hbit = 0;
+
+	while (dbit < db->maxbno) {
+		long c = dbit / BYTESIZ;
+		long dirb = c / DBM_DBLKSIZ;
+		bool set;
+
+		latch_dir_lock(db);
+
+		if (dirb == db->dirbno) {
+			set = 0 != (db->dirbuf[c % DBM_DBLKSIZ] & (1 << dbit % BYTESIZ));
+		} else {
+			if (dirb != dirbno) {
+				ssize_t got;
+
+				got = compat_pread(db->dirf,
+					dirbuf, DBM_DBLKSIZ, OFF_DIR(dirb));
+
+				if G_UNLIKELY(got < 0) {
+					latch_dir_unlock(db);
+					return -1;
+				}
+				if (got < DBM_DBLKSIZ)
+					memset(dirbuf + got, 0, DBM_DBLKSIZ - got);
+				dirbno = dirb;
+			}
+			set = 0 != (dirbuf[c % DBM_DBLKSIZ] & (1 << dbit % BYTESIZ));
+		}
+
+		latch_dir_unlock(db);
+
+		if (!set)
+			break;
+
+		dbit = 2 * dbit + ((hash & (1 << hbit++)) ? 2 : 1);
+	}
+
+	return hash & masks[hbit];
+}
+
+/**
+ * Look for a key without taking the database lock, concurrently with other
+ * readers and with the thread owning the lock.
+ *
+ * The page is copied in ``pag'', so ``val'' points into that buffer when
+ * the key is found.
+ *
+ * @return 1 if found, 0 if not found, -1 if the lookup must go through the
+ * regular serialized path (logged database, big data, corrupted page, error).
+ */
+static int
+sdbm_shared_lookup(DBM *db, datum key, char *pag, datum *val)
+{
+	char dirbuf[DBM_DBLKSIZ];
+	long pagb;
+	int r = -1;
+
+	latch_shared(db);
+
+	/*
+	 * With a write-ahead log, the latest version of blocks may only be
+	 * present in the log, which only the lock owner can read.
+	 */
+
+	if G_UNLIKELY(db->flags & DBM_BROKEN)
+		goto done;
+#ifdef WAL
+	if (db->wal != NULL)
+		goto done;
+#endif
+
+	pagb = shared_getpageb(db, exhash(key), dirbuf);
+	if G_UNLIKELY(pagb < 0)
+		goto done;
+
+	latch_page_rlock(db, pagb);
+
+#ifdef LRU
+	if (!lru_shared_copy(db, pagb, pag))
+#endif
+	{
+		ssize_t got = compat_pread(db->pagf, pag, DBM_PBLKSIZ, OFF_PAG(pagb));
+
+		if G_UNLIKELY(got < 0) {
+			latch_page_runlock(db, pagb);
+			goto done;
+		}
+		if (got < DBM_PBLKSIZ)
+			memset(pag + got, 0, DBM_PBLKSIZ - got);
+	}
+
+	latch_page_runlock(db, pagb);
+
+	if G_LIKELY(sdbm_chkpage(pag))
+		r = sharedpair(pag, key, val);
+
+	/* FALL THROUGH */
+
+done:
+	latch_unshared(db);
+	return r;
+}
+#endif	/* THREADS */
+
 datum
 sdbm_fetch(DBM *db, datum key)
 {
@@ -1107,6 +1374,25 @@ sdbm_fetch(DBM *db, datum key)
 	}
 	sdbm_check(db);
 
+#ifdef THREADS
+	/*
+	 * Lookups which can be satisfied from a single page do not need to
+	 * be serialized with the other operations.
+	 */
+
+	if (db->latch != NULL && !qlock_is_owned(db->lock)) {
+		char pag[DBM_PBLKSIZ];
+		datum value;
+		int r = sdbm_shared_lookup(db, key, pag, &value);
+
+		if G_LIKELY(r >= 0) {
+			ATOMIC_INC(&db->shared_reads);
+			return 0 == r ? nullitem : *sdbm_thread_datum(db, &value);
+		}
+		ATOMIC_INC(&db->shared_fallbacks);
+	}
+#endif
+
 	sdbm_synchronize(db);
 
 	if G_UNLIKELY(db->flags & DBM_BROKEN) {
@@ -1140,6 +1426,20 @@ sdbm_exists(DBM *db, datum key)
 	}
 	sdbm_check(db);
 
+#ifdef THREADS
+	if (db->latch != NULL && !qlock_is_owned(db->lock)) {
+		char pag[DBM_PBLKSIZ];
+		datum value;
+		int r = sdbm_shared_lookup(db, key, pag, &value);
+
+		if G_LIKELY(r >= 0) {
+			ATOMIC_INC(&db->shared_reads);
+			return r;
+		}
+		ATOMIC_INC(&db->shared_fallbacks);
+	}
+#endif
+
 	sdbm_synchronize(db);
 
 	if G_UNLIKELY(db->flags & DBM_BROKEN) {
@@ -1166,6 +1466,7 @@ int
 sdbm_delete(DBM *db, datum key)
 {
 	int status = -1;
+	long latched = -1;
 
 	if G_UNLIKELY(db == NULL || bad(key)) {
 		errno = EINVAL;
@@ -1193,6 +1494,12 @@ sdbm_delete(DBM *db, datum key)
 		goto done;
 	}
 
+	latched = db->pagbno;
+	latch_page_wlock(db, latched);
+
+	if G_UNLIKELY(!modifiable_pagbuf(db))
+		goto done;
+
 	if (!delpair(db, db->pagbuf, key)) {
 		errno = 0;
 		goto done;
@@ -1221,6 +1528,9 @@ sdbm_delete(DBM *db, datum key)
 	/* FALL THROUGH */
 
 done:
+	if (latched >= 0)
+		latch_page_wunlock(db, latched);
+
 	sdbm_return(db, status);
 }
 
@@ -1241,7 +1551,9 @@ storepair(DBM *db, datum key, datum val, int flags, bool *existed)
 {
 	size_t need;
 	long hash;
+	long latched;
 	bool need_split = FALSE;
+	bool exclusive = FALSE;
 	int result = 0;
 
 	assert_sdbm_locked(db);
@@ -1281,6 +1593,32 @@ storepair(DBM *db, datum key, datum val, int flags, bool *existed)
 		return -1;
 	}
 
+	/*
+	 * Latch the page whilst we modify it, to keep concurrent readers away.
+	 *
+	 * If there is not enough room in the page to insert the new pair, we
+	 * may have to split it, which changes the structure of the database:
+	 * we need exclusive access then.  Since readers wait for page latches
+	 * whilst sharing the structure latch, we must not hold the page latch
+	 * when requesting exclusive access.  Nothing was changed at this stage,
+	 * so readers cannot observe an intermediate state.
+	 */
+
+	latched = db->pagbno;
+	latch_page_wlock(db, latched);
+
+	if G_UNLIKELY(!fitpair(db, db->pagbuf, need)) {
+		latch_page_wunlock(db, latched);
+		latched = -1;
+		latch_exclusive(db);
+		exclusive = TRUE;
+	}
+
+	if G_UNLIKELY(!modifiable_pagbuf(db)) {
+		result = -1;
+		goto done;
+	}
+
 	/*
 	 * If we need to replace, fetch the information about the key first.
 	 * If it is not there, ignore.
@@ -1307,12 +1645,16 @@ storepair(DBM *db, datum key, datum val, int flags, bool *existed)
 			db->repl_stores++;
 			if (replaceable(val.dsize, valsize, big)) {
 				db->repl_inplace++;
-				if G_UNLIKELY(0 != replpair(db, db->pagbuf, idx, val))
-					return -1;
+				if G_UNLIKELY(0 != replpair(db, db->pagbuf, idx, val)) {
+					result = -1;
+					goto done;
+				}
 				goto inserted;
 			} else {
-				if G_UNLIKELY(!delipair(db, db->pagbuf, idx, TRUE))
-					return -1;
+				if G_UNLIKELY(!delipair(db, db->pagbuf, idx, TRUE)) {
+					result = -1;
+					goto done;
+				}
 				db->delta--;		/* Removed one key/pair for now */
 			}
 		}
@@ -1320,7 +1662,8 @@ storepair(DBM *db, datum key, datum val, int flags, bool *existed)
 #ifdef SEEDUPS
 	else if G_UNLIKELY(duppair(db, db->pagbuf, key)) {
 		errno = EEXIST;
-		return 1;
+		result = 1;
+		goto done;
 	}
 #endif
 
@@ -1330,8 +1673,14 @@ storepair(DBM *db, datum key, datum val, int flags, bool *existed)
 
 	need_split = !fitpair(db, db->pagbuf, need);
 
-	if G_UNLIKELY(need_split && !makroom(db, hash, need))
-		return -1;
+#ifdef THREADS
+	g_assert(!need_split || exclusive || NULL == db->latch);
+#endif
+
+	if G_UNLIKELY(need_split && !makroom(db, hash, need)) {
+		result = -1;
+		goto done;
+	}
 
 	/*
 	 * we have enough room or split is successful. insert the key,
@@ -1365,12 +1714,20 @@ inserted:
 
 #ifdef LRU
 	if G_UNLIKELY(!force_flush_pagbuf(db, need_split && !db->is_volatile))
-		return -1;
+		result = -1;
 #else
 	if G_UNLIKELY(!flush_pagbuf(db))
-		return -1;
+		result = -1;
 #endif
 
+	/* FALL THROUGH */
+
+done:
+	if (latched >= 0)
+		latch_page_wunlock(db, latched);
+	if G_UNLIKELY(exclusive)
+		latch_unexclusive(db);
+
 	return result;		/* 0 means success */
 }
 
@@ -1421,6 +1778,22 @@ sdbm_replace(DBM *db, datum key, datum val, bool *existed)
 	sdbm_return(db, r);
 }
 
+/**
+ * Write the new page resulting from a split, bypassing the LRU cache.
+ *
+ * @return the amount of bytes written, -1 on error with errno set.
+ */
+static ssize_t
+write_newpag(DBM *db, const char *pag, long num)
+{
+#ifdef WAL
+	if (db->wal != NULL)
+		return wal_write(db, WAL_PAG, pag, num);
+#endif
+
+	return compat_pwrite(db->pagf, pag, DBM_PBLKSIZ, OFF_PAG(num));
+}
+
 /*
  * makroom - make room by splitting the overfull page
  * this routine will attempt to make room for DBM_SPLTMAX times before
@@ -1575,7 +1948,7 @@ makroom(DBM *db, long int hash, size_t need)
 #endif	/* LRU */
 		else if G_UNLIKELY((
 			db->pagwrite++,
-			compat_pwrite(db->pagf, New, DBM_PBLKSIZ, OFF_PAG(newp)) < 0)
+			write_newpag(db, New, newp) < 0)
 		) {
 			s_warning("sdbm: \"%s\": cannot flush new page #%ld: %m",
 				sdbm_name(db), newp);
@@ -1725,7 +2098,7 @@ restore:
 		lru_invalidate(db, newp);	/* We're about to commit a newer version */
 #endif
 		memset(New, 0, DBM_PBLKSIZ);
-		if (compat_pwrite(db->pagf, New, DBM_PBLKSIZ, OFF_PAG(newp)) < 0) {
+		if (write_newpag(db, New, newp) < 0) {
 			s_critical("sdbm: \"%s\": cannot zero-back new split page #%ld: %m",
 				sdbm_name(db), newp);
 			ioerr(db, TRUE);
@@ -1901,6 +2274,17 @@ sdbm_firstkey(DBM *db)
 	}
 #endif	/* LRU */
 
+#ifdef WAL
+	if (db->wal != NULL) {
+		fileoffset_t waltail = wal_tail_offset(db);
+
+		/* Pages can also lie in the log, past the end of the .pag file */
+
+		if (waltail > db->pagtail)
+			db->pagtail = waltail - 1;
+	}
+#endif	/* WAL */
+
 	if G_UNLIKELY(db->pagtail < 0) {
 		value = iteration_done(db, FALSE);
 		goto done;
@@ -2100,6 +2484,7 @@ validpage(DBM *db, long pagb)
 	unsigned short *ino = (unsigned short *) pag;
 	int removed = 0;
 	int corrupted = 0;
+	bool latched = FALSE;
 
 	assert_sdbm_locked(db);
 
@@ -2116,6 +2501,13 @@ validpage(DBM *db, long pagb)
 		kpag = getpageb(db, hash, FALSE);
 
 		if G_UNLIKELY(kpag != pagb) {
+			if (!latched) {
+				latch_page_wlock(db, pagb);
+				latched = TRUE;
+			}
+			if (!modifiable_pagbuf(db))
+				break;
+			pag = db->pagbuf;		/* Page may have been copied */
 			if (delipair(db, pag, i, TRUE)) {
 				removed++;
 			} else {
@@ -2126,6 +2518,13 @@ validpage(DBM *db, long pagb)
 			}
 		} else if G_UNLIKELY(!chkipair(db, pag, i)) {
 			/* Don't delete big data here, bitmap will be fixed later */
+			if (!latched) {
+				latch_page_wlock(db, pagb);
+				latched = TRUE;
+			}
+			if (!modifiable_pagbuf(db))
+				break;
+			pag = db->pagbuf;		/* Page may have been copied */
 			if (delipair(db, pag, i, FALSE)) {
 				corrupted++;
 			} else {
@@ -2156,6 +2555,9 @@ validpage(DBM *db, long pagb)
 		(void) flush_pagbuf(db);
 #endif
 	}
+
+	if (latched)
+		latch_page_wunlock(db, pagb);
 }
 
 static bool
@@ -2168,17 +2570,33 @@ fetch_dirbuf(DBM *db, long dirb)
 	if (dirb != db->dirbno) {
 		ssize_t got;
 
+		/*
+		 * Concurrent readers use db->dirbuf when it holds the block they
+		 * need, so the buffer must be latched whilst we swap it.
+		 */
+
+		latch_dir_lock(db);
+
 #ifdef LRU
-		if (db->dirbuf_dirty && !flush_dirbuf(db))
+		if (db->dirbuf_dirty && !flush_dirbuf(db)) {
+			latch_dir_unlock(db);
 			return FALSE;
+		}
 #endif
 
 		db->dirread++;
+
+#ifdef WAL
+		got = NULL == db->wal ? 0 : wal_read(db, WAL_DIR, db->dirbuf, dirb);
+		if (0 == got)
+#endif
 		got = compat_pread(db->dirf, db->dirbuf, DBM_DBLKSIZ, OFF_DIR(dirb));
 		if G_UNLIKELY(got < 0) {
 			s_critical("sdbm: \"%s\": could not read dir page #%ld: %m",
 				sdbm_name(db), dirb);
 			ioerr(db, FALSE);
+			db->dirbno = -1;		/* Buffer may have been partially read */
+			latch_dir_unlock(db);
 			return FALSE;
 		}
 
@@ -2186,6 +2604,7 @@ fetch_dirbuf(DBM *db, long dirb)
 			memset(db->dirbuf, 0, DBM_DBLKSIZ);
 		}
 		db->dirbno = dirb;
+		latch_dir_unlock(db);
 
 		debug(("dir read: %ld\n", dirb));
 	} else {
@@ -2304,6 +2723,7 @@ int
 sdbm_deletekey(DBM *db)
 {
 	int status = -1;
+	long latched = -1;
 
 	if G_UNLIKELY(db == NULL) {
 		errno = EINVAL;
@@ -2360,6 +2780,12 @@ sdbm_deletekey(DBM *db)
 	 * Delete key number ``db->keyptr'' on the current page.
 	 */
 
+	latched = db->pagbno;
+	latch_page_wlock(db, latched);
+
+	if G_UNLIKELY(!modifiable_pagbuf(db))
+		goto done;
+
 	if G_UNLIKELY(!delnpair(db, db->pagbuf, db->keyptr))
 		goto done;
 
@@ -2378,6 +2804,9 @@ sdbm_deletekey(DBM *db)
 	/* FALL THROUGH */
 
 done:
+	if (latched >= 0)
+		latch_page_wunlock(db, latched);
+
 	return status;
 
 no_entry:
@@ -2590,6 +3019,16 @@ sdbm_sync(DBM *db)
 		npag++;
 #endif
 
+#ifdef WAL
+	/*
+	 * Group commit: all the blocks logged since the last sync become
+	 * durable at once.
+	 */
+
+	if (db->wal != NULL && !wal_commit(db))
+		npag = (ssize_t) -1;
+#endif
+
 done:
 	sdbm_return(db, npag);
 }
@@ -2657,6 +3096,14 @@ sdbm_count(const DBM *db)
 	}
 #endif
 
+#ifdef WAL
+	/* We are going to read the .pag file directly */
+	if (db->wal != NULL && !sdbm_checkpoint(deconstify_pointer(db))) {
+		count = (ssize_t) -1;
+		goto done;
+	}
+#endif
+
 	if (-1 == seek_to_filepos(db->pagf, 0)) {
 		count = (ssize_t) -1;
 		goto done;
@@ -2715,6 +3162,7 @@ sdbm_shrink(DBM *db)
 	filestat_t buf;
 	filesize_t offset;
 	bool status;
+	bool exclusive = FALSE;
 
 	sdbm_check(db);
 
@@ -2725,6 +3173,12 @@ sdbm_shrink(DBM *db)
 		goto error;
 	}
 
+#ifdef WAL
+	/* Make sure the files hold the latest version of all the blocks */
+	if (db->wal != NULL && !sdbm_checkpoint(db))
+		goto error;
+#endif
+
 	if G_UNLIKELY(-1 == fstat(db->pagf, &buf))
 		goto error;
 
@@ -2770,7 +3224,7 @@ sdbm_shrink(DBM *db)
 
 		r = compat_pread(db->pagf, VARLEN(count), offset);
 		if G_UNLIKELY(-1 == r || r != sizeof count)
-			return FALSE;
+			goto error;
 
 	computed:
 		if (count != 0)
@@ -2779,9 +3233,20 @@ sdbm_shrink(DBM *db)
 		bno++;
 	}
 
+	/*
+	 * Truncating the files changes the structure of the database, keep
+	 * concurrent readers away.
+	 */
+
+	latch_exclusive(db);
+	exclusive = TRUE;
+
 	offset = OFF_PAG(truncate_bno);
 
 	if (offset < paglen) {
+#ifdef LRU
+		lru_unmap(db);		/* Mapped pages past new tail would fault */
+#endif
 		if (-1 == ftruncate(db->pagf, offset))
 			goto error;
 #ifdef LRU
@@ -2886,6 +3351,9 @@ no_idx_change:
 	status = TRUE;
 
 done:
+	if (exclusive)
+		latch_unexclusive(db);
+
 	sdbm_return(db, status);
 
 error:
@@ -2914,6 +3382,9 @@ sdbm_rename_files(DBM *db,
 {
 	int openflags, error = 0, status;
 	bool dat_opened, dat_reopened;
+#ifdef WAL
+	bool logged;
+#endif
 
 	if G_UNLIKELY(db == NULL) {
 		errno = EINVAL;
@@ -2941,6 +3412,22 @@ sdbm_rename_files(DBM *db,
 
 	openflags = db->openflags & ~(O_TRUNC | O_EXCL | O_CREAT);
 
+#ifdef WAL
+	/*
+	 * The log is named after the .pag file: write back all the logged
+	 * blocks and close it, it will be re-created after the renaming.
+	 */
+
+	logged = db->wal != NULL;
+	if (logged) {
+		if (!sdbm_checkpoint(db))
+			goto error;
+		wal_close(db, FALSE);
+	}
+#endif
+
+	latch_exclusive(db);		/* File descriptors are going to change */
+
 	/*
 	 * We're not going to flush the LRU cache or the buffers but simply
 	 * close the files, rename them and reopen them immediately afterwards.
@@ -2949,6 +3436,9 @@ sdbm_rename_files(DBM *db,
 	 * we undo the renaming and try to reopen the original files.
 	 */
 
+#ifdef LRU
+	lru_unmap(db);		/* Mapping is attached to the old .pag file */
+#endif
 	fd_forget_and_close(&db->dirf);
 	fd_forget_and_close(&db->pagf);
 
@@ -3040,11 +3530,19 @@ emergency_restore:
 	if (!dat_reopened) {
 		error = errno;
 		db->flags |= DBM_BROKEN;
+		goto done;
 	}
 
+#ifdef WAL
+	if (logged && -1 == wal_open(db))
+		error = errno;
+#endif
+
 	/* FALL THROUGH */
 
 done:
+	latch_unexclusive(db);
+
 	if (error != 0) {
 		errno = error;
 		s_carp("sdbm: \"%s\": renaming operation %s: %m",
@@ -3153,6 +3651,7 @@ int
 sdbm_clear(DBM *db)
 {
 	int result;
+	bool exclusive = FALSE;
 
 	if G_UNLIKELY(db == NULL) {
 		errno = EINVAL;
@@ -3172,7 +3671,16 @@ sdbm_clear(DBM *db)
 	}
 	if G_UNLIKELY(db->rdb != NULL)
 		sdbm_clear(db->rdb);		/* Also clear rebuilt DB */
+	latch_exclusive(db);			/* Concurrent readers must be gone */
+	exclusive = TRUE;
 	db->delta = 0;
+#ifdef WAL
+	if (db->wal != NULL)
+		wal_discard(db);	/* Before truncating, lest it be replayed */
+#endif
+#ifdef LRU
+	lru_unmap(db);
+#endif
 	if G_UNLIKELY(-1 == ftruncate(db->pagf, 0))
 		goto error;
 	db->pagbno = -1;
@@ -3196,6 +3704,8 @@ sdbm_clear(DBM *db)
 	result = 0;
 
 done:
+	if (exclusive)
+		latch_unexclusive(db);
 	sdbm_return(db, result);
 
 error:
@@ -3237,9 +3747,11 @@ sdbm_set_cache(DBM *db, long pages)
 	sdbm_synchronize(db);
 
 #ifdef LRU
+	latch_exclusive(db);
 	if G_UNLIKELY(NULL == db->cache)
 		lru_init(db);
 	result = setcache(db, pages);
+	latch_unexclusive(db);
 #else
 	(void) pages;
 	errno = ENOTSUP;
@@ -3293,6 +3805,134 @@ sdbm_set_wdelay(DBM *db, bool on)
 	sdbm_return(db, result);
 }
 
+/**
+ * @return whether clean pages are read from a mapping of the .pag file.
+ */
+bool
+sdbm_get_mmap(const DBM *db)
+{
+	bool mapped;
+
+	sdbm_check(db);
+
+	sdbm_synchronize(db);
+
+#ifdef LRU
+	mapped = getmmap(db);
+#else
+	mapped = FALSE;
+#endif
+
+	sdbm_return(db, mapped);
+}
+
+/**
+ * Turn memory-mapped reads on or off.
+ *
+ * When on, clean pages which are not held in the LRU cache are accessed
+ * directly through a read-only shared mapping of the .pag file, sparing
+ * a read() and a copy.  The LRU cache then only keeps the pages which
+ * have been modified or wired.  This is best for databases which are
+ * mostly read and fit in the kernel page cache.
+ *
+ * Mapped reads are not used whilst the write-ahead log is enabled.
+ *
+ * @return 0 if OK, -1 on error with errno set.
+ */
+int
+sdbm_set_mmap(DBM *db, bool on)
+{
+	int result;
+
+	sdbm_check(db);
+
+	sdbm_synchronize(db);
+
+#ifdef LRU
+	result = setmmap(db, on);
+#else
+	(void) on;
+	errno = ENOTSUP;
+	result = -1;
+#endif
+
+	sdbm_return(db, result);
+}
+
+/**
+ * @return whether the write-ahead log is enabled.
+ */
+bool
+sdbm_get_wal(const DBM *db)
+{
+	bool logged;
+
+	sdbm_check(db);
+
+	sdbm_synchronize(db);
+
+#ifdef WAL
+	logged = db->wal != NULL;
+#else
+	logged = FALSE;
+#endif
+
+	sdbm_return(db, logged);
+}
+
+/**
+ * Turn the write-ahead log on or off.
+ *
+ * With the write-ahead log, modified pages are appended to a log file
+ * instead of being written back in place, and become durable at the next
+ * sdbm_sync() which commits them all at once.  When turning the log off,
+ * all the logged pages are first written back to the database files.
+ *
+ * Deferred writes should be enabled as well, otherwise each modified page
+ * is logged immediately.
+ *
+ * @return 0 if OK, -1 on error with errno set.
+ */
+int
+sdbm_set_wal(DBM *db, bool on)
+{
+	int result = 0;
+
+	sdbm_check(db);
+
+	sdbm_synchronize(db);
+
+	if G_UNLIKELY(db->flags & DBM_BROKEN) {
+		errno = ESTALE;
+		result = -1;
+		goto done;
+	}
+
+#ifdef WAL
+	/* Concurrent readers only run when the database is not logged */
+	latch_exclusive(db);
+	if (on) {
+		lru_unmap(db);		/* Latest page versions will be in the log */
+		result = wal_open(db);
+	} else if (db->wal != NULL) {
+		/* Blocks still dirty in memory must go to the log first */
+		if (!sdbm_checkpoint(db)) {
+			result = -1;
+		} else {
+			wal_close(db, FALSE);
+		}
+	}
+	latch_unexclusive(db);
+#else
+	(void) on;
+	errno = ENOTSUP;
+	result = -1;
+#endif
+
+done:
+	sdbm_return(db, result);
+}
+
 /**
  * @return whether database was flagged as "volatile".
  */
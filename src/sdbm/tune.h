@@ -15,6 +15,7 @@
 #define LRU_PAGES	64	/* default amount of pages in LRU cache */
 #define BIGDATA			/* can store large keys/values */
 #define THREADS			/* thread-safe */
+#define WAL				/* optional write-ahead log, requires LRU */
 
 /*
  * misc
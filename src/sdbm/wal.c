@@ -0,0 +1,858 @@
+/*
+ * sdbm - ndbm work-alike hashed database library
+ *
+ * Write-ahead log.
+ * status: public domain.
+ *
+ * When the write-ahead log is enabled on a database, modified .pag and .dir
+ * blocks are no longer written back in place: they are appended to a log
+ * file instead, which turns the random writes into sequential ones.  An
+ * in-core index remembers where the latest version of each logged block
+ * lies in the log, so that reads are satisfied from there.
+ *
+ * Each sdbm_sync() appends a commit marker and synchronizes the log to
+ * disk, so that all the changes made since the previous sync become durable
+ * with a single fdatasync() call: this is the group commit.  The .dat file
+ * is not logged but is synchronized before the commit marker is written,
+ * so that committed pages never refer to big keys or values which did not
+ * make it to the disk.  Conversely, .dat blocks freed since the last commit
+ * are only released once the commit marker is on disk, since the committed
+ * pages may still refer to them.
+ *
+ * Commits only happen at sdbm_sync() time, when all the blocks modified by
+ * the operations made so far have been logged, or at explicit checkpoints
+ * requested by the database layer after it has logged its dirty blocks.
+ * The log therefore grows until then, however large it gets.
+ *
+ * When the log is large enough at commit time, or when the database is
+ * closed, it is checkpointed: the latest version of each logged block is
+ * written back to the .pag and .dir files, in block order, these files are
+ * synchronized and the log is truncated.
+ *
+ * Should the process crash, the next opening of the database replays all
+ * the committed records from the log, restoring the database to the state
+ * it had at the last sdbm_sync().  Records past the last commit marker, or
+ * torn by the crash, are discarded.  The .dat blocks allocated since that
+ * commit are still flagged as used in the .dat bitmap: the database layer
+ * then rebuilds the bitmap from the live pages, lest these blocks leak.
+ *
+ * @ingroup sdbm
+ * @file
+ */
+
+#include "common.h"
+
+#include "sdbm.h"
+#include "tune.h"
+#include "big.h"
+#include "private.h"
+#include "wal.h"
+
+#include "lib/compat_pio.h"
+#include "lib/crc.h"
+#include "lib/debug.h"
+#include "lib/endian.h"
+#include "lib/fd.h"
+#include "lib/file.h"
+#include "lib/halloc.h"
+#include "lib/hevset.h"
+#include "lib/iovec.h"
+#include "lib/log.h"
+#include "lib/qlock.h"
+#include "lib/str.h"
+#include "lib/stringify.h"		/* For plural() */
+#include "lib/walloc.h"
+#include "lib/xsort.h"
+
+#include "lib/override.h"		/* Must be the last header included */
+
+#define WAL_FEXT		".wal"
+#define WAL_REC_MAGIC	0x57414c31U		/* "WAL1" */
+#define WAL_HEAD		16				/* Size of record header */
+#define WAL_CRC_OFFSET	12				/* CRC is the last header field */
+
+/*
+ * The log is checkpointed at sync time as soon as it grows past
+ * WAL_CHECKPOINT bytes.
+ */
+#define WAL_CHECKPOINT	(4 * 1024 * 1024)
+
+enum sdbm_wal_magic { SDBM_WAL_MAGIC = 0x3b0e5a91 };
+
+/**
+ * Location of the latest version of a logged block.
+ */
+struct wal_entry {
+	long bno;				/* Block number (key) */
+	fileoffset_t offset;	/* Offset of the block data within the log */
+};
+
+/**
+ * The write-ahead log.
+ */
+struct DBMWAL {
+	enum sdbm_wal_magic magic;	/* Magic number */
+	int fd;						/* Log file descriptor */
+	char *path;					/* Log file name */
+	hevset_t *pag;				/* Logged .pag blocks (struct wal_entry) */
+	hevset_t *dir;				/* Logged .dir blocks (struct wal_entry) */
+	fileoffset_t end;			/* Log end, where next record goes */
+	fileoffset_t committed;		/* Log end at the last commit */
+	long maxpag;				/* Highest logged .pag block, -1 if none */
+	ulong records;				/* Stats: amount of records written */
+	ulong reads;				/* Stats: amount of reads from the log */
+	ulong commits;				/* Stats: amount of group commits */
+	ulong checkpoints;			/* Stats: amount of checkpoints */
+};
+
+static inline void
+sdbm_wal_check(const struct DBMWAL * const w)
+{
+	g_assert(w != NULL);
+	g_assert(SDBM_WAL_MAGIC == w->magic);
+}
+
+/**
+ * @return size of the data following the header for a given record kind.
+ */
+static size_t
+wal_payload(enum wal_kind kind)
+{
+	switch (kind) {
+	case WAL_PAG:		return DBM_PBLKSIZ;
+	case WAL_DIR:		return DBM_DBLKSIZ;
+	case WAL_COMMIT:	return 0;
+	}
+
+	g_assert_not_reached();
+}
+
+/**
+ * Derive the log filename from the .pag filename.
+ *
+ * If that file bears the ".pag" extension, it is simply replaced by ".wal".
+ * Otherwise, we append the ".wal" suffix to it.
+ *
+ * @return a new string to be freed via hfree().
+ */
+static char *
+wal_filename(const char *pagname)
+{
+	str_t *s = str_new_from(pagname);
+	size_t i;
+
+	if (STR_HAS_SUFFIX(s, DBM_PAGFEXT, &i)) {
+		str_replace(s, i, STR_CONST_LEN(DBM_PAGFEXT), WAL_FEXT);
+	} else {
+		str_cat_len(s, WAL_FEXT, CONST_STRLEN(WAL_FEXT));
+	}
+
+	return str_s2c_null(&s);
+}
+
+/**
+ * Fill the header of a record.
+ *
+ * The CRC covers the header fields preceding it, then the payload.
+ */
+static void
+wal_head_fill(char *head, enum wal_kind kind, long bno, const char *data)
+{
+	uint32 crc;
+
+	g_assert(bno >= 0 && UNSIGNED(bno) <= MAX_INT_VAL(uint32));
+
+	poke_le32(&head[0], WAL_REC_MAGIC);
+	poke_le32(&head[4], kind);
+	poke_le32(&head[8], bno);
+
+	crc = crc32_update(0, head, WAL_CRC_OFFSET);
+	crc = crc32_update(crc, data, wal_payload(kind));
+
+	poke_le32(&head[WAL_CRC_OFFSET], crc);
+}
+
+/**
+ * Parse and validate record header.
+ *
+ * @return the record kind, 0 if header is invalid.
+ */
+static enum wal_kind
+wal_head_parse(const char *head, long *bno)
+{
+	uint32 kind;
+
+	if (peek_le32(&head[0]) != WAL_REC_MAGIC)
+		return 0;
+
+	kind = peek_le32(&head[4]);
+
+	switch (kind) {
+	case WAL_PAG:
+	case WAL_DIR:
+	case WAL_COMMIT:
+		*bno = peek_le32(&head[8]);
+		return kind;
+	}
+
+	return 0;
+}
+
+/**
+ * Check record CRC.
+ */
+static bool
+wal_crc_ok(const char *head, const char *data, size_t len)
+{
+	uint32 crc;
+
+	crc = crc32_update(0, head, WAL_CRC_OFFSET);
+	crc = crc32_update(crc, data, len);
+
+	return crc == peek_le32(&head[WAL_CRC_OFFSET]);
+}
+
+static void
+wal_entry_free(void *data, void *unused)
+{
+	struct wal_entry *e = data;
+
+	(void) unused;
+	WFREE(e);
+}
+
+/**
+ * Discard the in-core index of logged blocks.
+ */
+static void
+wal_index_clear(struct DBMWAL *wal)
+{
+	hevset_foreach(wal->pag, wal_entry_free, NULL);
+	hevset_clear(wal->pag);
+	hevset_foreach(wal->dir, wal_entry_free, NULL);
+	hevset_clear(wal->dir);
+	wal->maxpag = -1;
+}
+
+/**
+ * Truncate the log, discarding all its records.
+ *
+ * @return TRUE if OK.
+ */
+static bool
+wal_truncate(DBM *db)
+{
+	struct DBMWAL *wal = db->wal;
+
+	wal_index_clear(wal);
+	wal->end = wal->committed = 0;
+
+	if (-1 == ftruncate(wal->fd, 0)) {
+		s_warning("sdbm: \"%s\": cannot truncate log %s: %m",
+			sdbm_name(db), wal->path);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/**
+ * Enable the write-ahead log on the database.
+ *
+ * @return 0 if OK, -1 on error with errno set.
+ */
+int
+wal_open(DBM *db)
+{
+	struct DBMWAL *wal;
+	char *path;
+	int fd;
+	struct wal_entry dummy;
+
+	sdbm_check(db);
+	assert_sdbm_locked(db);
+
+	if (db->wal != NULL)
+		return 0;
+
+	if G_UNLIKELY(db->flags & DBM_RDONLY) {
+		errno = EPERM;
+		return -1;
+	}
+
+	/*
+	 * Any log we find here was left over by a previous session and has
+	 * already been replayed by sdbm_prep(), so we can truncate it.
+	 */
+
+	path = wal_filename(db->pagname);
+	fd = file_open(path, O_CREAT | O_TRUNC | O_RDWR, db->openmode);
+
+	if (-1 == fd) {
+		HFREE_NULL(path);
+		return -1;
+	}
+
+	crc_init();
+
+	WALLOC0(wal);
+	wal->magic = SDBM_WAL_MAGIC;
+	wal->fd = fd;
+	wal->path = path;
+	wal->maxpag = -1;
+	wal->pag = hevset_create(offsetof(struct wal_entry, bno),
+		HASH_KEY_FIXED, sizeof(dummy.bno));
+	wal->dir = hevset_create(offsetof(struct wal_entry, bno),
+		HASH_KEY_FIXED, sizeof(dummy.bno));
+
+	db->wal = wal;
+
+	return 0;
+}
+
+/**
+ * Log statistics about the write-ahead log.
+ */
+static void
+log_walstats(DBM *db)
+{
+	struct DBMWAL *wal = db->wal;
+
+	s_info("sdbm: \"%s\" WAL records = %lu, reads = %lu",
+		sdbm_name(db), wal->records, wal->reads);
+	s_info("sdbm: \"%s\" WAL commits = %lu, checkpoints = %lu",
+		sdbm_name(db), wal->commits, wal->checkpoints);
+}
+
+/**
+ * Disable the write-ahead log on the database.
+ *
+ * @param db			the database
+ * @param checkpoint	whether logged blocks must be written back first
+ */
+void
+wal_close(DBM *db, bool checkpoint)
+{
+	struct DBMWAL *wal = db->wal;
+	bool unlink_log = TRUE;
+
+	if (NULL == wal)
+		return;
+
+	sdbm_wal_check(wal);
+
+	/*
+	 * If we cannot checkpoint the log, keep it around: it will be replayed
+	 * when the database is opened again.
+	 */
+
+	if (checkpoint && wal->end != 0)
+		unlink_log = wal_checkpoint(db);
+
+#ifdef BIGDATA
+	/*
+	 * Blocks freed since the last commit can no longer be released: the
+	 * database files are going away or the log could not be committed.
+	 */
+
+	big_discard(db);
+#endif
+
+	if (common_stats)
+		log_walstats(db);
+
+	fd_forget_and_close(&wal->fd);
+
+	if (unlink_log && -1 == unlink(wal->path)) {
+		s_warning("sdbm: \"%s\": cannot unlink log %s: %m",
+			sdbm_name(db), wal->path);
+	}
+
+	wal_index_clear(wal);
+	hevset_free_null(&wal->pag);
+	hevset_free_null(&wal->dir);
+	HFREE_NULL(wal->path);
+	wal->magic = 0;
+	WFREE(wal);
+	db->wal = NULL;
+}
+
+/**
+ * Append a block to the log, superseding any older version of that block
+ * within the log or the database files.
+ *
+ * @param db	the database
+ * @param kind	whether we log a .pag or .dir block
+ * @param buf	the block data
+ * @param bno	the block number
+ *
+ * @return the amount of bytes from the block written (its size) on success,
+ * -1 on error with errno set.
+ */
+ssize_t
+wal_write(DBM *db, enum wal_kind kind, const char *buf, long bno)
+{
+	struct DBMWAL *wal = db->wal;
+	char head[WAL_HEAD];
+	iovec_t iov[2];
+	size_t len = wal_payload(kind);
+	ssize_t w;
+	hevset_t *hs;
+	struct wal_entry *e;
+
+	sdbm_wal_check(wal);
+	assert_sdbm_locked(db);
+	g_assert(WAL_PAG == kind || WAL_DIR == kind);
+
+	wal_head_fill(head, kind, bno, buf);
+	iov[0] = iov_get(head, WAL_HEAD);
+	iov[1] = iov_get(deconstify_char(buf), len);
+
+	w = compat_pwritev(wal->fd, iov, N_ITEMS(iov), wal->end);
+
+	if G_UNLIKELY(w != (ssize_t) (WAL_HEAD + len)) {
+		if (w >= 0) {
+			s_critical("sdbm: \"%s\": partial log write (%zd bytes) "
+				"of %s block #%ld", sdbm_name(db), w,
+				WAL_PAG == kind ? "pag" : "dir", bno);
+			errno = EIO;
+		}
+		return -1;		/* Record not accounted for, will be overwritten */
+	}
+
+	hs = WAL_PAG == kind ? wal->pag : wal->dir;
+	e = hevset_lookup(hs, &bno);
+
+	if (NULL == e) {
+		WALLOC(e);
+		e->bno = bno;
+		hevset_insert(hs, e);
+	}
+
+	e->offset = wal->end + WAL_HEAD;
+	wal->end += w;
+	wal->records++;
+
+	if (WAL_PAG == kind)
+		wal->maxpag = MAX(wal->maxpag, bno);
+
+	/*
+	 * We may be in the middle of an operation, e.g. splitting a page: the
+	 * log cannot be committed here, it will be at the next sdbm_sync().
+	 */
+
+	return len;
+}
+
+/**
+ * Read latest version of a block from the log, if present.
+ *
+ * @param db	the database
+ * @param kind	whether we want a .pag or .dir block
+ * @param buf	where block data is read
+ * @param bno	the block number
+ *
+ * @return the size of the block when found in the log, 0 if the block was
+ * not logged, -1 on error with errno set.
+ */
+ssize_t
+wal_read(DBM *db, enum wal_kind kind, char *buf, long bno)
+{
+	struct DBMWAL *wal = db->wal;
+	const struct wal_entry *e;
+	size_t len = wal_payload(kind);
+	ssize_t r;
+
+	sdbm_wal_check(wal);
+	assert_sdbm_locked(db);
+
+	e = hevset_lookup(WAL_PAG == kind ? wal->pag : wal->dir, &bno);
+
+	if (NULL == e)
+		return 0;
+
+	r = compat_pread(wal->fd, buf, len, e->offset);
+
+	if G_UNLIKELY(r != (ssize_t) len) {
+		if (r >= 0) {
+			s_critical("sdbm: \"%s\": partial log read (%zd bytes) "
+				"of %s block #%ld", sdbm_name(db), r,
+				WAL_PAG == kind ? "pag" : "dir", bno);
+			errno = EIO;
+		}
+		return -1;
+	}
+
+	wal->reads++;
+	return len;
+}
+
+/**
+ * Make all the records written so far durable.
+ *
+ * @return TRUE if OK.
+ */
+static bool
+wal_flush(DBM *db)
+{
+	struct DBMWAL *wal = db->wal;
+	char head[WAL_HEAD];
+	ssize_t w;
+
+	if (wal->end == wal->committed)
+		return TRUE;
+
+#ifdef BIGDATA
+	/*
+	 * The .dat file is written in place: it must reach the disk before the
+	 * pages referring to its blocks are committed.
+	 */
+
+	if (db->big != NULL && is_valid_fd(big_datfno(db)))
+		fd_fdatasync(big_datfno(db));
+#endif
+
+	wal_head_fill(head, WAL_COMMIT, 0, NULL);
+	w = compat_pwrite(wal->fd, head, WAL_HEAD, wal->end);
+
+	if G_UNLIKELY(w != WAL_HEAD) {
+		if (w >= 0)
+			errno = EIO;
+		s_warning("sdbm: \"%s\": cannot write commit record to %s: %m",
+			sdbm_name(db), wal->path);
+		return FALSE;
+	}
+
+	if G_UNLIKELY(-1 == fd_fdatasync(wal->fd)) {
+		s_warning("sdbm: \"%s\": cannot sync log %s: %m",
+			sdbm_name(db), wal->path);
+		return FALSE;
+	}
+
+	wal->end += WAL_HEAD;
+	wal->committed = wal->end;
+	wal->commits++;
+
+#ifdef BIGDATA
+	/*
+	 * The .dat blocks freed since the last commit are no longer referred
+	 * to by the committed pages: they can now be reused.
+	 */
+
+	big_commit(db);
+#endif
+
+	return TRUE;
+}
+
+/**
+ * Group commit: make all the changes logged since the last commit durable
+ * and checkpoint the log when it has grown large enough.
+ *
+ * @return TRUE if OK, FALSE on error with errno set.
+ */
+bool
+wal_commit(DBM *db)
+{
+	struct DBMWAL *wal = db->wal;
+
+	sdbm_wal_check(wal);
+	assert_sdbm_locked(db);
+
+	if (!wal_flush(db))
+		return FALSE;
+
+	if (wal->end >= WAL_CHECKPOINT)
+		return wal_checkpoint(db);
+
+	return TRUE;
+}
+
+static void
+wal_entry_collect(void *data, void *udata)
+{
+	struct wal_entry ***ep = udata;
+
+	*(*ep)++ = data;
+}
+
+static int
+wal_entry_cmp(const void *a, const void *b)
+{
+	const struct wal_entry * const *ea = a, * const *eb = b;
+
+	return CMP((*ea)->bno, (*eb)->bno);
+}
+
+/**
+ * Copy the latest version of all the logged blocks of a given kind back
+ * to their file, in ascending block order.
+ *
+ * @return TRUE if OK.
+ */
+static bool
+wal_writeback(DBM *db, enum wal_kind kind, int fd, char *buf)
+{
+	struct DBMWAL *wal = db->wal;
+	hevset_t *hs = WAL_PAG == kind ? wal->pag : wal->dir;
+	size_t i, n = hevset_count(hs);
+	size_t len = wal_payload(kind);
+	struct wal_entry **entries, **ep;
+	bool ok = TRUE;
+
+	if (0 == n)
+		return TRUE;
+
+	HALLOC_ARRAY(entries, n);
+	ep = entries;
+	hevset_foreach(hs, wal_entry_collect, &ep);
+	xsort(entries, n, sizeof entries[0], wal_entry_cmp);
+
+	for (i = 0; i < n; i++) {
+		const struct wal_entry *e = entries[i];
+		fileoffset_t offset = WAL_PAG == kind ? OFF_PAG(e->bno) : OFF_DIR(e->bno);
+
+		if (
+			compat_pread(wal->fd, buf, len, e->offset) != (ssize_t) len ||
+			compat_pwrite(fd, buf, len, offset) != (ssize_t) len
+		) {
+			s_warning("sdbm: \"%s\": cannot checkpoint %s block #%ld: %m",
+				sdbm_name(db), WAL_PAG == kind ? "pag" : "dir", e->bno);
+			ok = FALSE;
+			break;
+		}
+	}
+
+	HFREE_NULL(entries);
+	return ok;
+}
+
+/**
+ * Checkpoint the log: write all the logged blocks back to the database
+ * files, synchronize them and truncate the log.
+ *
+ * @return TRUE if OK, FALSE on error with errno set, the log being kept.
+ */
+bool
+wal_checkpoint(DBM *db)
+{
+	struct DBMWAL *wal = db->wal;
+	char *buf;
+	bool ok;
+
+	sdbm_wal_check(wal);
+	assert_sdbm_locked(db);
+
+	if (0 == wal->end)
+		return TRUE;
+
+	/*
+	 * Commit first, so that a crash during the checkpoint replays all the
+	 * blocks we may have partially written back.
+	 */
+
+	if (!wal_flush(db))
+		return FALSE;
+
+	STATIC_ASSERT(DBM_DBLKSIZ >= DBM_PBLKSIZ);
+
+	buf = walloc(DBM_DBLKSIZ);
+	ok = wal_writeback(db, WAL_PAG, db->pagf, buf) &&
+		wal_writeback(db, WAL_DIR, db->dirf, buf);
+	wfree(buf, DBM_DBLKSIZ);
+
+	if (!ok) {
+		ioerr(db, TRUE);
+		return FALSE;
+	}
+
+	if (-1 == fd_fdatasync(db->pagf) || -1 == fd_fdatasync(db->dirf)) {
+		s_warning("sdbm: \"%s\": cannot sync database files: %m",
+			sdbm_name(db));
+		return FALSE;
+	}
+
+	wal->checkpoints++;
+
+	return wal_truncate(db);
+}
+
+/**
+ * Discard the whole log, when the database is cleared.
+ */
+void
+wal_discard(DBM *db)
+{
+	struct DBMWAL *wal = db->wal;
+
+	sdbm_wal_check(wal);
+	assert_sdbm_locked(db);
+
+#ifdef BIGDATA
+	big_discard(db);	/* The .dat file is cleared as well */
+#endif
+
+	(void) wal_truncate(db);
+}
+
+/**
+ * @return offset of the end of the .pag file, accounting for the blocks
+ * held in the log, 0 if no .pag block is logged.
+ */
+fileoffset_t
+wal_tail_offset(const DBM *db)
+{
+	const struct DBMWAL *wal = db->wal;
+
+	sdbm_wal_check(wal);
+
+	return OFF_PAG(wal->maxpag + 1);
+}
+
+/**
+ * Replay a log left over after a crash, when opening the database.
+ *
+ * Only the records preceding the last commit marker are replayed.  When
+ * the database is opened read-only, the log cannot be replayed and the
+ * opening fails with EACCES.
+ *
+ * The .dat file is not logged: blocks allocated after the last commit
+ * remain flagged as used although no replayed page refers to them.  The
+ * caller is told whether a log was found, so that it can rebuild the .dat
+ * bitmap from the live pages.
+ *
+ * @param pagname	the name of the .pag file, from which the log name derives
+ * @param pagf		the opened .pag file
+ * @param dirf		the opened .dir file
+ * @param flags		the open() flags used for the database
+ * @param found		set to TRUE if a log was left over by a crash
+ *
+ * @return TRUE if OK, FALSE on error with errno set, the log being kept.
+ */
+bool
+wal_recover(const char *pagname, int pagf, int dirf, int flags, bool *found)
+{
+	char *path;
+	int fd;
+	char head[WAL_HEAD];
+	char *buf = NULL;
+	fileoffset_t offset, committed = 0;
+	ulong replayed = 0;
+	bool ok = TRUE;
+	int pass;
+
+	*found = FALSE;
+	path = wal_filename(pagname);
+
+	/*
+	 * Truncating the database supersedes anything the log could hold.
+	 */
+
+	if ((flags & (O_RDWR | O_WRONLY)) && (flags & O_TRUNC)) {
+		if (-1 == unlink(path) && ENOENT != errno)
+			s_warning("%s(): cannot delete \"%s\": %m", G_STRFUNC, path);
+		goto done;
+	}
+
+	fd = file_open_silent(path, O_RDONLY, 0);
+
+	if (-1 == fd) {
+		if (ENOENT != errno) {
+			s_warning("%s(): cannot open \"%s\": %m", G_STRFUNC, path);
+			ok = FALSE;
+		}
+		goto done;
+	}
+
+	*found = TRUE;
+
+	/*
+	 * The database files may refer to stale blocks, the latest committed
+	 * version of which lies in the log: we cannot serve them.
+	 */
+
+	if (!(flags & (O_RDWR | O_WRONLY))) {
+		s_warning("%s(): read-only access, cannot replay %s", G_STRFUNC, path);
+		fd_forget_and_close(&fd);
+		errno = EACCES;
+		ok = FALSE;
+		goto done;
+	}
+
+	crc_init();
+	buf = walloc(DBM_DBLKSIZ);
+
+	/*
+	 * The first pass locates the last commit marker, the second pass
+	 * replays the records preceding it.
+	 */
+
+	for (pass = 0; pass < 2 && ok; pass++) {
+		offset = 0;
+
+		while (0 == pass || offset < committed) {
+			enum wal_kind kind;
+			size_t len;
+			long bno;
+
+			if (compat_pread(fd, head, WAL_HEAD, offset) != WAL_HEAD)
+				break;
+
+			kind = wal_head_parse(head, &bno);
+			if (0 == kind)
+				break;
+
+			len = wal_payload(kind);
+
+			if (
+				compat_pread(fd, buf, len, offset + WAL_HEAD) != (ssize_t) len
+				|| !wal_crc_ok(head, buf, len)
+			)
+				break;
+
+			offset += WAL_HEAD + len;
+
+			if (0 == pass) {
+				if (WAL_COMMIT == kind)
+					committed = offset;
+			} else if (WAL_COMMIT != kind) {
+				int tfd = WAL_PAG == kind ? pagf : dirf;
+				fileoffset_t toff = WAL_PAG == kind ? OFF_PAG(bno) : OFF_DIR(bno);
+
+				if (compat_pwrite(tfd, buf, len, toff) != (ssize_t) len) {
+					s_warning("%s(): cannot replay %s block #%ld from %s: %m",
+						G_STRFUNC, WAL_PAG == kind ? "pag" : "dir", bno, path);
+					ok = FALSE;
+					break;
+				}
+				replayed++;
+			}
+		}
+	}
+
+	fd_forget_and_close(&fd);
+	WFREE_NULL(buf, DBM_DBLKSIZ);
+
+	if (!ok)
+		goto done;
+
+	if (replayed != 0) {
+		if (-1 == fd_fdatasync(pagf) || -1 == fd_fdatasync(dirf)) {
+			s_warning("%s(): cannot sync database files for %s: %m",
+				G_STRFUNC, pagname);
+			ok = FALSE;
+			goto done;
+		}
+		s_info("sdbm: replayed %lu block%s from %s",
+			replayed, plural(replayed), path);
+	}
+
+	if (-1 == unlink(path))
+		s_warning("%s(): cannot unlink \"%s\": %m", G_STRFUNC, path);
+
+done:
+	HFREE_NULL(path);
+	return ok;
+}
+
+/* vi: set ts=4 sw=4 cindent: */
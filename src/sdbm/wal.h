@@ -0,0 +1,33 @@
+/* Mini EMBED (wal.c) */
+#define wal_open sdbm__wal_open
+#define wal_close sdbm__wal_close
+#define wal_recover sdbm__wal_recover
+#define wal_write sdbm__wal_write
+#define wal_read sdbm__wal_read
+#define wal_commit sdbm__wal_commit
+#define wal_checkpoint sdbm__wal_checkpoint
+#define wal_discard sdbm__wal_discard
+#define wal_tail_offset sdbm__wal_tail_offset
+
+/**
+ * Kind of blocks recorded in the write-ahead log.
+ */
+enum wal_kind {
+	WAL_PAG = 1,		/* .pag block */
+	WAL_DIR = 2,		/* .dir block */
+	WAL_COMMIT = 3		/* commit marker, no payload */
+};
+
+struct DBMWAL;
+
+int wal_open(DBM *);
+void wal_close(DBM *, bool);
+bool wal_recover(const char *, int, int, int, bool *);
+ssize_t wal_write(DBM *, enum wal_kind, const char *, long);
+ssize_t wal_read(DBM *, enum wal_kind, char *, long);
+bool wal_commit(DBM *);
+bool wal_checkpoint(DBM *);
+void wal_discard(DBM *);
+fileoffset_t wal_tail_offset(const DBM *);
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -38,7 +38,10 @@
 #include "lib/ascii.h"
 #include "lib/cq.h"
 #include "lib/file_object.h"
+#include "lib/dump_options.h"
 #include "lib/hset.h"
+#include "lib/inputevt.h"
+#include "lib/log.h"
 #include "lib/misc.h"
 #include "lib/pow2.h"
 #include "lib/pslist.h"
@@ -230,6 +233,41 @@ shell_exec_lib_show_files(struct gnutella_shell *sh,
 	return REPLY_READY;
 }
 
+static enum shell_reply
+shell_exec_lib_show_inputevt(struct gnutella_shell *sh,
+	int argc, const char *argv[])
+{
+	const char *pretty;
+	const option_t options[] = {
+		{ "p", &pretty },			/* pretty-print */
+	};
+	int parsed;
+	unsigned opt = 0;
+	logagent_t *la;
+
+	shell_check(sh);
+	g_assert(argv);
+	g_assert(argc > 0);
+
+	parsed = shell_options_parse(sh, argv, options, N_ITEMS(options));
+	if (parsed < 0)
+		return REPLY_ERROR;
+
+	if (pretty != NULL)
+		opt |= DUMP_OPT_PRETTY;
+
+	la = log_agent_string_make(0, "INPUTEVT ");
+	inputevt_dump_stats_log(la, opt);
+
+	shell_write(sh, "100~\n");
+	shell_write(sh, log_agent_string_get(la));
+	shell_write(sh, ".\n");
+
+	log_agent_free_null(&la);
+
+	return REPLY_READY;
+}
+
 static enum shell_reply
 shell_exec_lib_show(struct gnutella_shell *sh,
 	int argc, const char *argv[])
@@ -248,6 +286,7 @@ shell_exec_lib_show(struct gnutella_shell *sh,
 
 	CMD(callout);
 	CMD(files);
+	CMD(inputevt);
 
 #undef CMD
 
@@ -298,7 +337,8 @@ shell_help_lib(int argc, const char *argv[])
 			if (2 == argc) {
 				return
 					"lib show callout      # display callout queues\n"
-					"lib show files [-uw]  # display open files\n";
+					"lib show files [-uw]  # display open files\n"
+					"lib show inputevt [-p] # display I/O dispatching stats\n";
 			} else {
 				if (0 == ascii_strcasecmp(argv[2], "callout")) {
 					return "lib show callout\n"
@@ -310,11 +350,16 @@ shell_help_lib(int argc, const char *argv[])
 						"-u: show one entry per file path "
 							"(ignoring -w if supplied)\n"
 						"-w: show where files were opened\n";
+				} else
+				if (0 == ascii_strcasecmp(argv[2], "inputevt")) {
+					return "lib show inputevt [-p]\n"
+						"display I/O event dispatching statistics\n"
+						"-p: pretty-print numbers\n";
 				}
 			}
 		}
 	} else {
-		return "lib show callout|files\n";
+		return "lib show callout|files|inputevt\n";
 	}
 	return NULL;
 }
@@ -40,6 +40,7 @@
 #include "lib/ascii.h"
 #include "lib/halloc.h"
 #include "lib/iso3166.h"
+#include "lib/misc.h"			/* For compact_size() */
 #include "lib/options.h"
 #include "lib/pslist.h"
 #include "lib/str.h"
@@ -95,6 +96,40 @@ print_node_info(struct gnutella_shell *sh, const gnutella_node_t *n)
 	shell_write(sh, "\n");	/* Terminate line */
 }
 
+/**
+ * Display compression statistics for a node.
+ */
+static void
+print_node_compression(struct gnutella_shell *sh, const gnutella_node_t *n)
+{
+	char buf[256];
+	char cost[32];
+
+	g_return_if_fail(sh);
+	g_return_if_fail(n);
+
+	if (!NODE_TX_COMPRESSED(n) || 0 == n->tx_given) {
+		str_bprintf(ARYLEN(cost), "-");
+	} else {
+		/* CPU cost per KiB of uncompressed input, in microseconds */
+		str_bprintf(ARYLEN(cost), "%.2f",
+			n->tx_deflate_ns / 1000.0 / (n->tx_given / 1024.0));
+	}
+
+	str_bprintf(ARYLEN(buf),
+		"%-21.45s %8s %8s %5.1f%% %8.3f %8s %5.1f%%",
+		node_gnet_addr(n),
+		compact_size(n->tx_given, FALSE),
+		compact_size2(n->tx_deflated, FALSE),
+		NODE_TX_COMPRESSED(n) ? 100.0 * NODE_TX_COMPRESSION_RATIO(n) : 0.0,
+		n->tx_deflate_ns / 1e9,
+		cost,
+		NODE_RX_COMPRESSED(n) ? 100.0 * NODE_RX_COMPRESSION_RATIO(n) : 0.0);
+
+	shell_write(sh, buf);
+	shell_write(sh, "\n");	/* Terminate line */
+}
+
 /**
  * Displays all connected nodes
  */
@@ -102,13 +137,36 @@ enum shell_reply
 shell_exec_nodes(struct gnutella_shell *sh, int argc, const char *argv[])
 {
 	const pslist_t *sl;
+	const char *opt_c;
+	const option_t options[] = {
+		{ "c", &opt_c },			/* compression statistics */
+	};
+	int parsed;
 
 	shell_check(sh);
 	g_assert(argv);
 	g_assert(argc > 0);
 
+	parsed = shell_options_parse(sh, argv, options, N_ITEMS(options));
+	if (parsed < 0)
+		return REPLY_ERROR;
+
 	shell_set_msg(sh, "");
 
+	if (opt_c != NULL) {
+		shell_write(sh,
+		  "100~ \n"
+		  "Node                      TX   TX-Out  TX-Gain  CPU (s) us/KiB  "
+		  "RX-Gain\n");
+
+		PSLIST_FOREACH(node_all_nodes(), sl) {
+			print_node_compression(sh, sl->data);
+		}
+		shell_write(sh, ".\n");	/* Terminate message body */
+
+		return REPLY_READY;
+	}
+
 	shell_write(sh,
 	  "100~ \n"
 	  "Node                  Flags       CC Since  Uptime User-Agent\n");
@@ -134,7 +192,9 @@ shell_help_nodes(int argc, const char *argv[])
 	g_assert(argv);
 	g_assert(argc > 0);
 
-	return NULL;
+	return "nodes [-c]\n"
+		"display connected Gnutella nodes\n"
+		"-c: show compression ratios and CPU cost instead\n";
 }
 
 /* vi: set ts=4 sw=4 cindent: */
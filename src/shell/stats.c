@@ -35,9 +35,14 @@
 
 #include "cmd.h"
 #include "core/gnet_stats.h"
+#include "core/verify.h"
 
 #include "lib/ascii.h"
+#include "lib/dbmw.h"
+#include "lib/misc.h"			/* For compact_size() */
 #include "lib/options.h"
+#include "lib/pslist.h"
+#include "lib/str.h"
 #include "lib/stringify.h"
 #include "lib/teq.h"
 #include "lib/xmalloc.h"
@@ -191,6 +196,92 @@ shell_exec_stats_drop(struct gnutella_shell *sh,
 	return REPLY_READY;
 }
 
+static enum shell_reply
+shell_exec_stats_hashing(struct gnutella_shell *sh,
+	int argc, const char *argv[])
+{
+	pslist_t *info, *sl;
+	str_t *s;
+
+	shell_check(sh);
+	g_assert(argv);
+	g_assert(argc > 0);
+
+	shell_write(sh, "100~\n");
+	shell_write(sh,
+		"Device             Queue Readers  Pending   Rate/s     ETA   Hashed\n");
+
+	info = verify_device_info_list();
+	s = str_new(80);
+
+	PSLIST_FOREACH(info, sl) {
+		const verify_device_info_t *vdi = sl->data;
+
+		str_printf(s, "%-18s ", uint64_to_string(vdi->dev));
+		str_catf(s, "%5zu ", vdi->queued);
+		str_catf(s, "%7u ", vdi->readers);
+		str_catf(s, "%8s ", compact_size(vdi->pending, FALSE));
+		str_catf(s, "%8s ", compact_size(vdi->rate, FALSE));
+		str_catf(s, "%7s ",
+			0 == vdi->pending ? "-" :
+			0 == vdi->rate ? "?" :
+			compact_time(MIN(vdi->pending / vdi->rate, INT_MAX)));
+		str_catf(s, "%8s", compact_size(vdi->hashed, FALSE));
+		str_putc(s, '\n');
+		shell_write(sh, str_2c(s));
+	}
+
+	str_destroy_null(&s);
+	verify_device_info_list_free_null(&info);
+	shell_write(sh, ".\n");
+
+	return REPLY_READY;
+}
+
+static enum shell_reply
+shell_exec_stats_dbstore(struct gnutella_shell *sh,
+	int argc, const char *argv[])
+{
+	pslist_t *info, *sl;
+	str_t *s;
+
+	shell_check(sh);
+	g_assert(argv);
+	g_assert(argc > 0);
+
+	shell_write(sh, "100~\n");
+	shell_write(sh,
+		"Database                 Items     Used   Target     Reads   Hit% "
+		"Ghost%    Writes   Hit%   Evicted\n");
+
+	info = dbmw_cache_info_list();
+	s = str_new(100);
+
+	PSLIST_FOREACH(info, sl) {
+		const dbmw_cache_info_t *dci = sl->data;
+
+		str_printf(s, "%-22.22s ", dci->name);
+		str_catf(s, "%7zu ", dci->items);
+		str_catf(s, "%8s ", compact_size(dci->bytes, FALSE));
+		str_catf(s, "%8s ", compact_size(dci->target, FALSE));
+		str_catf(s, "%9s ", uint64_to_string(dci->r_access));
+		str_catf(s, "%6.2f ", dci->r_hits * 100.0 / MAX(1, dci->r_access));
+		str_catf(s, "%6.2f ", dci->g_hits * 100.0 /
+			MAX(1, dci->r_access + dci->w_access));
+		str_catf(s, "%9s ", uint64_to_string(dci->w_access));
+		str_catf(s, "%6.2f ", dci->w_hits * 100.0 / MAX(1, dci->w_access));
+		str_catf(s, "%9s", uint64_to_string(dci->evictions));
+		str_putc(s, '\n');
+		shell_write(sh, str_2c(s));
+	}
+
+	str_destroy_null(&s);
+	dbmw_cache_info_list_free_null(&info);
+	shell_write(sh, ".\n");
+
+	return REPLY_READY;
+}
+
 /**
  * Handle the stats command.
  */
@@ -213,6 +304,8 @@ shell_exec_stats(struct gnutella_shell *sh, int argc, const char *argv[])
 
 	CMD(general);
 	CMD(drop);
+	CMD(hashing);
+	CMD(dbstore);
 
 #undef CMD
 
@@ -245,10 +338,28 @@ shell_help_stats(int argc, const char *argv[])
 				"-t : only show TCP messages.\n"
 				"-u : only show UDP messages.\n";
 		}
+		else if (0 == ascii_strcasecmp(argv[1], "hashing")) {
+			return "stats hashing\n"
+				"prints file hashing activity per device: queued files, "
+				"threads reading,\n"
+				"bytes left to hash, hashing rate, estimated time to "
+				"completion and\n"
+				"total bytes hashed.\n";
+		}
+		else if (0 == ascii_strcasecmp(argv[1], "dbstore")) {
+			return "stats dbstore\n"
+				"prints the value cache of each database: cached items, "
+				"memory used and\n"
+				"targeted, read cache hits, misses on recently evicted "
+				"keys (ghosts),\n"
+				"write cache hits on dirty entries and evicted entries.\n";
+		}
 	} else {
 		return
 			"stats [general] [-p]\n"
 			"stats drop [-ptu]\n"
+			"stats hashing\n"
+			"stats dbstore\n"
 			;
 	}
 	return NULL;